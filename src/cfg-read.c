@@ -15,6 +15,18 @@
 #include "cfg-parse.h"
 #include "list.h"
 
+#include "fdstream.h"
+#include "staticfile.h"
+#include "statictext.h"
+
+#ifdef HAVE_OGGZ
+#include "ogg-stdin.h"
+#endif
+
+#ifdef HAVE_SHCODECS
+#include "shrecord.h"
+#endif
+
 static CopaStatus
 cfg_read_block_start (const char * name, void * user_data)
 {
@@ -42,6 +54,10 @@ cfg_read_block_end (const char * name, void * user_data)
 
   if (!strncasecmp (name, "StaticText", 10)) {
 	  cfg->resources = list_join (cfg->resources, statictext_resources (cfg->block_dict));
+  } else if (!strncasecmp (name, "StaticFile", 10)) {
+	  cfg->resources = list_join (cfg->resources, staticfile_resources (cfg->block_dict));
+  } else if (!strncasecmp (name, "Directory", 9)) {
+	  cfg->resources = list_join (cfg->resources, staticdir_resources (cfg->block_dict));
   } else if (!strncasecmp (name, "Stdin", 5)) {
           cfg->resources = list_join (cfg->resources, fdstream_resources (cfg->block_dict));
 #ifdef HAVE_OGGZ
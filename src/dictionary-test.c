@@ -3,15 +3,25 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
 #include "dictionary.h"
 
+/* More keys than buckets, so that some share a bucket */
+static const char * keys[] = {
+  "Path", "Type", "Format", "SlowClient", "ZeroCopy", "ZeroCopyClients",
+  "HLSPath", "HLSDuration", "HLSSegments", "FrameRate", "FMP4Path",
+  "FMP4Fragment", "CtlFile", "Preview", "Directory", "Listen",
+  "MaxConnections", "KeepAliveTimeout", "Text", "Index", NULL
+};
+
 int
 main (int argc, char * argv[])
 {
   Dictionary * table;
   const char * value;
+  int i;
 
   table = dictionary_new ();
   dictionary_delete (table);
@@ -40,5 +50,17 @@ main (int argc, char * argv[])
 
   dictionary_delete (table);
 
+  table = dictionary_new ();
+  for (i = 0; keys[i]; i++)
+    dictionary_insert (table, keys[i], keys[i]);
+
+  for (i = 0; keys[i]; i++) {
+    value = dictionary_lookup (table, keys[i]);
+    if (!value) exit (1);
+    if (strcmp (value, keys[i])) exit (1);
+  }
+
+  dictionary_delete (table);
+
   exit (0);
 }
@@ -57,11 +57,13 @@ variable_free (Variable * variable)
   return 0;
 }
 
+/* The tree compares a new variable with those already in it, so lookups
+ * search for a variable too */
 static int
-variable_cmp (char * s1, Variable * v2)
+variable_cmp (Variable * v1, Variable * v2)
 {
-  if (!s1 || !v2) return -1;
-  return strcasecmp (s1, v2->name);
+  if (!v1 || !v2) return -1;
+  return strcasecmp (v1->name, v2->name);
 }
 
 Dictionary *
@@ -115,13 +117,14 @@ dictionary_hash (const char * name)
 const char *
 dictionary_lookup (Dictionary * table, const char * name)
 {
-  Variable * variable;
+  Variable key, * variable;
   x_node_t * node;
   ub4 h;
 
   h = dictionary_hash (name);
 
-  node = x_tree_find (table->buckets[h], (void *)name);
+  key.name = (char *)name;
+  node = x_tree_find (table->buckets[h], &key);
   if (node == NULL) {
     return NULL;
   } else {
@@ -133,13 +136,14 @@ dictionary_lookup (Dictionary * table, const char * name)
 int
 dictionary_insert (Dictionary * table, const char * name, const char * value)
 {
-  Variable * variable;
+  Variable key, * variable;
   x_node_t * node;
   ub4 h;
 
   h = dictionary_hash (name);
 
-  node = x_tree_find (table->buckets[h], (void *)name);
+  key.name = (char *)name;
+  node = x_tree_find (table->buckets[h], &key);
   if (node == NULL) {
     variable = variable_new (name, value);
     table->buckets[h] = x_tree_insert (table->buckets[h], variable);
@@ -3,26 +3,38 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h> /* STDIN_FILENO */
 
+#include "fmp4.h"
+#include "hls.h"
 #include "http-reqline.h"
 #include "http-status.h"
 #include "params.h"
+#include "recorder.h"
 #include "resource.h"
 #include "stream.h"
 
 #define DEFAULT_CONTENT_TYPE "video/mp4"
 
+/* Clients served by splice/tee when ZeroCopy is on; the rest use the ring buffer */
+#define DEFAULT_ZERO_COPY_CLIENTS 32
+
 #define x_strdup(s) ((s)?strdup((s)):(NULL))
 
 struct fdstream {
 	const char * path;
 	const char * content_type;
         struct stream * stream;
+        struct hls * hls;
+        struct fmp4 * fmp4;
+        struct recorder * recorder;
 };
 
 static int
@@ -34,7 +46,7 @@ fdstream_check (http_request * request, void * data)
 }
 
 static void
-fdstream_head (http_request * request, params_t * request_headers, const char ** status_line,
+fdstream_head (http_request * request, const char ** status_line,
 		params_t ** response_headers, void * data)
 {
 	struct fdstream * st = (struct fdstream *)data;
@@ -42,38 +54,78 @@ fdstream_head (http_request * request, params_t * request_headers, const char **
 
         *status_line = http_status_line (HTTP_STATUS_OK);
 
-        r = params_append (r, "Content-Type", (char *)st->content_type);
+        *response_headers = params_append (r, "Content-Type", (char *)st->content_type);
+}
+
+static void *
+fdstream_open (http_request * request, int notify_fd, int chunked, void * data)
+{
+	struct fdstream * st = (struct fdstream *)data;
+	struct stream_client * c;
+	params_t * query;
+	char * q, * fps, * t, * d;
+
+	if ((c = stream_client_open (st->stream, notify_fd, chunked)) == NULL)
+		return NULL;
+
+	/* ?fps=N limits the frame rate of MJPEG streams. With a DVR, ?t=T
+	 * starts at time T (seconds since the epoch, or before now if
+	 * negative) and ?d=N ends N seconds later */
+	if ((q = index (request->path, '?')) != NULL) {
+		q++;
+		query = params_new_parse (q, strlen (q), PARAMS_QUERY);
+		if ((fps = params_get (query, "fps")) != NULL)
+			stream_client_set_fps (st->stream, c, atof (fps));
+		if ((t = params_get (query, "t")) != NULL)
+			stream_client_seek_time (st->stream, c, atof (t));
+		if ((d = params_get (query, "d")) != NULL)
+			stream_client_set_duration (st->stream, c, atof (d));
+		params_free (query);
+	}
+
+	return c;
+}
+
+static ssize_t
+fdstream_pump (int fd, void * client, void * data)
+{
+	struct fdstream * st = (struct fdstream *)data;
+
+	return stream_client_pump (st->stream, (struct stream_client *)client, fd);
+}
+
+static int
+fdstream_queue (int fd, void * client, struct uring * u, void * tag, void * data)
+{
+	struct fdstream * st = (struct fdstream *)data;
+
+	return stream_client_queue (st->stream, (struct stream_client *)client, fd, u, tag);
+}
+
+static ssize_t
+fdstream_complete (void * client, int res, void * data)
+{
+	struct fdstream * st = (struct fdstream *)data;
+
+	return stream_client_complete (st->stream, (struct stream_client *)client, res);
+}
+
+static void
+fdstream_close (void * client, void * data)
+{
+	struct fdstream * st = (struct fdstream *)data;
+
+	stream_client_close (st->stream, (struct stream_client *)client);
 }
 
 static void
-fdstream_body (int fd, http_request * request, params_t * request_headers, void * data)
+fdstream_status (int fd, void * data)
 {
 	struct fdstream * st = (struct fdstream *)data;
-	struct stream * stream = st->stream;
-        size_t n, avail;
-        int rd;
-
-        rd = ringbuffer_open (&stream->rb);
-
-        while (stream->active) {
-                while ((avail = ringbuffer_avail (&stream->rb, rd)) == 0)
-                        usleep (10000);
-
-#ifdef DEBUG
-                if (avail != 0) printf ("stream_reader: %ld bytes available\n", avail);
-#endif
-                n = ringbuffer_writefd (fd, &stream->rb, rd);
-                if (n == -1) {
-                        break;
-                }
-                
-                fsync (fd);
-#ifdef DEBUG
-                if (n!=0 || avail != 0) printf ("stream_reader: wrote %ld of %ld bytes to socket\n", n, avail);
-#endif
-        }
-
-        ringbuffer_close (&stream->rb, rd);
+
+	stream_write_status (fd, st->path, st->stream);
+	if (st->recorder)
+		recorder_write_status (fd, st->recorder);
 }
 
 static void
@@ -81,7 +133,14 @@ fdstream_delete (void * data)
 {
 	struct fdstream * st = (struct fdstream *)data;
 
+	/* The recorder reads from the stream until it stops */
+	if (st->recorder)
+		recorder_free (st->recorder);
 	stream_close (st->stream);
+	if (st->hls)
+		hls_free (st->hls);
+	if (st->fmp4)
+		fmp4_free (st->fmp4);
 
 	free ((char *)st->path);
 	free ((char *)st->content_type);
@@ -89,47 +148,108 @@ fdstream_delete (void * data)
 	free (st);
 }
 
+/* Free the outputs of a stream that could not be made */
+static void
+fdstream_outputs_free (struct hls * hls, struct fmp4 * fmp4, struct recorder * recorder)
+{
+	if (hls)
+		hls_free (hls);
+	if (fmp4)
+		fmp4_free (fmp4);
+	if (recorder)
+		recorder_free (recorder);
+}
+
+/* The stream takes over hls, fmp4 and recorder, which are freed along with
+ * it by fdstream_delete(), or at once if it cannot be made */
 struct resource *
-fdstream_resource (const char * path, int fd, const char * content_type)
+fdstream_resource (const char * path, int fd, const char * content_type,
+		   enum ringbuffer_policy policy, enum stream_format format,
+		   int zero_copy_clients, const struct stream_dvr * dvr, struct hls * hls,
+		   struct fmp4 * fmp4, struct recorder * recorder)
 {
 	struct fdstream * st;
+	struct resource * r;
 
-	if ((st = calloc (1, sizeof(*st))) == NULL)
+	if ((st = calloc (1, sizeof(*st))) == NULL) {
+		fdstream_outputs_free (hls, fmp4, recorder);
 		return NULL;
+	}
 
 	st->path = x_strdup (path);
 	if (st->path == NULL) {
 		free (st);
+		fdstream_outputs_free (hls, fmp4, recorder);
 		return NULL;
 	}
 
 	st->content_type = x_strdup (content_type);
 	if (st->content_type == NULL) {
-		free (st);
 		free ((char *)st->path);
+		free (st);
+		fdstream_outputs_free (hls, fmp4, recorder);
 		return NULL;
 	}
 
-	st->stream = stream_open (fd);
+	st->stream = stream_new (policy, format, content_type);
 	if (st->stream == NULL) {
-		free (st);
 		free ((char *)st->path);
 		free ((char *)st->content_type);
+		free (st);
+		fdstream_outputs_free (hls, fmp4, recorder);
+		return NULL;
+	}
+
+	if (dvr != NULL && stream_set_dvr (st->stream, dvr) == -1)
+		fprintf (stderr, "DVRPath: serving %s without a DVR\n", path);
+
+	/* The HLS segmenter and fMP4 muxer see the input before any client */
+	if (hls != NULL) {
+		st->hls = hls;
+		stream_add_tap (st->stream, hls_write, hls);
+	}
+	if (fmp4 != NULL) {
+		st->fmp4 = fmp4;
+		stream_add_tap (st->stream, fmp4_write, fmp4);
+	}
+
+	st->recorder = recorder;
+
+	if (stream_start (st->stream, fd, zero_copy_clients) == -1) {
+		fdstream_delete (st);
 		return NULL;
 	}
 
-	return resource_new (fdstream_check, fdstream_head, fdstream_body, fdstream_delete, st);
+	if (recorder != NULL && recorder_start (recorder, st->stream) == -1)
+		fprintf (stderr, "RecordPath: could not start recording %s\n", path);
+
+	if ((r = resource_new_stream (fdstream_check, fdstream_head, fdstream_open, fdstream_pump,
+				      fdstream_close, fdstream_delete, st)) != NULL) {
+		r->status = fdstream_status;
+		r->queue = fdstream_queue;
+		r->complete = fdstream_complete;
+		r->chunked = 1;
+		r->path = st->path;
+		resource_cache_head (r);
+	} else {
+		fdstream_delete (st);
+	}
+
+	return r;
 }
 
 struct resource *
-fdstream_resource_open (const char * urlpath, const char * filepath, const char * content_type)
+fdstream_resource_open (const char * urlpath, const char * filepath, const char * content_type,
+			int zero_copy_clients)
 {
         int fd;
 
         if ((fd = open (filepath, O_RDONLY)) == -1)
 		return NULL;
 
-	return fdstream_resource (urlpath, fd, content_type);
+	return fdstream_resource (urlpath, fd, content_type, RINGBUFFER_BLOCK,
+				  stream_format_parse (NULL, content_type, urlpath),
+				  zero_copy_clients, NULL, NULL, NULL, NULL);
 }
 
 list_t *
@@ -138,21 +258,84 @@ fdstream_resources (Dictionary * config)
 	list_t * l;
 	const char * path;
 	const char * ctype;
+	const char * zero_copy;
+	const char * chunked_value;
+	enum ringbuffer_policy policy;
+	enum stream_format format;
+	int zero_copy_clients = 0;
 	struct resource * r;
+	struct hls * hls;
+	struct fmp4 * fmp4;
+	struct stream_dvr dvr;
+	struct recorder * recorder;
+	int has_dvr;
+	int chunked, fmp4_chunked;
 
 	l = list_new();
 
 	path = dictionary_lookup (config, "Path");
 	ctype = dictionary_lookup (config, "Type");
+	policy = stream_policy_parse (dictionary_lookup (config, "SlowClient"));
+
+	if ((zero_copy = dictionary_lookup (config, "ZeroCopy")) != NULL &&
+	    !strncasecmp (zero_copy, "on", 2)) {
+		zero_copy_clients = DEFAULT_ZERO_COPY_CLIENTS;
+		if ((zero_copy = dictionary_lookup (config, "ZeroCopyClients")) != NULL)
+			zero_copy_clients = atoi (zero_copy);
+	}
 
 	if (!ctype) ctype = DEFAULT_CONTENT_TYPE;
 
+	format = stream_format_parse (dictionary_lookup (config, "Format"), ctype, path);
+	/* Chunked clients are served from the ring buffer, so a stream using
+	 * ZeroCopy only sends chunks if asked to. The fMP4 stream always
+	 * comes from a ring buffer */
+	chunked_value = dictionary_lookup (config, "Chunked");
+	chunked = stream_chunked_parse (chunked_value, -1);
+	fmp4_chunked = (chunked != 0);
+	if (chunked == -1)
+		chunked = (zero_copy_clients == 0);
+	has_dvr = (stream_dvr_parse (&dvr, dictionary_lookup (config, "DVRPath"),
+				     dictionary_lookup (config, "DVRSize"),
+				     dictionary_lookup (config, "DVRDuration")) == 0);
+
+	if ((hls = hls_config (config)) != NULL && format != STREAM_FORMAT_H264) {
+		fprintf (stderr, "HLSPath: only available for H.264 streams\n");
+		hls_free (hls);
+		hls = NULL;
+	}
+
+	if ((fmp4 = fmp4_config (config, policy)) != NULL && format != STREAM_FORMAT_H264) {
+		fprintf (stderr, "FMP4Path: only available for H.264 streams\n");
+		fmp4_free (fmp4);
+		fmp4 = NULL;
+	}
+
+	recorder = recorder_config (config);
+
 	if (path) {
-		if ((r = fdstream_resource (path, STDIN_FILENO, ctype)) != NULL)
+		if ((r = fdstream_resource (path, STDIN_FILENO, ctype, policy, format,
+					       zero_copy_clients, has_dvr ? &dvr : NULL,
+					       hls, fmp4, recorder)) != NULL) {
+			r->chunked = chunked;
 			l = list_append (l, r);
+			if (hls != NULL)
+				l = list_append (l, hls_resource (hls));
+			if (fmp4 != NULL && (r = fmp4_resource (fmp4)) != NULL) {
+				r->chunked = fmp4_chunked;
+				l = list_append (l, r);
+			}
+		}
+	} else {
+		if (hls != NULL)
+			hls_free (hls);
+		if (fmp4 != NULL)
+			fmp4_free (fmp4);
+		if (recorder != NULL)
+			recorder_free (recorder);
 	}
 
-	/* fdstream_resource_open ("/stream2", "/tmp/stream2.264", "video/mp4"); */
+	/* fdstream_resource_open ("/stream2", "/tmp/stream2.264", "video/mp4", 0); */
 
 	return l;
 }
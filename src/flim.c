@@ -31,7 +31,7 @@ flim_append_headers (params_t * response_headers)
 }
 
 static void
-flim_head (http_request * request, params_t * request_headers, const char ** status_line,
+flim_head (http_request * request, const char ** status_line,
 		params_t ** response_headers, void * data)
 {
         *status_line = http_status_line (HTTP_STATUS_OK);
@@ -39,7 +39,7 @@ flim_head (http_request * request, params_t * request_headers, const char ** sta
 }
 
 static void
-flim_body (int fd, http_request * request, params_t * request_headers, void * data)
+flim_body (int fd, http_request * request, void * data)
 {
         write (fd, FLIM_TEXT, strlen(FLIM_TEXT));
 }
@@ -47,5 +47,14 @@ flim_body (int fd, http_request * request, params_t * request_headers, void * da
 struct resource *
 flim_resource (void)
 {
-	return resource_new (flim_check, flim_head, flim_body, NULL /* del */, NULL /* data */);
+	struct resource * r;
+
+	if ((r = resource_new (flim_check, flim_head, flim_body, NULL /* del */, NULL /* data */)) != NULL) {
+		r->path = "/flim.txt";
+		r->body_cache = FLIM_TEXT;
+		r->body_cache_len = strlen (FLIM_TEXT);
+		resource_cache_head (r);
+	}
+
+	return r;
 }
@@ -0,0 +1,141 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#define _GNU_SOURCE /* memmem */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "tests.h"
+
+#include "fmp4.h"
+#include "resource.h"
+
+/* Baseline 1280x720, then Main 172x142 */
+static const unsigned char sps_a[] = {0x67, 0x42, 0x00, 0x1f, 0xed, 0x00, 0xa0, 0x0b, 0x72};
+static const unsigned char sps_b[] = {0x67, 0x4d, 0x00, 0x0b, 0xed, 0x05, 0x89, 0xf7, 0x48};
+static const unsigned char pps[] = {0x68, 0xce, 0x38, 0x80};
+
+static const unsigned char start_code[] = {0x00, 0x00, 0x00, 0x01};
+static const unsigned char idr[] = {0x65, 0x88, 0x84, 0x21, 0x43};
+static const unsigned char slice[] = {0x41, 0x9a, 0x02, 0x04};
+
+static uint32_t
+get_u32 (const unsigned char * p)
+{
+        return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+write_nal (struct fmp4 * fmp4, const unsigned char * nal, size_t len)
+{
+        fmp4_write (start_code, sizeof(start_code), fmp4);
+        fmp4_write (nal, len, fmp4);
+}
+
+/* An IDR picture with its parameter sets, followed by two P pictures */
+static void
+write_gop (struct fmp4 * fmp4, const unsigned char * sps, size_t sps_len)
+{
+        write_nal (fmp4, sps, sps_len);
+        write_nal (fmp4, pps, sizeof(pps));
+        write_nal (fmp4, idr, sizeof(idr));
+        write_nal (fmp4, slice, sizeof(slice));
+        write_nal (fmp4, slice, sizeof(slice));
+}
+
+/* Send all the client can take into fd */
+static void
+pump (struct resource * r, void * client, int fd)
+{
+        while (r->pump (fd, client, r->data) > 0);
+}
+
+/* Whether an init segment starts at box, and carries sps */
+static int
+is_init (const unsigned char * box, size_t len, const unsigned char * sps, size_t sps_len)
+{
+        const unsigned char * moov = box + get_u32 (box);
+
+        if (memcmp (box + 4, "ftyp", 4) || get_u32 (box) + 8 > len ||
+            memcmp (moov + 4, "moov", 4))
+                return 0;
+
+        return memmem (moov, get_u32 (moov), sps, sps_len) != NULL;
+}
+
+int
+main (int argc, char * argv[])
+{
+        struct fmp4 * fmp4;
+        struct resource * r;
+        void * client;
+        unsigned char buf[64*1024];
+        ssize_t len;
+        size_t pos, nr_inits = 0, nr_fragments = 0;
+        int fds[2], notify_fd;
+
+        INFO ("Opening an fMP4 output");
+        if ((fmp4 = fmp4_new ("/live.mp4", 1, 25.0, RINGBUFFER_SKIP)) == NULL)
+                FAIL ("fmp4_new");
+        if ((r = fmp4_resource (fmp4)) == NULL)
+                FAIL ("fmp4_resource");
+        if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == -1 ||
+            (notify_fd = eventfd (0, EFD_NONBLOCK)) == -1)
+                FAIL ("socketpair");
+
+        INFO ("Joining at the first IDR picture");
+        write_gop (fmp4, sps_a, sizeof(sps_a));
+        if ((client = r->open (NULL, notify_fd, 0, r->data)) == NULL)
+                FAIL ("Client not opened");
+        pump (r, client, fds[0]);
+
+        INFO ("Changing the SPS while the client is playing");
+        write_gop (fmp4, sps_b, sizeof(sps_b));
+        pump (r, client, fds[0]);
+
+        if ((len = recv (fds[1], buf, sizeof(buf), MSG_DONTWAIT)) <= 0)
+                FAIL ("Nothing sent");
+
+        /* An access unit is complete when the next picture starts, and a
+         * fragment when the next access unit is added. So the client has
+         * ftyp moov, the three fragments coded with sps_a, and then ftyp
+         * moov for sps_b ahead of the fragment of the IDR picture coded
+         * with it */
+        for (pos = 0; pos + 8 <= (size_t)len; pos += get_u32 (buf + pos)) {
+                if (get_u32 (buf + pos) < 8)
+                        FAIL ("Bad box size");
+
+                if (!memcmp (buf + pos + 4, "ftyp", 4)) {
+                        if (!is_init (buf + pos, len - pos, nr_inits ? sps_b : sps_a,
+                                      sizeof(sps_a)))
+                                FAIL ("Init segment does not carry the current SPS");
+                        if (nr_inits == 1 && nr_fragments != 3)
+                                FAIL ("New init segment not before the first fragment using it");
+                        nr_inits++;
+                } else if (!memcmp (buf + pos + 4, "moof", 4)) {
+                        nr_fragments++;
+                }
+        }
+
+        if (pos != (size_t)len)
+                FAIL ("Boxes do not tile the stream");
+        if (nr_inits != 2 || nr_fragments != 4)
+                FAIL ("Expected two init segments and four fragments");
+
+        r->close (client, r->data);
+        resource_delete (r);
+        fmp4_free (fmp4);
+        close (fds[0]);
+        close (fds[1]);
+        close (notify_fd);
+
+        exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,413 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+
+#include "fmp4.h"
+#include "h264-au.h"
+#include "http-status.h"
+#include "mp4-mux.h"
+#include "params.h"
+#include "stream.h"
+
+/* #define DEBUG */
+
+#define x_strdup(s) ((s)?strdup((s)):(NULL))
+
+#define NAL_TYPE_SPS 7
+#define NAL_TYPE_PPS 8
+#define NAL_TYPE_AUD 9
+
+struct fmp4 {
+        char * path;
+        int fragment_frames;
+        struct stream * stream;
+
+        /* Muxing, by the input stream's writer only */
+        struct h264_au_reader * reader;
+        unsigned char sps[H264_PARAM_SET_MAX], pps[H264_PARAM_SET_MAX];
+        size_t sps_len, pps_len;
+        unsigned char init[MP4_INIT_MAX];
+        size_t init_len;   /* 0 until the SPS and PPS are known */
+        int synced;        /* whether the current fragment follows an IDR picture */
+
+        /* The fragment being built: its samples, and their data in AVC format */
+        uint32_t sequence;
+        uint64_t decode_time;
+        int sync;          /* whether it starts with an IDR picture */
+        struct mp4_sample samples[FMP4_MAX_SAMPLES];
+        int nr_samples;
+        unsigned char * mdat;
+        size_t mdat_len, mdat_size;
+};
+
+/* Remember a parameter set, returning 1 if it changed */
+static int
+fmp4_param_set (unsigned char * dest, size_t * dest_len, const unsigned char * nal,
+                size_t len)
+{
+        if (len > H264_PARAM_SET_MAX || (len == *dest_len && !memcmp (dest, nal, len)))
+                return 0;
+
+        memcpy (dest, nal, len);
+        *dest_len = len;
+
+        return 1;
+}
+
+/* Pick up the parameter sets in an Annex-B buffer, returning 1 if they
+ * changed */
+static int
+fmp4_scan_params (struct fmp4 * fmp4, const unsigned char * buf, size_t len)
+{
+        const unsigned char * nal;
+        size_t pos = 0, nal_len;
+        int changed = 0;
+
+        while ((nal = h264_nal_next (buf, len, &pos, &nal_len)) != NULL) {
+                if (nal_len == 0)
+                        continue;
+
+                switch (nal[0] & 0x1f) {
+                case NAL_TYPE_SPS:
+                        changed |= fmp4_param_set (fmp4->sps, &fmp4->sps_len, nal, nal_len);
+                        break;
+                case NAL_TYPE_PPS:
+                        changed |= fmp4_param_set (fmp4->pps, &fmp4->pps_len, nal, nal_len);
+                        break;
+                default:
+                        break;
+                }
+        }
+
+        return changed;
+}
+
+/* Rebuild the init segment for new parameter sets. Clients already playing
+ * are sent it in the stream, ahead of the first fragment coded with them;
+ * clients that join later are sent it before their first fragment */
+static void
+fmp4_update_init (struct fmp4 * fmp4)
+{
+        if (fmp4->sps_len == 0 || fmp4->pps_len == 0)
+                return;
+
+        fmp4->init_len = mp4_init_segment (fmp4->init, fmp4->sps, fmp4->sps_len,
+                                           fmp4->pps, fmp4->pps_len);
+        if (fmp4->init_len > 0)
+                stream_write (fmp4->stream, fmp4->init, fmp4->init_len);
+}
+
+/* Write out the current fragment, if any */
+static void
+fmp4_flush (struct fmp4 * fmp4)
+{
+        unsigned char head[MP4_FRAGMENT_HEAD_SIZE (FMP4_MAX_SAMPLES)];
+        struct stream * stream = fmp4->stream;
+        uint64_t pos;
+        size_t len;
+
+        if (fmp4->nr_samples == 0)
+                return;
+
+        len = mp4_fragment_head (head, ++fmp4->sequence, fmp4->decode_time,
+                                 fmp4->samples, fmp4->nr_samples);
+
+        pos = ringbuffer_tail (&stream->rb);
+        stream_write (stream, head, len);
+        stream_write (stream, fmp4->mdat, fmp4->mdat_len);
+
+        /* Clients join at fragments starting with an IDR picture, after the
+         * init segment it was coded with */
+        if (fmp4->sync)
+                stream_mark_sync (stream, pos, fmp4->init, fmp4->init_len);
+
+#ifdef DEBUG
+        printf ("fmp4: fragment %u, %d samples, %zu bytes%s\n", fmp4->sequence,
+                fmp4->nr_samples, len + fmp4->mdat_len, fmp4->sync ? ", sync" : "");
+#endif
+
+        fmp4->nr_samples = 0;
+        fmp4->mdat_len = 0;
+}
+
+static void
+fmp4_discard (struct fmp4 * fmp4)
+{
+        fmp4->nr_samples = 0;
+        fmp4->mdat_len = 0;
+        fmp4->synced = 0;
+}
+
+/* Make room for len more bytes of sample data */
+static int
+fmp4_reserve (struct fmp4 * fmp4, size_t len)
+{
+        unsigned char * mdat;
+        size_t size;
+
+        if (fmp4->mdat_len + len <= fmp4->mdat_size)
+                return 0;
+
+        if (fmp4->mdat_len + len > FMP4_FRAGMENT_SIZE_MAX)
+                return -1;
+
+        for (size = fmp4->mdat_size ? fmp4->mdat_size : 64*1024;
+             size < fmp4->mdat_len + len; size *= 2);
+        if ((mdat = realloc (fmp4->mdat, size)) == NULL)
+                return -1;
+
+        fmp4->mdat = mdat;
+        fmp4->mdat_size = size;
+
+        return 0;
+}
+
+/* Add an access unit to the fragment, as NAL units with 4 byte lengths.
+ * The parameter sets are in the init segment, and delimiters are not
+ * used in MP4 */
+static int
+fmp4_add_sample (struct fmp4 * fmp4, const struct h264_access_unit * au)
+{
+        struct mp4_sample * sample = &fmp4->samples[fmp4->nr_samples];
+        const unsigned char * nal;
+        unsigned char * p;
+        size_t pos = 0, nal_len, start = fmp4->mdat_len;
+
+        while ((nal = h264_nal_next (au->data, au->len, &pos, &nal_len)) != NULL) {
+                switch (nal_len ? nal[0] & 0x1f : 0) {
+                case 0:
+                case NAL_TYPE_SPS:
+                case NAL_TYPE_PPS:
+                case NAL_TYPE_AUD:
+                        continue;
+                default:
+                        break;
+                }
+
+                if (fmp4_reserve (fmp4, 4 + nal_len) == -1)
+                        return -1;
+
+                p = fmp4->mdat + fmp4->mdat_len;
+                p[0] = nal_len >> 24;
+                p[1] = nal_len >> 16;
+                p[2] = nal_len >> 8;
+                p[3] = nal_len;
+                memcpy (p + 4, nal, nal_len);
+                fmp4->mdat_len += 4 + nal_len;
+        }
+
+        if (fmp4->nr_samples == 0)
+                fmp4->decode_time = au->pts;
+
+        sample->duration = au->duration;
+        sample->size = fmp4->mdat_len - start;
+        sample->flags = au->idr ? MP4_SAMPLE_SYNC : MP4_SAMPLE_NON_SYNC;
+        fmp4->nr_samples++;
+
+        return 0;
+}
+
+/* Called with each complete access unit */
+static void
+fmp4_access_unit (const struct h264_access_unit * au, void * data)
+{
+        struct fmp4 * fmp4 = (struct fmp4 *)data;
+        int changed;
+
+        /* A fragment with a gap cannot be played; start again at an IDR */
+        if (au->discontinuity)
+                fmp4_discard (fmp4);
+
+        if (au->idr) {
+                fmp4_flush (fmp4);
+
+                changed = 0;
+                if (au->params_len > 0)
+                        changed |= fmp4_scan_params (fmp4, au->params, au->params_len);
+                changed |= fmp4_scan_params (fmp4, au->data, au->len);
+                if (changed)
+                        fmp4_update_init (fmp4);
+
+                fmp4->synced = (fmp4->init_len > 0);
+                fmp4->sync = 1;
+        } else if (fmp4->nr_samples == FMP4_MAX_SAMPLES ||
+                   (fmp4->fragment_frames > 0 && fmp4->nr_samples >= fmp4->fragment_frames)) {
+                fmp4_flush (fmp4);
+                fmp4->sync = 0;
+        }
+
+        if (fmp4->synced && fmp4_add_sample (fmp4, au) == -1)
+                fmp4_discard (fmp4);
+}
+
+void
+fmp4_write (const unsigned char * buf, size_t len, void * data)
+{
+        struct fmp4 * fmp4 = (struct fmp4 *)data;
+
+        h264_au_reader_write (fmp4->reader, buf, len);
+}
+
+struct fmp4 *
+fmp4_new (const char * path, int fragment_frames, double frame_rate,
+          enum ringbuffer_policy policy)
+{
+        struct fmp4 * fmp4;
+
+        if ((fmp4 = calloc (1, sizeof(*fmp4))) == NULL)
+                return NULL;
+
+        fmp4->path = x_strdup (path);
+        fmp4->fragment_frames = (fragment_frames > 0) ? fragment_frames : 0;
+        fmp4->stream = stream_new (policy, STREAM_FORMAT_FMP4, "video/mp4");
+        fmp4->reader = h264_au_reader_new (frame_rate, fmp4_access_unit, fmp4);
+
+        if (fmp4->path == NULL || fmp4->stream == NULL || fmp4->reader == NULL) {
+                fmp4_free (fmp4);
+                return NULL;
+        }
+
+        return fmp4;
+}
+
+void
+fmp4_free (struct fmp4 * fmp4)
+{
+        if (fmp4->reader)
+                h264_au_reader_free (fmp4->reader);
+        if (fmp4->stream)
+                stream_close (fmp4->stream);
+
+        free (fmp4->mdat);
+        free (fmp4->path);
+        free (fmp4);
+}
+
+struct fmp4 *
+fmp4_config (Dictionary * config, enum ringbuffer_policy policy)
+{
+        const char * path, * value;
+        int fragment_frames = 1;
+        double frame_rate = 0.0;
+
+        if ((path = dictionary_lookup (config, "FMP4Path")) == NULL)
+                return NULL;
+
+        if ((value = dictionary_lookup (config, "FMP4Fragment")) != NULL)
+                fragment_frames = strncasecmp (value, "gop", 3) ? atoi (value) : 0;
+        if ((value = dictionary_lookup (config, "FrameRate")) != NULL)
+                frame_rate = atof (value);
+
+        return fmp4_new (path, fragment_frames, frame_rate, policy);
+}
+
+/*
+ * Resource
+ */
+
+static int
+fmp4_check (http_request * request, void * data)
+{
+        struct fmp4 * fmp4 = (struct fmp4 *)data;
+
+        return !strncmp (request->path, fmp4->path, strlen (fmp4->path));
+}
+
+static void
+fmp4_head (http_request * request, const char ** status_line,
+           params_t ** response_headers, void * data)
+{
+        params_t * r = *response_headers;
+
+        (void) request;
+        (void) data;
+
+        *status_line = http_status_line (HTTP_STATUS_OK);
+        r = params_append (r, "Content-Type", "video/mp4");
+        *response_headers = params_append (r, "Cache-Control", "no-cache");
+}
+
+static void *
+fmp4_open (http_request * request, int notify_fd, int chunked, void * data)
+{
+        struct fmp4 * fmp4 = (struct fmp4 *)data;
+
+        (void) request;
+
+        return stream_client_open (fmp4->stream, notify_fd, chunked);
+}
+
+static ssize_t
+fmp4_pump (int fd, void * client, void * data)
+{
+        struct fmp4 * fmp4 = (struct fmp4 *)data;
+
+        return stream_client_pump (fmp4->stream, (struct stream_client *)client, fd);
+}
+
+static int
+fmp4_queue (int fd, void * client, struct uring * u, void * tag, void * data)
+{
+        struct fmp4 * fmp4 = (struct fmp4 *)data;
+
+        return stream_client_queue (fmp4->stream, (struct stream_client *)client, fd, u, tag);
+}
+
+static ssize_t
+fmp4_complete (void * client, int res, void * data)
+{
+        struct fmp4 * fmp4 = (struct fmp4 *)data;
+
+        return stream_client_complete (fmp4->stream, (struct stream_client *)client, res);
+}
+
+static void
+fmp4_close (void * client, void * data)
+{
+        struct fmp4 * fmp4 = (struct fmp4 *)data;
+
+        stream_client_close (fmp4->stream, (struct stream_client *)client);
+}
+
+static void
+fmp4_status (int fd, void * data)
+{
+        struct fmp4 * fmp4 = (struct fmp4 *)data;
+
+        stream_write_status (fd, fmp4->path, fmp4->stream);
+}
+
+/* Nothing to free: fdstream owns the fmp4 output */
+static void
+fmp4_resource_delete (void * data)
+{
+        (void) data;
+}
+
+struct resource *
+fmp4_resource (struct fmp4 * fmp4)
+{
+        struct resource * r;
+
+        if ((r = resource_new_stream (fmp4_check, fmp4_head, fmp4_open, fmp4_pump, fmp4_close,
+                                      fmp4_resource_delete, fmp4)) != NULL) {
+                r->status = fmp4_status;
+                r->queue = fmp4_queue;
+                r->complete = fmp4_complete;
+                r->chunked = 1;
+                r->path = fmp4->path;
+                resource_cache_head (r);
+        }
+
+        return r;
+}
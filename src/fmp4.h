@@ -0,0 +1,51 @@
+#ifndef __FMP4_H__
+#define __FMP4_H__
+
+#include "dictionary.h"
+#include "resource.h"
+#include "ringbuffer.h"
+
+/*
+ * A fragmented MP4 (CMAF) output for an H.264 stream, for low latency
+ * players such as those built on Media Source Extensions. The stream's
+ * data is passed in through fmp4_write(), as a StreamTap, and remuxed
+ * into an init segment and a series of moof/mdat fragments, which are
+ * served progressively from a stream of their own.
+ *
+ * A fragment is cut before every IDR picture, and also after every
+ * fragment_frames pictures, so that with fragment_frames 1 each picture
+ * is sent as soon as it is complete. A client joins at the latest
+ * fragment starting with an IDR picture, and is first sent the init
+ * segment for it; the init segment is rebuilt whenever the stream's SPS
+ * or PPS change, and sent in the stream ahead of the next fragment to
+ * the clients already playing.
+ *
+ * Pictures are timed by their arrival, or at a fixed frame rate, as
+ * described in h264-au.h.
+ */
+
+/* Most pictures in a fragment; a longer GOP is split */
+#define FMP4_MAX_SAMPLES 256
+
+/* A fragment which grows this large is discarded */
+#define FMP4_FRAGMENT_SIZE_MAX (32*1024*1024)
+
+struct fmp4;
+
+/* fragment_frames is 0 to cut fragments at IDR pictures only */
+struct fmp4 * fmp4_new (const char * path, int fragment_frames, double frame_rate,
+                        enum ringbuffer_policy policy);
+void fmp4_free (struct fmp4 * fmp4);
+
+/* Make an fMP4 output from the FMP4* settings of a stream's configuration
+ * block, or return NULL if it has none */
+struct fmp4 * fmp4_config (Dictionary * config, enum ringbuffer_policy policy);
+
+/* Add stream data; a StreamTap */
+void fmp4_write (const unsigned char * buf, size_t len, void * data);
+
+/* The resource serving the fragmented MP4 stream. Deleting the resource
+ * does not free the fMP4 output, which stays owned by the caller */
+struct resource * fmp4_resource (struct fmp4 * fmp4);
+
+#endif /* __FMP4_H__ */
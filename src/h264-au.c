@@ -0,0 +1,208 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "h264-au.h"
+
+struct h264_au_reader {
+        struct h264_parser * parser;
+        H264AccessUnitReady ready;
+        void * data;
+
+        double frame_rate;
+        uint64_t nr_frames;
+        struct timespec start;
+
+        unsigned char * pending; /* input from the current access unit on */
+        size_t pending_len, pending_size;
+        uint64_t pending_pos;    /* stream offset of pending[0] */
+        uint64_t input_pos;      /* stream offset of the next input */
+
+        int in_au;               /* whether an access unit has started */
+        int lost;                /* input was discarded since the last delivery */
+        struct h264_access_unit au;
+        uint64_t au_pos;
+        unsigned char params[H264_PARAMS_MAX];
+};
+
+/* The presentation time of the next picture */
+static uint64_t
+h264_au_pts (struct h264_au_reader * r)
+{
+        struct timespec now;
+        uint64_t t;
+
+        if (r->frame_rate > 0) {
+                t = (uint64_t)(r->nr_frames * H264_AU_CLOCK / r->frame_rate);
+        } else {
+                clock_gettime (CLOCK_MONOTONIC, &now);
+                t = (uint64_t)(now.tv_sec - r->start.tv_sec) * H264_AU_CLOCK +
+                        ((int64_t)now.tv_nsec - r->start.tv_nsec) * H264_AU_CLOCK / 1000000000;
+        }
+
+        r->nr_frames++;
+
+        /* Leave room for a muxer's clock to run ahead of the first picture */
+        return H264_AU_CLOCK + t;
+}
+
+/* Called by the parser at the start of each access unit */
+static void
+h264_au_start (uint64_t pos, int idr, void * data)
+{
+        struct h264_au_reader * r = (struct h264_au_reader *)data;
+        uint64_t pts = h264_au_pts (r);
+
+        if (r->in_au) {
+                if (r->au_pos < r->pending_pos) {
+                        /* Part of it was thrown away */
+                        r->lost = 1;
+                } else {
+                        r->au.data = r->pending + (r->au_pos - r->pending_pos);
+                        r->au.len = pos - r->au_pos;
+                        r->au.duration = pts - r->au.pts;
+                        r->au.discontinuity = r->lost;
+                        r->lost = 0;
+                        r->ready (&r->au, r->data);
+                }
+        }
+
+        r->in_au = 1;
+        r->au_pos = pos;
+        r->au.idr = idr;
+        r->au.pts = pts;
+        r->au.params_len = 0;
+}
+
+/* Called by the parser for IDR access units, after h264_au_start() */
+static void
+h264_au_sync (uint64_t pos, const unsigned char * params, size_t params_len, void * data)
+{
+        struct h264_au_reader * r = (struct h264_au_reader *)data;
+
+        (void) pos;
+
+        memcpy (r->params, params, params_len);
+        r->au.params = r->params;
+        r->au.params_len = params_len;
+}
+
+struct h264_au_reader *
+h264_au_reader_new (double frame_rate, H264AccessUnitReady ready, void * data)
+{
+        struct h264_au_reader * r;
+
+        if ((r = calloc (1, sizeof(*r))) == NULL)
+                return NULL;
+
+        if ((r->parser = h264_parser_new (h264_au_sync, r)) == NULL) {
+                free (r);
+                return NULL;
+        }
+        h264_parser_set_access_unit (r->parser, h264_au_start);
+
+        r->ready = ready;
+        r->data = data;
+        r->frame_rate = frame_rate;
+        clock_gettime (CLOCK_MONOTONIC, &r->start);
+
+        return r;
+}
+
+void
+h264_au_reader_free (struct h264_au_reader * r)
+{
+        h264_parser_free (r->parser);
+        free (r->pending);
+        free (r);
+}
+
+/* Drop the buffered input */
+static void
+h264_au_drop (struct h264_au_reader * r)
+{
+        r->pending_pos = r->input_pos;
+        r->pending_len = 0;
+        r->lost = 1;
+}
+
+void
+h264_au_reader_write (struct h264_au_reader * r, const unsigned char * buf, size_t len)
+{
+        unsigned char * pending;
+        size_t size, keep;
+
+        /* No end to the access unit in sight */
+        if (r->pending_len + len > H264_AU_MAX)
+                h264_au_drop (r);
+
+        if (r->pending_len + len > r->pending_size) {
+                for (size = r->pending_size ? r->pending_size : 64*1024;
+                     size < r->pending_len + len; size *= 2);
+                if ((pending = realloc (r->pending, size)) == NULL) {
+                        h264_au_drop (r);
+                        r->input_pos += len;
+                        r->pending_pos = r->input_pos;
+                        h264_parser_scan (r->parser, buf, len);
+                        return;
+                }
+                r->pending = pending;
+                r->pending_size = size;
+        }
+
+        memcpy (r->pending + r->pending_len, buf, len);
+        r->pending_len += len;
+        r->input_pos += len;
+
+        h264_parser_scan (r->parser, buf, len);
+
+        /* Keep only the current access unit, which is not yet complete */
+        if (r->au_pos > r->pending_pos) {
+                keep = (r->au_pos < r->input_pos) ? r->input_pos - r->au_pos : 0;
+                memmove (r->pending, r->pending + r->pending_len - keep, keep);
+                r->pending_len = keep;
+                r->pending_pos = r->input_pos - keep;
+        }
+}
+
+const unsigned char *
+h264_nal_next (const unsigned char * buf, size_t len, size_t * pos, size_t * nal_len)
+{
+        const unsigned char * nal;
+        size_t i = *pos, start, end;
+
+        /* Find the next start code */
+        for (; i + 2 < len; i++) {
+                if (buf[i] == 0 && buf[i+1] == 0 && buf[i+2] == 1)
+                        break;
+        }
+        if (i + 2 >= len)
+                return NULL;
+
+        start = i + 3;
+        nal = buf + start;
+
+        /* It ends at the following start code, less any zeros before it */
+        for (i = start; i + 2 < len; i++) {
+                if (buf[i] == 0 && buf[i+1] == 0 && buf[i+2] == 1)
+                        break;
+        }
+        end = (i + 2 < len) ? i : len;
+        *pos = end;
+
+        while (end > start && buf[end-1] == 0)
+                end--;
+
+        *nal_len = end - start;
+
+        return nal;
+}
@@ -0,0 +1,64 @@
+#ifndef __H264_AU_H__
+#define __H264_AU_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "h264-parse.h"
+
+/*
+ * Assemble an H.264 Annex-B byte stream into whole access units, each
+ * with a presentation time, for muxing into a container. An access unit
+ * is complete when the next one starts, so each is delivered one picture
+ * late, along with its duration.
+ *
+ * Raw H.264 carries no timestamps, so each picture is stamped with the
+ * time it arrived, or with its position at a fixed frame rate if one is
+ * given. Pictures are assumed to arrive in presentation order, ie. the
+ * stream has no B-frames.
+ */
+
+/* Timestamps are in units of 1/90000 second, as used by MPEG-TS */
+#define H264_AU_CLOCK 90000
+
+/* Input buffered while looking for the end of an access unit, past which
+ * it is discarded */
+#define H264_AU_MAX (8*1024*1024)
+
+struct h264_access_unit {
+        const unsigned char * data; /* Annex-B, from its first start code */
+        size_t len;
+        int idr;
+        uint64_t pts;               /* H264_AU_CLOCK units, from H264_AU_CLOCK */
+        uint64_t duration;
+
+        /* The latest SPS and PPS, each with a start code, for an IDR access
+         * unit which does not carry its own; otherwise params_len is 0 */
+        const unsigned char * params;
+        size_t params_len;
+
+        /* Set if access units were lost before this one */
+        int discontinuity;
+};
+
+typedef void (*H264AccessUnitReady) (const struct h264_access_unit * au, void * data);
+
+struct h264_au_reader;
+
+/* frame_rate is 0 to stamp pictures with their arrival time */
+struct h264_au_reader * h264_au_reader_new (double frame_rate, H264AccessUnitReady ready,
+                                            void * data);
+void h264_au_reader_free (struct h264_au_reader * r);
+
+/* Add the next len bytes of the stream */
+void h264_au_reader_write (struct h264_au_reader * r, const unsigned char * buf, size_t len);
+
+/*
+ * Iterate over the NAL units of an Annex-B buffer: returns the start of
+ * the NAL unit after *pos (its header byte), and sets its length without
+ * trailing zeros, or returns NULL at the end.
+ */
+const unsigned char * h264_nal_next (const unsigned char * buf, size_t len, size_t * pos,
+                                     size_t * nal_len);
+
+#endif /* __H264_AU_H__ */
@@ -0,0 +1,231 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "tests.h"
+
+#include "h264-parse.h"
+
+#define MAX_SYNCS 8
+
+struct syncs {
+        int n;
+        uint64_t pos[MAX_SYNCS];
+        unsigned char params[MAX_SYNCS][H264_PARAMS_MAX];
+        size_t params_len[MAX_SYNCS];
+
+        /* Access units */
+        int nr_aus;
+        uint64_t au_pos[MAX_SYNCS];
+        int au_idr[MAX_SYNCS];
+};
+
+static void
+record_access_unit (uint64_t pos, int idr, void * data)
+{
+        struct syncs * s = (struct syncs *)data;
+        int i, idrs = 0;
+
+        if (s->nr_aus == MAX_SYNCS)
+                FAIL ("Too many access units");
+
+        /* Each IDR access unit is reported before its sync point */
+        for (i = 0; i < s->nr_aus; i++)
+                idrs += s->au_idr[i];
+        if (idr && s->n != idrs)
+                FAIL ("Access unit reported after its sync point");
+
+        s->au_pos[s->nr_aus] = pos;
+        s->au_idr[s->nr_aus] = idr;
+        s->nr_aus++;
+}
+
+static void
+record_sync (uint64_t pos, const unsigned char * params, size_t params_len, void * data)
+{
+        struct syncs * s = (struct syncs *)data;
+
+        if (s->n == MAX_SYNCS)
+                FAIL ("Too many sync points");
+
+        s->pos[s->n] = pos;
+        memcpy (s->params[s->n], params, params_len);
+        s->params_len[s->n] = params_len;
+        s->n++;
+}
+
+/*
+ * A stream of four pictures:
+ *   AUD SPS PPS IDR(2 slices)   -- carries its own parameters
+ *   P
+ *   SEI IDR                     -- needs the cached parameters
+ *   P
+ * with a mix of 3 and 4 byte start codes, and a trailing zero after the PPS.
+ */
+static const unsigned char sps[] = {0x67, 0x42, 0x00, 0x1e, 0x8d, 0x68};
+static const unsigned char pps[] = {0x68, 0xce, 0x3c, 0x80};
+
+static const unsigned char stream[] = {
+        /* 0: AUD */
+        0x00, 0x00, 0x00, 0x01, 0x09, 0xf0,
+        /* 6: SPS */
+        0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1e, 0x8d, 0x68,
+        /* 16: PPS, trailing zero */
+        0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80, 0x00,
+        /* 24: IDR, first slice */
+        0x00, 0x00, 0x01, 0x65, 0x88, 0x84, 0x00, 0x00, 0x03, 0x01, 0x22,
+        /* 35: IDR, second slice (first_mb_in_slice = 1) */
+        0x00, 0x00, 0x01, 0x65, 0x40, 0x11, 0x22,
+        /* 42: P */
+        0x00, 0x00, 0x00, 0x01, 0x41, 0x9a, 0x01, 0x02,
+        /* 50: SEI */
+        0x00, 0x00, 0x00, 0x01, 0x06, 0x05, 0x01, 0x80,
+        /* 58: IDR */
+        0x00, 0x00, 0x01, 0x65, 0x88, 0x80, 0x10,
+        /* 65: P */
+        0x00, 0x00, 0x00, 0x01, 0x41, 0x9a, 0x02, 0x04,
+        /* 73: end */
+        0x00, 0x00, 0x01, 0x09, 0xf0
+};
+
+/* Where each access unit starts; the first and third are IDR */
+static const uint64_t au_pos[] = {0, 42, 50, 65};
+
+static void
+check_syncs (struct syncs * s)
+{
+        unsigned char expected[H264_PARAMS_MAX];
+        size_t len = 0;
+
+        if (s->n != 2)
+                FAIL ("Expected two IDR access units");
+
+        if (s->pos[0] != 0)
+                FAIL ("First access unit should start at its AUD");
+        if (s->params_len[0] != 0)
+                FAIL ("First access unit carries its own parameters");
+
+        if (s->pos[1] != 50)
+                FAIL ("Second access unit should start at its SEI");
+
+        memcpy (expected, "\0\0\0\1", 4); len += 4;
+        memcpy (expected + len, sps, sizeof(sps)); len += sizeof(sps);
+        memcpy (expected + len, "\0\0\0\1", 4); len += 4;
+        memcpy (expected + len, pps, sizeof(pps)); len += sizeof(pps);
+
+        if (s->params_len[1] != len || memcmp (s->params[1], expected, len))
+                FAIL ("Cached SPS and PPS not prepended to second access unit");
+}
+
+/* Parameter sets for 1280x720 Baseline; 1920x1080 High with a scaling
+ * matrix, POC type 1 and cropping; and 172x142 Main, cropped from QCIF */
+static const unsigned char sps_720p[] = {
+        0x67, 0x42, 0x00, 0x1f, 0xed, 0x00, 0xa0, 0x0b, 0x72
+};
+static const unsigned char sps_1080p[] = {
+        0x67, 0x64, 0x00, 0x28, 0xad, 0xb4, 0xd3, 0x4d, 0x34, 0xd3, 0x4d, 0x00,
+        0xa1, 0xc8, 0xc5, 0x0f, 0x40, 0x3c, 0x01, 0x13, 0xf2, 0xa0
+};
+static const unsigned char sps_cropped[] = {
+        0x67, 0x4d, 0x00, 0x0b, 0xed, 0x05, 0x89, 0xf7, 0x48
+};
+
+static void
+check_sps (const unsigned char * nal, size_t len, int profile, int level,
+           int width, int height)
+{
+        struct h264_sps sps;
+
+        if (h264_sps_parse (nal, len, &sps) == -1)
+                FAIL ("SPS parse error");
+
+        if (sps.profile_idc != profile || sps.level_idc != level)
+                FAIL ("Wrong profile or level");
+
+        if (sps.width != width || sps.height != height)
+                FAIL ("Wrong picture size");
+}
+
+int
+main (int argc, char * argv[])
+{
+        struct h264_parser * p;
+        struct h264_sps info;
+        struct syncs s;
+        size_t i;
+
+        INFO ("Scanning a whole buffer");
+        memset (&s, 0, sizeof(s));
+        p = h264_parser_new (record_sync, &s);
+        h264_parser_scan (p, stream, sizeof(stream));
+        check_syncs (&s);
+        h264_parser_free (p);
+
+        INFO ("Scanning a byte at a time");
+        memset (&s, 0, sizeof(s));
+        p = h264_parser_new (record_sync, &s);
+        for (i = 0; i < sizeof(stream); i++)
+                h264_parser_scan (p, &stream[i], 1);
+        check_syncs (&s);
+        h264_parser_free (p);
+
+        INFO ("Finding every access unit");
+        memset (&s, 0, sizeof(s));
+        p = h264_parser_new (record_sync, &s);
+        h264_parser_set_access_unit (p, record_access_unit);
+        h264_parser_scan (p, stream, sizeof(stream));
+        check_syncs (&s);
+        if (s.nr_aus != 4)
+                FAIL ("Expected four access units");
+        for (i = 0; i < 4; i++) {
+                if (s.au_pos[i] != au_pos[i] || s.au_idr[i] != (i % 2 == 0))
+                        FAIL ("Access unit misplaced");
+        }
+        h264_parser_free (p);
+
+        INFO ("Parsing sequence parameter sets");
+        check_sps (sps_720p, sizeof(sps_720p), 66, 31, 1280, 720);
+        check_sps (sps_1080p, sizeof(sps_1080p), 100, 40, 1920, 1080);
+        check_sps (sps_cropped, sizeof(sps_cropped), 77, 11, 172, 142);
+        if (h264_sps_parse (sps_1080p, 8, &info) != -1)
+                FAIL ("Truncated SPS parsed");
+        if (h264_sps_parse (pps, sizeof(pps), &info) != -1)
+                FAIL ("PPS parsed as an SPS");
+
+        INFO ("IDR with no NAL units before it");
+        {
+                static const unsigned char bare_idr[] = {
+                        0x00, 0x00, 0x00, 0x01, 0x65, 0x88, 0x80, 0x10,
+                        0x00, 0x00, 0x01, 0x09, 0xf0
+                };
+                unsigned char buf[sizeof(stream)];
+
+                /* The first two pictures, then an IDR straight after the P */
+                memcpy (buf, stream, 50);
+                memcpy (buf + 50, bare_idr, sizeof(bare_idr));
+
+                memset (&s, 0, sizeof(s));
+                p = h264_parser_new (record_sync, &s);
+                h264_parser_scan (p, buf, 50 + sizeof(bare_idr));
+                if (s.n != 2 || s.pos[1] != 50)
+                        FAIL ("Expected a sync point at the bare IDR");
+                if (s.params_len[1] != 4 + sizeof(sps) + 4 + sizeof(pps))
+                        FAIL ("Parameter sets of an earlier access unit not prepended");
+                h264_parser_free (p);
+        }
+
+        INFO ("IDR without any parameter sets");
+        memset (&s, 0, sizeof(s));
+        p = h264_parser_new (record_sync, &s);
+        h264_parser_scan (p, stream + 58, sizeof(stream) - 58);
+        if (s.n != 0)
+                FAIL ("Sync point without parameter sets");
+        h264_parser_free (p);
+
+        return 0;
+}
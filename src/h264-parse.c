@@ -0,0 +1,417 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "h264-parse.h"
+
+/* #define DEBUG */
+
+/* NAL unit types */
+#define NAL_SLICE      1
+#define NAL_IDR        5
+#define NAL_SEI        6
+#define NAL_SPS        7
+#define NAL_PPS        8
+#define NAL_AUD        9
+
+#define HAVE_SPS 0x1
+#define HAVE_PPS 0x2
+
+enum h264_state {
+        STATE_PAYLOAD = 0, /* in the body of a NAL unit */
+        STATE_HEADER,      /* next byte is a NAL unit header */
+        STATE_SLICE        /* next byte starts a slice header */
+};
+
+struct param_set {
+        unsigned char data[H264_PARAM_SET_MAX];
+        size_t len;
+};
+
+struct h264_parser {
+        H264Sync sync;
+        H264AccessUnit au;
+        void * data;
+
+        uint64_t pos;        /* stream offset of the next byte */
+        enum h264_state state;
+        int zeros;           /* consecutive zero bytes seen */
+
+        int nal_type;
+        uint64_t nal_start;  /* offset of the current NAL unit's start code */
+
+        /* Non-VCL NAL units seen since the last picture open a new access
+         * unit; au_start is where it began, and au_params which parameter
+         * sets it carries */
+        int in_prefix;
+        uint64_t au_start;
+        int au_params;
+        uint64_t vcl_start;  /* access unit start for the current slice */
+
+        /* The parameter set being collected, if any, and the cache */
+        struct param_set * collect;
+        int overflow;
+        struct param_set pending;
+        struct param_set sps;
+        struct param_set pps;
+
+        unsigned char params[H264_PARAMS_MAX];
+};
+
+struct h264_parser *
+h264_parser_new (H264Sync sync, void * data)
+{
+        struct h264_parser * p;
+
+        if ((p = calloc (1, sizeof(*p))) == NULL)
+                return NULL;
+
+        p->sync = sync;
+        p->data = data;
+
+        return p;
+}
+
+void
+h264_parser_free (struct h264_parser * p)
+{
+        free (p);
+}
+
+void
+h264_parser_set_access_unit (struct h264_parser * p, H264AccessUnit au)
+{
+        p->au = au;
+}
+
+static int
+nal_starts_au (int type)
+{
+        return (type == NAL_SEI || type == NAL_SPS || type == NAL_PPS || type == NAL_AUD ||
+                (type >= 14 && type <= 18));
+}
+
+/* A parameter set NAL unit has ended; the zeros of the following start code
+ * were collected with it */
+static void
+end_param_set (struct h264_parser * p, int trailing_zeros)
+{
+        struct param_set * ps = p->collect;
+
+        p->collect = NULL;
+
+        if (p->overflow)
+                return;
+
+        if ((size_t)trailing_zeros > ps->len)
+                trailing_zeros = ps->len;
+        ps->len -= trailing_zeros;
+
+        if (ps->len == 0)
+                return;
+
+        if (p->nal_type == NAL_SPS)
+                p->sps = *ps;
+        else
+                p->pps = *ps;
+}
+
+static void
+nal_start (struct h264_parser * p, int type)
+{
+        p->nal_type = type;
+
+        if (nal_starts_au (type)) {
+                if (!p->in_prefix) {
+                        p->in_prefix = 1;
+                        p->au_start = p->nal_start;
+                        p->au_params = 0;
+                }
+                if (type == NAL_SPS)
+                        p->au_params |= HAVE_SPS;
+                else if (type == NAL_PPS)
+                        p->au_params |= HAVE_PPS;
+        } else if (type >= NAL_SLICE && type <= NAL_IDR) {
+                /* A picture with no NAL units before it carries no
+                 * parameter sets of its own */
+                if (!p->in_prefix)
+                        p->au_params = 0;
+                p->vcl_start = p->in_prefix ? p->au_start : p->nal_start;
+                p->in_prefix = 0;
+        }
+
+        if (type == NAL_SPS || type == NAL_PPS) {
+                p->collect = &p->pending;
+                p->pending.len = 0;
+                p->overflow = 0;
+        }
+}
+
+static size_t
+append_param_set (unsigned char * buf, const struct param_set * ps)
+{
+        static const unsigned char start_code[4] = {0, 0, 0, 1};
+
+        memcpy (buf, start_code, sizeof(start_code));
+        memcpy (buf + sizeof(start_code), ps->data, ps->len);
+
+        return sizeof(start_code) + ps->len;
+}
+
+static void
+idr_start (struct h264_parser * p)
+{
+        size_t len = 0;
+
+        if ((p->au_params & (HAVE_SPS|HAVE_PPS)) != (HAVE_SPS|HAVE_PPS)) {
+                /* A decoder cannot start here without parameter sets */
+                if (p->sps.len == 0 || p->pps.len == 0)
+                        return;
+
+                len = append_param_set (p->params, &p->sps);
+                len += append_param_set (p->params + len, &p->pps);
+        }
+
+#ifdef DEBUG
+        printf ("h264_parser: IDR at %llu, %zu bytes of parameters\n",
+                (unsigned long long)p->vcl_start, len);
+#endif
+
+        p->sync (p->vcl_start, p->params, len, p->data);
+}
+
+void
+h264_parser_scan (struct h264_parser * p, const unsigned char * buf, size_t len)
+{
+        size_t i;
+        unsigned char b;
+
+        for (i = 0; i < len; i++, p->pos++) {
+                b = buf[i];
+
+                if (p->state == STATE_HEADER) {
+                        nal_start (p, b & 0x1f);
+                        p->state = (p->nal_type == NAL_SLICE || p->nal_type == NAL_IDR) ?
+                                STATE_SLICE : STATE_PAYLOAD;
+                        p->zeros = 0;
+                        if (p->collect)
+                                p->collect->data[p->collect->len++] = b;
+                        continue;
+                }
+
+                if (p->state == STATE_SLICE) {
+                        /* first_mb_in_slice is ue(v), so a leading 1 bit means
+                         * 0: the first slice of a new picture */
+                        if (b & 0x80) {
+                                if (p->au)
+                                        p->au (p->vcl_start, p->nal_type == NAL_IDR, p->data);
+                                if (p->nal_type == NAL_IDR)
+                                        idr_start (p);
+                        }
+                        p->state = STATE_PAYLOAD;
+                }
+
+                if (b == 0x01 && p->zeros >= 2) {
+                        /* Start code: 00 00 01, or 00 00 00 01 at the start of
+                         * an access unit. Any further zeros are trailing zeros
+                         * of the previous NAL unit. */
+                        if (p->collect)
+                                end_param_set (p, p->zeros);
+                        p->nal_start = p->pos - (p->zeros >= 3 ? 3 : 2);
+                        p->state = STATE_HEADER;
+                        p->zeros = 0;
+                        continue;
+                }
+
+                p->zeros = (b == 0) ? p->zeros + 1 : 0;
+
+                if (p->collect) {
+                        if (p->collect->len < H264_PARAM_SET_MAX)
+                                p->collect->data[p->collect->len++] = b;
+                        else
+                                p->overflow = 1;
+                }
+        }
+}
+
+/*
+ * Sequence parameter sets
+ */
+
+struct bits {
+        const unsigned char * buf;
+        size_t len;     /* in bytes */
+        size_t pos;     /* in bits */
+        int overrun;
+};
+
+static unsigned int
+bits_read (struct bits * b, int n)
+{
+        unsigned int v = 0;
+
+        while (n-- > 0) {
+                if (b->pos >= b->len * 8) {
+                        b->overrun = 1;
+                        return 0;
+                }
+                v = (v << 1) | ((b->buf[b->pos / 8] >> (7 - b->pos % 8)) & 1);
+                b->pos++;
+        }
+
+        return v;
+}
+
+/* Exp-Golomb ue(v) */
+static unsigned int
+bits_ue (struct bits * b)
+{
+        int zeros = 0;
+
+        while (bits_read (b, 1) == 0 && !b->overrun) {
+                if (++zeros > 31) {
+                        b->overrun = 1;
+                        return 0;
+                }
+        }
+
+        return (1U << zeros) - 1 + bits_read (b, zeros);
+}
+
+/* Exp-Golomb se(v) */
+static int
+bits_se (struct bits * b)
+{
+        unsigned int v = bits_ue (b);
+
+        return (v & 1) ? (int)((v + 1) / 2) : -(int)(v / 2);
+}
+
+static void
+skip_scaling_list (struct bits * b, int size)
+{
+        int i, last = 8, next = 8;
+
+        for (i = 0; i < size; i++) {
+                if (next != 0)
+                        next = (last + bits_se (b) + 256) % 256;
+                last = (next == 0) ? last : next;
+        }
+}
+
+int
+h264_sps_parse (const unsigned char * nal, size_t len, struct h264_sps * sps)
+{
+        unsigned char rbsp[H264_PARAM_SET_MAX];
+        struct bits b;
+        unsigned int i, n, zeros = 0;
+        unsigned int width_mbs, height_units, frame_mbs_only;
+        unsigned int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+        int separate_planes = 0, sub_width, sub_height, poc_type;
+
+        if (len < 4 || (nal[0] & 0x1f) != NAL_SPS)
+                return -1;
+
+        /* Remove emulation prevention bytes; the fields needed are near the
+         * start, so a long SPS is truncated */
+        for (i = 1, n = 0; i < len && n < sizeof(rbsp); i++) {
+                if (zeros >= 2 && nal[i] == 0x03) {
+                        zeros = 0;
+                        continue;
+                }
+                zeros = (nal[i] == 0) ? zeros + 1 : 0;
+                rbsp[n++] = nal[i];
+        }
+
+        memset (&b, 0, sizeof(b));
+        b.buf = rbsp;
+        b.len = n;
+
+        memset (sps, 0, sizeof(*sps));
+        sps->profile_idc = bits_read (&b, 8);
+        sps->constraint_flags = bits_read (&b, 8);
+        sps->level_idc = bits_read (&b, 8);
+        bits_ue (&b); /* seq_parameter_set_id */
+
+        sps->chroma_format_idc = 1;
+        sps->bit_depth_luma = sps->bit_depth_chroma = 8;
+
+        switch (sps->profile_idc) {
+        case 100: case 110: case 122: case 244: case 44: case 83: case 86:
+        case 118: case 128: case 138: case 139: case 134: case 135:
+                sps->chroma_format_idc = bits_ue (&b);
+                if (sps->chroma_format_idc == 3)
+                        separate_planes = bits_read (&b, 1);
+                sps->bit_depth_luma = 8 + bits_ue (&b);
+                sps->bit_depth_chroma = 8 + bits_ue (&b);
+                bits_read (&b, 1); /* qpprime_y_zero_transform_bypass_flag */
+                if (bits_read (&b, 1)) {
+                        /* seq_scaling_matrix_present_flag */
+                        for (i = 0; i < (sps->chroma_format_idc != 3 ? 8U : 12U); i++) {
+                                if (bits_read (&b, 1))
+                                        skip_scaling_list (&b, i < 6 ? 16 : 64);
+                        }
+                }
+                break;
+        default:
+                break;
+        }
+
+        bits_ue (&b); /* log2_max_frame_num_minus4 */
+        poc_type = bits_ue (&b);
+        if (poc_type == 0) {
+                bits_ue (&b); /* log2_max_pic_order_cnt_lsb_minus4 */
+        } else if (poc_type == 1) {
+                bits_read (&b, 1); /* delta_pic_order_always_zero_flag */
+                bits_se (&b);      /* offset_for_non_ref_pic */
+                bits_se (&b);      /* offset_for_top_to_bottom_field */
+                n = bits_ue (&b);
+                for (i = 0; i < n && !b.overrun; i++)
+                        bits_se (&b);
+        }
+
+        bits_ue (&b);      /* max_num_ref_frames */
+        bits_read (&b, 1); /* gaps_in_frame_num_value_allowed_flag */
+        width_mbs = bits_ue (&b) + 1;
+        height_units = bits_ue (&b) + 1;
+        frame_mbs_only = bits_read (&b, 1);
+        if (!frame_mbs_only)
+                bits_read (&b, 1); /* mb_adaptive_frame_field_flag */
+        bits_read (&b, 1); /* direct_8x8_inference_flag */
+        if (bits_read (&b, 1)) {
+                crop_left = bits_ue (&b);
+                crop_right = bits_ue (&b);
+                crop_top = bits_ue (&b);
+                crop_bottom = bits_ue (&b);
+        }
+
+        if (b.overrun || sps->chroma_format_idc > 3 || width_mbs > 1024 || height_units > 1024)
+                return -1;
+
+        /* Cropping is in chroma samples, or luma for monochrome */
+        if (sps->chroma_format_idc == 0 || separate_planes) {
+                sub_width = 1;
+                sub_height = 1;
+        } else {
+                sub_width = (sps->chroma_format_idc == 3) ? 1 : 2;
+                sub_height = (sps->chroma_format_idc == 1) ? 2 : 1;
+        }
+        sub_height *= 2 - frame_mbs_only;
+
+        sps->width = width_mbs * 16 - sub_width * (crop_left + crop_right);
+        sps->height = (2 - frame_mbs_only) * height_units * 16 -
+                sub_height * (crop_top + crop_bottom);
+
+        if (sps->width <= 0 || sps->height <= 0)
+                return -1;
+
+        return 0;
+}
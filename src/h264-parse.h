@@ -0,0 +1,62 @@
+#ifndef __H264_PARSE_H__
+#define __H264_PARSE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * An incremental parser for H.264 Annex-B byte streams. It finds the start
+ * of each access unit that contains an IDR picture, so that a client can
+ * begin decoding there, and remembers the most recent sequence and picture
+ * parameter sets, which a decoder needs before the first IDR.
+ */
+
+/* Largest parameter set that is cached; larger ones are not */
+#define H264_PARAM_SET_MAX 256
+
+/* Largest set of parameters passed to H264Sync */
+#define H264_PARAMS_MAX (2 * (4 + H264_PARAM_SET_MAX))
+
+/*
+ * Called for each IDR access unit, where pos is the stream offset of its
+ * first byte. If the access unit does not carry its own SPS and PPS,
+ * params holds the most recent ones seen, each with a start code, to be
+ * sent before it; otherwise params_len is 0.
+ */
+typedef void (*H264Sync) (uint64_t pos, const unsigned char * params, size_t params_len,
+                          void * data);
+
+/*
+ * Called at the start of every access unit, with the stream offset of its
+ * first byte and whether it holds an IDR picture. For an IDR access unit
+ * this is called before H264Sync.
+ */
+typedef void (*H264AccessUnit) (uint64_t pos, int idr, void * data);
+
+struct h264_parser;
+
+struct h264_parser * h264_parser_new (H264Sync sync, void * data);
+void h264_parser_free (struct h264_parser * p);
+
+/* Also report each access unit to au, with the same data as sync */
+void h264_parser_set_access_unit (struct h264_parser * p, H264AccessUnit au);
+
+/* Scan the next len bytes of the stream */
+void h264_parser_scan (struct h264_parser * p, const unsigned char * buf, size_t len);
+
+/* What a container needs to know from a sequence parameter set */
+struct h264_sps {
+        int profile_idc;
+        int constraint_flags;
+        int level_idc;
+        int chroma_format_idc;
+        int bit_depth_luma;
+        int bit_depth_chroma;
+        int width;              /* in pixels, after cropping */
+        int height;
+};
+
+/* Parse an SPS NAL unit, from its header byte. Returns -1 if it is malformed */
+int h264_sps_parse (const unsigned char * nal, size_t len, struct h264_sps * sps);
+
+#endif /* __H264_PARSE_H__ */
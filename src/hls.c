@@ -0,0 +1,593 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "h264-au.h"
+#include "hls.h"
+#include "http-status.h"
+#include "params.h"
+#include "ts-mux.h"
+
+/* #define DEBUG */
+
+/* Longest playlist: the header and a line pair per segment */
+#define HLS_PLAYLIST_MAX (256 + HLS_MAX_SEGMENTS * 64)
+
+#define x_strdup(s) ((s)?strdup((s)):(NULL))
+
+struct hls_segment {
+        uint64_t seq;
+        uint64_t duration; /* TS_CLOCK units */
+        int refs;
+        unsigned char * data;
+        size_t len, size;
+};
+
+struct hls {
+        char * path;
+        unsigned long id; /* distinguishes this run's segment names */
+        uint64_t target;  /* TS_CLOCK units */
+        int nr_segments;
+
+        /* Published segments, under mutex; segment seq is kept in
+         * segments[seq % nr_kept] until it is replaced */
+        pthread_mutex_t mutex;
+        struct hls_segment ** segments;
+        int nr_kept;
+        uint64_t next_seq;
+        char playlist[HLS_PLAYLIST_MAX];
+        size_t playlist_len;
+
+        /* Segmenting, by the stream's writer only */
+        struct h264_au_reader * reader;
+        struct ts_mux mux;
+        struct hls_segment * cur;
+        uint64_t cur_pts;        /* of the first picture in cur */
+};
+
+static void
+hls_segment_release (struct hls * hls, struct hls_segment * s)
+{
+        pthread_mutex_lock (&hls->mutex);
+        if (--s->refs == 0) {
+                free (s->data);
+                free (s);
+        }
+        pthread_mutex_unlock (&hls->mutex);
+}
+
+/* Find a published segment, or NULL if it is gone. Release with
+ * hls_segment_release() */
+static struct hls_segment *
+hls_segment_get (struct hls * hls, uint64_t seq)
+{
+        struct hls_segment * s;
+
+        pthread_mutex_lock (&hls->mutex);
+        s = hls->segments[seq % hls->nr_kept];
+        if (s != NULL && s->seq == seq)
+                s->refs++;
+        else
+                s = NULL;
+        pthread_mutex_unlock (&hls->mutex);
+
+        return s;
+}
+
+static int
+hls_segment_name (struct hls * hls, char * buf, size_t n, uint64_t seq)
+{
+        return snprintf (buf, n, "%lx-%" PRIu64 ".ts", hls->id, seq);
+}
+
+/* Call with the mutex held */
+static void
+hls_playlist_update (struct hls * hls)
+{
+        struct hls_segment * s;
+        uint64_t first, seq, max = hls->target;
+        char * p = hls->playlist;
+        char * end = p + sizeof(hls->playlist);
+        char name[64];
+
+        first = (hls->next_seq > (uint64_t)hls->nr_segments) ?
+                hls->next_seq - hls->nr_segments : 0;
+
+        for (seq = first; seq < hls->next_seq; seq++) {
+                s = hls->segments[seq % hls->nr_kept];
+                if (s->duration > max)
+                        max = s->duration;
+        }
+
+        /* The target duration is in whole seconds, and no segment may exceed it */
+        p += snprintf (p, end - p, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%" PRIu64 "\n"
+                       "#EXT-X-MEDIA-SEQUENCE:%" PRIu64 "\n", (max + TS_CLOCK - 1) / TS_CLOCK, first);
+
+        for (seq = first; seq < hls->next_seq; seq++) {
+                s = hls->segments[seq % hls->nr_kept];
+                hls_segment_name (hls, name, sizeof(name), seq);
+                p += snprintf (p, end - p, "#EXTINF:%.3f,\n%s\n",
+                               (double)s->duration / TS_CLOCK, name);
+        }
+
+        hls->playlist_len = p - hls->playlist;
+}
+
+/* Make the current segment available, ending before a picture at pts */
+static void
+hls_publish (struct hls * hls, uint64_t pts)
+{
+        struct hls_segment * s = hls->cur, * old;
+
+        hls->cur = NULL;
+        s->duration = pts - hls->cur_pts;
+
+        pthread_mutex_lock (&hls->mutex);
+        s->seq = hls->next_seq++;
+        s->refs = 1;
+        old = hls->segments[s->seq % hls->nr_kept];
+        hls->segments[s->seq % hls->nr_kept] = s;
+        hls_playlist_update (hls);
+        pthread_mutex_unlock (&hls->mutex);
+
+#ifdef DEBUG
+        printf ("hls: segment %" PRIu64 ", %zu bytes, %.3fs\n", s->seq, s->len,
+                (double)s->duration / TS_CLOCK);
+#endif
+
+        if (old != NULL)
+                hls_segment_release (hls, old);
+}
+
+static void
+hls_segment_discard (struct hls * hls)
+{
+        if (hls->cur != NULL) {
+                free (hls->cur->data);
+                free (hls->cur);
+                hls->cur = NULL;
+        }
+}
+
+/* Make room for len more bytes in the current segment */
+static int
+hls_segment_reserve (struct hls * hls, size_t len)
+{
+        struct hls_segment * s = hls->cur;
+        unsigned char * data;
+        size_t size;
+
+        if (s->len + len <= s->size)
+                return 0;
+
+        if (s->len + len > HLS_SEGMENT_SIZE_MAX)
+                return -1;
+
+        for (size = s->size ? s->size : 64*1024; size < s->len + len; size *= 2);
+        if ((data = realloc (s->data, size)) == NULL)
+                return -1;
+
+        s->data = data;
+        s->size = size;
+
+        return 0;
+}
+
+static int
+hls_segment_start (struct hls * hls, uint64_t pts)
+{
+        if ((hls->cur = calloc (1, sizeof(*hls->cur))) == NULL)
+                return -1;
+
+        /* Every segment can be decoded on its own */
+        ts_mux_init (&hls->mux);
+        if (hls_segment_reserve (hls, 2 * TS_PACKET_SIZE) == -1) {
+                hls_segment_discard (hls);
+                return -1;
+        }
+        hls->cur->len += ts_mux_tables (&hls->mux, hls->cur->data);
+        hls->cur_pts = pts;
+
+        return 0;
+}
+
+/* Whether an access unit starts with an access unit delimiter */
+static int
+hls_has_aud (const unsigned char * buf, size_t len)
+{
+        size_t i;
+
+        for (i = 0; i + 1 < len && buf[i] == 0; i++);
+
+        return (i >= 2 && i + 1 < len && buf[i] == 1 && (buf[i+1] & 0x1f) == 9);
+}
+
+/* Mux an access unit into the current segment */
+static void
+hls_mux_access_unit (struct hls * hls, const struct h264_access_unit * au)
+{
+        static const unsigned char aud[] = {0x00, 0x00, 0x00, 0x01, 0x09, 0xf0};
+        struct iovec iov[3];
+        size_t total = 0;
+        int n = 0;
+
+        /* Transport streams need a delimiter before each access unit */
+        if (!hls_has_aud (au->data, au->len)) {
+                iov[n].iov_base = (void *)aud;
+                iov[n].iov_len = sizeof(aud);
+                total += iov[n++].iov_len;
+        }
+
+        /* Segments must start with the parameter sets */
+        if (au->params_len > 0) {
+                iov[n].iov_base = (void *)au->params;
+                iov[n].iov_len = au->params_len;
+                total += iov[n++].iov_len;
+        }
+
+        iov[n].iov_base = (void *)au->data;
+        iov[n].iov_len = au->len;
+        total += iov[n++].iov_len;
+
+        if (hls_segment_reserve (hls, ts_mux_pes_size (total)) == -1) {
+                hls_segment_discard (hls);
+                return;
+        }
+
+        hls->cur->len += ts_mux_pes (&hls->mux, hls->cur->data + hls->cur->len,
+                                     au->pts, iov, n);
+}
+
+/* Called with each complete access unit */
+static void
+hls_access_unit (const struct h264_access_unit * au, void * data)
+{
+        struct hls * hls = (struct hls *)data;
+
+        /* A segment with a gap cannot be played; start again at an IDR */
+        if (au->discontinuity)
+                hls_segment_discard (hls);
+
+        if (au->idr && (hls->cur == NULL || au->pts - hls->cur_pts >= hls->target)) {
+                if (hls->cur != NULL)
+                        hls_publish (hls, au->pts);
+                hls_segment_start (hls, au->pts);
+        }
+
+        if (hls->cur != NULL)
+                hls_mux_access_unit (hls, au);
+}
+
+void
+hls_write (const unsigned char * buf, size_t len, void * data)
+{
+        struct hls * hls = (struct hls *)data;
+
+        h264_au_reader_write (hls->reader, buf, len);
+}
+
+struct hls *
+hls_new (const char * path, double target_duration, int nr_segments, double frame_rate)
+{
+        struct hls * hls;
+
+        if ((hls = calloc (1, sizeof(*hls))) == NULL)
+                return NULL;
+
+        if (nr_segments < 1) nr_segments = 1;
+        if (nr_segments > HLS_MAX_SEGMENTS) nr_segments = HLS_MAX_SEGMENTS;
+
+        hls->path = x_strdup (path);
+        hls->id = (unsigned long)time (NULL);
+        hls->target = (uint64_t)(target_duration * TS_CLOCK);
+        hls->nr_segments = nr_segments;
+        hls->nr_kept = nr_segments + HLS_SPARE_SEGMENTS;
+        hls->segments = calloc (hls->nr_kept, sizeof(*hls->segments));
+        hls->reader = h264_au_reader_new (frame_rate, hls_access_unit, hls);
+
+        if (hls->path == NULL || hls->segments == NULL || hls->reader == NULL) {
+                hls_free (hls);
+                return NULL;
+        }
+
+        pthread_mutex_init (&hls->mutex, NULL);
+
+        return hls;
+}
+
+void
+hls_free (struct hls * hls)
+{
+        int i;
+
+        if (hls->segments) {
+                for (i = 0; i < hls->nr_kept; i++) {
+                        if (hls->segments[i] != NULL) {
+                                free (hls->segments[i]->data);
+                                free (hls->segments[i]);
+                        }
+                }
+                free (hls->segments);
+        }
+
+        hls_segment_discard (hls);
+
+        if (hls->reader)
+                h264_au_reader_free (hls->reader);
+
+        free (hls->path);
+        free (hls);
+}
+
+struct hls *
+hls_config (Dictionary * config)
+{
+        const char * path, * value;
+        double duration = HLS_DEFAULT_DURATION, frame_rate = 0.0;
+        int nr_segments = HLS_DEFAULT_SEGMENTS;
+
+        if ((path = dictionary_lookup (config, "HLSPath")) == NULL)
+                return NULL;
+
+        if ((value = dictionary_lookup (config, "HLSDuration")) != NULL && atof (value) > 0)
+                duration = atof (value);
+        if ((value = dictionary_lookup (config, "HLSSegments")) != NULL)
+                nr_segments = atoi (value);
+        if ((value = dictionary_lookup (config, "FrameRate")) != NULL)
+                frame_rate = atof (value);
+
+        return hls_new (path, duration, nr_segments, frame_rate);
+}
+
+/*
+ * Resource
+ */
+
+/* The name requested below the prefix, without any query */
+static size_t
+hls_request_name (struct hls * hls, http_request * request, const char ** name)
+{
+        *name = request->path + strlen (hls->path);
+
+        return strcspn (*name, "?#");
+}
+
+/* Find the segment a request names */
+static struct hls_segment *
+hls_request_segment (struct hls * hls, http_request * request)
+{
+        const char * name;
+        char expected[64];
+        unsigned long id;
+        uint64_t seq;
+        size_t len;
+
+        len = hls_request_name (hls, request, &name);
+
+        if (sscanf (name, "%lx-%" SCNu64, &id, &seq) != 2 || id != hls->id)
+                return NULL;
+
+        /* Only the exact name, no leading zeros or suffixes */
+        if ((size_t)hls_segment_name (hls, expected, sizeof(expected), seq) != len ||
+            strncmp (name, expected, len))
+                return NULL;
+
+        return hls_segment_get (hls, seq);
+}
+
+static int
+hls_request_playlist (struct hls * hls, http_request * request)
+{
+        const char * name;
+        size_t len;
+
+        len = hls_request_name (hls, request, &name);
+
+        return (len == strlen (HLS_PLAYLIST_NAME) && !strncmp (name, HLS_PLAYLIST_NAME, len));
+}
+
+static int
+hls_check (http_request * request, void * data)
+{
+        struct hls * hls = (struct hls *)data;
+
+        return !strncmp (request->path, hls->path, strlen (hls->path));
+}
+
+/*
+ * What a request is sent, found by the head: a segment, referenced until
+ * the body has been sent even if it is evicted meanwhile, or a copy of the
+ * playlist or error page
+ */
+struct hls_response {
+        struct hls * hls;
+        struct hls_segment * s;
+        const unsigned char * data;
+        size_t off, len;
+        char buf[HLS_PLAYLIST_MAX];
+};
+
+static void
+hls_response_free (struct hls_response * resp)
+{
+        if (resp->s != NULL)
+                hls_segment_release (resp->hls, resp->s);
+        free (resp);
+}
+
+static void
+hls_head (http_request * request, const char ** status_line,
+          params_t ** response_headers, void * data)
+{
+        struct hls * hls = (struct hls *)data;
+        struct hls_response * resp;
+        params_t * r = *response_headers;
+        char length[32];
+
+        if ((resp = calloc (1, sizeof(*resp))) == NULL) {
+                *status_line = http_status_line (HTTP_STATUS_INTERNAL_SERVER_ERROR);
+                return;
+        }
+        resp->hls = hls;
+
+        /* Kept for the body */
+        request->state = resp;
+
+        if (hls_request_playlist (hls, request)) {
+                pthread_mutex_lock (&hls->mutex);
+                resp->len = hls->playlist_len;
+                memcpy (resp->buf, hls->playlist, resp->len);
+                pthread_mutex_unlock (&hls->mutex);
+
+                if (resp->len > 0) {
+                        resp->data = (unsigned char *)resp->buf;
+                        *status_line = http_status_line (HTTP_STATUS_OK);
+                        r = params_append (r, "Content-Type", "application/vnd.apple.mpegurl");
+                        r = params_append (r, "Cache-Control", "no-cache");
+                }
+        } else if ((resp->s = hls_request_segment (hls, request)) != NULL) {
+                /* Published segments are not modified, so need no lock */
+                resp->data = resp->s->data;
+                resp->len = resp->s->len;
+                *status_line = http_status_line (HTTP_STATUS_OK);
+                r = params_append (r, "Content-Type", "video/mp2t");
+                r = params_append (r, "Cache-Control", "max-age=86400");
+        }
+
+        if (resp->data == NULL) {
+                resp->len = http_status_format_body (HTTP_STATUS_NOT_FOUND, resp->buf,
+                                                     sizeof(resp->buf));
+                resp->data = (unsigned char *)resp->buf;
+                *status_line = http_status_line (HTTP_STATUS_NOT_FOUND);
+                *response_headers = http_status_append_headers (r, HTTP_STATUS_NOT_FOUND);
+                return;
+        }
+
+        snprintf (length, sizeof(length), "%zu", resp->len);
+        r = params_append (r, "Content-Length", length);
+        *response_headers = r;
+}
+
+static void *
+hls_open (http_request * request, int notify_fd, int chunked, void * data)
+{
+        struct hls_response * resp = (struct hls_response *)request->state;
+
+        (void) notify_fd;
+        (void) chunked;
+        (void) data;
+
+        /* The body sends what the head found */
+        request->state = NULL;
+
+        return resp;
+}
+
+/* Send as much of the body as the socket takes without blocking */
+static ssize_t
+hls_pump (int fd, void * client, void * data)
+{
+        struct hls_response * resp = (struct hls_response *)client;
+        ssize_t n;
+
+        (void) data;
+
+        while (resp->off < resp->len) {
+                n = write (fd, resp->data + resp->off, resp->len - resp->off);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n == -1)
+                        return -1;
+                resp->off += n;
+        }
+
+        return RESOURCE_PUMP_END;
+}
+
+static void
+hls_close (void * client, void * data)
+{
+        (void) data;
+
+        hls_response_free ((struct hls_response *)client);
+}
+
+static void
+hls_release (void * state, void * data)
+{
+        (void) data;
+
+        hls_response_free ((struct hls_response *)state);
+}
+
+static void
+hls_send (int fd, const unsigned char * buf, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = write (fd, buf, len);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return;
+                buf += n;
+                len -= n;
+        }
+}
+
+static void
+hls_status (int fd, void * data)
+{
+        struct hls * hls = (struct hls *)data;
+        char buf[256];
+        uint64_t nr;
+        int n;
+
+        pthread_mutex_lock (&hls->mutex);
+        nr = hls->next_seq;
+        pthread_mutex_unlock (&hls->mutex);
+
+        n = snprintf (buf, sizeof(buf), "<h2>%s" HLS_PLAYLIST_NAME "</h2>\n"
+                      "<p>HLS: %" PRIu64 " segments published, %d listed</p>\n",
+                      hls->path, nr, hls->nr_segments);
+        if (n > 0)
+                hls_send (fd, (unsigned char *)buf, n);
+}
+
+/* The hls output is freed by whoever feeds it data, with hls_free(), once
+ * the stream writing to it has stopped; see hls_resource() */
+static void
+hls_resource_delete (void * data)
+{
+        (void) data;
+}
+
+struct resource *
+hls_resource (struct hls * hls)
+{
+        struct resource * r;
+
+        if ((r = resource_new_stream (hls_check, hls_head, hls_open, hls_pump, hls_close,
+                                      hls_resource_delete, hls)) != NULL) {
+                r->release = hls_release;
+                r->status = hls_status;
+                r->path = hls->path;
+        }
+
+        return r;
+}
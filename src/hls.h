@@ -0,0 +1,56 @@
+#ifndef __HLS_H__
+#define __HLS_H__
+
+#include "dictionary.h"
+#include "resource.h"
+
+/*
+ * An HTTP Live Streaming output for an H.264 stream. The stream's data is
+ * passed in through hls_write(), as a StreamTap, and cut into MPEG-TS
+ * segments at IDR access units. The most recent segments are kept in
+ * memory and listed in a live playlist, both served below a path prefix:
+ *
+ *   <prefix>index.m3u8       the playlist
+ *   <prefix><id>-<seq>.ts    segments
+ *
+ * Segments never change once published and their names are not reused,
+ * even across restarts, so they can be cached by clients and proxies.
+ *
+ * Pictures are timed by their arrival, or at a fixed frame rate, as
+ * described in h264-au.h.
+ */
+
+#define HLS_PLAYLIST_NAME "index.m3u8"
+
+/* Default and maximum number of segments listed in the playlist */
+#define HLS_DEFAULT_SEGMENTS 6
+#define HLS_MAX_SEGMENTS 64
+
+/* Segments are kept for a while after leaving the playlist, for clients
+ * that fetched the playlist just before */
+#define HLS_SPARE_SEGMENTS 3
+
+/* Default target segment duration, in seconds */
+#define HLS_DEFAULT_DURATION 2.0
+
+/* A segment which grows this large without an IDR is discarded */
+#define HLS_SEGMENT_SIZE_MAX (32*1024*1024)
+
+struct hls;
+
+struct hls * hls_new (const char * path, double target_duration, int nr_segments,
+                      double frame_rate);
+void hls_free (struct hls * hls);
+
+/* Make an HLS output from the HLS* settings of a stream's configuration
+ * block, or return NULL if it has none */
+struct hls * hls_config (Dictionary * config);
+
+/* Add stream data; a StreamTap */
+void hls_write (const unsigned char * buf, size_t len, void * data);
+
+/* The resource serving the playlist and segments. Deleting the resource
+ * does not free the hls output, which stays owned by the caller */
+struct resource * hls_resource (struct hls * hls);
+
+#endif /* __HLS_H__ */
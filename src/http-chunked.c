@@ -0,0 +1,139 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "http-chunked.h"
+
+#define CRLF "\r\n"
+
+void
+http_chunk_init (struct http_chunk * chunk)
+{
+        memset (chunk, 0, sizeof(*chunk));
+        chunk->tail_off = 2;
+}
+
+int
+http_chunk_pending (const struct http_chunk * chunk)
+{
+        return (chunk->head_off < chunk->head_len || chunk->left > 0 || chunk->tail_off < 2);
+}
+
+size_t
+http_chunk_advance (struct http_chunk * chunk, size_t n)
+{
+        size_t k, data;
+
+        k = chunk->head_len - chunk->head_off;
+        if (k > n) k = n;
+        chunk->head_off += k;
+        n -= k;
+
+        data = (chunk->left < n) ? chunk->left : n;
+        chunk->left -= data;
+        n -= data;
+
+        chunk->tail_off += n;
+
+        return data;
+}
+
+int
+http_chunk_iov (struct http_chunk * chunk, const struct iovec * iov, int iovcnt,
+                struct iovec * out)
+{
+        size_t total = 0, len;
+        int i, nout = 0;
+
+        if (iovcnt > HTTP_CHUNK_IOV_MAX) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (!http_chunk_pending (chunk)) {
+                for (i = 0; i < iovcnt; i++)
+                        total += iov[i].iov_len;
+
+                /* A chunk of size zero would end the body */
+                if (total == 0)
+                        return 0;
+
+                chunk->head_len = snprintf (chunk->head, sizeof(chunk->head), "%zx" CRLF, total);
+                chunk->head_off = 0;
+                chunk->left = total;
+                chunk->tail_off = 0;
+        }
+
+        if (chunk->head_off < chunk->head_len) {
+                out[nout].iov_base = chunk->head + chunk->head_off;
+                out[nout].iov_len = chunk->head_len - chunk->head_off;
+                nout++;
+        }
+
+        for (i = 0, total = 0; i < iovcnt && total < chunk->left; i++) {
+                len = iov[i].iov_len;
+                if (len > chunk->left - total)
+                        len = chunk->left - total;
+                out[nout].iov_base = iov[i].iov_base;
+                out[nout].iov_len = len;
+                nout++;
+                total += len;
+        }
+
+        /* The CRLF can only follow once all of the data is going out */
+        if (total == chunk->left && chunk->tail_off < 2) {
+                out[nout].iov_base = CRLF + chunk->tail_off;
+                out[nout].iov_len = 2 - chunk->tail_off;
+                nout++;
+        }
+
+        return nout;
+}
+
+ssize_t
+http_chunk_writev (int fd, struct http_chunk * chunk, const struct iovec * iov, int iovcnt)
+{
+        struct iovec out[HTTP_CHUNK_IOV_MAX + 2];
+        ssize_t n;
+        int nout;
+
+        if ((nout = http_chunk_iov (chunk, iov, iovcnt, out)) <= 0)
+                return nout;
+
+        if ((n = writev (fd, out, nout)) == -1)
+                return -1;
+
+        return http_chunk_advance (chunk, n);
+}
+
+int
+http_chunk_end (int fd, struct http_chunk * chunk)
+{
+        ssize_t n;
+
+        if (!chunk->ended) {
+                if (http_chunk_pending (chunk)) {
+                        errno = EINVAL;
+                        return -1;
+                }
+                memcpy (chunk->head, HTTP_CHUNK_LAST, strlen (HTTP_CHUNK_LAST));
+                chunk->head_len = strlen (HTTP_CHUNK_LAST);
+                chunk->head_off = 0;
+                chunk->ended = 1;
+        }
+
+        while (chunk->head_off < chunk->head_len) {
+                n = write (fd, chunk->head + chunk->head_off, chunk->head_len - chunk->head_off);
+                if (n == -1)
+                        return -1;
+                chunk->head_off += n;
+        }
+
+        return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef __HTTP_CHUNKED_H__
+#define __HTTP_CHUNKED_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Chunked transfer coding for bodies of unknown length, such as live
+ * streams. Each chunk is written with a single writev(): the size line,
+ * the data and the CRLF after it. A chunk may be cut short by a full
+ * socket, in which case the rest of it, framing included, is written by
+ * later calls.
+ */
+
+/* Most data iovecs per call */
+#define HTTP_CHUNK_IOV_MAX 8
+
+/* Largest size line, "ffffffffffffffff\r\n" */
+#define HTTP_CHUNK_HEAD_MAX 20
+
+/* The last chunk, with no trailers, ending the body */
+#define HTTP_CHUNK_LAST "0\r\n\r\n"
+
+struct http_chunk {
+        char head[HTTP_CHUNK_HEAD_MAX];
+        size_t head_len, head_off; /* the size line, or the last chunk */
+        size_t left;               /* data of the current chunk still to send */
+        size_t tail_off;           /* of the CRLF after the data */
+        int ended;                 /* the last chunk has been started */
+};
+
+void http_chunk_init (struct http_chunk * chunk);
+
+/* Whether a chunk has been started and not yet completely written */
+int http_chunk_pending (const struct http_chunk * chunk);
+
+/*
+ * Write data from iov as chunked body. If no chunk is pending, a chunk of
+ * all of iov's data is started; otherwise iov must begin with the rest of
+ * the pending chunk's data, and only that much is taken from it.
+ *
+ * Returns the number of data bytes written, not counting framing, or -1
+ * on error. The chunk is still pending after a short write.
+ */
+ssize_t http_chunk_writev (int fd, struct http_chunk * chunk, const struct iovec * iov,
+                           int iovcnt);
+
+/*
+ * The two halves of http_chunk_writev(), for writes made some other way:
+ * http_chunk_iov() fills out, which must have room for iovcnt + 2 iovecs,
+ * with what to write and returns how many it used; once the write is done,
+ * http_chunk_advance() accounts for the n bytes of it that went out and
+ * returns how many of those were data.
+ */
+int http_chunk_iov (struct http_chunk * chunk, const struct iovec * iov, int iovcnt,
+                    struct iovec * out);
+size_t http_chunk_advance (struct http_chunk * chunk, size_t n);
+
+/* Start (or continue) writing the last chunk. Returns 0 once it has been
+ * written, or -1 with errno set to EAGAIN if the socket filled first */
+int http_chunk_end (int fd, struct http_chunk * chunk);
+
+#endif /* __HTTP_CHUNKED_H__ */
@@ -0,0 +1,174 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#define _GNU_SOURCE /* F_SETPIPE_SZ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "http-chunked.h"
+
+#include "tests.h"
+
+#define DATA_LEN 100000
+
+/* The end of the data is sent in pieces of this size, copied out from the
+ * iovecs of http_chunk_iov() */
+#define SPLIT_LEN 1000
+#define PIECE_LEN 7
+
+static unsigned char data[DATA_LEN];
+static unsigned char wire[2 * DATA_LEN];
+static unsigned char decoded[DATA_LEN];
+
+static size_t
+drain (int fd, unsigned char * buf, size_t off, size_t size)
+{
+        ssize_t n;
+
+        while (off < size && (n = read (fd, buf + off, size - off)) > 0)
+                off += n;
+
+        return off;
+}
+
+/* Copy up to PIECE_LEN bytes of out to the end of buf, as a short write
+ * would send them, returning how many */
+static size_t
+copy_out (const struct iovec * out, int nout, unsigned char * buf, size_t * buf_len)
+{
+        size_t len, total = 0;
+        int i;
+
+        for (i = 0; i < nout && total < PIECE_LEN; i++) {
+                len = out[i].iov_len;
+                if (len > PIECE_LEN - total)
+                        len = PIECE_LEN - total;
+                memcpy (buf + *buf_len, out[i].iov_base, len);
+                *buf_len += len;
+                total += len;
+        }
+
+        return total;
+}
+
+/* Decode a chunked body, returning its length; fails if it is malformed
+ * or does not end with the last chunk */
+static size_t
+decode (const unsigned char * buf, size_t len, unsigned char * out)
+{
+        size_t pos = 0, out_len = 0, size;
+        char * end;
+
+        while (1) {
+                size = strtoul ((const char *)buf + pos, &end, 16);
+                pos = (const unsigned char *)end - buf;
+                if (pos + 2 > len || memcmp (buf + pos, "\r\n", 2))
+                        FAIL ("Bad chunk size line");
+                pos += 2;
+
+                if (size == 0)
+                        break;
+
+                if (pos + size + 2 > len)
+                        FAIL ("Chunk overruns body");
+                memcpy (out + out_len, buf + pos, size);
+                out_len += size;
+                pos += size;
+
+                if (memcmp (buf + pos, "\r\n", 2))
+                        FAIL ("No CRLF after chunk data");
+                pos += 2;
+        }
+
+        if (pos + 2 != len || memcmp (buf + pos, "\r\n", 2))
+                FAIL ("Body does not end after the last chunk");
+
+        return out_len;
+}
+
+int
+main (int argc, char * argv[])
+{
+        struct http_chunk chunk;
+        struct iovec iov[2], out[4];
+        size_t off, wire_len = 0, step, sent = 0;
+        ssize_t n;
+        int fds[2], i, nout;
+
+        for (i = 0; i < DATA_LEN; i++)
+                data[i] = i * 7;
+
+        if (pipe (fds) == -1)
+                FAIL ("pipe");
+        fcntl (fds[0], F_SETFL, O_NONBLOCK);
+        fcntl (fds[1], F_SETFL, O_NONBLOCK);
+        fcntl (fds[1], F_SETPIPE_SZ, 4096);
+
+        INFO ("Empty writes send nothing");
+        http_chunk_init (&chunk);
+        if (http_chunk_writev (fds[1], &chunk, NULL, 0) != 0 || http_chunk_pending (&chunk))
+                FAIL ("Empty write started a chunk");
+
+        INFO ("Chunks cut short by a full pipe");
+        for (off = 0, step = 1; off < DATA_LEN - SPLIT_LEN; off += step, step = step * 3 + 1) {
+                if (step > DATA_LEN - SPLIT_LEN - off)
+                        step = DATA_LEN - SPLIT_LEN - off;
+
+                /* Each chunk is offered as two iovecs, and resumed until done */
+                iov[0].iov_base = data + off;
+                iov[0].iov_len = step / 2;
+                iov[1].iov_base = data + off + step / 2;
+                iov[1].iov_len = step - step / 2;
+
+                sent = 0;
+                do {
+                        n = http_chunk_writev (fds[1], &chunk, iov, 2);
+                        if (n == -1 && errno != EAGAIN)
+                                FAIL ("http_chunk_writev");
+                        if (n > 0) {
+                                sent += n;
+                                /* Present the rest of the chunk's data */
+                                iov[0].iov_base = data + off + sent;
+                                iov[0].iov_len = step - sent;
+                                iov[1].iov_len = 0;
+                        }
+                        wire_len = drain (fds[0], wire, wire_len, sizeof(wire));
+                } while (http_chunk_pending (&chunk));
+
+                if (sent != step)
+                        FAIL ("Chunk data not all sent");
+        }
+
+        INFO ("Chunks written in pieces from http_chunk_iov");
+        for (off = DATA_LEN - SPLIT_LEN; off < DATA_LEN || http_chunk_pending (&chunk); ) {
+                /* A pending chunk is offered the rest of its data */
+                iov[0].iov_base = data + off;
+                iov[0].iov_len = http_chunk_pending (&chunk) ? chunk.left : DATA_LEN - off;
+                if ((nout = http_chunk_iov (&chunk, iov, 1, out)) <= 0)
+                        FAIL ("http_chunk_iov");
+                off += http_chunk_advance (&chunk, copy_out (out, nout, wire, &wire_len));
+        }
+
+        INFO ("Last chunk");
+        while (http_chunk_end (fds[1], &chunk) == -1) {
+                if (errno != EAGAIN)
+                        FAIL ("http_chunk_end");
+                wire_len = drain (fds[0], wire, wire_len, sizeof(wire));
+        }
+        wire_len = drain (fds[0], wire, wire_len, sizeof(wire));
+
+        if (decode (wire, wire_len, decoded) != DATA_LEN || memcmp (decoded, data, DATA_LEN))
+                FAIL ("Decoded body differs");
+
+        close (fds[0]);
+        close (fds[1]);
+
+        exit (EXIT_SUCCESS);
+}
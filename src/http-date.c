@@ -8,6 +8,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/timerfd.h>
+
+#include "http-date.h"
 
 #define HTTPDATE_FMT "%3s, %02d %s %4d %02d:%02d:%02d GMT"
 
@@ -24,13 +31,136 @@ httpdate_init (void)
 int
 httpdate_snprint (char * buf, int n, time_t mtime)
 {
-  struct tm * g;
+  struct tm g;
 
-  g = gmtime (&mtime);
+  gmtime_r (&mtime, &g);
 
   return snprintf (buf, n, HTTPDATE_FMT,
-		   wdays[g->tm_wday], g->tm_mday, months[g->tm_mon],
-		   g->tm_year + 1900, g->tm_hour, g->tm_min, g->tm_sec);
+		   wdays[g.tm_wday], g.tm_mday, months[g.tm_mon],
+		   g.tm_year + 1900, g.tm_hour, g.tm_min, g.tm_sec);
+}
+
+/*
+ * The clock thread formats each second's date into the next of a few
+ * slots and then publishes it, so readers never see a slot being written
+ * unless they hold on to a date for several seconds.
+ */
+#define HTTPDATE_SLOTS 4
+
+static struct httpdate clock_slots[HTTPDATE_SLOTS];
+static _Atomic (struct httpdate *) clock_current = NULL;
+
+static __thread struct httpdate local_date;
+
+static void
+httpdate_format (struct httpdate * date, time_t t)
+{
+  size_t len;
+
+  date->time = t;
+  len = httpdate_snprint (date->value, sizeof(date->value), t);
+
+  memcpy (date->line, "Date: ", 6);
+  memcpy (date->line + 6, date->value, len);
+  memcpy (date->line + 6 + len, "\r\n", 2);
+  date->line_len = len + 8;
+}
+
+static void
+clock_publish (int * next)
+{
+  struct httpdate * date = &clock_slots[*next];
+  struct timespec now;
+
+  /* Not time(), which may read a coarse clock still behind the second
+   * that the timer has just marked */
+  clock_gettime (CLOCK_REALTIME, &now);
+  httpdate_format (date, now.tv_sec);
+  atomic_store_explicit (&clock_current, date, memory_order_release);
+
+  *next = (*next + 1) % HTTPDATE_SLOTS;
+}
+
+static void *
+clock_main (void * data)
+{
+  int fd = *(int *)data;
+  int next = 1;
+  uint64_t exp;
+
+  free (data);
+
+  while (1) {
+    if (read (fd, &exp, sizeof(uint64_t)) != sizeof(uint64_t)) {
+      perror ("httpdate clock read");
+      continue;
+    }
+    clock_publish (&next);
+  }
+
+  return NULL;
+}
+
+int
+httpdate_clock_start (void)
+{
+  struct itimerspec new_value;
+  struct timespec now;
+  pthread_t thread;
+  int * fd;
+  int next = 0;
+
+  if ((fd = malloc (sizeof(int))) == NULL)
+    return -1;
+
+  if ((*fd = timerfd_create (CLOCK_REALTIME, TFD_CLOEXEC)) == -1) {
+    perror ("timerfd_create");
+    free (fd);
+    return -1;
+  }
+
+  /* Fire on each whole second */
+  clock_gettime (CLOCK_REALTIME, &now);
+  new_value.it_value.tv_sec = now.tv_sec + 1;
+  new_value.it_value.tv_nsec = 0;
+  new_value.it_interval.tv_sec = 1;
+  new_value.it_interval.tv_nsec = 0;
+
+  if (timerfd_settime (*fd, TFD_TIMER_ABSTIME, &new_value, NULL) == -1) {
+    perror ("timerfd_settime");
+    close (*fd);
+    free (fd);
+    return -1;
+  }
+
+  clock_publish (&next);
+
+  if (pthread_create (&thread, NULL, clock_main, fd) != 0) {
+    perror ("pthread_create");
+    close (*fd);
+    free (fd);
+    return -1;
+  }
+  pthread_detach (thread);
+
+  return 0;
+}
+
+const struct httpdate *
+httpdate_now (void)
+{
+  struct httpdate * date;
+  time_t t;
+
+  date = atomic_load_explicit (&clock_current, memory_order_acquire);
+  if (date != NULL)
+    return date;
+
+  /* No clock thread; keep a copy for this thread */
+  if ((t = time (NULL)) != local_date.time || local_date.line_len == 0)
+    httpdate_format (&local_date, t);
+
+  return &local_date;
 }
 
 time_t
@@ -3,8 +3,32 @@
 
 #include <time.h>
 
+#include <stddef.h>
+
 void httpdate_init (void);
 int httpdate_snprint (char * buf, int n, time_t mtime);
 time_t httpdate_parse (char * s, int n);
 
+/* The current date, formatted for the Date header */
+struct httpdate {
+  time_t time;
+  char value[32];       /* eg. "Sat, 17 Oct 2009 08:00:00 GMT" */
+  char line[48];        /* "Date: " value CRLF */
+  size_t line_len;
+};
+
+/*
+ * Start a thread which reformats the current date once a second, on the
+ * second, from a timerfd. Until it is started, httpdate_now() formats the
+ * date itself in each calling thread.
+ */
+int httpdate_clock_start (void);
+
+/*
+ * The current date. This does not block or make a system call once the
+ * clock is running; the result stays valid for at least a few seconds,
+ * long enough to format a response.
+ */
+const struct httpdate * httpdate_now (void);
+
 #endif /* __HTTPDATE_H__ */
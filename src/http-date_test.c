@@ -36,5 +36,17 @@ main (int argc, char * argv[])
     }
   }
 
+  INFO ("Current date without the clock thread:");
+  if (httpdate_now ()->time != time (NULL) && httpdate_now ()->time != time (NULL) - 1)
+    FAIL ("Wrong current date");
+  INFO (httpdate_now ()->value);
+
+  INFO ("Current date from the clock thread:");
+  if (httpdate_clock_start () == -1)
+    FAIL ("Could not start clock");
+  if (strlen (httpdate_now ()->value) != 29 || strncmp (httpdate_now ()->line, "Date: ", 6))
+    FAIL ("Bad date format");
+  INFO (httpdate_now ()->line);
+
   return 0;
 }
@@ -0,0 +1,179 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+/*
+ * Compare requests parsed per second by the in-place request parser
+ * against the previous approach: a request line parser which copies the
+ * method and path out, followed by params_new_parse() on the headers.
+ *
+ * Each iteration copies the request into a fresh buffer, parses it and
+ * looks up the User-Agent and Connection headers, as the server does for
+ * every request.
+ *
+ * Usage: http-parse-bench [iterations]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http-reqline.h"
+#include "params.h"
+
+static const char * requests[] = {
+        "GET /stream.264 HTTP/1.1\r\n"
+        "Host: localhost:3000\r\n"
+        "User-Agent: curl/7.88.1\r\n"
+        "Accept: */*\r\n"
+        "\r\n",
+
+        "GET /stream.mjpg?fps=5 HTTP/1.1\r\n"
+        "Host: camera.local\r\n"
+        "Connection: keep-alive\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+        "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+        "Referer: http://camera.local/\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "\r\n",
+
+        NULL
+};
+
+/* The request line parser this replaced, which copies the method and path */
+static size_t
+old_reqline_parse (char * s, size_t len, http_method * method, char ** path)
+{
+        size_t span, consumed = 0;
+
+        span = strcspn (s, " ");
+        if (span == 3 && !strncmp (s, "GET", 3)) {
+                *method = HTTP_METHOD_GET;
+        } else if (span == 4 && !strncmp (s, "HEAD", 4)) {
+                *method = HTTP_METHOD_HEAD;
+        } else {
+                return 0;
+        }
+        s += span+1;
+        consumed += span+1;
+
+        span = strcspn (s, " ");
+        *path = malloc (span+1);
+        strncpy (*path, s, span);
+        (*path)[span] = '\0';
+        s += span+1;
+        consumed += span+1;
+
+        span = strcspn (s, "\r\n");
+        if (span != 8 || strncmp (s, "HTTP/1.", 7))
+                goto fail;
+        s += span;
+        consumed += span;
+
+        span = strspn (s, "\r\n");
+        if (span > 2)
+                goto fail;
+
+        /* The original request line was kept for logging */
+        free (strndup (s - consumed, consumed));
+
+        return consumed + span;
+
+fail:
+        free (*path);
+        return 0;
+}
+
+static int
+old_parse (char * buf, size_t len)
+{
+        params_t * headers;
+        http_method method;
+        char * path;
+        size_t n;
+        int ok;
+
+        if ((n = old_reqline_parse (buf, len, &method, &path)) == 0)
+                return 0;
+
+        headers = params_new_parse (&buf[n], len - n, PARAMS_HEADERS);
+        ok = (params_get (headers, "User-Agent") != NULL) |
+                (params_get (headers, "Connection") != NULL);
+        params_free (headers);
+        free (path);
+
+        return ok;
+}
+
+static int
+new_parse (char * buf, size_t len)
+{
+        http_request request;
+
+        http_request_init (&request);
+        if (http_request_parse (&request, buf, len) != HTTP_PARSE_DONE)
+                return 0;
+
+        return (http_request_header (&request, HTTP_HEADER_USER_AGENT) != NULL) |
+                (http_request_header (&request, HTTP_HEADER_CONNECTION) != NULL);
+}
+
+static double
+now (void)
+{
+        struct timespec ts;
+
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+bench (const char * name, int (*parse) (char *, size_t), long iterations)
+{
+        char buf[4096];
+        const char * req;
+        double start, elapsed;
+        long i, ok = 0;
+        size_t len;
+        int r;
+
+        start = now ();
+
+        for (r = 0; (req = requests[r]) != NULL; r++) {
+                len = strlen (req);
+                for (i = 0; i < iterations; i++) {
+                        memcpy (buf, req, len + 1);
+                        ok += parse (buf, len);
+                }
+        }
+
+        elapsed = now () - start;
+
+        printf ("%-4s parser: %10.0f requests per second (%ld ok)\n",
+                name, r * iterations / elapsed, ok);
+
+        return r * iterations / elapsed;
+}
+
+int
+main (int argc, char * argv[])
+{
+        long iterations = 1000000;
+        double old_rate, new_rate;
+
+        if (argc > 1) iterations = atol (argv[1]);
+
+        old_rate = bench ("old", old_parse, iterations);
+        new_rate = bench ("new", new_parse, iterations);
+
+        printf ("new/old: %.2fx\n", new_rate / old_rate);
+
+        exit (0);
+}
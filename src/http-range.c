@@ -0,0 +1,157 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http-range.h"
+
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t')
+
+/* Parse a decimal byte position; returns the character after it, or NULL */
+static const char *
+range_parse_pos (const char * s, off_t * pos)
+{
+        off_t v = 0;
+
+        if (*s < '0' || *s > '9')
+                return NULL;
+
+        for (; *s >= '0' && *s <= '9'; s++) {
+                /* Positions past any real file are clamped rather than overflowing */
+                if (v < ((off_t)1 << 52))
+                        v = v * 10 + (*s - '0');
+        }
+
+        *pos = v;
+        return s;
+}
+
+/* Sort by first byte and merge ranges which overlap or touch */
+static int
+range_coalesce (http_range * ranges, int n)
+{
+        http_range t;
+        int i, j;
+
+        for (i = 1; i < n; i++) {
+                t = ranges[i];
+                for (j = i; j > 0 && ranges[j-1].first > t.first; j--)
+                        ranges[j] = ranges[j-1];
+                ranges[j] = t;
+        }
+
+        for (i = 0, j = 1; j < n; j++) {
+                if (ranges[j].first <= ranges[i].last + 1) {
+                        if (ranges[j].last > ranges[i].last)
+                                ranges[i].last = ranges[j].last;
+                } else {
+                        ranges[++i] = ranges[j];
+                }
+        }
+
+        return (n > 0) ? i + 1 : 0;
+}
+
+int
+http_range_parse (const char * spec, off_t size, http_range * ranges)
+{
+        const char * s;
+        off_t first, last;
+        int n = 0, specs = 0;
+
+        if (spec == NULL || strncasecmp (spec, "bytes=", 6) != 0)
+                return 0;
+
+        s = spec + 6;
+
+        while (1) {
+                while (IS_SPACE (*s)) s++;
+
+                if (*s == '-') {
+                        /* Suffix range: the last bytes */
+                        if ((s = range_parse_pos (s + 1, &last)) == NULL)
+                                return 0;
+                        first = (last < size) ? size - last : 0;
+                        last = (last > 0) ? size - 1 : -1;
+                } else {
+                        if ((s = range_parse_pos (s, &first)) == NULL || *s != '-')
+                                return 0;
+                        s++;
+                        if (*s >= '0' && *s <= '9') {
+                                if ((s = range_parse_pos (s, &last)) == NULL || last < first)
+                                        return 0;
+                                if (last >= size)
+                                        last = size - 1;
+                        } else {
+                                last = size - 1;
+                        }
+                }
+
+                if (++specs > HTTP_RANGE_MAX)
+                        return 0;
+
+                /* Ranges starting past the end cannot be satisfied */
+                if (first < size && first <= last) {
+                        ranges[n].first = first;
+                        ranges[n].last = last;
+                        n++;
+                }
+
+                while (IS_SPACE (*s)) s++;
+
+                if (*s == '\0')
+                        break;
+                if (*s++ != ',')
+                        return 0;
+        }
+
+        if (n == 0)
+                return -1;
+
+        return range_coalesce (ranges, n);
+}
+
+int
+http_range_snprint (char * buf, size_t n, const http_range * range, off_t size)
+{
+        if (range == NULL)
+                return snprintf (buf, n, "bytes */%lld", (long long)size);
+
+        return snprintf (buf, n, "bytes %lld-%lld/%lld", (long long)range->first,
+                         (long long)range->last, (long long)size);
+}
+
+int
+http_range_part_head (char * buf, size_t n, const http_range * range, off_t size,
+                      const char * content_type)
+{
+        char content_range[80];
+
+        http_range_snprint (content_range, sizeof(content_range), range, size);
+
+        return snprintf (buf, n, "\r\n--" HTTP_RANGE_BOUNDARY "\r\n"
+                         "Content-Type: %s\r\nContent-Range: %s\r\n\r\n",
+                         content_type, content_range);
+}
+
+off_t
+http_range_multipart_length (const http_range * ranges, int nranges, off_t size,
+                             const char * content_type)
+{
+        char head[HTTP_RANGE_PART_HEAD_MAX];
+        off_t len = strlen (HTTP_RANGE_TRAILER);
+        int i, n;
+
+        for (i = 0; i < nranges; i++) {
+                n = http_range_part_head (head, sizeof(head), &ranges[i], size, content_type);
+                if (n < 0 || (size_t)n >= sizeof(head))
+                        return -1;
+                len += n;
+                len += ranges[i].last - ranges[i].first + 1;
+        }
+
+        return len;
+}
@@ -0,0 +1,49 @@
+#ifndef __HTTP_RANGE_H__
+#define __HTTP_RANGE_H__
+
+#include <sys/types.h>
+
+/* A byte range, first and last inclusive as in the Range header */
+typedef struct {
+        off_t first;
+        off_t last;
+} http_range;
+
+/* More ranges than this in one request are ignored, and the whole
+ * representation is sent instead */
+#define HTTP_RANGE_MAX 16
+
+/* Parts of a multi-range response are separated by this boundary */
+#define HTTP_RANGE_BOUNDARY "sighttpd-8f1d0c5a7e2b"
+#define HTTP_RANGE_MULTIPART "multipart/byteranges; boundary=" HTTP_RANGE_BOUNDARY
+#define HTTP_RANGE_TRAILER "\r\n--" HTTP_RANGE_BOUNDARY "--\r\n"
+
+/* Longest header of one part of a multipart/byteranges body; a response
+ * whose part heads would be longer is not sent in parts */
+#define HTTP_RANGE_PART_HEAD_MAX 512
+
+/*
+ * Parse the value of a Range header against a representation of the
+ * given size. Overlapping and adjacent ranges are merged, and the result
+ * is sorted by offset.
+ *
+ * Returns the number of ranges stored, 0 if the header should be ignored
+ * (it is not a byte range, is malformed, or asks for too many ranges), or
+ * -1 if none of the ranges can be satisfied (416).
+ */
+int http_range_parse (const char * spec, off_t size, http_range * ranges);
+
+/* Format a Content-Range value for a range, eg. "bytes 0-499/1234". If
+ * range is NULL, format the value for a 416 response, with only the size */
+int http_range_snprint (char * buf, size_t n, const http_range * range, off_t size);
+
+/* Format the header preceding one part of a multipart/byteranges body */
+int http_range_part_head (char * buf, size_t n, const http_range * range, off_t size,
+                          const char * content_type);
+
+/* The Content-Length of a multipart/byteranges body, or -1 if a part head
+ * would be longer than HTTP_RANGE_PART_HEAD_MAX */
+off_t http_range_multipart_length (const http_range * ranges, int nranges, off_t size,
+                                   const char * content_type);
+
+#endif /* __HTTP_RANGE_H__ */
@@ -0,0 +1,142 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http-range.h"
+
+#include "tests.h"
+
+#define SIZE 10000
+
+struct range_test {
+        const char * spec;
+        int n;          /* expected result of http_range_parse() */
+        http_range ranges[3];
+};
+
+static struct range_test tests[] = {
+        /* Single ranges */
+        {"bytes=0-499", 1, {{0, 499}}},
+        {"bytes=500-999", 1, {{500, 999}}},
+        {"bytes=9500-", 1, {{9500, 9999}}},
+        {"bytes=-500", 1, {{9500, 9999}}},
+        {"bytes=0-0", 1, {{0, 0}}},
+        {"bytes=9999-", 1, {{9999, 9999}}},
+        {"bytes=-20000", 1, {{0, 9999}}},
+        {"bytes=9000-20000", 1, {{9000, 9999}}},
+        {"Bytes = 0-9", 0, {{0, 0}}},
+
+        /* Multiple ranges */
+        {"bytes=0-99,200-299", 2, {{0, 99}, {200, 299}}},
+        {"bytes=0-99, 200-299 ,-100", 3, {{0, 99}, {200, 299}, {9900, 9999}}},
+        {"bytes=500-599,0-99", 2, {{0, 99}, {500, 599}}},
+
+        /* Overlapping and adjacent ranges are merged */
+        {"bytes=0-499,500-999", 1, {{0, 999}}},
+        {"bytes=0-499,100-199", 1, {{0, 499}}},
+        {"bytes=400-999,0-499,2000-2999", 2, {{0, 999}, {2000, 2999}}},
+        {"bytes=-100,9000-", 1, {{9000, 9999}}},
+
+        /* Unsatisfiable ranges are dropped */
+        {"bytes=20000-,0-9", 1, {{0, 9}}},
+        {"bytes=10000-", -1, {{0, 0}}},
+        {"bytes=20000-30000", -1, {{0, 0}}},
+        {"bytes=-0", -1, {{0, 0}}},
+
+        /* Malformed or unsupported headers are ignored */
+        {"bytes=", 0, {{0, 0}}},
+        {"bytes=abc", 0, {{0, 0}}},
+        {"bytes=500-400", 0, {{0, 0}}},
+        {"bytes=0-99,", 0, {{0, 0}}},
+        {"bytes=0-99;200-299", 0, {{0, 0}}},
+        {"bytes=--5", 0, {{0, 0}}},
+        {"items=0-9", 0, {{0, 0}}},
+        {"0-99", 0, {{0, 0}}},
+        {"bytes=0-1,2-3,4-5,6-7,8-9,10-11,12-13,14-15,16-17,18-19,20-21,22-23,"
+         "24-25,26-27,28-29,30-31,32-33", 0, {{0, 0}}},
+
+        {NULL, 0, {{0, 0}}}
+};
+
+static void
+test_parse (void)
+{
+        http_range ranges[HTTP_RANGE_MAX];
+        char msg[256];
+        int i, j, n;
+
+        INFO ("Parsing ranges");
+
+        for (i = 0; tests[i].spec; i++) {
+                n = http_range_parse (tests[i].spec, SIZE, ranges);
+                if (n != tests[i].n) {
+                        snprintf (msg, sizeof(msg), "%s: got %d ranges, expected %d",
+                                  tests[i].spec, n, tests[i].n);
+                        FAIL (msg);
+                }
+
+                for (j = 0; j < n; j++) {
+                        if (ranges[j].first != tests[i].ranges[j].first ||
+                            ranges[j].last != tests[i].ranges[j].last) {
+                                snprintf (msg, sizeof(msg), "%s: range %d is %lld-%lld", tests[i].spec,
+                                          j, (long long)ranges[j].first, (long long)ranges[j].last);
+                                FAIL (msg);
+                        }
+                }
+        }
+
+        INFO ("Parsing ranges of an empty file");
+        if (http_range_parse ("bytes=0-", 0, ranges) != -1)
+                FAIL ("Range of an empty file is satisfiable");
+        if (http_range_parse ("bytes=-10", 0, ranges) != -1)
+                FAIL ("Suffix range of an empty file is satisfiable");
+}
+
+static void
+test_format (void)
+{
+        http_range ranges[2] = {{0, 99}, {200, 299}};
+        char buf[256];
+        off_t len;
+
+        INFO ("Formatting Content-Range");
+
+        http_range_snprint (buf, sizeof(buf), &ranges[1], SIZE);
+        if (strcmp (buf, "bytes 200-299/10000"))
+                FAIL (buf);
+
+        http_range_snprint (buf, sizeof(buf), NULL, SIZE);
+        if (strcmp (buf, "bytes */10000"))
+                FAIL (buf);
+
+        INFO ("Measuring multipart/byteranges");
+
+        len = http_range_multipart_length (ranges, 2, SIZE, "video/mp2t");
+        len -= http_range_part_head (buf, sizeof(buf), &ranges[0], SIZE, "video/mp2t");
+        len -= http_range_part_head (buf, sizeof(buf), &ranges[1], SIZE, "video/mp2t");
+        if (len != 200 + strlen (HTTP_RANGE_TRAILER))
+                FAIL ("Multipart length is wrong");
+
+        INFO ("Part heads too long to send");
+        {
+                char ctype[HTTP_RANGE_PART_HEAD_MAX];
+
+                memset (ctype, 'x', sizeof(ctype) - 1);
+                ctype[sizeof(ctype) - 1] = '\0';
+                if (http_range_multipart_length (ranges, 2, SIZE, ctype) != -1)
+                        FAIL ("Multipart length given for part heads that do not fit");
+        }
+}
+
+int
+main (int argc, char * argv[])
+{
+        test_parse ();
+        test_format ();
+
+        exit (EXIT_SUCCESS);
+}
@@ -4,112 +4,240 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "http-reqline.h"
+#include "http-scan.h"
 
-size_t
-http_request_parse (char * s, size_t len, http_request * request)
+void
+http_request_init (http_request * request)
 {
-        char * sp = " ";
-        char * crlf = "\r\n";
-        size_t span, consumed=0;
-        char * original_reqline;
-        http_method method;
-        char * path;
-        http_version version;
-
-        original_reqline = s;
-
-        /* Extract method */
-        span = strcspn (s, sp);
-
-        switch (span) {
-        case 3:
-                if (!strncmp (s, "GET", 3)) {
-                        method = HTTP_METHOD_GET;
-                } else if (!strncmp (s, "PUT", 3)) {
-                        method = HTTP_METHOD_PUT;
-                } else {
-                        goto fail;
-                }
+        memset (request, 0, sizeof(*request));
+}
+
+/* Move a pointer into src_buf to the same place in dst_buf */
+#define REBASE(p) ((p) == NULL ? NULL : dst_buf + ((p) - src_buf))
+
+void
+http_request_copy (http_request * dst, char * dst_buf, const http_request * src,
+                   const char * src_buf)
+{
+        int i;
+
+        memcpy (dst_buf, src_buf, src->length);
+        *dst = *src;
+
+        dst->method_name = REBASE (src->method_name);
+        dst->path = REBASE (src->path);
+        dst->version_name = REBASE (src->version_name);
+
+        for (i = 0; i < src->nr_headers; i++) {
+                dst->headers[i].name = REBASE (src->headers[i].name);
+                dst->headers[i].value = REBASE (src->headers[i].value);
+        }
+}
+
+static http_method
+http_method_parse (const char * s)
+{
+        switch (s[0]) {
+        case 'G':
+                if (!strcmp (s, "GET")) return HTTP_METHOD_GET;
                 break;
-        case 4:
-                if (!strncmp (s, "HEAD", 4)) {
-                        method = HTTP_METHOD_HEAD;
-                } else if (!strncmp (s, "POST", 4)) {
-                        method = HTTP_METHOD_POST;
-                } else {
-                        goto fail;
-                }
+        case 'H':
+                if (!strcmp (s, "HEAD")) return HTTP_METHOD_HEAD;
                 break;
-        case 5:
-                if (!strncmp (s, "TRACE", 5)) {
-                        method = HTTP_METHOD_TRACE;
-                } else {
-                        goto fail;
-                }
+        case 'P':
+                if (!strcmp (s, "POST")) return HTTP_METHOD_POST;
+                if (!strcmp (s, "PUT")) return HTTP_METHOD_PUT;
                 break;
-        case 6:
-                if (!strncmp (s, "DELETE", 6)) {
-                        method = HTTP_METHOD_DELETE;
-                } else {
-                        goto fail;
-                }
+        case 'O':
+                if (!strcmp (s, "OPTIONS")) return HTTP_METHOD_OPTIONS;
                 break;
-        case 7:
-                if (!strncmp (s, "OPTIONS", 7)) {
-                        method = HTTP_METHOD_OPTIONS;
-                } else if (!strncmp (s, "CONNECT", 7)) {
-                        method = HTTP_METHOD_CONNECT;
-                } else {
-                        goto fail;
-                }
+        case 'D':
+                if (!strcmp (s, "DELETE")) return HTTP_METHOD_DELETE;
+                break;
+        case 'T':
+                if (!strcmp (s, "TRACE")) return HTTP_METHOD_TRACE;
+                break;
+        case 'C':
+                if (!strcmp (s, "CONNECT")) return HTTP_METHOD_CONNECT;
                 break;
         default:
-                goto fail;
                 break;
         }
 
-        s += span+1;
-        consumed += span+1;
-
-        /* Extract path */
-        span = strcspn (s, sp);
-        path = malloc (span+1);
-        strncpy (path, s, span);
-        path[span] = '\0';
-
-        s += span+1;
-        consumed += span+1;
-
-        /* Extract version */
-        span = strcspn (s, crlf);
-        if (span != 8) goto fail;
-        if (!strncmp (s, "HTTP/1.1", 8)) {
-                version = HTTP_VERSION_1_1;
-        } else if (!strncmp (s, "HTTP/1.0", 8)) {
-                version = HTTP_VERSION_1_0;
-        } else if (!strncmp (s, "HTTP/0.9", 8)) {
-                version = HTTP_VERSION_0_9;
+        return HTTP_METHOD_EXTENSION;
+}
+
+/* Split a NUL-terminated request line in place */
+static int
+http_reqline_parse (http_request * request, char * line, char * end)
+{
+        char * path, * version;
+
+        if ((path = (char *)http_scan (line, end, ' ')) == NULL || path == line)
+                return -1;
+        *path++ = '\0';
+
+        if ((version = (char *)http_scan (path, end, ' ')) == NULL || version == path)
+                return -1;
+        *version++ = '\0';
+
+        if (!strcmp (version, "HTTP/1.1")) {
+                request->version = HTTP_VERSION_1_1;
+        } else if (!strcmp (version, "HTTP/1.0")) {
+                request->version = HTTP_VERSION_1_0;
+        } else if (!strcmp (version, "HTTP/0.9")) {
+                request->version = HTTP_VERSION_0_9;
         } else {
-                goto fail;
+                return -1;
+        }
+
+        request->method_name = line;
+        request->method = http_method_parse (line);
+        request->path = path;
+        request->version_name = version;
+
+        return 0;
+}
+
+static int
+http_header_identify (const char * name)
+{
+        switch (name[0]) {
+        case 'H': case 'h':
+                if (!strcasecmp (name, "Host")) return HTTP_HEADER_HOST;
+                break;
+        case 'C': case 'c':
+                if (!strcasecmp (name, "Connection")) return HTTP_HEADER_CONNECTION;
+                if (!strcasecmp (name, "Content-Length")) return HTTP_HEADER_CONTENT_LENGTH;
+                break;
+        case 'U': case 'u':
+                if (!strcasecmp (name, "User-Agent")) return HTTP_HEADER_USER_AGENT;
+                break;
+        case 'I': case 'i':
+                if (!strcasecmp (name, "If-Modified-Since")) return HTTP_HEADER_IF_MODIFIED_SINCE;
+                if (!strcasecmp (name, "If-None-Match")) return HTTP_HEADER_IF_NONE_MATCH;
+                if (!strcasecmp (name, "If-Range")) return HTTP_HEADER_IF_RANGE;
+                break;
+        case 'R': case 'r':
+                if (!strcasecmp (name, "Range")) return HTTP_HEADER_RANGE;
+                break;
+        case 'T': case 't':
+                if (!strcasecmp (name, "Transfer-Encoding")) return HTTP_HEADER_TRANSFER_ENCODING;
+                break;
+        default:
+                break;
         }
 
-        s += span;
-        consumed += span;
+        return -1;
+}
 
-        span = strspn (s, crlf);
-        if (span > 2) goto fail;
+/* Split a NUL-terminated header line in place */
+static int
+http_header_parse (http_request * request, char * line, char * end)
+{
+        http_header * h;
+        char * colon, * value;
+        int id;
 
-        request->original_reqline = strndup (original_reqline, consumed);
-        consumed += span;
+        if ((colon = (char *)http_scan (line, end, ':')) == NULL || colon == line)
+                return -1;
+        *colon = '\0';
 
-        request->method = method;
-        request->path = path;
-        request->version = version;
+        value = colon + 1;
+        while (*value == ' ' || *value == '\t')
+                value++;
+        while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+                *--end = '\0';
+
+        h = &request->headers[request->nr_headers++];
+        h->name = line;
+        h->value = value;
 
-        return consumed;
+        /* Keep the first of any repeated known header */
+        if ((id = http_header_identify (line)) != -1 && request->known[id] == 0)
+                request->known[id] = request->nr_headers;
 
-fail:
         return 0;
 }
+
+/* Join a continuation line onto the value of the previous header */
+static int
+http_header_fold (http_request * request, char * line)
+{
+        char * s;
+
+        if (request->nr_headers == 0)
+                return -1;
+
+        for (s = request->headers[request->nr_headers-1].value; *s; s++);
+        for (; s < line; s++)
+                *s = ' ';
+
+        return 0;
+}
+
+http_parse_result
+http_request_parse (http_request * request, char * buf, size_t len)
+{
+        char * line, * nl, * end;
+
+        while (request->length < len) {
+                line = buf + request->length;
+
+                /* Only search the bytes which arrived since the last call */
+                nl = (char *)http_scan (line + request->scanned, buf + len, '\n');
+                if (nl == NULL) {
+                        request->scanned = len - request->length;
+                        return HTTP_PARSE_AGAIN;
+                }
+
+                end = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+                *end = '\0';
+
+                request->length = nl + 1 - buf;
+                request->scanned = 0;
+
+                if (request->path == NULL) {
+                        /* Ignore blank lines before the request line */
+                        if (end == line)
+                                continue;
+                        if (http_reqline_parse (request, line, end) == -1)
+                                return HTTP_PARSE_ERROR;
+                } else if (end == line) {
+                        return HTTP_PARSE_DONE;
+                } else if (*line == ' ' || *line == '\t') {
+                        if (http_header_fold (request, line) == -1)
+                                return HTTP_PARSE_ERROR;
+                } else if (request->nr_headers == HTTP_REQUEST_HEADERS_MAX) {
+                        return HTTP_PARSE_TOO_LARGE;
+                } else if (http_header_parse (request, line, end) == -1) {
+                        return HTTP_PARSE_ERROR;
+                }
+        }
+
+        return HTTP_PARSE_AGAIN;
+}
+
+const char *
+http_request_header (http_request * request, http_header_id id)
+{
+        int i = request->known[id];
+
+        return (i == 0) ? NULL : request->headers[i-1].value;
+}
+
+const char *
+http_request_header_get (http_request * request, const char * name)
+{
+        int i;
+
+        for (i = 0; i < request->nr_headers; i++) {
+                if (!strcasecmp (request->headers[i].name, name))
+                        return request->headers[i].value;
+        }
+
+        return NULL;
+}
@@ -1,6 +1,8 @@
 #ifndef __HTTP_REQLINE_H__
 #define __HTTP_REQLINE_H__
 
+#include <stddef.h>
+
 /* http://www.ietf.org/rfc/rfc2616.txt */
 
 typedef enum {
@@ -21,13 +23,82 @@ typedef enum {
         HTTP_VERSION_1_1
 } http_version;
 
+/* Headers which can be looked up without searching */
+typedef enum {
+        HTTP_HEADER_HOST,
+        HTTP_HEADER_CONNECTION,
+        HTTP_HEADER_USER_AGENT,
+        HTTP_HEADER_RANGE,
+        HTTP_HEADER_CONTENT_LENGTH,
+        HTTP_HEADER_TRANSFER_ENCODING,
+        HTTP_HEADER_IF_MODIFIED_SINCE,
+        HTTP_HEADER_IF_NONE_MATCH,
+        HTTP_HEADER_IF_RANGE,
+        HTTP_HEADER_KNOWN
+} http_header_id;
+
+/* Maximum number of headers in a request */
+#define HTTP_REQUEST_HEADERS_MAX 32
+
 typedef struct {
-        char * original_reqline;
+        char * name;
+        char * value;
+} http_header;
+
+typedef enum {
+        HTTP_PARSE_AGAIN,       /* The request head is incomplete */
+        HTTP_PARSE_DONE,        /* A whole request head has been parsed */
+        HTTP_PARSE_ERROR,       /* Malformed request */
+        HTTP_PARSE_TOO_LARGE    /* More than HTTP_REQUEST_HEADERS_MAX headers */
+} http_parse_result;
+
+/*
+ * A request parsed in place: the method, path, version and header strings
+ * all point into the caller's buffer, which the parser NUL-terminates as it
+ * goes. The buffer must stay put and unmodified between calls.
+ */
+typedef struct {
+        char * method_name;
         http_method method;
-        http_version version;
         char * path;
+        char * version_name;
+        http_version version;
+
+        int nr_headers;
+        http_header headers[HTTP_REQUEST_HEADERS_MAX];
+
+        /* Index + 1 into headers for each known header, or 0 if absent */
+        unsigned char known[HTTP_HEADER_KNOWN];
+
+        /* Set by the resource's head, for the rest of the response */
+        void * state;
+
+        /* Parser state */
+        size_t length;  /* bytes consumed by complete lines */
+        size_t scanned; /* bytes of the current line searched for its end */
 } http_request;
 
-size_t http_request_parse (char * s, size_t len, http_request * request);
+/* Reset a request before parsing a new one */
+void http_request_init (http_request * request);
+
+/*
+ * Continue parsing a request head from buf, of which len bytes have been
+ * received. On HTTP_PARSE_DONE, request->length is the size of the request
+ * head, including its terminating blank line.
+ */
+http_parse_result http_request_parse (http_request * request, char * buf, size_t len);
+
+/*
+ * Copy a parsed request, and the request->length bytes of src_buf it was
+ * parsed from, to dst_buf, so that it stays valid once src_buf is reused
+ */
+void http_request_copy (http_request * dst, char * dst_buf, const http_request * src,
+                        const char * src_buf);
+
+/* The value of a known header, or NULL */
+const char * http_request_header (http_request * request, http_header_id id);
+
+/* The value of any header, by case-insensitive name, or NULL */
+const char * http_request_header_get (http_request * request, const char * name);
 
 #endif /* __HTTP_REQLINE_H__ */
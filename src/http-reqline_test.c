@@ -15,26 +15,107 @@ test_http_parse (char * s, http_method e_method, char * e_path, http_version e_v
 {
         char buf[256];
         http_request request;
-        size_t len;
 
-        strncpy (buf, s, strlen(s));
-        buf[strlen(s)-2] = '\0';
-        INFO (buf);
+        strcpy (buf, s);
+        INFO (s);
 
-        len = http_request_parse (s, strlen(s), &request);
-        if (len != strlen (s)) {
-                FAIL ("Did not consume entire line");
-        }
+        http_request_init (&request);
+        if (http_request_parse (&request, buf, strlen(buf)) != HTTP_PARSE_DONE)
+                FAIL ("Did not parse request");
+        if (request.length != strlen (s))
+                FAIL ("Did not consume entire request");
+        if (request.method != e_method || strcmp (request.path, e_path) ||
+            request.version != e_version)
+                FAIL ("Parsed request line incorrectly");
+}
+
+#define HEADERS \
+        "GET /stream.ogv?fps=2 HTTP/1.1\r\n" \
+        "Host: localhost:3000\r\n" \
+        "User-Agent:curl/7.88.1  \r\n" \
+        "X-Folded: one\r\n" \
+        "\ttwo\r\n" \
+        "connection: close\r\n" \
+        "\r\n" \
+        "GET / HTTP/1.1\r\n"
+
+static void
+check_headers (http_request * request)
+{
+        if (request->length != strlen (HEADERS) - 16)
+                FAIL ("Did not stop at the end of the request");
+        if (strcmp (request->path, "/stream.ogv?fps=2"))
+                FAIL ("Wrong path");
+        if (request->nr_headers != 4)
+                FAIL ("Wrong number of headers");
+        if (strcmp (http_request_header (request, HTTP_HEADER_HOST), "localhost:3000"))
+                FAIL ("Wrong Host");
+        if (strcmp (http_request_header (request, HTTP_HEADER_USER_AGENT), "curl/7.88.1"))
+                FAIL ("Whitespace not trimmed from User-Agent");
+        if (strcmp (http_request_header (request, HTTP_HEADER_CONNECTION), "close"))
+                FAIL ("Known header not matched case-insensitively");
+        if (http_request_header (request, HTTP_HEADER_RANGE) != NULL)
+                FAIL ("Absent header found");
+        if (strcmp (http_request_header_get (request, "x-folded"), "one  \ttwo"))
+                FAIL ("Continuation line not joined");
 }
 
 int
 main (int argc, char * argv[])
 {
+        http_request request, copy;
+        char buf[512], * copy_buf;
+        size_t i;
+        int n;
+
         INFO ("Testing parse of valid HTTP request lines:");
 
-        test_http_parse ("GET /stream.ogv HTTP/1.1\r\n", HTTP_METHOD_GET, "/stream.ogv", HTTP_VERSION_1_1);
-        test_http_parse ("PUT /stream.ogv HTTP/1.1\r\n", HTTP_METHOD_PUT, "/stream.ogv", HTTP_VERSION_1_1);
-        test_http_parse ("OPTIONS * HTTP/1.1\r\n", HTTP_METHOD_OPTIONS, "*", HTTP_VERSION_1_1);
-                
+        test_http_parse ("GET /stream.ogv HTTP/1.1\r\n\r\n", HTTP_METHOD_GET, "/stream.ogv", HTTP_VERSION_1_1);
+        test_http_parse ("PUT /stream.ogv HTTP/1.1\r\n\r\n", HTTP_METHOD_PUT, "/stream.ogv", HTTP_VERSION_1_1);
+        test_http_parse ("OPTIONS * HTTP/1.1\r\n\r\n", HTTP_METHOD_OPTIONS, "*", HTTP_VERSION_1_1);
+        test_http_parse ("\r\nHEAD / HTTP/1.0\n\n", HTTP_METHOD_HEAD, "/", HTTP_VERSION_1_0);
+
+        INFO ("Testing parse of headers in one buffer");
+        strcpy (buf, HEADERS);
+        http_request_init (&request);
+        if (http_request_parse (&request, buf, strlen(buf)) != HTTP_PARSE_DONE)
+                FAIL ("Did not parse request");
+        check_headers (&request);
+
+        INFO ("Testing copy of a parsed request");
+        copy_buf = malloc (request.length);
+        http_request_copy (&copy, copy_buf, &request, buf);
+        memset (buf, 'x', sizeof(buf));
+        check_headers (&copy);
+        free (copy_buf);
+
+        INFO ("Testing parse of headers a byte at a time");
+        strcpy (buf, HEADERS);
+        http_request_init (&request);
+        for (i = 1; i < strlen(HEADERS); i++) {
+                if (http_request_parse (&request, buf, i) == HTTP_PARSE_DONE)
+                        break;
+        }
+        check_headers (&request);
+
+        INFO ("Testing rejection of malformed requests");
+        strcpy (buf, "GET /\r\n\r\n");
+        http_request_init (&request);
+        if (http_request_parse (&request, buf, strlen(buf)) != HTTP_PARSE_ERROR)
+                FAIL ("Accepted request line without a version");
+
+        strcpy (buf, "GET / HTTP/1.1\r\nNo colon\r\n\r\n");
+        http_request_init (&request);
+        if (http_request_parse (&request, buf, strlen(buf)) != HTTP_PARSE_ERROR)
+                FAIL ("Accepted header without a colon");
+
+        n = sprintf (buf, "GET / HTTP/1.1\r\n");
+        for (i = 0; i <= HTTP_REQUEST_HEADERS_MAX; i++)
+                n += sprintf (buf + n, "X-%ld: y\r\n", (long)i);
+        sprintf (buf + n, "\r\n");
+        http_request_init (&request);
+        if (http_request_parse (&request, buf, strlen(buf)) != HTTP_PARSE_TOO_LARGE)
+                FAIL ("Accepted too many headers");
+
         exit (EXIT_SUCCESS);
 }
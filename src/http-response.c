@@ -6,171 +6,818 @@
 #include "config.h"
 #endif
 
+#define _GNU_SOURCE /* memfd_create */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
 #include "sighttpd.h"
 #include "resource.h"
+#include "router.h"
 #include "params.h"
+#include "http-date.h"
 #include "http-reqline.h"
+#include "http-response.h"
 #include "http-status.h"
 #include "list.h"
 #include "log.h"
 
 /* #define DEBUG */
 
-static params_t *
-response_headers_new (void)
+#define SERVER_LINE "Server: Sighttpd/" VERSION "\r\n"
+
+static void
+respond_get_head (struct resource * r, http_request * request,
+                  const char ** status_line, params_t ** response_headers)
 {
-        params_t * response_headers = NULL;
-        char date[256];
+	if (r != NULL) {
+		r->head (request, status_line, response_headers, r->data);
+		return;
+	}
 
-        httpdate_snprint (date, 256, time(NULL));
-        response_headers = params_append (response_headers, "Date", date);
-        response_headers = params_append (response_headers, "Server", "Sighttpd/" VERSION);
+        *status_line = http_status_line (HTTP_STATUS_NOT_FOUND);
+        *response_headers = http_status_append_headers (*response_headers, HTTP_STATUS_NOT_FOUND);
+}
 
-        return response_headers;
+/* Drop what the resource's head left on the request for the body */
+static void
+respond_release (struct resource * r, http_request * request)
+{
+        if (request->state != NULL && r != NULL && r->release != NULL)
+                r->release (request->state, r->data);
+        request->state = NULL;
 }
 
+/*
+ * Send iov without waiting for the socket. Whatever it would not take is
+ * kept in schild->out, to go out from the event loop before anything else
+ * is sent. With MSG_MORE in flags, what is sent waits to share a segment
+ * with the first bytes of the body. Returns -1 if the connection has failed.
+ */
+static int
+respond_send (struct sighttpd_child * schild, struct iovec * iov, int n, int flags)
+{
+        struct msghdr msg;
+        ssize_t sent;
+        size_t total = 0, len;
+        int i;
+
+        memset (&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        if ((sent = sendmsg (schild->accept_fd, &msg, flags | MSG_DONTWAIT)) == -1) {
+                if (errno != EAGAIN && errno != EINTR)
+                        return -1;
+                sent = 0;
+        }
+
+        for (i = 0; i < n; i++)
+                total += iov[i].iov_len;
+        if ((size_t)sent == total)
+                return 0;
+
+        if ((schild->out = malloc (total - sent)) == NULL)
+                return -1;
+        schild->out_len = 0;
+        schild->out_off = 0;
+
+        for (i = 0; i < n; i++) {
+                if ((size_t)sent >= iov[i].iov_len) {
+                        sent -= iov[i].iov_len;
+                        continue;
+                }
+                len = iov[i].iov_len - sent;
+                memcpy (schild->out + schild->out_len, (char *)iov[i].iov_base + sent, len);
+                schild->out_len += len;
+                sent = 0;
+        }
+
+        return 0;
+}
+
+/* Send what respond_send() held back. Returns 0 once it has all gone, or
+ * -1, with errno EAGAIN if the socket is full again */
+static int
+respond_flush (struct sighttpd_child * schild)
+{
+        ssize_t n;
+
+        while (schild->out_off < schild->out_len) {
+                n = send (schild->accept_fd, schild->out + schild->out_off,
+                          schild->out_len - schild->out_off, MSG_DONTWAIT);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                schild->out_off += n;
+        }
+
+        free (schild->out);
+        schild->out = NULL;
+        schild->out_len = 0;
+        schild->out_off = 0;
+
+        return 0;
+}
+
+/* Hold back partial segments while cork is set, and send whatever is
+ * waiting once it is cleared */
 static void
-params_writefd (int fd, params_t * params)
+respond_cork (int fd, int cork)
+{
+        setsockopt (fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+}
+
+/*
+ * The rest of a response that did not all fit in the socket at once. The
+ * held bytes are flushed before pump is called, so there is nothing left
+ * to send by then.
+ */
+static ssize_t
+respond_held_pump (int fd, void * client, void * data)
 {
-        char headers_out[1024];
+        (void) fd;
+        (void) client;
+        (void) data;
 
-        params_snprint (headers_out, 1024, params, PARAMS_HEADERS);
-        write (fd, headers_out, strlen(headers_out));
-        fsync (fd);
+        return RESOURCE_PUMP_END;
 }
 
 static void
-respond_get_head (struct sighttpd_child * schild, http_request * request, params_t * request_headers,
-                  const char ** status_line, params_t ** response_headers)
+respond_held_close (void * client, void * data)
 {
-        list_t * l, * resources;
+        (void) client;
+        (void) data;
+}
 
-	resources = schild->sighttpd->resources;
-	for (l = resources; l; l = l->next) {
-		struct resource * r = (struct resource *)l->data;
+static struct resource respond_held = {
+        .pump = respond_held_pump,
+        .close = respond_held_close,
+};
 
-		if (r->check(request, r->data)) {
-			r->head (request, request_headers, status_line, response_headers, r->data);
-			return;
-		}
-	}
+/*
+ * A body written by the resource's body function, such as the status page
+ * or the output of a shell command, is rendered into memory by a helper
+ * thread so that a slow one does not hold up the worker's other clients.
+ * The worker then sends it with a Content-Length, keeping the connection
+ * usable for the next request.
+ */
+struct respond_render {
+        atomic_int refs; /* the connection and the helper thread */
+        atomic_int done; /* set by the helper thread, which then signals notify_fd */
+        int notify_fd;
+
+        struct resource * r;
+        http_request request; /* a copy, parsed in place in the end of this */
+        struct sighttpd_child * schild; /* for the worker only */
+
+        int fd; /* the rendered body */
+        off_t off, len; /* len is -1 if the body could not be rendered */
+
+        /* The head up to its last line, which follows the Content-Length */
+        char * head;
+        size_t head_len;
+        const char * head_end;
+        int head_sent;
+        int has_length; /* the resource's head gave a Content-Length */
+        char date[32];
+};
 
-        *status_line = http_status_line (HTTP_STATUS_NOT_FOUND);
-        *response_headers = http_status_append_headers (*response_headers, HTTP_STATUS_NOT_FOUND);
+static void
+respond_render_unref (struct respond_render * job)
+{
+        struct resource * r = job->r;
+
+        if (atomic_fetch_sub (&job->refs, 1) != 1)
+                return;
+
+        if (job->request.state != NULL && r->release != NULL)
+                r->release (job->request.state, r->data);
+        close (job->fd);
+        free (job);
+}
+
+static void *
+respond_render_main (void * data)
+{
+        struct respond_render * job = (struct respond_render *)data;
+        uint64_t one = 1;
+
+        job->r->body (job->fd, &job->request, job->r->data);
+
+        if ((job->len = lseek (job->fd, 0, SEEK_CUR)) == -1)
+                perror ("lseek");
+
+        atomic_store (&job->done, 1);
+        if (write (job->notify_fd, &one, sizeof(one)) == -1)
+                perror ("write");
+
+        respond_render_unref (job);
+
+        return NULL;
+}
+
+/*
+ * Start rendering the resource's body, and hand the connection over to the
+ * event loop to send it. The head is sent once the body's length is known:
+ * iov holds all of it except for head_end, its last line.
+ */
+static int
+respond_render (struct sighttpd_child * schild, struct resource * r, http_request * request,
+                struct iovec * iov, int n, const char * head_end, int has_length,
+                const char * date)
+{
+        struct respond_render * job;
+        pthread_t thread;
+        size_t head_len = 0;
+        int i;
+
+        for (i = 0; i < n; i++)
+                head_len += iov[i].iov_len;
+
+        if ((job = calloc (1, sizeof(*job) + request->length + head_len)) == NULL)
+                return -1;
+
+        if ((job->fd = memfd_create ("sighttpd-body", MFD_CLOEXEC)) == -1) {
+                perror ("memfd_create");
+                free (job);
+                return -1;
+        }
+
+        atomic_init (&job->refs, 2);
+        atomic_init (&job->done, 0);
+        job->notify_fd = schild->notify_fd;
+        job->r = r;
+        job->schild = schild;
+
+        /* The body may run after the request buffer has moved on, and
+         * takes over whatever the head left for it */
+        http_request_copy (&job->request, (char *)(job + 1), request, schild->buf);
+        request->state = NULL;
+
+        job->head = (char *)(job + 1) + request->length;
+        for (i = 0; i < n; i++) {
+                memcpy (job->head + job->head_len, iov[i].iov_base, iov[i].iov_len);
+                job->head_len += iov[i].iov_len;
+        }
+        job->head_end = head_end;
+        job->has_length = has_length;
+        snprintf (job->date, sizeof(job->date), "%s", date);
+
+        if (pthread_create (&thread, NULL, respond_render_main, job) != 0) {
+                perror ("pthread_create");
+                request->state = job->request.state;
+                close (job->fd);
+                free (job);
+                return -1;
+        }
+        pthread_detach (thread);
+
+        schild->client = job;
+
+        return 0;
+}
+
+static ssize_t
+respond_render_pump (int fd, void * client, void * data)
+{
+        struct respond_render * job = (struct respond_render *)client;
+        struct sighttpd_child * schild = job->schild;
+        struct iovec iov[3];
+        char length[24], length_line[48];
+        ssize_t n;
+        int i = 0;
+
+        (void) data;
+
+        if (!atomic_load (&job->done))
+                return 0;
+
+        if (job->len == -1) {
+                errno = EIO;
+                return -1;
+        }
+
+        if (!job->head_sent) {
+                snprintf (length, sizeof(length), "%lld", (long long)job->len);
+
+                iov[i].iov_base = job->head;
+                iov[i].iov_len = job->head_len;
+                i++;
+
+                if (!job->has_length) {
+                        iov[i].iov_base = length_line;
+                        iov[i].iov_len = snprintf (length_line, sizeof(length_line),
+                                                   "Content-Length: %s\r\n", length);
+                        i++;
+                }
+
+                iov[i].iov_base = (void *)job->head_end;
+                iov[i].iov_len = strlen (job->head_end);
+                i++;
+
+                /* The head goes out in one segment with the start of the
+                 * body; pumped() uncorks once it has all been sent */
+                if (job->len > 0) {
+                        respond_cork (fd, 1);
+                        schild->corked = 1;
+                }
+
+                log_access (&job->request, job->date, length);
+
+                job->head_sent = 1;
+                if (respond_send (schild, iov, i, 0) == -1)
+                        return -1;
+                if (schild->out != NULL) {
+                        errno = EAGAIN;
+                        return -1;
+                }
+        }
+
+        while (job->off < job->len) {
+                n = sendfile (fd, job->fd, &job->off, job->len - job->off);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                } else if (n == 0) {
+                        errno = EIO;
+                        return -1;
+                }
+        }
+
+        return RESOURCE_PUMP_END;
 }
 
 static void
-respond_get_body (struct sighttpd_child * schild, http_request * request, params_t * request_headers)
+respond_render_close (void * client, void * data)
 {
-        int fd = schild->accept_fd;
-        list_t * l, * resources;
+        (void) data;
+
+        respond_render_unref ((struct respond_render *)client);
+}
 
-	resources = schild->sighttpd->resources;
-	for (l = resources; l; l = l->next) {
-		struct resource * r = (struct resource *)l->data;
+static struct resource respond_rendered = {
+        .pump = respond_render_pump,
+        .close = respond_render_close,
+};
 
-		if (r->check(request, r->data)) {
-			r->body (fd, request, request_headers, r->data);
-			return;
-		}
-	}
+/* Whether the client asked for the connection to be kept open afterwards */
+static int
+request_keep_alive (http_request * request)
+{
+        const char * connection;
+
+        connection = http_request_header (request, HTTP_HEADER_CONNECTION);
+
+        switch (request->version) {
+        case HTTP_VERSION_1_1:
+                return !(connection && strcasestr (connection, "close"));
+        case HTTP_VERSION_1_0:
+                return (connection && strcasestr (connection, "keep-alive"));
+        default:
+                return 0;
+        }
+}
+
+/* Request bodies are not read, so a request carrying one ends the connection */
+static int
+request_has_body (http_request * request)
+{
+        const char * length;
 
-        http_status_stream_body (fd, HTTP_STATUS_NOT_FOUND);
+        if (http_request_header (request, HTTP_HEADER_TRANSFER_ENCODING) != NULL)
+                return 1;
+
+        length = http_request_header (request, HTTP_HEADER_CONTENT_LENGTH);
+        return (length != NULL && atoll (length) != 0);
 }
 
+static http_response_state respond_error (struct sighttpd_child * schild, http_status status);
+
 static void
 respond_method_not_allowed (const char ** status_line, params_t ** response_headers)
 {
         *status_line = http_status_line (HTTP_STATUS_METHOD_NOT_ALLOWED);
-        *response_headers = params_append (*response_headers, "Allow", "GET");
-        *response_headers = params_append (*response_headers, "Allow", "HEAD");
+        *response_headers = params_append (*response_headers, "Allow", "GET, HEAD");
 }
 
-static void
-respond (struct sighttpd_child * schild, http_request * request, params_t * request_headers)
+static http_response_state
+respond (struct sighttpd_child * schild, http_request * request)
 {
-        params_t * response_headers;
+        params_t * response_headers = NULL;
         const char * status_line;
+        const char * content_length;
+        const struct httpdate * date;
+        struct resource * r = NULL;
+        struct iovec iov[8];
+        char head[1024], status_body[256];
+        const char * body = NULL;
+        size_t body_len = 0;
+        int fd = schild->accept_fd;
+        int keep_alive, chunked = 0, cached = 0, corked = 0, more = 0, render = 0, n = 0;
 
-        response_headers = response_headers_new ();
+        schild->nr_served++;
+
+        keep_alive = schild->sighttpd->keepalive_timeout > 0 &&
+                request_keep_alive (request) &&
+                !request_has_body (request);
 
         switch (request->method) {
         case HTTP_METHOD_HEAD:
         case HTTP_METHOD_GET:
-                respond_get_head (schild, request, request_headers, &status_line, &response_headers);
+                r = router_lookup (schild->sighttpd->router, request);
+                if (r != NULL && r->head_cache != NULL) {
+                        cached = 1;
+                } else {
+                        respond_get_head (r, request, &status_line, &response_headers);
+                }
                 break;
         default:
                 respond_method_not_allowed (&status_line, &response_headers);
+                keep_alive = 0;
                 break;
         }
 
-        write (schild->accept_fd, status_line, strlen(status_line));
-        params_writefd (schild->accept_fd, response_headers);
+        /* Bodies known in advance, such as static text and error pages,
+         * are sent from memory along with the head. Others are rendered
+         * off the worker thread */
+        if (request->method == HTTP_METHOD_GET) {
+                if (r != NULL && r->body_cache != NULL) {
+                        body = r->body_cache;
+                        body_len = r->body_cache_len;
+                } else if (r == NULL) {
+                        body_len = http_status_format_body (HTTP_STATUS_NOT_FOUND, status_body,
+                                                            sizeof(status_body));
+                        body = (body_len > 0) ? status_body : NULL;
+                } else if (r->pump == NULL && r->body != NULL) {
+                        render = 1;
+                }
+        }
 
-        log_access (request, request_headers, response_headers);
+        if (cached) {
+                iov[n].iov_base = r->head_cache;
+                iov[n].iov_len = r->head_cache_len;
+                content_length = r->head_length;
+        } else {
+                iov[n].iov_base = head;
+                iov[n].iov_len = http_status_format_head (head, sizeof(head), status_line,
+                                                          response_headers);
+                if (iov[n].iov_len == 0) {
+                        /* The headers would not fit */
+                        params_free (response_headers);
+                        respond_release (r, request);
+                        return respond_error (schild, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+                }
+                content_length = params_get (response_headers, "Content-Length");
+        }
+        n++;
+
+        if (r != NULL && r->pump != NULL) {
+                /* Streamed bodies of a length given in the head end when
+                 * it has been sent. Others are sent in chunks to HTTP/1.1
+                 * clients if the resource can, and otherwise delimited by
+                 * closing the connection */
+                if (content_length != NULL) {
+                        /* keep_alive stands */
+                } else if (r->chunked && request->version == HTTP_VERSION_1_1) {
+                        chunked = 1;
+                        iov[n].iov_base = "Transfer-Encoding: chunked\r\n";
+                        iov[n].iov_len = strlen (iov[n].iov_base);
+                        n++;
+                } else {
+                        keep_alive = 0;
+                }
+        }
 
-        if (request->method == HTTP_METHOD_GET) {
-                respond_get_body (schild, request, request_headers);
+        date = httpdate_now ();
+        iov[n].iov_base = (void *)date->line;
+        iov[n].iov_len = date->line_len;
+        n++;
+
+        iov[n].iov_base = SERVER_LINE;
+        iov[n].iov_len = strlen (SERVER_LINE);
+        n++;
+
+        if (!keep_alive) {
+                iov[n].iov_base = "Connection: close\r\n\r\n";
+        } else if (request->version == HTTP_VERSION_1_0) {
+                iov[n].iov_base = "Connection: keep-alive\r\n\r\n";
+        } else {
+                iov[n].iov_base = "\r\n";
+        }
+        iov[n].iov_len = strlen (iov[n].iov_base);
+        n++;
+
+        if (render) {
+                if (respond_render (schild, r, request, iov, n - 1, iov[n - 1].iov_base,
+                                    content_length != NULL, date->value) == -1) {
+                        params_free (response_headers);
+                        respond_release (r, request);
+                        return respond_error (schild, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+                }
+                params_free (response_headers);
+                schild->resource = &respond_rendered;
+                schild->keep_alive = keep_alive;
+                return HTTP_RESPONSE_STREAM;
+        }
+
+        if (body != NULL) {
+                iov[n].iov_base = (void *)body;
+                iov[n].iov_len = body_len;
+                n++;
+        }
+
+        /* The status line and all headers go out together, along with the
+         * start of the body: a body that the resource pumps to a length
+         * given in the head is corked until it is done, and otherwise the
+         * head is held for the first write of the body, which is sent as
+         * soon as it is made */
+        if (request->method == HTTP_METHOD_GET && r != NULL && r->pump != NULL) {
+                if (content_length == NULL)
+                        more = MSG_MORE;
+                else
+                        corked = 1;
+        }
+
+        if (corked)
+                respond_cork (fd, 1);
+        if (respond_send (schild, iov, n, more) == -1) {
+                params_free (response_headers);
+                respond_release (r, request);
+                return HTTP_RESPONSE_CLOSE;
+        }
+
+        log_access (request, date->value, content_length);
+        params_free (response_headers);
+
+        if (request->method == HTTP_METHOD_GET && r != NULL && r->pump != NULL) {
+                schild->client = r->open (request, schild->notify_fd, chunked, r->data);
+                respond_release (r, request);
+                if (schild->client == NULL)
+                        return HTTP_RESPONSE_CLOSE;
+
+                /* No further request will be read, and a live stream may
+                 * hold the connection for hours */
+                if (!keep_alive) {
+                        http_request_init (request);
+                        free (schild->buf);
+                        schild->buf = NULL;
+                        schild->buf_len = 0;
+                }
+
+                schild->resource = r;
+                schild->keep_alive = keep_alive;
+                schild->corked = corked;
+
+                /* The event loop drives the body from here on */
+                return (schild->out != NULL) ? HTTP_RESPONSE_BLOCKED : HTTP_RESPONSE_STREAM;
+        }
+
+        respond_release (r, request);
+
+        if (schild->out != NULL) {
+                /* The event loop sends the rest as the socket allows */
+                schild->resource = &respond_held;
+                schild->client = NULL;
+                schild->keep_alive = keep_alive;
+                return HTTP_RESPONSE_BLOCKED;
         }
 
 #ifdef DEBUG
-        printf ("Finished serving / lost client\n");
+        printf ("Finished serving %s\n", keep_alive ? "; keeping connection open" : "/ lost client");
 #endif
+
+        return keep_alive ? HTTP_RESPONSE_READ : HTTP_RESPONSE_CLOSE;
 }
 
-void * http_response (struct sighttpd_child * schild)
+/* Answer a request that cannot be served at all, and end the connection */
+static http_response_state
+respond_error (struct sighttpd_child * schild, http_status status)
 {
-        params_t * request_headers;
-        http_request request;
-        int fd;
-	char s[8192];
-        char * cur;
-        size_t rem=8192, nread, n;
-        int init=0;
+        params_t * response_headers;
+        const struct httpdate * date;
+        struct msghdr msg;
+        struct iovec iov[5];
+        char head[256], body[256];
 
-        fd = schild->accept_fd;
+        response_headers = http_status_append_headers (NULL, status);
 
-        cur = s;
+        iov[0].iov_base = head;
+        iov[0].iov_len = http_status_format_head (head, sizeof(head), http_status_line (status),
+                                                  response_headers);
+        params_free (response_headers);
 
-        setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, NULL, 0);
+        date = httpdate_now ();
+        iov[1].iov_base = (void *)date->line;
+        iov[1].iov_len = date->line_len;
 
-	/* proc client's requests */
-	while ((nread = read(fd, cur, rem)) != 0) {
-                if (n == -1) {
-                        perror ("read");
-                        continue;
-                } else if (nread < 8192) {
-                        /* NUL-terminate input buffer */
-                        cur[nread] = '\0';
+        iov[2].iov_base = SERVER_LINE;
+        iov[2].iov_len = strlen (SERVER_LINE);
+
+        iov[3].iov_base = "Connection: close\r\n\r\n";
+        iov[3].iov_len = strlen (iov[3].iov_base);
+
+        iov[4].iov_base = body;
+        iov[4].iov_len = http_status_format_body (status, body, sizeof(body));
+
+        memset (&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 5;
+        sendmsg (schild->accept_fd, &msg, MSG_DONTWAIT);
+
+        /* Closing with unread input would reset the connection, and could
+         * lose the response; discard what the client has sent already */
+        shutdown (schild->accept_fd, SHUT_WR);
+        while (recv (schild->accept_fd, schild->buf, SIGHTTPD_CHILD_BUFSIZE, MSG_DONTWAIT) > 0);
+
+        return HTTP_RESPONSE_CLOSE;
+}
+
+/* Drop the request just served from the front of the buffer */
+static void
+request_consume (struct sighttpd_child * schild)
+{
+        http_request * request = &schild->request;
+
+        schild->buf_len -= request->length;
+        memmove (schild->buf, &schild->buf[request->length], schild->buf_len);
+        http_request_init (request);
+}
+
+/* Serve each complete request in the buffer in turn; pipelined requests
+ * may already be waiting behind the first */
+static http_response_state
+respond_buffered (struct sighttpd_child * schild)
+{
+        http_request * request = &schild->request;
+        http_response_state state;
+        char * s = schild->buf;
+
+        while (1) {
+                switch (http_request_parse (request, s, schild->buf_len)) {
+                case HTTP_PARSE_AGAIN:
+                        /* The rest of the head would not fit */
+                        if (schild->buf_len == SIGHTTPD_CHILD_BUFSIZE)
+                                return respond_error (schild,
+                                                      HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
+                        return HTTP_RESPONSE_READ;
+                case HTTP_PARSE_ERROR:
+                        return respond_error (schild, HTTP_STATUS_BAD_REQUEST);
+                case HTTP_PARSE_TOO_LARGE:
+                        return respond_error (schild, HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
+                case HTTP_PARSE_DONE:
+                        break;
                 }
-                if (!init && (n = http_request_parse (cur, rem, &request)) > 0) {
-                        memmove (s, &s[n], nread-n);
-                        init = 1;
+
 #ifdef DEBUG
-                        printf ("Got HTTP method %d, version %d for %s (consumed %d)\n", request.method,
-                                request.version, request.path, n);
+                printf ("Got HTTP method %d, version %d for %s (consumed %ld)\n", request->method,
+                        request->version, request->path, request->length);
 #endif
-                }
 
-                request_headers = params_new_parse (s, strlen (s), PARAMS_HEADERS);
-                if (request_headers != NULL) {
-                        respond (schild, &request, request_headers);
-                        goto closeit;
-                } else {
-                        n = strlen (cur);
-                        cur += n;
-                        rem -= n;
+                if ((state = respond (schild, request)) != HTTP_RESPONSE_READ)
+                        return state;
+
+                request_consume (schild);
+        }
+}
+
+void
+http_response_init (struct sighttpd_child * schild)
+{
+        int fd = schild->accept_fd, one = 1;
+
+        /* Responses are written whole, or corked until they are */
+        setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        /* The worker never waits on one client's socket */
+        fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+}
+
+http_response_state
+http_response_read (struct sighttpd_child * schild)
+{
+        char * s;
+        size_t rem;
+        ssize_t nread;
+
+        if (schild->buf == NULL &&
+            (schild->buf = malloc (SIGHTTPD_CHILD_BUFSIZE)) == NULL)
+                return HTTP_RESPONSE_CLOSE;
+        s = schild->buf;
+
+        rem = SIGHTTPD_CHILD_BUFSIZE - schild->buf_len;
+        if (rem == 0) {
+                /* Request header does not fit in the buffer */
+                return respond_error (schild, HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
+        }
+
+        nread = recv (schild->accept_fd, &s[schild->buf_len], rem, MSG_DONTWAIT);
+        if (nread == -1) {
+                if (errno == EAGAIN || errno == EINTR)
+                        return HTTP_RESPONSE_READ;
+                perror ("read");
+                return HTTP_RESPONSE_CLOSE;
+        } else if (nread == 0) {
+                return HTTP_RESPONSE_CLOSE;
+        }
+
+        schild->buf_len += nread;
+
+        return respond_buffered (schild);
+}
+
+/* Move on from a pump of a streaming body which returned n */
+static http_response_state
+pumped (struct sighttpd_child * schild, ssize_t n)
+{
+        struct resource * r = schild->resource;
+
+        if (n == RESOURCE_PUMP_END) {
+                /* The body was delimited in-band; move on to the next request */
+                r->close (schild->client, r->data);
+                schild->resource = NULL;
+                schild->client = NULL;
+
+                if (schild->corked) {
+                        respond_cork (schild->accept_fd, 0);
+                        schild->corked = 0;
                 }
-	}
 
-closeit:
-        sighttpd_child_destroy (schild);
+                if (!schild->keep_alive)
+                        return HTTP_RESPONSE_CLOSE;
+
+                request_consume (schild);
+                return respond_buffered (schild);
+        } else if (n == -1) {
+                if (errno == EAGAIN)
+                        return HTTP_RESPONSE_BLOCKED;
+                return HTTP_RESPONSE_CLOSE;
+        }
+
+        return HTTP_RESPONSE_STREAM;
+}
+
+http_response_state
+http_response_pump (struct sighttpd_child * schild)
+{
+        struct resource * r;
+        http_response_state state;
+        unsigned long served;
+
+        /* The end of one body can start the next pipelined response, which
+         * is pumped straight away rather than at the next wakeup */
+        do {
+                r = schild->resource;
+                served = schild->nr_served;
+
+                if (schild->out != NULL && respond_flush (schild) == -1)
+                        return pumped (schild, -1);
+
+                state = pumped (schild, r->pump (schild->accept_fd, schild->client, r->data));
+        } while (state == HTTP_RESPONSE_STREAM && schild->nr_served != served);
+
+        return state;
+}
+
+int
+http_response_queue (struct sighttpd_child * schild, struct uring * u)
+{
+        struct resource * r = schild->resource;
+
+        /* Anything held back goes out first, from pump */
+        if (r->queue == NULL || schild->out != NULL)
+                return 0;
+
+        return r->queue (schild->accept_fd, schild->client, u, schild, r->data);
+}
+
+http_response_state
+http_response_complete (struct sighttpd_child * schild, int res)
+{
+        struct resource * r = schild->resource;
+        http_response_state state;
+        unsigned long served = schild->nr_served;
+
+        state = pumped (schild, r->complete (schild->client, res, r->data));
+        if (state == HTTP_RESPONSE_STREAM && schild->nr_served != served)
+                return http_response_pump (schild);
 
-	return 0;		/* terminate the thread */
+        return state;
 }
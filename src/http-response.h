@@ -3,6 +3,22 @@
 
 #include "sighttpd.h"
 
-void * http_response (void * schild);
+typedef enum {
+        HTTP_RESPONSE_READ,     /* Waiting for more of the request */
+        HTTP_RESPONSE_STREAM,   /* Streaming a body; pump when data may be available */
+        HTTP_RESPONSE_BLOCKED,  /* Streaming a body; pump when the socket is writable */
+        HTTP_RESPONSE_CLOSE     /* Finished with this connection */
+} http_response_state;
+
+void http_response_init (struct sighttpd_child * schild);
+http_response_state http_response_read (struct sighttpd_child * schild);
+http_response_state http_response_pump (struct sighttpd_child * schild);
+
+/* Queue the next write of a streaming body on u in place of pumping it,
+ * if the resource can; returns 1 if a write was queued, with schild as
+ * its tag. Its result is then passed to http_response_complete() */
+struct uring;
+int http_response_queue (struct sighttpd_child * schild, struct uring * u);
+http_response_state http_response_complete (struct sighttpd_child * schild, int res);
 
 #endif /* __HTTP_RESPONSE__ */
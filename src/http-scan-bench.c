@@ -0,0 +1,170 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+/*
+ * Compare the byte scanners used by the request parser. Each pass walks
+ * every request in the corpus the way the parser does: find each line
+ * end, then the ':' of each header line, or the two SPs of a request line.
+ *
+ * The corpus is a file of captured requests, each ending with its blank
+ * line, eg. as saved by tcpflow; without one a built-in set of requests
+ * from common browsers and players is used.
+ *
+ * Usage: http-scan-bench [corpus [passes]]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http-scan.h"
+
+typedef const char * (*scan_func) (const char * s, const char * end, int c);
+
+static const char corpus_builtin[] =
+        "GET /stream.264 HTTP/1.1\r\n"
+        "Host: 192.168.1.20:3000\r\n"
+        "User-Agent: VLC/3.0.18 LibVLC/3.0.18\r\n"
+        "Range: bytes=0-\r\n"
+        "Connection: close\r\n"
+        "Icy-MetaData: 1\r\n"
+        "\r\n"
+        "GET /stream.mjpg HTTP/1.1\r\n"
+        "Host: camera.local\r\n"
+        "Connection: keep-alive\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+        "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+        "Referer: http://camera.local/\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "\r\n"
+        "GET /status HTTP/1.1\r\n"
+        "Host: camera.local\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,"
+        "image/webp,*/*;q=0.8\r\n"
+        "Accept-Language: en-GB,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Connection: keep-alive\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "If-Modified-Since: Sat, 17 Oct 2009 08:00:00 GMT\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "\r\n"
+        "GET /flim.txt HTTP/1.0\r\n"
+        "User-Agent: Wget/1.21.3\r\n"
+        "Accept: */*\r\n"
+        "Host: camera.local\r\n"
+        "\r\n";
+
+static char *
+corpus_load (const char * path, size_t * len)
+{
+        FILE * f;
+        char * buf;
+        long size;
+
+        if ((f = fopen (path, "rb")) == NULL) {
+                perror (path);
+                exit (1);
+        }
+
+        fseek (f, 0, SEEK_END);
+        size = ftell (f);
+        fseek (f, 0, SEEK_SET);
+
+        if ((buf = malloc (size)) == NULL || fread (buf, 1, size, f) != (size_t)size) {
+                fprintf (stderr, "Could not read %s\n", path);
+                exit (1);
+        }
+        fclose (f);
+
+        *len = size;
+        return buf;
+}
+
+/* Walk the corpus as the parser does; returns the number of fields found */
+static long
+walk (scan_func scan, const char * buf, size_t len)
+{
+        const char * s = buf, * end = buf + len, * nl, * p;
+        int reqline = 1;
+        long found = 0;
+
+        while ((nl = scan (s, end, '\n')) != NULL) {
+                if (nl - s <= 1) {
+                        /* Blank line: the next line starts a request */
+                        reqline = 1;
+                } else if (reqline) {
+                        for (p = s; (p = scan (p, nl, ' ')) != NULL; p++)
+                                found++;
+                        reqline = 0;
+                } else if (scan (s, nl, ':') != NULL) {
+                        found++;
+                }
+                s = nl + 1;
+        }
+
+        return found;
+}
+
+static double
+now (void)
+{
+        struct timespec ts;
+
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+bench (const char * name, scan_func scan, const char * buf, size_t len, long passes)
+{
+        double start, elapsed;
+        long i, found = 0;
+
+        start = now ();
+        for (i = 0; i < passes; i++)
+                found += walk (scan, buf, len);
+        elapsed = now () - start;
+
+        printf ("%-7s %8.1f MB per second (%ld fields)\n",
+                name, len * passes / elapsed / 1e6, found);
+
+        return len * passes / elapsed;
+}
+
+int
+main (int argc, char * argv[])
+{
+        const char * buf = corpus_builtin;
+        size_t len = sizeof(corpus_builtin) - 1;
+        long passes = 0;
+        double scalar;
+
+        if (argc > 1) buf = corpus_load (argv[1], &len);
+        if (argc > 2) passes = atol (argv[2]);
+
+        /* Default to about 1GB scanned per implementation */
+        if (passes <= 0)
+                passes = 1000000000 / (len ? len : 1) + 1;
+
+        printf ("Scanning %ld bytes of requests %ld times\n", (long)len, passes);
+
+        scalar = bench ("scalar", http_scan_scalar, buf, len, passes);
+#ifdef HTTP_SCAN_X86
+        printf ("sse2/scalar: %.2fx\n",
+                bench ("sse2", http_scan_sse2, buf, len, passes) / scalar);
+        if (http_scan_have_avx2 ())
+                printf ("avx2/scalar: %.2fx\n",
+                        bench ("avx2", http_scan_avx2, buf, len, passes) / scalar);
+#endif
+
+        exit (0);
+}
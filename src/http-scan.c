@@ -0,0 +1,97 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+
+#include "http-scan.h"
+
+#ifdef HTTP_SCAN_X86
+#include <immintrin.h>
+#endif
+
+const char *
+http_scan_scalar (const char * s, const char * end, int c)
+{
+        for (; s < end; s++) {
+                if (*s == (char)c)
+                        return s;
+        }
+
+        return NULL;
+}
+
+#ifdef HTTP_SCAN_X86
+
+const char *
+http_scan_sse2 (const char * s, const char * end, int c)
+{
+        __m128i needle = _mm_set1_epi8 ((char)c);
+        __m128i v;
+        int mask;
+
+        while (end - s >= 16) {
+                v = _mm_loadu_si128 ((const __m128i *)s);
+                if ((mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, needle))) != 0)
+                        return s + __builtin_ctz (mask);
+                s += 16;
+        }
+
+        return http_scan_scalar (s, end, c);
+}
+
+__attribute__((target("avx2")))
+const char *
+http_scan_avx2 (const char * s, const char * end, int c)
+{
+        __m256i needle = _mm256_set1_epi8 ((char)c);
+        __m256i v;
+        unsigned int mask;
+
+        while (end - s >= 32) {
+                v = _mm256_loadu_si256 ((const __m256i *)s);
+                if ((mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, needle))) != 0)
+                        return s + __builtin_ctz (mask);
+                s += 32;
+        }
+
+        /* Most header lines are short; finish with one 16 byte step */
+        return http_scan_sse2 (s, end, c);
+}
+
+int
+http_scan_have_avx2 (void)
+{
+        __builtin_cpu_init ();
+        return __builtin_cpu_supports ("avx2");
+}
+
+static const char * (*scan) (const char * s, const char * end, int c) = http_scan_sse2;
+
+__attribute__((constructor))
+static void
+http_scan_select (void)
+{
+        if (http_scan_have_avx2 ())
+                scan = http_scan_avx2;
+}
+
+const char *
+http_scan (const char * s, const char * end, int c)
+{
+        return scan (s, end, c);
+}
+
+#else
+
+const char *
+http_scan (const char * s, const char * end, int c)
+{
+        return http_scan_scalar (s, end, c);
+}
+
+#endif /* HTTP_SCAN_X86 */
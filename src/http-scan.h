@@ -0,0 +1,29 @@
+#ifndef __HTTP_SCAN_H__
+#define __HTTP_SCAN_H__
+
+/*
+ * Byte search for the request parser: line ends, the ':' after a header
+ * name and the SP between request line fields. On x86 this compares 16
+ * (SSE2) or 32 (AVX2) bytes at a time, chosen once at startup according
+ * to what the CPU supports.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define HTTP_SCAN_X86
+#endif
+
+/* Find the first byte c in [s, end), or return NULL */
+const char * http_scan (const char * s, const char * end, int c);
+
+/* The individual implementations, for testing and benchmarking */
+const char * http_scan_scalar (const char * s, const char * end, int c);
+
+#ifdef HTTP_SCAN_X86
+const char * http_scan_sse2 (const char * s, const char * end, int c);
+const char * http_scan_avx2 (const char * s, const char * end, int c);
+
+/* Whether http_scan_avx2() may be called on this CPU */
+int http_scan_have_avx2 (void);
+#endif
+
+#endif /* __HTTP_SCAN_H__ */
@@ -0,0 +1,59 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http-scan.h"
+
+#include "tests.h"
+
+#define BUF_SIZE 200
+
+typedef const char * (*scan_func) (const char * s, const char * end, int c);
+
+/* Compare against memchr at every alignment and length, with the target
+ * at every position and absent */
+static void
+test_scan (const char * name, scan_func scan)
+{
+        char buf[BUF_SIZE];
+        const char * expected, * got;
+        int off, len, pos;
+
+        INFO (name);
+
+        for (off = 0; off < 32; off++) {
+                for (len = 0; off + len <= BUF_SIZE; len++) {
+                        for (pos = -1; pos < len; pos++) {
+                                memset (buf, 'a', BUF_SIZE);
+                                if (pos >= 0)
+                                        buf[off + pos] = '\n';
+                                /* A match just past the end must not be found */
+                                if (off + len < BUF_SIZE)
+                                        buf[off + len] = '\n';
+
+                                expected = memchr (buf + off, '\n', len);
+                                got = scan (buf + off, buf + off + len, '\n');
+                                if (got != expected)
+                                        FAIL ("Scan result differs from memchr");
+                        }
+                }
+        }
+}
+
+int
+main (int argc, char * argv[])
+{
+        test_scan ("Testing scalar scan", http_scan_scalar);
+#ifdef HTTP_SCAN_X86
+        test_scan ("Testing SSE2 scan", http_scan_sse2);
+        if (http_scan_have_avx2 ())
+                test_scan ("Testing AVX2 scan", http_scan_avx2);
+#endif
+        test_scan ("Testing selected scan", http_scan);
+
+        exit (EXIT_SUCCESS);
+}
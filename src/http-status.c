@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "http-status.h"
 
@@ -113,6 +114,9 @@ http_status_line (http_status status)
         case HTTP_STATUS_EXPECTATION_FAILED:
                 return "HTTP/1.1 417 Expectation Failed\r\n";
                 break;
+        case HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE:
+                return "HTTP/1.1 431 Request Header Fields Too Large\r\n";
+                break;
         case HTTP_STATUS_INTERNAL_SERVER_ERROR:
                 return "HTTP/1.1 500 Internal Server Error\r\n";
                 break;
@@ -157,16 +161,45 @@ http_status_append_headers (params_t * response_headers, http_status status)
         return response_headers;
 }
 
-int
-http_status_stream_body (int fd, http_status status)
+/* Format a status line and headers, without the blank line ending them */
+size_t
+http_status_format_head (char * buf, size_t n, const char * status_line, params_t * headers)
+{
+        size_t len;
+        int hlen;
+
+        len = snprintf (buf, n, "%s", status_line);
+        if (len >= n)
+                return 0;
+
+        /* The headers come with the blank line, which is left off for the
+         * response to add more */
+        hlen = params_snprint (buf + len, n - len, headers, PARAMS_HEADERS);
+        if (hlen < 2 || (size_t)hlen >= n - len || memcmp (buf + len + hlen - 2, "\r\n", 2))
+                return 0;
+
+        return len + hlen - 2;
+}
+
+size_t
+http_status_format_body (http_status status, char * buf, size_t n)
 {
         const char * status_line;
-        char buf[1024];
-        int n;
+        size_t len;
 
         status_line = http_status_line (status);
 
-        n = snprintf (buf, 1024, HTTP_STATUS_TMPL,
-                      status_line, status_line);
+        len = snprintf (buf, n, HTTP_STATUS_TMPL, status_line, status_line);
+
+        return (len < n) ? len : 0;
+}
+
+int
+http_status_stream_body (int fd, http_status status)
+{
+        char buf[1024];
+        size_t n;
+
+        n = http_status_format_body (status, buf, sizeof(buf));
         return write (fd, buf, n);
 }
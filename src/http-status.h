@@ -38,6 +38,7 @@ typedef enum {
         HTTP_STATUS_UNSUPPORTED_MEDIA_TYPE = 415,
         HTTP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE = 416,
         HTTP_STATUS_EXPECTATION_FAILED = 417,
+        HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
         HTTP_STATUS_INTERNAL_SERVER_ERROR = 500,
         HTTP_STATUS_NOT_IMPLEMENTED = 501,
         HTTP_STATUS_BAD_GATEWAY = 502,
@@ -52,6 +53,16 @@ http_status_line (http_status status);
 params_t *
 http_status_append_headers (params_t * response_headers, http_status status);
 
+/* Format a status line and headers into buf, without the blank line that
+ * ends them, returning the length, or 0 if they do not fit in n bytes */
+size_t
+http_status_format_head (char * buf, size_t n, const char * status_line, params_t * headers);
+
+/* Format the body of an error page for status into buf, returning its
+ * length, or 0 if it does not fit in n bytes */
+size_t
+http_status_format_body (http_status status, char * buf, size_t n);
+
 int
 http_status_stream_body (int fd, http_status status);
 
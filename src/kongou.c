@@ -152,7 +152,7 @@ kongou_append_headers (params_t * response_headers)
 }
 
 static void
-kongou_head (http_request * request, params_t * request_headers, const char ** status_line,
+kongou_head (http_request * request, const char ** status_line,
 		params_t ** response_headers, void * data)
 {
         *status_line = http_status_line (HTTP_STATUS_OK);
@@ -243,7 +243,7 @@ kongou_set_param (char * key, char * value, void * user_data)
 }
 
 static void
-kongou_body (int fd, http_request * request, params_t * request_headers, void * data)
+kongou_body (int fd, http_request * request, void * data)
 {
         char *q;
         char buf[1024], cmd[64];
@@ -291,5 +291,12 @@ kongou_body (int fd, http_request * request, params_t * request_headers, void *
 struct resource *
 kongou_resource (void)
 {
-	return resource_new (kongou_check, kongou_head, kongou_body, NULL /* del */, NULL /* data */);
+	struct resource * r;
+
+	if ((r = resource_new (kongou_check, kongou_head, kongou_body, NULL /* del */, NULL /* data */)) != NULL) {
+		r->path = "/kongou";
+		resource_cache_head (r);
+	}
+
+	return r;
 }
@@ -9,22 +9,20 @@
 #include <stdio.h>
 
 #include "params.h"
+#include "http-date.h"
 #include "http-reqline.h"
 
 #define ACCESS_LOG "/var/log/sighttpd/access.log"
 #define ERROR_LOG "/var/log/sighttpd/error.log"
 
 #define DATE_FMT "[%s] "
-#define LOG_FMT DATE_FMT "\"%s\" 200 %s \"%s\"\r\n"
+#define LOG_FMT DATE_FMT "\"%s %s %s\" 200 %s \"%s\"\r\n"
 
 FILE * access_log=NULL, * error_log=NULL;
 
 static int log_date (FILE * stream)
 {
-        char date[256];
-
-        httpdate_snprint (date, 256, time(NULL));
-        return fprintf (stream, DATE_FMT, date);
+        return fprintf (stream, DATE_FMT, httpdate_now ()->value);
 }
 
 int log_open (void)
@@ -53,29 +51,30 @@ int log_close (void)
         }
 }
 
-void log_access (http_request * request, params_t * request_headers, params_t * response_headers)
+void log_access (http_request * request, const char * date, const char * content_length)
 {
-        char canon[1024];
-        char * date, * user_agent, * content_length;
+        const char * user_agent;
+        int i;
 
         /* Dump request headers to stdout */
-        params_snprint (canon, 1024, request_headers, PARAMS_HEADERS);
-        puts (canon);
+        for (i = 0; i < request->nr_headers; i++)
+                printf ("%s: %s\r\n", request->headers[i].name, request->headers[i].value);
+        puts ("");
 
         /* Apache-style logging */
-        if ((date = params_get (response_headers, "Date")) == NULL)
-            date = "";
-        if ((user_agent = params_get (request_headers, "User-Agent")) == NULL)
+        if ((user_agent = http_request_header (request, HTTP_HEADER_USER_AGENT)) == NULL)
             user_agent = "";
-        if ((content_length = params_get (response_headers, "Content-Length")) == NULL)
+        if (content_length == NULL)
             content_length = "";
 
         if (access_log != NULL) {
-                fprintf (access_log, LOG_FMT, date, request->original_reqline,
+                fprintf (access_log, LOG_FMT, date,
+                         request->method_name, request->path, request->version_name,
                          content_length, user_agent);
                 fflush (access_log);
         } else {
-                fprintf (stderr, LOG_FMT, date, request->original_reqline,
+                fprintf (stderr, LOG_FMT, date,
+                         request->method_name, request->path, request->version_name,
                          content_length, user_agent);
         }
 }
@@ -3,4 +3,4 @@
 int log_open (void);
 int log_close (void);
 
-void log_access (http_request * request, params_t * request_headers, params_t * response_headers);
+void log_access (http_request * request, const char * date, const char * content_length);
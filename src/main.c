@@ -6,19 +6,22 @@
 #include "config.h"
 #endif
 
+#define _GNU_SOURCE /* accept4 */
+
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <resolv.h>
-#include <pthread.h>
 #include <signal.h>
+#include <unistd.h>
 
 #include "dictionary.h"
-#include "http-response.h"
 #include "sighttpd.h"
 #include "cfg-read.h"
+#include "http-date.h"
+#include "worker.h"
 
 #ifdef HAVE_OGGZ
 #include "ogg-stdin.h"
@@ -158,6 +161,10 @@ int main(int argc, char *argv[])
 		dictionary_insert (cfg->dictionary, "Listen", argv[optind]);
 	}
 
+        /* Format the Date header once a second for all threads */
+        httpdate_init ();
+        httpdate_clock_start ();
+
         log_open ();
 
         sighttpd = sighttpd_init (cfg);
@@ -190,35 +197,36 @@ int main(int argc, char *argv[])
 	if (bind(sd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
 		panic("bind");
 
-	/* Make into listener with 10 slots * */
-	if (listen(sd, 10) != 0) {
+	/* Make into listener with 128 slots * */
+	if (listen(sd, 128) != 0) {
 		panic("listen")
 	} else {
 		/* Begin waiting for connections * */
 		int ad;
 		socklen_t size;
 		struct sockaddr gotcha;
-		pthread_t child;
-                pthread_attr_t attr;
                 struct sighttpd_child * schild;
 
-                /* set thread create attributes */
-                pthread_attr_init(&attr);
-                pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-                /* Ignore SIGPIPE, handle client disconnect in processing threads */
+                /* Ignore SIGPIPE, handle client disconnect in the workers */
                 signal(SIGPIPE, SIG_IGN);
 
-		/* process all incoming clients */
+                if (workers_start (sighttpd) == -1)
+                        panic("workers_start");
+
+		/* hand all incoming clients to the workers */
 		while (1) {
 			size = sizeof(struct sockaddr_in);
-			ad = accept(sd, &gotcha, &size);
+			/* Keep client sockets out of the children of popen() and
+			 * system(), which would hold them open */
+			ad = accept4(sd, &gotcha, &size, SOCK_CLOEXEC);
 
 			if (ad == -1) {
 				perror("accept");
-			} else {
-                                schild = sighttpd_child_new (sighttpd, ad);
-				pthread_create(&child, &attr, http_response, schild);	/* start thread */
+			} else if ((schild = sighttpd_child_new (sighttpd, ad)) == NULL) {
+				close (ad);
+			} else if (workers_dispatch (sighttpd, schild) == -1) {
+				perror("workers_dispatch");
+				sighttpd_child_destroy (schild);
 			}
 		}
 
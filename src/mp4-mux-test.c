@@ -0,0 +1,193 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tests.h"
+
+#include "mp4-mux.h"
+
+/* Baseline profile, level 3.1, 1280x720 */
+static const unsigned char sps[] = {0x67, 0x42, 0x00, 0x1f, 0xed, 0x00, 0xa0, 0x0b, 0x72};
+static const unsigned char pps[] = {0x68, 0xce, 0x38, 0x80};
+
+/* Boxes which contain only other boxes */
+static const char * containers[] = {
+        "moov", "trak", "mdia", "minf", "dinf", "stbl", "mvex", "moof", "traf", NULL
+};
+
+static uint32_t
+get_u32 (const unsigned char * p)
+{
+        return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int
+is_container (const unsigned char * type)
+{
+        int i;
+
+        for (i = 0; containers[i]; i++)
+                if (!memcmp (type, containers[i], 4))
+                        return 1;
+
+        return 0;
+}
+
+/* Check that boxes tile buf exactly, recursing into containers */
+static void
+check_boxes (const unsigned char * buf, size_t len)
+{
+        size_t pos = 0, size;
+
+        while (pos < len) {
+                if (len - pos < 8)
+                        FAIL ("Truncated box header");
+
+                size = get_u32 (buf + pos);
+                if (size < 8 || size > len - pos)
+                        FAIL ("Box size overruns its parent");
+
+                if (is_container (buf + pos + 4))
+                        check_boxes (buf + pos + 8, size - 8);
+
+                pos += size;
+        }
+}
+
+/* Find the first box of a type, searching depth first; returns its start */
+static const unsigned char *
+find_box (const unsigned char * buf, size_t len, const char * type)
+{
+        const unsigned char * found;
+        size_t pos = 0, size;
+
+        while (pos + 8 <= len) {
+                size = get_u32 (buf + pos);
+
+                if (!memcmp (buf + pos + 4, type, 4))
+                        return buf + pos;
+
+                if (is_container (buf + pos + 4) &&
+                    (found = find_box (buf + pos + 8, size - 8, type)) != NULL)
+                        return found;
+
+                pos += size;
+        }
+
+        return NULL;
+}
+
+static void
+test_init_segment (void)
+{
+        unsigned char out[MP4_INIT_MAX];
+        const unsigned char * box;
+        size_t len;
+
+        INFO ("Init segment");
+        len = mp4_init_segment (out, sps, sizeof(sps), pps, sizeof(pps));
+        if (len == 0 || len > sizeof(out))
+                FAIL ("Init segment not written");
+
+        check_boxes (out, len);
+
+        if (memcmp (out + 4, "ftyp", 4))
+                FAIL ("Init segment does not start with ftyp");
+
+        if (find_box (out, len, "trex") == NULL)
+                FAIL ("No trex for fragments");
+
+        if ((box = find_box (out, len, "tkhd")) == NULL)
+                FAIL ("No tkhd");
+        if (get_u32 (box + 84) != (1280 << 16) || get_u32 (box + 88) != (720 << 16))
+                FAIL ("Wrong track dimensions");
+
+        if ((box = find_box (out, len, "mdhd")) == NULL || get_u32 (box + 20) != MP4_TIMESCALE)
+                FAIL ("Wrong media timescale");
+
+        /* avc1 is the entry of stsd, after its version, flags and count; avcC
+         * is inside avc1, after its 78 bytes of fields */
+        if ((box = find_box (out, len, "stsd")) == NULL || get_u32 (box + 12) != 1)
+                FAIL ("No sample description");
+        box = find_box (box + 16, get_u32 (box) - 16, "avc1");
+        if (box == NULL)
+                FAIL ("No avc1 sample entry");
+        box = find_box (box + 86, get_u32 (box) - 86, "avcC");
+        if (box == NULL)
+                FAIL ("No avcC");
+        if (box[8] != 1 || box[9] != 0x42 || box[11] != 0x1f || (box[12] & 3) != 3)
+                FAIL ("Bad avcC header");
+        if ((box[13] & 0x1f) != 1 ||
+            ((box[14] << 8) | box[15]) != sizeof(sps) || memcmp (box + 16, sps, sizeof(sps)))
+                FAIL ("SPS not in avcC");
+        if (box[16 + sizeof(sps)] != 1 ||
+            ((box[17 + sizeof(sps)] << 8) | box[18 + sizeof(sps)]) != sizeof(pps) ||
+            memcmp (box + 19 + sizeof(sps), pps, sizeof(pps)))
+                FAIL ("PPS not in avcC");
+
+        INFO ("Unparseable SPS");
+        if (mp4_init_segment (out, pps, sizeof(pps), pps, sizeof(pps)) != 0)
+                FAIL ("Init segment written without an SPS");
+}
+
+static void
+test_fragment (void)
+{
+        struct mp4_sample samples[3] = {
+                {3600, 1000, MP4_SAMPLE_SYNC},
+                {3600, 200, MP4_SAMPLE_NON_SYNC},
+                {3601, 300, MP4_SAMPLE_NON_SYNC}
+        };
+        unsigned char out[MP4_FRAGMENT_HEAD_SIZE (3)];
+        const unsigned char * box, * moof = out;
+        size_t len, moof_len;
+
+        INFO ("Fragment head");
+        len = mp4_fragment_head (out, 7, 0x123456789ULL, samples, 3);
+        if (len != MP4_FRAGMENT_HEAD_SIZE (3))
+                FAIL ("Wrong fragment head length");
+
+        moof_len = get_u32 (moof);
+        if (memcmp (moof + 4, "moof", 4) || moof_len + 8 != len)
+                FAIL ("Fragment head is not a moof and an mdat header");
+        check_boxes (moof, moof_len);
+
+        if (get_u32 (out + moof_len) != 8 + 1000 + 200 + 300 ||
+            memcmp (out + moof_len + 4, "mdat", 4))
+                FAIL ("Wrong mdat length");
+
+        if ((box = find_box (moof, moof_len, "mfhd")) == NULL || get_u32 (box + 12) != 7)
+                FAIL ("Wrong sequence number");
+
+        if ((box = find_box (moof, moof_len, "tfhd")) == NULL ||
+            (get_u32 (box + 8) & 0x020000) == 0)
+                FAIL ("Data is not relative to the moof");
+
+        if ((box = find_box (moof, moof_len, "tfdt")) == NULL || box[8] != 1 ||
+            get_u32 (box + 12) != 0x1 || get_u32 (box + 16) != 0x23456789)
+                FAIL ("Wrong decode time");
+
+        if ((box = find_box (moof, moof_len, "trun")) == NULL || get_u32 (box + 12) != 3)
+                FAIL ("Wrong sample count");
+        if (get_u32 (box + 16) != len)
+                FAIL ("Data offset does not point at the mdat payload");
+        if (get_u32 (box + 20) != 3600 || get_u32 (box + 24) != 1000 ||
+            get_u32 (box + 28) != MP4_SAMPLE_SYNC || get_u32 (box + 44) != 3601 ||
+            get_u32 (box + 52) != MP4_SAMPLE_NON_SYNC)
+                FAIL ("Wrong sample table");
+}
+
+int
+main (int argc, char * argv[])
+{
+        test_init_segment ();
+        test_fragment ();
+
+        exit (EXIT_SUCCESS);
+}
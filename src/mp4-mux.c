@@ -0,0 +1,357 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#include <string.h>
+
+#include "mp4-mux.h"
+
+#define TRACK_ID 1
+
+static unsigned char *
+put_u8 (unsigned char * p, unsigned int v)
+{
+        *p++ = v;
+        return p;
+}
+
+static unsigned char *
+put_u16 (unsigned char * p, unsigned int v)
+{
+        *p++ = v >> 8;
+        *p++ = v;
+        return p;
+}
+
+static unsigned char *
+put_u32 (unsigned char * p, uint32_t v)
+{
+        *p++ = v >> 24;
+        *p++ = v >> 16;
+        *p++ = v >> 8;
+        *p++ = v;
+        return p;
+}
+
+static unsigned char *
+put_u64 (unsigned char * p, uint64_t v)
+{
+        p = put_u32 (p, v >> 32);
+        return put_u32 (p, v);
+}
+
+static unsigned char *
+put_zeros (unsigned char * p, size_t n)
+{
+        memset (p, 0, n);
+        return p + n;
+}
+
+/* Start a box, leaving room for its size, which box_end() fills in */
+static unsigned char *
+box_start (unsigned char * p, const char * type)
+{
+        p = put_u32 (p, 0);
+        memcpy (p, type, 4);
+        return p + 4;
+}
+
+/* A full box also has a version and flags */
+static unsigned char *
+full_box_start (unsigned char * p, const char * type, int version, uint32_t flags)
+{
+        p = box_start (p, type);
+        return put_u32 (p, ((uint32_t)version << 24) | flags);
+}
+
+static void
+box_end (unsigned char * start, unsigned char * end)
+{
+        put_u32 (start, end - start);
+}
+
+static unsigned char *
+put_matrix (unsigned char * p)
+{
+        static const uint32_t unity[9] = {
+                0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000
+        };
+        int i;
+
+        for (i = 0; i < 9; i++)
+                p = put_u32 (p, unity[i]);
+
+        return p;
+}
+
+static unsigned char *
+put_avcc (unsigned char * p, const struct h264_sps * info, const unsigned char * sps,
+          size_t sps_len, const unsigned char * pps, size_t pps_len)
+{
+        unsigned char * box = p;
+
+        p = box_start (p, "avcC");
+        p = put_u8 (p, 1);                 /* configurationVersion */
+        p = put_u8 (p, sps[1]);            /* AVCProfileIndication */
+        p = put_u8 (p, sps[2]);            /* profile_compatibility */
+        p = put_u8 (p, sps[3]);            /* AVCLevelIndication */
+        p = put_u8 (p, 0xfc | 3);          /* lengthSizeMinusOne */
+        p = put_u8 (p, 0xe0 | 1);          /* numOfSequenceParameterSets */
+        p = put_u16 (p, sps_len);
+        memcpy (p, sps, sps_len);
+        p += sps_len;
+        p = put_u8 (p, 1);                 /* numOfPictureParameterSets */
+        p = put_u16 (p, pps_len);
+        memcpy (p, pps, pps_len);
+        p += pps_len;
+
+        if (info->profile_idc == 100 || info->profile_idc == 110 ||
+            info->profile_idc == 122 || info->profile_idc == 144) {
+                p = put_u8 (p, 0xfc | info->chroma_format_idc);
+                p = put_u8 (p, 0xf8 | (info->bit_depth_luma - 8));
+                p = put_u8 (p, 0xf8 | (info->bit_depth_chroma - 8));
+                p = put_u8 (p, 0);         /* numOfSequenceParameterSetExt */
+        }
+
+        box_end (box, p);
+        return p;
+}
+
+static unsigned char *
+put_stbl (unsigned char * p, const struct h264_sps * info, const unsigned char * sps,
+          size_t sps_len, const unsigned char * pps, size_t pps_len)
+{
+        unsigned char * stbl = p, * stsd, * avc1, * box;
+
+        p = box_start (p, "stbl");
+
+        stsd = p;
+        p = full_box_start (p, "stsd", 0, 0);
+        p = put_u32 (p, 1);                /* entry_count */
+
+        avc1 = p;
+        p = box_start (p, "avc1");
+        p = put_zeros (p, 6);
+        p = put_u16 (p, 1);                /* data_reference_index */
+        p = put_zeros (p, 16);
+        p = put_u16 (p, info->width);
+        p = put_u16 (p, info->height);
+        p = put_u32 (p, 0x00480000);       /* 72 dpi */
+        p = put_u32 (p, 0x00480000);
+        p = put_u32 (p, 0);
+        p = put_u16 (p, 1);                /* frame_count */
+        p = put_zeros (p, 32);             /* compressorname */
+        p = put_u16 (p, 0x0018);           /* depth */
+        p = put_u16 (p, 0xffff);
+        p = put_avcc (p, info, sps, sps_len, pps, pps_len);
+        box_end (avc1, p);
+        box_end (stsd, p);
+
+        /* Samples are all in fragments */
+        box = p;
+        p = full_box_start (p, "stts", 0, 0);
+        p = put_u32 (p, 0);
+        box_end (box, p);
+
+        box = p;
+        p = full_box_start (p, "stsc", 0, 0);
+        p = put_u32 (p, 0);
+        box_end (box, p);
+
+        box = p;
+        p = full_box_start (p, "stsz", 0, 0);
+        p = put_u32 (p, 0);
+        p = put_u32 (p, 0);
+        box_end (box, p);
+
+        box = p;
+        p = full_box_start (p, "stco", 0, 0);
+        p = put_u32 (p, 0);
+        box_end (box, p);
+
+        box_end (stbl, p);
+        return p;
+}
+
+static unsigned char *
+put_trak (unsigned char * p, const struct h264_sps * info, const unsigned char * sps,
+          size_t sps_len, const unsigned char * pps, size_t pps_len)
+{
+        unsigned char * trak = p, * mdia, * minf, * dinf, * url, * box;
+
+        p = box_start (p, "trak");
+
+        box = p;
+        p = full_box_start (p, "tkhd", 0, 0x000003); /* enabled, in movie */
+        p = put_u32 (p, 0);                /* creation_time */
+        p = put_u32 (p, 0);                /* modification_time */
+        p = put_u32 (p, TRACK_ID);
+        p = put_u32 (p, 0);
+        p = put_u32 (p, 0);                /* duration */
+        p = put_zeros (p, 8);
+        p = put_u16 (p, 0);                /* layer */
+        p = put_u16 (p, 0);                /* alternate_group */
+        p = put_u16 (p, 0);                /* volume */
+        p = put_u16 (p, 0);
+        p = put_matrix (p);
+        p = put_u32 (p, (uint32_t)info->width << 16);
+        p = put_u32 (p, (uint32_t)info->height << 16);
+        box_end (box, p);
+
+        mdia = p;
+        p = box_start (p, "mdia");
+
+        box = p;
+        p = full_box_start (p, "mdhd", 0, 0);
+        p = put_u32 (p, 0);
+        p = put_u32 (p, 0);
+        p = put_u32 (p, MP4_TIMESCALE);
+        p = put_u32 (p, 0);                /* duration */
+        p = put_u16 (p, 0x55c4);           /* language: und */
+        p = put_u16 (p, 0);
+        box_end (box, p);
+
+        box = p;
+        p = full_box_start (p, "hdlr", 0, 0);
+        p = put_u32 (p, 0);
+        memcpy (p, "vide", 4);
+        p += 4;
+        p = put_zeros (p, 12);
+        memcpy (p, "VideoHandler", 13);
+        p += 13;
+        box_end (box, p);
+
+        minf = p;
+        p = box_start (p, "minf");
+
+        box = p;
+        p = full_box_start (p, "vmhd", 0, 1);
+        p = put_zeros (p, 8);              /* graphicsmode, opcolor */
+        box_end (box, p);
+
+        dinf = p;
+        p = box_start (p, "dinf");
+        box = p;
+        p = full_box_start (p, "dref", 0, 0);
+        p = put_u32 (p, 1);
+        url = p;
+        p = full_box_start (p, "url ", 0, 1); /* media is in this file */
+        box_end (url, p);
+        box_end (box, p);
+        box_end (dinf, p);
+
+        p = put_stbl (p, info, sps, sps_len, pps, pps_len);
+
+        box_end (minf, p);
+        box_end (mdia, p);
+        box_end (trak, p);
+
+        return p;
+}
+
+size_t
+mp4_init_segment (unsigned char * out, const unsigned char * sps, size_t sps_len,
+                  const unsigned char * pps, size_t pps_len)
+{
+        struct h264_sps info;
+        unsigned char * p = out, * moov, * mvex, * box;
+
+        if (sps_len > H264_PARAM_SET_MAX || pps_len > H264_PARAM_SET_MAX ||
+            h264_sps_parse (sps, sps_len, &info) == -1)
+                return 0;
+
+        box = p;
+        p = box_start (p, "ftyp");
+        memcpy (p, "iso6", 4);             /* major_brand */
+        p = put_u32 (p + 4, 0);            /* minor_version */
+        memcpy (p, "iso6cmfcavc1mp41", 16);
+        p += 16;
+        box_end (box, p);
+
+        moov = p;
+        p = box_start (p, "moov");
+
+        box = p;
+        p = full_box_start (p, "mvhd", 0, 0);
+        p = put_u32 (p, 0);                /* creation_time */
+        p = put_u32 (p, 0);                /* modification_time */
+        p = put_u32 (p, MP4_TIMESCALE);
+        p = put_u32 (p, 0);                /* duration: unknown, as it is live */
+        p = put_u32 (p, 0x00010000);       /* rate */
+        p = put_u16 (p, 0x0100);           /* volume */
+        p = put_zeros (p, 10);
+        p = put_matrix (p);
+        p = put_zeros (p, 24);             /* pre_defined */
+        p = put_u32 (p, TRACK_ID + 1);     /* next_track_ID */
+        box_end (box, p);
+
+        p = put_trak (p, &info, sps, sps_len, pps, pps_len);
+
+        mvex = p;
+        p = box_start (p, "mvex");
+        box = p;
+        p = full_box_start (p, "trex", 0, 0);
+        p = put_u32 (p, TRACK_ID);
+        p = put_u32 (p, 1);                /* default_sample_description_index */
+        p = put_u32 (p, 0);                /* default_sample_duration */
+        p = put_u32 (p, 0);                /* default_sample_size */
+        p = put_u32 (p, 0);                /* default_sample_flags */
+        box_end (box, p);
+        box_end (mvex, p);
+
+        box_end (moov, p);
+
+        return p - out;
+}
+
+size_t
+mp4_fragment_head (unsigned char * out, uint32_t sequence, uint64_t decode_time,
+                   const struct mp4_sample * samples, int nr_samples)
+{
+        unsigned char * p = out, * moof, * traf, * box;
+        uint32_t mdat_len = 8;
+        int i;
+
+        moof = p;
+        p = box_start (p, "moof");
+
+        box = p;
+        p = full_box_start (p, "mfhd", 0, 0);
+        p = put_u32 (p, sequence);
+        box_end (box, p);
+
+        traf = p;
+        p = box_start (p, "traf");
+
+        box = p;
+        p = full_box_start (p, "tfhd", 0, 0x020000); /* default-base-is-moof */
+        p = put_u32 (p, TRACK_ID);
+        box_end (box, p);
+
+        box = p;
+        p = full_box_start (p, "tfdt", 1, 0);
+        p = put_u64 (p, decode_time);
+        box_end (box, p);
+
+        /* data-offset, sample-duration, sample-size and sample-flags present */
+        box = p;
+        p = full_box_start (p, "trun", 0, 0x000701);
+        p = put_u32 (p, nr_samples);
+        p = put_u32 (p, MP4_FRAGMENT_HEAD_SIZE (nr_samples)); /* data_offset, from the moof */
+        for (i = 0; i < nr_samples; i++) {
+                p = put_u32 (p, samples[i].duration);
+                p = put_u32 (p, samples[i].size);
+                p = put_u32 (p, samples[i].flags);
+                mdat_len += samples[i].size;
+        }
+        box_end (box, p);
+
+        box_end (traf, p);
+        box_end (moof, p);
+
+        p = put_u32 (p, mdat_len);
+        memcpy (p, "mdat", 4);
+        p += 4;
+
+        return p - out;
+}
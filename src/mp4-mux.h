@@ -0,0 +1,51 @@
+#ifndef __MP4_MUX_H__
+#define __MP4_MUX_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "h264-parse.h"
+
+/*
+ * Fragmented MP4 (ISO BMFF, as used by CMAF and Media Source Extensions)
+ * for a single H.264 track. The init segment, ftyp and moov, describes the
+ * track and carries the SPS and PPS; each fragment is a moof followed by
+ * an mdat of samples in AVC format, ie. NAL units with 4 byte lengths
+ * instead of start codes.
+ */
+
+/* Media timescale, the same as MPEG-TS */
+#define MP4_TIMESCALE 90000
+
+/* Largest init segment */
+#define MP4_INIT_MAX (1024 + 2 * H264_PARAM_SET_MAX)
+
+/* Sample flags: sample_depends_on and sample_is_non_sync_sample */
+#define MP4_SAMPLE_SYNC     0x02000000
+#define MP4_SAMPLE_NON_SYNC 0x01010000
+
+struct mp4_sample {
+        uint32_t duration; /* MP4_TIMESCALE units */
+        uint32_t size;
+        uint32_t flags;
+};
+
+/* Write an init segment for the given SPS and PPS NAL units, which start
+ * with their header bytes. Returns its length, or 0 if the SPS cannot be
+ * parsed or a parameter set is larger than H264_PARAM_SET_MAX */
+size_t mp4_init_segment (unsigned char * out, const unsigned char * sps, size_t sps_len,
+                         const unsigned char * pps, size_t pps_len);
+
+/* The length of the moof and mdat header for a fragment of n samples: moof,
+ * mfhd, traf, tfhd, tfdt, trun with 12 bytes per sample, and the mdat header */
+#define MP4_FRAGMENT_HEAD_SIZE(n) (8 + 16 + 8 + 16 + 20 + 20 + 12 * (n) + 8)
+
+/*
+ * Write the moof of a fragment, and the header of its mdat; the sample
+ * data follows. sequence counts fragments from 1, and decode_time is that
+ * of the first sample. Returns MP4_FRAGMENT_HEAD_SIZE (nr_samples).
+ */
+size_t mp4_fragment_head (unsigned char * out, uint32_t sequence, uint64_t decode_time,
+                          const struct mp4_sample * samples, int nr_samples);
+
+#endif /* __MP4_MUX_H__ */
@@ -0,0 +1,83 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "tests.h"
+
+#include "multipart-parse.h"
+
+#define MAX_PARTS 8
+
+struct parts {
+        int n;
+        uint64_t pos[MAX_PARTS];
+};
+
+static void
+record_part (uint64_t pos, void * data)
+{
+        struct parts * s = (struct parts *)data;
+
+        if (s->n == MAX_PARTS)
+                FAIL ("Too many parts");
+
+        s->pos[s->n++] = pos;
+}
+
+#define PART "\r\n--++++++++\r\nContent-type: image/jpeg\r\n\r\n"
+
+/* Three parts; the second image contains a near miss of the delimiter */
+static const char stream[] =
+        /* 0 */ PART "\xff\xd8 first \xff\xd9"
+        /* 53 */ PART "\xff\xd8 \r\n--+++++ \r\n\r\n--+ \xff\xd9"
+        /* 118 */ PART "\xff\xd8 third \xff\xd9";
+
+static void
+check_parts (struct parts * s)
+{
+        if (s->n != 3)
+                FAIL ("Expected three parts");
+
+        if (s->pos[0] != 0 || s->pos[1] != 53 || s->pos[2] != 118)
+                FAIL ("Parts found at the wrong offsets");
+}
+
+int
+main (int argc, char * argv[])
+{
+        struct multipart_parser * p;
+        struct parts s;
+        size_t i;
+
+        INFO ("Scanning a whole buffer");
+        memset (&s, 0, sizeof(s));
+        p = multipart_parser_new ("multipart/x-mixed-replace; boundary=++++++++",
+                                  record_part, &s);
+        if (p == NULL)
+                FAIL ("multipart_parser_new");
+        multipart_parser_scan (p, (unsigned char *)stream, sizeof(stream) - 1);
+        check_parts (&s);
+        multipart_parser_free (p);
+
+        INFO ("Scanning a byte at a time, with a quoted boundary");
+        memset (&s, 0, sizeof(s));
+        p = multipart_parser_new ("multipart/x-mixed-replace;boundary=\"++++++++\"; x=y",
+                                  record_part, &s);
+        if (p == NULL)
+                FAIL ("multipart_parser_new with quoted boundary");
+        for (i = 0; i < sizeof(stream) - 1; i++)
+                multipart_parser_scan (p, (unsigned char *)&stream[i], 1);
+        check_parts (&s);
+        multipart_parser_free (p);
+
+        INFO ("Content type without a boundary");
+        if (multipart_parser_new ("image/jpeg", record_part, &s) != NULL)
+                FAIL ("Parser created without a boundary");
+
+        return 0;
+}
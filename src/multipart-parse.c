@@ -0,0 +1,126 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "multipart-parse.h"
+
+/* #define DEBUG */
+
+/* CRLF "--" boundary */
+#define DELIMITER_MAX (4 + MULTIPART_BOUNDARY_MAX)
+
+struct multipart_parser {
+        MultipartSync sync;
+        void * data;
+
+        uint64_t pos;        /* stream offset of the next byte */
+
+        /* The delimiter, and for each prefix of it the length of the
+         * longest proper prefix that is also a suffix, so that a partial
+         * match can continue across buffers without backing up */
+        unsigned char delim[DELIMITER_MAX];
+        int delim_len;
+        int fail[DELIMITER_MAX];
+        int matched;
+};
+
+/* Find the boundary parameter in a Content-Type value */
+static int
+multipart_boundary (const char * content_type, char * boundary)
+{
+        const char * s;
+        int len = 0, quoted = 0;
+
+        for (s = content_type; s && *s; s++) {
+                if (!strncasecmp (s, "boundary=", 9))
+                        break;
+        }
+        if (s == NULL || *s == '\0')
+                return -1;
+
+        s += 9;
+        if (*s == '"') {
+                quoted = 1;
+                s++;
+        }
+
+        while (*s && len < MULTIPART_BOUNDARY_MAX) {
+                if (quoted ? (*s == '"') : (*s == ';' || isspace ((unsigned char)*s)))
+                        break;
+                boundary[len++] = *s++;
+        }
+        boundary[len] = '\0';
+
+        return (len > 0) ? len : -1;
+}
+
+struct multipart_parser *
+multipart_parser_new (const char * content_type, MultipartSync sync, void * data)
+{
+        struct multipart_parser * p;
+        char boundary[MULTIPART_BOUNDARY_MAX + 1];
+        int i, k, len;
+
+        if ((len = multipart_boundary (content_type, boundary)) == -1)
+                return NULL;
+
+        if ((p = calloc (1, sizeof(*p))) == NULL)
+                return NULL;
+
+        p->sync = sync;
+        p->data = data;
+
+        memcpy (p->delim, "\r\n--", 4);
+        memcpy (p->delim + 4, boundary, len);
+        p->delim_len = 4 + len;
+
+        p->fail[0] = 0;
+        for (i = 1, k = 0; i < p->delim_len; i++) {
+                while (k > 0 && p->delim[i] != p->delim[k])
+                        k = p->fail[k-1];
+                if (p->delim[i] == p->delim[k])
+                        k++;
+                p->fail[i] = k;
+        }
+
+        return p;
+}
+
+void
+multipart_parser_free (struct multipart_parser * p)
+{
+        free (p);
+}
+
+void
+multipart_parser_scan (struct multipart_parser * p, const unsigned char * buf, size_t len)
+{
+        size_t i;
+
+        for (i = 0; i < len; i++, p->pos++) {
+                while (p->matched > 0 && buf[i] != p->delim[p->matched])
+                        p->matched = p->fail[p->matched-1];
+
+                if (buf[i] == p->delim[p->matched])
+                        p->matched++;
+
+                if (p->matched == p->delim_len) {
+#ifdef DEBUG
+                        printf ("multipart_parser: part at %llu\n",
+                                (unsigned long long)(p->pos + 1 - p->delim_len));
+#endif
+                        p->sync (p->pos + 1 - p->delim_len, p->data);
+                        p->matched = p->fail[p->matched-1];
+                }
+        }
+}
@@ -0,0 +1,33 @@
+#ifndef __MULTIPART_PARSE_H__
+#define __MULTIPART_PARSE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * An incremental parser for multipart streams, such as the
+ * multipart/x-mixed-replace streams of JPEG images used for MJPEG. It
+ * finds the delimiter that starts each part, so that a client can begin
+ * at a whole frame.
+ */
+
+/* Longest boundary allowed by RFC 2046 */
+#define MULTIPART_BOUNDARY_MAX 70
+
+/* Called for each part, where pos is the stream offset of the CRLF that
+ * begins its delimiter */
+typedef void (*MultipartSync) (uint64_t pos, void * data);
+
+struct multipart_parser;
+
+/* Create a parser for the boundary given in content_type, eg.
+ * "multipart/x-mixed-replace; boundary=++++++++". Returns NULL if there is
+ * no valid boundary */
+struct multipart_parser * multipart_parser_new (const char * content_type,
+                                                MultipartSync sync, void * data);
+void multipart_parser_free (struct multipart_parser * p);
+
+/* Scan the next len bytes of the stream */
+void multipart_parser_scan (struct multipart_parser * p, const unsigned char * buf, size_t len);
+
+#endif /* __MULTIPART_PARSE_H__ */
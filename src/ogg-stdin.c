@@ -3,7 +3,10 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/sendfile.h>
@@ -132,7 +135,7 @@ oggstdin_check (http_request * request, void * data)
 }
 
 static void
-oggstdin_head (http_request * request, params_t * request_headers, const char ** status_line,
+oggstdin_head (http_request * request, const char ** status_line,
 		params_t ** response_headers, void * data)
 {
 	struct oggstdin * st = (struct oggstdin *)data;
@@ -140,48 +143,97 @@ oggstdin_head (http_request * request, params_t * request_headers, const char **
 
         *status_line = http_status_line (HTTP_STATUS_OK);
 
-        r = params_append (r, "Content-Type", st->content_type);
+        *response_headers = params_append (r, "Content-Type", st->content_type);
 }
 
-static void
-oggstdin_body (int fd, http_request * request, params_t * request_headers, void * data)
+struct oggstdin_client {
+	off_t offset; /* bytes of the cached headers sent so far */
+	int rd;
+	int notify_fd;
+};
+
+static void *
+oggstdin_open (http_request * request, int notify_fd, int chunked, void * data)
 {
 	struct oggstdin * st = (struct oggstdin *)data;
-        size_t n, avail;
-	off_t offset=0;
-        int rd;
+	struct oggstdin_client * client;
 
-	while (st->in_headers) {
-		usleep (10000);
+	if ((client = malloc (sizeof(*client))) == NULL)
+		return NULL;
+
+	client->offset = 0;
+	client->rd = -1;
+
+	/* Data pages follow the headers, so they also signal header completion */
+	client->notify_fd = notify_fd;
+	if (ringbuffer_watch (&st->rb, notify_fd) == -1) {
+		free (client);
+		return NULL;
 	}
 
-	if ((n = sendfile (fd, st->headers_fd, &offset, st->headers_len)) == -1) {
-		perror ("OggStdin body write");
-		return;
+	return client;
+}
+
+static ssize_t
+oggstdin_pump (int fd, void * client, void * data)
+{
+	struct oggstdin * st = (struct oggstdin *)data;
+	struct oggstdin_client * c = (struct oggstdin_client *)client;
+	ssize_t n;
+
+	if (!st->active) {
+		errno = EPIPE;
+		return -1;
 	}
-	fsync (fd);
 
-        rd = ringbuffer_open (&st->rb);
+	/* Send the cached headers first, once they are complete */
+	if (c->rd == -1) {
+		if (st->in_headers)
+			return 0;
+
+		if (c->offset < st->headers_len) {
+			n = sendfile (fd, st->headers_fd, &c->offset, st->headers_len - c->offset);
+			if (n == -1 && errno != EAGAIN)
+				perror ("OggStdin body write");
+			if (n > 0 && c->offset < st->headers_len) {
+				errno = EAGAIN;
+				return -1;
+			}
+			return n;
+		}
+
+		if ((c->rd = ringbuffer_open (&st->rb)) == -1)
+			return -1;
+	}
 
-        while (st->active) {
-                while ((avail = ringbuffer_avail (&st->rb, rd)) == 0)
-                        usleep (10000);
+	if (ringbuffer_avail (&st->rb, c->rd) == 0)
+		return 0;
+
+	n = ringbuffer_writefd (fd, &st->rb, c->rd);
+
+	/* A short write means the socket is full; wait until it drains */
+	if (n > 0 && ringbuffer_avail (&st->rb, c->rd) > 0) {
+		errno = EAGAIN;
+		return -1;
+	}
 
 #ifdef DEBUG
-                if (avail != 0) printf ("stream_reader: %ld bytes available\n", avail);
-#endif
-                n = ringbuffer_writefd (fd, &st->rb, rd);
-                if (n == -1) {
-                        break;
-                }
-                
-                fsync (fd);
-#ifdef DEBUG
-                if (n!=0 || avail != 0) printf ("stream_reader: wrote %ld of %ld bytes to socket\n", n, avail);
+	printf ("stream_reader: wrote %ld bytes to socket\n", n);
 #endif
-        }
 
-        ringbuffer_close (&st->rb, rd);
+	return n;
+}
+
+static void
+oggstdin_close (void * client, void * data)
+{
+	struct oggstdin * st = (struct oggstdin *)data;
+	struct oggstdin_client * c = (struct oggstdin_client *)client;
+
+	ringbuffer_unwatch (&st->rb, c->notify_fd);
+	if (c->rd != -1)
+		ringbuffer_close (&st->rb, c->rd);
+	free (c);
 }
 
 static void
@@ -191,6 +243,7 @@ oggstdin_delete (void * data)
 
 	free (st->path);
 	free (st->content_type);
+        ringbuffer_destroy (&st->rb);
         free (st->rb.data);
         list_free_with (st->header_tracker, &free);
 
@@ -203,6 +256,7 @@ struct resource *
 oggstdin_resource (const char * path, const char * content_type)
 {
 	struct oggstdin * st = &oggstdin_pvt;
+	struct resource * r;
         unsigned char * data, * headers;
         size_t len = 4096*16*32;
 	size_t header_len = 10 * 1024;
@@ -228,14 +282,25 @@ oggstdin_resource (const char * path, const char * content_type)
 		return NULL;
 	}
 
-	ringbuffer_init (&st->rb, data, len);
+	if (ringbuffer_init (&st->rb, data, len) == -1) {
+		free (data);
+		free (st->path);
+		free (st->content_type);
+		return NULL;
+	}
 	st->active = 1;
 
 	st->headers_len = 0;
 	st->in_headers = 0;
         st->header_tracker = list_new ();
 
-	return resource_new (oggstdin_check, oggstdin_head, oggstdin_body, oggstdin_delete, st);
+	if ((r = resource_new_stream (oggstdin_check, oggstdin_head, oggstdin_open, oggstdin_pump,
+				      oggstdin_close, oggstdin_delete, st)) != NULL) {
+		r->path = st->path;
+		resource_cache_head (r);
+	}
+
+	return r;
 }
 
 list_t *
@@ -0,0 +1,531 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE /* O_DIRECT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "recorder.h"
+#include "ringbuffer.h"
+#include "stream.h"
+
+/* #define DEBUG */
+
+#define x_strdup(s) ((s)?strdup((s)):(NULL))
+
+/* Longest file name made from RecordPath */
+#define RECORDER_PATH_MAX 4096
+
+/* Length of the timestamp in file names, YYYYmmdd-HHMMSS, with -N added
+ * if a file of that name exists */
+#define RECORDER_STAMP_LEN 24
+
+/* Most suffixes tried before giving up on a name */
+#define RECORDER_NAME_TRIES 100
+
+struct recorder {
+        char * base;            /* RecordPath, without its extension */
+        char * ext;             /* its extension, eg. ".264", or "" */
+        size_t file_size;       /* start a new file after this many bytes, or 0 */
+        int nr_files;           /* files kept, or 0 for all */
+        int direct;             /* write with O_DIRECT */
+
+        struct stream * stream;
+        int rd;
+        pthread_t thread;
+        int started;
+        _Atomic int quit;
+
+        /* Only used by the recording thread */
+        int fd, index_fd;
+        unsigned char * buf;    /* RECORDER_BUFFER, aligned for O_DIRECT */
+        size_t fill;
+        uint64_t file_bytes;    /* in the current file, including buf */
+        int synced;             /* at or after a sync point; data before one is skipped */
+        uint64_t sync_from;     /* where to look for the next sync point */
+        uint64_t last_index;    /* time of the last index entry, or 0 after a gap */
+        uint64_t last_flush;
+        int failing;            /* the last open or write failed, and was logged */
+
+        /* Timestamps of the last nr_files recordings, to remove the oldest */
+        char (*stamps)[RECORDER_STAMP_LEN];
+        _Atomic uint64_t nr_opened;
+
+        _Atomic uint64_t nr_bytes;
+        _Atomic uint64_t nr_gaps;
+        _Atomic uint64_t nr_skipped;
+};
+
+/* Wall-clock time in microseconds since the epoch */
+static uint64_t
+recorder_time (void)
+{
+        struct timespec ts;
+
+        clock_gettime (CLOCK_REALTIME, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+recorder_file_path (struct recorder * rec, const char * stamp, const char * ext,
+                    char * path, size_t len)
+{
+        snprintf (path, len, "%s-%s%s", rec->base, stamp, ext);
+}
+
+/* Remove the recording started at stamp, and its index */
+static void
+recorder_remove (struct recorder * rec, const char * stamp)
+{
+        char path[RECORDER_PATH_MAX];
+
+        recorder_file_path (rec, stamp, rec->ext, path, sizeof(path));
+        if (unlink (path) == -1 && errno != ENOENT)
+                perror (path);
+
+        recorder_file_path (rec, stamp, ".idx", path, sizeof(path));
+        if (unlink (path) == -1 && errno != ENOENT)
+                perror (path);
+}
+
+/* Create a new recording, which must not exist yet */
+static int
+recorder_create (struct recorder * rec, const char * path)
+{
+        int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+        int fd;
+
+        if (rec->direct) {
+                fd = open (path, flags | O_DIRECT, 0644);
+                if (fd != -1 || errno != EINVAL)
+                        return fd;
+
+                fprintf (stderr, "RecordDirect: not supported for %s, "
+                         "writing through the page cache\n", path);
+                rec->direct = 0;
+        }
+
+        return open (path, flags, 0644);
+}
+
+static int
+recorder_open_file (struct recorder * rec)
+{
+        char path[RECORDER_PATH_MAX];
+        char * stamp;
+        struct tm tm;
+        time_t now;
+        size_t len;
+        int n;
+
+        /* Make room in the list of recordings kept */
+        if (rec->nr_files > 0) {
+                stamp = rec->stamps[rec->nr_opened % rec->nr_files];
+                if (rec->nr_opened >= (uint64_t)rec->nr_files)
+                        recorder_remove (rec, stamp);
+        } else {
+                stamp = rec->stamps[0];
+        }
+
+        now = time (NULL);
+        localtime_r (&now, &tm);
+        len = strftime (stamp, RECORDER_STAMP_LEN, "%Y%m%d-%H%M%S", &tm);
+
+        /* A file started in the same second as the last, or left by an
+         * earlier run, is never overwritten; the new one gets a suffix */
+        for (n = 1; ; n++) {
+                recorder_file_path (rec, stamp, rec->ext, path, sizeof(path));
+                rec->fd = recorder_create (rec, path);
+                if (rec->fd != -1 || errno != EEXIST || n == RECORDER_NAME_TRIES)
+                        break;
+                snprintf (stamp + len, RECORDER_STAMP_LEN - len, "-%d", n);
+        }
+        if (rec->fd == -1) {
+                if (!rec->failing)
+                        perror (path);
+                rec->failing = 1;
+                return -1;
+        }
+
+        /* The index belongs with the new recording, whatever was there */
+        recorder_file_path (rec, stamp, ".idx", path, sizeof(path));
+        if ((rec->index_fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                                   0644)) == -1)
+                perror (path);
+
+        rec->nr_opened++;
+        rec->file_bytes = 0;
+        rec->last_index = 0;
+        rec->failing = 0;
+
+        return 0;
+}
+
+/*
+ * Write out the buffer. With partial set, only write whole blocks, keeping
+ * at least the last one so that a late sync point can still be taken back;
+ * otherwise this ends the file, and only its last block may be partial,
+ * which O_DIRECT cannot write.
+ */
+static void
+recorder_flush (struct recorder * rec, int partial)
+{
+        size_t len = rec->fill, done = 0;
+        ssize_t n;
+
+        if (partial)
+                len = (len > RECORDER_ALIGN) ? (len - RECORDER_ALIGN) & ~(RECORDER_ALIGN - 1) : 0;
+        else if (rec->direct && len % RECORDER_ALIGN != 0)
+                fcntl (rec->fd, F_SETFL, fcntl (rec->fd, F_GETFL) & ~O_DIRECT);
+
+        while (done < len) {
+                n = write (rec->fd, rec->buf + done, len - done);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        /* The block is lost; later ones may still fit */
+                        if (!rec->failing)
+                                perror ("Record");
+                        rec->failing = 1;
+                        break;
+                }
+                done += n;
+                rec->failing = 0;
+        }
+
+        atomic_fetch_add (&rec->nr_bytes, done);
+
+        memmove (rec->buf, rec->buf + len, rec->fill - len);
+        rec->fill -= len;
+        rec->last_flush = recorder_time ();
+}
+
+static void
+recorder_close_file (struct recorder * rec)
+{
+        if (rec->fd == -1)
+                return;
+
+        recorder_flush (rec, 0);
+        close (rec->fd);
+        rec->fd = -1;
+
+        if (rec->index_fd != -1) {
+                close (rec->index_fd);
+                rec->index_fd = -1;
+        }
+}
+
+/* At a sync point: start a new file if the current one is full, and add
+ * an index entry if one is due */
+static void
+recorder_mark (struct recorder * rec)
+{
+        struct recorder_index_entry e;
+        uint64_t now;
+
+        if (rec->fd == -1 || (rec->file_size > 0 && rec->file_bytes >= rec->file_size)) {
+                recorder_close_file (rec);
+                if (recorder_open_file (rec) == -1) {
+                        /* Try again at the next sync point */
+                        rec->synced = 0;
+                        return;
+                }
+        }
+        rec->synced = 1;
+
+        now = recorder_time ();
+        if (rec->index_fd == -1 ||
+            (rec->last_index > 0 && now < rec->last_index + RECORDER_INDEX_INTERVAL))
+                return;
+
+        e.time = now;
+        e.offset = rec->file_bytes;
+        if (write (rec->index_fd, &e, sizeof(e)) == sizeof(e))
+                rec->last_index = now;
+}
+
+/* Copy len bytes from the ring buffer to the file, or skip them if not
+ * synced. Returns -1 if the writer overran the reader meanwhile, in which
+ * case the data last read is not kept */
+static int
+recorder_append (struct recorder * rec, uint64_t len)
+{
+        struct ringbuffer * rb = &rec->stream->rb;
+        size_t n;
+
+        if (!rec->synced)
+                return ringbuffer_seek (rb, rec->rd, ringbuffer_tell (rb, rec->rd) + len);
+
+        while (len > 0) {
+                n = RECORDER_BUFFER - rec->fill;
+                if (n > len)
+                        n = len;
+
+                ringbuffer_read (rb, rec->rd, rec->buf + rec->fill, n);
+                if (ringbuffer_lagged (rb, rec->rd))
+                        return -1;
+
+                rec->fill += n;
+                rec->file_bytes += n;
+                if (rec->fill == RECORDER_BUFFER)
+                        recorder_flush (rec, 1);
+
+                len -= n;
+        }
+
+        return 0;
+}
+
+/*
+ * Take back the last len bytes read, to re-read them from a sync point that
+ * was marked after they had been: the writer parses data after adding it to
+ * the ring buffer. Returns 1 if they have already been written out, or -1 if
+ * they are no longer in the ring buffer.
+ */
+static int
+recorder_unread (struct recorder * rec, uint64_t len)
+{
+        struct ringbuffer * rb = &rec->stream->rb;
+
+        if (rec->synced) {
+                if (len > rec->fill)
+                        return 1;
+                rec->fill -= len;
+                rec->file_bytes -= len;
+        }
+
+        return ringbuffer_seek (rb, rec->rd, ringbuffer_tell (rb, rec->rd) - len);
+}
+
+/* The first sync point at or after pos */
+static int
+recorder_sync_at (struct ringbuffer * rb, uint64_t pos, uint64_t * seq)
+{
+        uint64_t id;
+
+        if (pos == 0)
+                return ringbuffer_sync_get (rb, 0, seq);
+
+        return ringbuffer_sync_next (rb, pos - 1, &id, seq);
+}
+
+/* Record whatever is available, marking each sync point on the way */
+static int
+recorder_copy (struct recorder * rec)
+{
+        struct ringbuffer * rb = &rec->stream->rb;
+        uint64_t pread, end, seq;
+        int ret;
+
+        pread = ringbuffer_tell (rb, rec->rd);
+        end = pread + ringbuffer_avail (rb, rec->rd);
+
+        /* Any point will do */
+        if (rec->stream->format == STREAM_FORMAT_NONE) {
+                recorder_mark (rec);
+                return recorder_append (rec, end - pread);
+        }
+
+        while (recorder_sync_at (rb, rec->sync_from, &seq) == 0 && seq < end) {
+                rec->sync_from = seq + 1;
+                if (seq > pread) {
+                        if (recorder_append (rec, seq - pread) == -1)
+                                return -1;
+                } else if (seq < pread) {
+                        if ((ret = recorder_unread (rec, pread - seq)) == -1)
+                                return -1;
+                        else if (ret == 1)
+                                continue;
+                }
+                pread = seq;
+                recorder_mark (rec);
+        }
+
+        return recorder_append (rec, end - pread);
+}
+
+/* The writer overran the recorder: log the gap, and resume at the latest
+ * sync point, or the write position */
+static void
+recorder_skip (struct recorder * rec)
+{
+        struct ringbuffer * rb = &rec->stream->rb;
+        uint64_t id, seq, pread;
+
+        pread = ringbuffer_tell (rb, rec->rd);
+
+        if (rec->stream->format == STREAM_FORMAT_NONE ||
+            ringbuffer_sync_latest (rb, &id, &seq) == -1 ||
+            ringbuffer_seek (rb, rec->rd, seq) == -1)
+                ringbuffer_seek (rb, rec->rd, ringbuffer_tail (rb));
+
+        seq = ringbuffer_tell (rb, rec->rd);
+        rec->sync_from = seq;
+        rec->synced = (rec->stream->format == STREAM_FORMAT_NONE);
+        rec->last_index = 0;
+
+        atomic_fetch_add (&rec->nr_gaps, 1);
+        atomic_fetch_add (&rec->nr_skipped, seq - pread);
+        fprintf (stderr, "Record %s-*%s: disk fell behind, skipped %llu bytes\n",
+                 rec->base, rec->ext, (unsigned long long)(seq - pread));
+}
+
+static void *
+recorder_main (void * data)
+{
+        struct recorder * rec = (struct recorder *)data;
+        struct ringbuffer * rb = &rec->stream->rb;
+
+        while (!atomic_load (&rec->quit)) {
+                if (ringbuffer_wait (rb, rec->rd, 1000) == 0) {
+                        if (!rec->stream->active)
+                                break;
+                        continue;
+                }
+
+                if (ringbuffer_lagged (rb, rec->rd) || recorder_copy (rec) == -1)
+                        recorder_skip (rec);
+
+                /* Keep what is on disk reasonably current for slow streams */
+                if (rec->fd != -1 && rec->fill > 2 * RECORDER_ALIGN &&
+                    recorder_time () >= rec->last_flush + RECORDER_FLUSH_INTERVAL)
+                        recorder_flush (rec, 1);
+        }
+
+        recorder_close_file (rec);
+
+        return NULL;
+}
+
+struct recorder *
+recorder_new (const char * path, size_t file_size, int nr_files, int direct)
+{
+        struct recorder * rec;
+        const char * ext, * slash;
+        void * mem;
+
+        if ((rec = calloc (1, sizeof(*rec))) == NULL)
+                return NULL;
+
+        /* Timestamps go before the extension */
+        ext = strrchr (path, '.');
+        slash = strrchr (path, '/');
+        if (ext == NULL || (slash != NULL && ext < slash))
+                ext = path + strlen (path);
+
+        rec->base = strndup (path, ext - path);
+        rec->ext = x_strdup (ext);
+        rec->stamps = calloc (nr_files > 0 ? nr_files : 1, sizeof(*rec->stamps));
+        if (posix_memalign (&mem, RECORDER_ALIGN, RECORDER_BUFFER) == 0)
+                rec->buf = mem;
+
+        if (rec->base == NULL || rec->ext == NULL || rec->stamps == NULL || rec->buf == NULL) {
+                recorder_free (rec);
+                return NULL;
+        }
+
+        rec->file_size = file_size;
+        rec->nr_files = nr_files;
+        rec->direct = direct;
+        rec->rd = rec->fd = rec->index_fd = -1;
+
+        return rec;
+}
+
+void
+recorder_free (struct recorder * rec)
+{
+        if (rec->started) {
+                atomic_store (&rec->quit, 1);
+                pthread_join (rec->thread, NULL);
+                ringbuffer_close (&rec->stream->rb, rec->rd);
+                atomic_fetch_sub (&rec->stream->nr_ring_clients, 1);
+        }
+
+        free (rec->buf);
+        free (rec->stamps);
+        free (rec->base);
+        free (rec->ext);
+        free (rec);
+}
+
+struct recorder *
+recorder_config (Dictionary * config)
+{
+        const char * path, * value;
+        size_t file_size = RECORDER_DEFAULT_FILE_SIZE;
+        int nr_files = 0, direct = 1;
+
+        if ((path = dictionary_lookup (config, "RecordPath")) == NULL)
+                return NULL;
+
+        if ((value = dictionary_lookup (config, "RecordFileSize")) != NULL &&
+            stream_size_parse (value, &file_size) == -1) {
+                fprintf (stderr, "RecordFileSize: invalid size %s, recording to one file\n",
+                         value);
+                file_size = 0;
+        }
+        if ((value = dictionary_lookup (config, "RecordFiles")) != NULL)
+                nr_files = atoi (value);
+        if ((value = dictionary_lookup (config, "RecordDirect")) != NULL)
+                direct = !strncasecmp (value, "on", 2);
+
+        return recorder_new (path, file_size, nr_files, direct);
+}
+
+int
+recorder_start (struct recorder * rec, struct stream * stream)
+{
+        rec->stream = stream;
+
+        if ((rec->rd = ringbuffer_open_lossy (&stream->rb)) == -1)
+                return -1;
+
+        rec->sync_from = ringbuffer_tell (&stream->rb, rec->rd);
+        rec->synced = (stream->format == STREAM_FORMAT_NONE);
+
+        /* A zero-copy stream only fills the ring buffer for its readers */
+        atomic_fetch_add (&stream->nr_ring_clients, 1);
+
+        if (pthread_create (&rec->thread, NULL, recorder_main, rec) != 0) {
+                atomic_fetch_sub (&stream->nr_ring_clients, 1);
+                ringbuffer_close (&stream->rb, rec->rd);
+                return -1;
+        }
+        rec->started = 1;
+
+        return 0;
+}
+
+void
+recorder_write_status (int fd, struct recorder * rec)
+{
+        char buf[512];
+        int n;
+
+        n = snprintf (buf, sizeof(buf),
+                      "<p>Recording to %s-*%s: %llu bytes in %llu files, "
+                      "%llu gaps (%llu bytes skipped)</p>\n",
+                      rec->base, rec->ext,
+                      (unsigned long long)atomic_load (&rec->nr_bytes),
+                      (unsigned long long)atomic_load (&rec->nr_opened),
+                      (unsigned long long)atomic_load (&rec->nr_gaps),
+                      (unsigned long long)atomic_load (&rec->nr_skipped));
+        if (n > 0 && n < (int)sizeof(buf))
+                write (fd, buf, n);
+}
@@ -0,0 +1,70 @@
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <stdint.h>
+
+#include "dictionary.h"
+#include "stream.h"
+
+/*
+ * Records a stream to disk from its own reader of the stream's ring buffer,
+ * in place of piping the input through tee(1). Recordings are split into
+ * files named from RecordPath and the time each was started, eg. for
+ * RecordPath /var/record/cam1.264:
+ *
+ *   /var/record/cam1-20100407-132309.264    the recording
+ *   /var/record/cam1-20100407-132309.idx    its time index
+ *
+ * For streams with a Format, each file starts at a sync point so that it
+ * can be played on its own. The index holds a struct recorder_index_entry,
+ * in host byte order, for at most one sync point per RECORDER_INDEX_INTERVAL
+ * and for the first after each gap.
+ *
+ * The recorder's reader is lossy: the stream's writer overruns it rather
+ * than waiting, so a slow disk never holds up the input or live clients,
+ * whatever their SlowClient policy. When that happens the recorder logs the
+ * gap and carries on in the same file from the latest sync point.
+ */
+
+/* Microseconds between index entries */
+#define RECORDER_INDEX_INTERVAL 1000000
+
+/* Data is written from a buffer of this size, in multiples of the
+ * alignment O_DIRECT needs */
+#define RECORDER_BUFFER (1024*1024)
+#define RECORDER_ALIGN 4096
+
+/* Microseconds data may wait in memory before whole blocks of it are
+ * written out */
+#define RECORDER_FLUSH_INTERVAL 1000000
+
+/* A new file is started after this many bytes, by default */
+#define RECORDER_DEFAULT_FILE_SIZE (256*1024*1024)
+
+struct recorder_index_entry {
+        uint64_t time;          /* microseconds since the epoch */
+        uint64_t offset;        /* bytes into the recording */
+};
+
+struct recorder;
+
+/* Record to files named from path, each of at least file_size bytes (or
+ * one file if 0), keeping the last nr_files (or all if 0). If direct is
+ * set, write with O_DIRECT where the filesystem allows */
+struct recorder * recorder_new (const char * path, size_t file_size, int nr_files, int direct);
+
+/* Stop recording, and close the current file. Call before closing the
+ * stream */
+void recorder_free (struct recorder * rec);
+
+/* Make a recorder from the Record* settings of a stream's configuration
+ * block, or return NULL if it has none */
+struct recorder * recorder_config (Dictionary * config);
+
+/* Start recording stream in a thread of its own */
+int recorder_start (struct recorder * rec, struct stream * stream);
+
+/* Write an HTML summary of the recording to fd */
+void recorder_write_status (int fd, struct recorder * rec);
+
+#endif /* __RECORDER_H__ */
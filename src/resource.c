@@ -2,7 +2,11 @@
    Copyright (C) 2009 Conrad Parker
 */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "http-status.h"
 #include "resource.h"
 
 struct resource * resource_new (ResourceCheck check, ResourceHead head, ResourceBody body,
@@ -22,8 +26,58 @@ struct resource * resource_new (ResourceCheck check, ResourceHead head, Resource
 	return r;
 }
 
+struct resource * resource_new_stream (ResourceCheck check, ResourceHead head,
+				       ResourceOpen open, ResourcePump pump, ResourceClose close,
+				       ResourceDelete del, void * data)
+{
+	struct resource * r;
+
+	if ((r = resource_new (check, head, NULL, del, data)) == NULL)
+		return NULL;
+
+	r->open = open;
+	r->pump = pump;
+	r->close = close;
+
+	return r;
+}
+
+int resource_cache_head (struct resource * resource)
+{
+	const char * status_line;
+	params_t * headers = NULL;
+	const char * length;
+	char buf[1024];
+	size_t len;
+
+	resource->head (NULL, &status_line, &headers, resource->data);
+
+	/* The response adds more headers */
+	if ((len = http_status_format_head (buf, sizeof(buf), status_line, headers)) == 0) {
+		params_free (headers);
+		return -1;
+	}
+
+	if ((resource->head_cache = malloc (len)) == NULL) {
+		params_free (headers);
+		return -1;
+	}
+	memcpy (resource->head_cache, buf, len);
+	resource->head_cache_len = len;
+
+	if ((length = params_get (headers, "Content-Length")) != NULL)
+		resource->head_length = strdup (length);
+
+	params_free (headers);
+
+	return 0;
+}
+
 void resource_delete (struct resource * resource)
 {
+	free (resource->head_cache);
+	free (resource->head_length);
+
 	if (resource->del)
 		resource->del(resource->data);
 }
@@ -1,27 +1,129 @@
 #ifndef __RESOURCE_H__
 #define __RESOURCE_H__
 
+#include <sys/types.h>
+
 #include "sighttpd.h"
 #include "params.h"
 #include "http-reqline.h"
 
+/* Request headers are available from the request, eg. with http_request_header() */
 typedef int (*ResourceCheck) (http_request * request, void * data);
-typedef void (*ResourceHead) (http_request * request, params_t * request_headers,
-		const char ** status_line, params_t ** response_headers, void * data);
-typedef void (*ResourceBody) (int fd, http_request * request, params_t * request_headers, void * data);
+typedef void (*ResourceHead) (http_request * request, const char ** status_line,
+		params_t ** response_headers, void * data);
+/*
+ * body is called on a helper thread and writes to a file in memory, which is
+ * sent once it returns; it may take its time, eg. to run a shell command,
+ * without holding up other clients. A body that never changes can be given
+ * as body_cache instead.
+ */
+typedef void (*ResourceBody) (int fd, http_request * request, void * data);
 typedef void (*ResourceDelete) (void * data);
 
+/*
+ * A head which finds what to send, eg. an open file, can leave it in
+ * request->state for the body (or open) to send from, rather than looking
+ * it up again. release is called with it once the response is done, unless
+ * open took it over by setting request->state to NULL.
+ */
+typedef void (*ResourceRelease) (void * state, void * data);
+
+/* Optional: write an HTML fragment describing the resource to the status page */
+typedef void (*ResourceStatus) (int fd, void * data);
+
+/*
+ * Streaming bodies are driven by the worker event loop instead of being
+ * written in a single call. open is called once the response headers have
+ * been sent and returns per-client state; pump is called whenever the
+ * stream may have data for that client and the socket is writable; close
+ * releases the client state when the connection goes away.
+ *
+ * open is passed the worker's notification eventfd, which the resource
+ * should signal (eg. with ringbuffer_watch()) when new data arrives.
+ *
+ * pump returns the number of bytes written, 0 if there is nothing to send
+ * yet, or -1 on error or end of stream. If the socket would block, pump
+ * returns -1 with errno set to EAGAIN.
+ *
+ * A body whose Content-Length the head gave, such as a file, is sent in
+ * full and then ended by returning RESOURCE_PUMP_END. As pump is only
+ * called again when the socket becomes writable or the notification fd is
+ * signalled, it should write until the socket would block.
+ *
+ * A resource that sets its chunked flag can frame its body with chunked
+ * transfer coding, which is used for HTTP/1.1 clients: open is then
+ * called with chunked set, and pump writes each block of data as a chunk.
+ * At the end of the stream pump writes the last chunk and returns
+ * RESOURCE_PUMP_END, and the connection is kept open for further requests.
+ */
+#define RESOURCE_PUMP_END (-2)
+
+typedef void * (*ResourceOpen) (http_request * request, int notify_fd, int chunked,
+				void * data);
+typedef ssize_t (*ResourcePump) (int fd, void * client, void * data);
+typedef void (*ResourceClose) (void * client, void * data);
+
+/*
+ * Optional, for streaming bodies: instead of writing, queue the client's
+ * next write on the worker's io_uring with uring_queue_*(), reported with
+ * tag, and return 1; the worker submits the writes for all of its clients
+ * at once and passes each result (bytes written or -errno) to complete,
+ * which returns what pump would have. Return 0 to have pump called as usual.
+ */
+struct uring;
+typedef int (*ResourceQueue) (int fd, void * client, struct uring * u, void * tag, void * data);
+typedef ssize_t (*ResourceComplete) (void * client, int res, void * data);
+
 struct resource {
 	ResourceCheck check;
 	ResourceHead head;
 	ResourceBody body;
 	ResourceDelete del;
+	ResourceRelease release;
 	void * data;
+
+	ResourceOpen open;
+	ResourcePump pump;
+	ResourceClose close;
+	ResourceQueue queue;
+	ResourceComplete complete;
+
+	ResourceStatus status;
+
+	int chunked; /* pump can send chunked transfer coding */
+
+	/* Optional: the path prefix which check matches, letting the router
+	 * find this resource without calling check */
+	const char * path;
+
+	/* Optional: the status line and headers, formatted once by
+	 * resource_cache_head() when they do not depend on the request */
+	char * head_cache;
+	size_t head_cache_len;
+	char * head_length; /* the cached Content-Length value, if any */
+
+	/* Optional: a body which does not depend on the request, owned by
+	 * the resource's data. It is sent from memory along with the head,
+	 * in place of calling body */
+	const char * body_cache;
+	size_t body_cache_len;
 };
 
 struct resource * resource_new (ResourceCheck check, ResourceHead head, ResourceBody body,
 				ResourceDelete del, void * data);
 
+struct resource * resource_new_stream (ResourceCheck check, ResourceHead head,
+				       ResourceOpen open, ResourcePump pump, ResourceClose close,
+				       ResourceDelete del, void * data);
+
+/*
+ * Format the resource's head once, for a resource whose head function
+ * does not look at the request (it is called with a NULL request).
+ * Responses then send the cached block with only the Date and
+ * connection headers added.
+ */
+int resource_cache_head (struct resource * resource);
+
 void resource_delete (struct resource * resource);
 
 #endif /* __RESOURCE_H__ */
@@ -0,0 +1,567 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+/*
+ * Stress test for the broadcast ringbuffer: one writer and many readers
+ * running concurrently. Every reader must see the exact byte sequence
+ * written, from the point at which it opened. Build with
+ * ./configure --enable-thread-sanitizer to check for data races.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "ringbuffer.h"
+#include "tests.h"
+
+#define NR_READERS 100
+#define NR_REGISTRY 1000 /* more than fit in one slab */
+#define NR_WATCHES 200
+#define RB_SIZE 4096
+#define CHUNK_SIZE 173 /* not a divisor of RB_SIZE, so writes wrap */
+#define TOTAL_BYTES (1024*1024)
+
+static struct ringbuffer rb;
+
+static volatile int failed = 0;
+
+/* Byte n of the stream */
+static unsigned char
+pattern (uint64_t n)
+{
+        return (unsigned char)((n * 7) ^ (n >> 8));
+}
+
+static void *
+reader_main (void * data)
+{
+        int rd = *(int *)data;
+        unsigned char buf[CHUNK_SIZE * 2];
+        uint64_t pos;
+        ssize_t avail;
+        size_t i, len;
+
+        /* All readers open before the writer starts */
+        pos = 0;
+
+        while (pos < TOTAL_BYTES) {
+                if ((avail = ringbuffer_wait (&rb, rd, 1000)) == 0)
+                        continue;
+
+                len = (size_t)avail < sizeof(buf) ? (size_t)avail : sizeof(buf);
+                ringbuffer_read (&rb, rd, buf, len);
+
+                for (i = 0; i < len; i++, pos++) {
+                        if (buf[i] != pattern (pos)) {
+                                failed = 1;
+                                return NULL;
+                        }
+                }
+        }
+
+        ringbuffer_close (&rb, rd);
+
+        return NULL;
+}
+
+/* One reader keeps up and one never reads; check what happens to the slow
+ * one when the writer needs its space */
+static void
+test_policy (enum ringbuffer_policy policy)
+{
+        struct ringbuffer prb;
+        unsigned char data[RB_SIZE/2 + 1];
+        unsigned char out[RB_SIZE];
+        int fast, slow;
+
+        memset (data, 'x', sizeof(data));
+
+        if (ringbuffer_init (&prb, malloc (RB_SIZE), RB_SIZE) == -1)
+                FAIL ("ringbuffer_init");
+        ringbuffer_set_policy (&prb, policy);
+
+        fast = ringbuffer_open (&prb);
+        slow = ringbuffer_open (&prb);
+
+        ringbuffer_write (&prb, data, sizeof(data));
+        ringbuffer_read (&prb, fast, out, sizeof(data));
+
+        if (ringbuffer_lag (&prb, slow) != sizeof(data))
+                FAIL ("Slow reader lag");
+        if (ringbuffer_lag (&prb, fast) != 0)
+                FAIL ("Fast reader lag");
+
+        if (policy == RINGBUFFER_BLOCK) {
+                if (ringbuffer_free (&prb) != RB_SIZE - sizeof(data))
+                        FAIL ("Writer not held back by slow reader");
+                goto done;
+        }
+
+        /* This overruns the slow reader */
+        ringbuffer_write (&prb, data, sizeof(data));
+        if (ringbuffer_read (&prb, fast, out, sizeof(data)) != sizeof(data))
+                FAIL ("Fast reader affected by slow reader");
+
+        if (policy == RINGBUFFER_SKIP) {
+                if (ringbuffer_read (&prb, slow, out, 1) != 0)
+                        FAIL ("Slow reader not skipped");
+                if (ringbuffer_lag (&prb, slow) != 0)
+                        FAIL ("Slow reader not at write position");
+                if (atomic_load (&prb.nr_skipped) != 1)
+                        FAIL ("Skip not counted");
+        } else {
+                if (ringbuffer_read (&prb, slow, out, 1) != -1 || errno != ENOBUFS)
+                        FAIL ("Slow reader not dropped");
+                if (atomic_load (&prb.nr_dropped) != 1)
+                        FAIL ("Drop not counted");
+        }
+
+        ringbuffer_close (&prb, slow);
+        if (ringbuffer_lag (&prb, slow) != -1)
+                FAIL ("Lag of closed reader");
+
+done:
+        ringbuffer_close (&prb, fast);
+        free (prb.data);
+        ringbuffer_destroy (&prb);
+}
+
+/* A lossy reader that never reads is overrun even under the block policy,
+ * and resumes where it seeks to */
+static void
+test_lossy (void)
+{
+        struct ringbuffer lrb;
+        unsigned char data[RB_SIZE/2 + 1];
+        unsigned char out[RB_SIZE];
+        int fast, lossy;
+
+        memset (data, 'x', sizeof(data));
+
+        if (ringbuffer_init (&lrb, malloc (RB_SIZE), RB_SIZE) == -1)
+                FAIL ("ringbuffer_init");
+
+        fast = ringbuffer_open (&lrb);
+        if ((lossy = ringbuffer_open_lossy (&lrb)) == -1)
+                FAIL ("ringbuffer_open_lossy");
+
+        ringbuffer_write (&lrb, data, sizeof(data));
+        ringbuffer_read (&lrb, fast, out, sizeof(data));
+        if (ringbuffer_lagged (&lrb, lossy))
+                FAIL ("Lossy reader overrun early");
+
+        if (ringbuffer_make_room (&lrb, sizeof(data)) < sizeof(data))
+                FAIL ("Writer held back by lossy reader");
+        ringbuffer_write (&lrb, data, sizeof(data));
+        if (ringbuffer_read (&lrb, fast, out, sizeof(data)) != sizeof(data))
+                FAIL ("Fast reader affected by lossy reader");
+
+        if (!ringbuffer_lagged (&lrb, lossy))
+                FAIL ("Lossy reader not overrun");
+
+        if (ringbuffer_seek (&lrb, lossy, ringbuffer_tail (&lrb)) == -1 ||
+            ringbuffer_lagged (&lrb, lossy) || ringbuffer_lag (&lrb, lossy) != 0)
+                FAIL ("Lossy reader did not resume");
+
+        ringbuffer_close (&lrb, lossy);
+        ringbuffer_close (&lrb, fast);
+        free (lrb.data);
+        ringbuffer_destroy (&lrb);
+}
+
+static void *
+room_reader_main (void * data)
+{
+        struct ringbuffer * wrb = data;
+        unsigned char out[RB_SIZE/2];
+
+        usleep (100000);
+        ringbuffer_read (wrb, 0, out, sizeof(out));
+
+        return NULL;
+}
+
+/* A writer waiting for room on a full buffer sleeps until the reader
+ * moves on, rather than until it times out */
+static void
+test_wait_room (void)
+{
+        struct ringbuffer wrb;
+        unsigned char data[RB_SIZE/8];
+        struct timespec t0, t1;
+        pthread_t reader;
+        size_t i;
+        long ms;
+
+        memset (data, 'x', sizeof(data));
+
+        if (ringbuffer_init (&wrb, malloc (RB_SIZE), RB_SIZE) == -1)
+                FAIL ("ringbuffer_init");
+        if (ringbuffer_open (&wrb) != 0)
+                FAIL ("ringbuffer_open");
+
+        for (i = 0; i < 8; i++)
+                ringbuffer_write (&wrb, data, sizeof(data));
+
+        if (ringbuffer_wait_room (&wrb, 1, 50) != 0)
+                FAIL ("Room in a full buffer");
+
+        pthread_create (&reader, NULL, room_reader_main, &wrb);
+        clock_gettime (CLOCK_MONOTONIC, &t0);
+        if (ringbuffer_wait_room (&wrb, RB_SIZE/2, 5000) < RB_SIZE/2)
+                FAIL ("Writer not given room");
+        clock_gettime (CLOCK_MONOTONIC, &t1);
+        pthread_join (reader, NULL);
+
+        ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+        if (ms >= 2500)
+                FAIL ("Writer not woken by reader");
+
+        ringbuffer_close (&wrb, 0);
+        free (wrb.data);
+        ringbuffer_destroy (&wrb);
+}
+
+/* Peek at data across the end of the buffer, and consume part of it */
+static void
+test_peek (void)
+{
+        struct ringbuffer prb;
+        unsigned char data[1000];
+        struct iovec iov[2];
+        uint64_t pos;
+        size_t i;
+        int rd, cnt;
+
+        if (ringbuffer_init (&prb, malloc (RB_SIZE), RB_SIZE) == -1)
+                FAIL ("ringbuffer_init");
+
+        rd = ringbuffer_open (&prb);
+
+        /* Only the last write is left unread */
+        for (pos = 0; pos < RB_SIZE; pos += sizeof(data)) {
+                for (i = 0; i < sizeof(data); i++)
+                        data[i] = pattern (pos + i);
+                ringbuffer_flush (&prb, rd);
+                ringbuffer_write (&prb, data, sizeof(data));
+        }
+
+        /* The last write wraps, so the data is in two pieces */
+        if ((cnt = ringbuffer_peek (&prb, rd, RB_SIZE, iov)) != 2)
+                FAIL ("Wrapped data not in two pieces");
+        if (iov[0].iov_len + iov[1].iov_len != sizeof(data) || iov[1].iov_base != prb.data)
+                FAIL ("Wrong peek lengths");
+        for (i = 0; i < iov[0].iov_len; i++)
+                if (((unsigned char *)iov[0].iov_base)[i] != pattern (pos - sizeof(data) + i))
+                        FAIL ("Wrong data before the wrap");
+
+        if (ringbuffer_peek (&prb, rd, 10, iov) != 1 || iov[0].iov_len != 10)
+                FAIL ("Peek not limited to max");
+
+        if (ringbuffer_avail (&prb, rd) != sizeof(data))
+                FAIL ("Peek consumed data");
+
+        ringbuffer_consume (&prb, rd, sizeof(data) - 1);
+        if (ringbuffer_peek (&prb, rd, RB_SIZE, iov) != 1 || iov[0].iov_len != 1 ||
+            *(unsigned char *)iov[0].iov_base != pattern (pos - 1))
+                FAIL ("Wrong data after consume");
+
+        ringbuffer_consume (&prb, rd, 1);
+        if (ringbuffer_peek (&prb, rd, RB_SIZE, iov) != 0)
+                FAIL ("Data left after consuming it all");
+
+        ringbuffer_close (&prb, rd);
+        free (prb.data);
+        ringbuffer_destroy (&prb);
+}
+
+/* Reading input into a full buffer is told apart from the end of input */
+static void
+test_readfd (void)
+{
+        struct ringbuffer frb;
+        unsigned char data[RB_SIZE];
+        int fds[2], rd;
+        ssize_t n;
+
+        if (ringbuffer_init (&frb, malloc (RB_SIZE), RB_SIZE) == -1)
+                FAIL ("ringbuffer_init");
+        if (pipe (fds) == -1)
+                FAIL ("pipe");
+
+        rd = ringbuffer_open (&frb);
+        memset (data, 'x', sizeof(data));
+        if (write (fds[1], data, sizeof(data)) != sizeof(data))
+                FAIL ("write");
+
+        /* The blocked reader keeps the buffer full */
+        while ((n = ringbuffer_readfd (fds[0], &frb)) > 0)
+                ;
+        if (n != -1 || errno != EAGAIN)
+                FAIL ("Full buffer not reported as EAGAIN");
+
+        ringbuffer_flush (&frb, rd);
+        close (fds[1]);
+        while ((n = ringbuffer_readfd (fds[0], &frb)) > 0)
+                ringbuffer_flush (&frb, rd);
+        if (n != 0)
+                FAIL ("End of input not reported as 0");
+
+        close (fds[0]);
+        ringbuffer_close (&frb, rd);
+        free (frb.data);
+        ringbuffer_destroy (&frb);
+}
+
+/* Many workers can watch one buffer */
+static void
+test_watch (void)
+{
+        struct ringbuffer wrb;
+        uint64_t count;
+        int fd, efd, slabs;
+
+        if (ringbuffer_init (&wrb, malloc (RB_SIZE), RB_SIZE) == -1)
+                FAIL ("ringbuffer_init");
+
+        /* Nothing is written, so the fds need not be open */
+        for (fd = 1000; fd < 1000 + NR_WATCHES; fd++) {
+                if (ringbuffer_watch (&wrb, fd) == -1 || ringbuffer_watch (&wrb, fd) == -1)
+                        FAIL ("ringbuffer_watch");
+        }
+        if (wrb.nr_watches != NR_WATCHES)
+                FAIL ("Wrong number of watches");
+
+        for (fd = 1000; fd < 1000 + NR_WATCHES; fd++) {
+                ringbuffer_unwatch (&wrb, fd);
+                ringbuffer_unwatch (&wrb, fd);
+        }
+        if (wrb.nr_watches != 0)
+                FAIL ("Watches left after unwatching");
+
+        /* Freed slots are reused */
+        slabs = atomic_load (&wrb.nr_watch_slabs);
+        for (fd = 2000; fd < 2000 + NR_WATCHES; fd++)
+                ringbuffer_watch (&wrb, fd);
+        if (atomic_load (&wrb.nr_watch_slabs) != slabs)
+                FAIL ("Watch slots not reused");
+        for (fd = 2000; fd < 2000 + NR_WATCHES; fd++)
+                ringbuffer_unwatch (&wrb, fd);
+
+        /* Only watched fds are signalled */
+        if ((efd = eventfd (0, EFD_NONBLOCK)) == -1)
+                FAIL ("eventfd");
+        ringbuffer_watch (&wrb, efd);
+        ringbuffer_signal (&wrb);
+        if (read (efd, &count, sizeof(count)) != sizeof(count) || count != 1)
+                FAIL ("Watched fd not signalled");
+        ringbuffer_unwatch (&wrb, efd);
+        ringbuffer_signal (&wrb);
+        if (read (efd, &count, sizeof(count)) != -1)
+                FAIL ("Unwatched fd signalled");
+        close (efd);
+
+        free (wrb.data);
+        ringbuffer_destroy (&wrb);
+}
+
+/* Mark a sync point every 300 bytes, and join and skip using them */
+static void
+test_sync (void)
+{
+        struct ringbuffer srb;
+        unsigned char data[300], out[300];
+        uint64_t id, seq, pos;
+        int i, rd;
+
+        if (ringbuffer_init (&srb, malloc (RB_SIZE), RB_SIZE) == -1)
+                FAIL ("ringbuffer_init");
+
+        if (ringbuffer_sync_latest (&srb, &id, &seq) != -1)
+                FAIL ("Sync point in empty buffer");
+
+        for (pos = 0, i = 0; i < 10; i++) {
+                ringbuffer_mark_sync (&srb, pos);
+                memset (data, i, sizeof(data));
+                ringbuffer_write (&srb, data, sizeof(data));
+                pos += sizeof(data);
+        }
+
+        if (ringbuffer_sync_latest (&srb, &id, &seq) == -1 || id != 9 || seq != 2700)
+                FAIL ("ringbuffer_sync_latest");
+
+        if (ringbuffer_sync_next (&srb, 1450, &id, &seq) == -1 || id != 5 || seq != 1500)
+                FAIL ("ringbuffer_sync_next");
+
+        if (ringbuffer_sync_next (&srb, 2700, &id, &seq) != -1)
+                FAIL ("ringbuffer_sync_next past the end");
+
+        if (ringbuffer_sync_get (&srb, 3, &seq) == -1 || seq != 900)
+                FAIL ("ringbuffer_sync_get");
+
+        if (ringbuffer_sync_get (&srb, 10, &seq) != -1)
+                FAIL ("ringbuffer_sync_get before it is marked");
+
+        /* With no readers, the writer considers the whole buffer free */
+        if (ringbuffer_free (&srb) != RB_SIZE)
+                FAIL ("ringbuffer_free with no readers");
+
+        INFO ("Join at a sync point");
+        rd = ringbuffer_open (&srb);
+        if (ringbuffer_tell (&srb, rd) != 3000)
+                FAIL ("New reader not at write position");
+        if (ringbuffer_seek (&srb, rd, 1500) == -1)
+                FAIL ("ringbuffer_seek back");
+
+        /* The writer must now leave the reader's data alone */
+        if (ringbuffer_free (&srb) != RB_SIZE - 1500)
+                FAIL ("Seek did not hold back the writer");
+
+        ringbuffer_read (&srb, rd, out, sizeof(out));
+        if (out[0] != 5 || out[299] != 5)
+                FAIL ("Wrong data after seek");
+
+        INFO ("Seeking to data no longer in the buffer fails");
+        ringbuffer_seek (&srb, rd, 3000);
+        for (i = 0; i < 20; i++)
+                ringbuffer_write (&srb, data, sizeof(data));
+        if (ringbuffer_seek (&srb, rd, 0) != -1)
+                FAIL ("Seek to overwritten data");
+        if (ringbuffer_tell (&srb, rd) != ringbuffer_tail (&srb))
+                FAIL ("Failed seek not at write position");
+
+        ringbuffer_close (&srb, rd);
+        free (srb.data);
+        ringbuffer_destroy (&srb);
+}
+
+int
+main (int argc, char * argv[])
+{
+        pthread_t readers[NR_READERS];
+        int rds[NR_READERS];
+        static int reg[NR_REGISTRY];
+        unsigned char chunk[CHUNK_SIZE];
+        uint64_t pos = 0;
+        size_t i, len;
+        int r;
+
+        if (ringbuffer_init (&rb, malloc (RB_SIZE), RB_SIZE) == -1)
+                FAIL ("ringbuffer_init");
+
+        INFO ("Open and close a reader");
+        if ((r = ringbuffer_open (&rb)) == -1)
+                FAIL ("ringbuffer_open");
+        ringbuffer_close (&rb, r);
+
+        INFO ("Free space with no readers");
+        if (ringbuffer_free (&rb) != RB_SIZE)
+                FAIL ("ringbuffer_free");
+
+        INFO ("SlowClient block");
+        test_policy (RINGBUFFER_BLOCK);
+
+        INFO ("SlowClient skip");
+        test_policy (RINGBUFFER_SKIP);
+
+        INFO ("SlowClient drop");
+        test_policy (RINGBUFFER_DROP);
+
+        INFO ("Lossy reader");
+        test_lossy ();
+
+        INFO ("Sync points");
+        test_sync ();
+
+        INFO ("Peek and consume");
+        test_peek ();
+
+        INFO ("Read input into a full buffer");
+        test_readfd ();
+
+        INFO ("Writer waits for room");
+        test_wait_room ();
+
+        INFO ("Watch from many workers");
+        test_watch ();
+
+        INFO ("Open many readers");
+        for (r = 0; r < NR_REGISTRY; r++) {
+                if ((reg[r] = ringbuffer_open (&rb)) == -1)
+                        FAIL ("ringbuffer_open");
+                if (r > 0 && reg[r] == reg[r-1])
+                        FAIL ("Duplicate read descriptor");
+        }
+        if (ringbuffer_free (&rb) != RB_SIZE)
+                FAIL ("ringbuffer_free with idle readers");
+
+        INFO ("Closed slots are reused");
+        for (r = 0; r < NR_REGISTRY; r++) {
+                ringbuffer_close (&rb, reg[r]);
+        }
+        for (r = 0; r < NR_REGISTRY; r++) {
+                if ((reg[r] = ringbuffer_open (&rb)) >= NR_REGISTRY)
+                        FAIL ("Slot not reused");
+        }
+        for (r = 0; r < NR_REGISTRY; r++) {
+                ringbuffer_close (&rb, reg[r]);
+        }
+
+        INFO ("Open all readers");
+        for (r = 0; r < NR_READERS; r++) {
+                if ((rds[r] = ringbuffer_open (&rb)) == -1)
+                        FAIL ("ringbuffer_open");
+        }
+
+        INFO ("Broadcast to all readers");
+        for (r = 0; r < NR_READERS; r++) {
+                pthread_create (&readers[r], NULL, reader_main, &rds[r]);
+        }
+
+        while (pos < TOTAL_BYTES && !failed) {
+                len = CHUNK_SIZE;
+                if (pos + len > TOTAL_BYTES)
+                        len = TOTAL_BYTES - pos;
+
+                /* Wait for the slowest reader to make room */
+                if ((size_t)ringbuffer_free (&rb) < len) {
+                        sched_yield ();
+                        continue;
+                }
+
+                for (i = 0; i < len; i++)
+                        chunk[i] = pattern (pos + i);
+                ringbuffer_write (&rb, chunk, len);
+                pos += len;
+        }
+
+        for (r = 0; r < NR_READERS; r++) {
+                pthread_join (readers[r], NULL);
+        }
+
+        if (failed)
+                FAIL ("Reader saw corrupt data");
+
+        /* The writer refreshes its cached slowest reader once the buffer
+         * is half full */
+        INFO ("All readers closed");
+        memset (chunk, 0, sizeof(chunk));
+        for (i = 0; i <= RB_SIZE / 2; i += CHUNK_SIZE)
+                ringbuffer_write (&rb, chunk, CHUNK_SIZE);
+        if (ringbuffer_free (&rb) != RB_SIZE)
+                FAIL ("ringbuffer_free after close");
+
+        free (rb.data);
+        ringbuffer_destroy (&rb);
+
+        exit (0);
+}
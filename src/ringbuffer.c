@@ -24,247 +24,910 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include "ringbuffer.h"
 
-#define RDOPEN(rbuf,rd) (rbuf->readers & (1<<rd))
+/* Reader slot states */
+#define RD_FREE    0
+#define RD_OPEN    1
+
+#define READER(rbuf,rd) \
+	(&(rbuf)->slabs[(rd) / RINGBUFFER_SLAB_READERS][(rd) % RINGBUFFER_SLAB_READERS])
+
+#define RDOPEN(rbuf,rd) \
+	(atomic_load(&READER(rbuf,rd)->open) == RD_OPEN)
+
+/* Open and not overrun: the writer must not overwrite its data */
+#define RDLIVE(rbuf,rd) \
+	(RDOPEN(rbuf,rd) && !atomic_load(&READER(rbuf,rd)->lagged))
+
+/* The most the writer reads at once. In non-blocking modes the writer also
+ * makes at least this much room per read */
+#define READ_CHUNK(rbuf) ((rbuf)->size / 8)
+
+static inline uint64_t load_pwrite(struct ringbuffer *rbuf)
+{
+	return atomic_load_explicit(&rbuf->pwrite, memory_order_acquire);
+}
+
+static inline uint64_t load_pread(struct ringbuffer *rbuf, int readd)
+{
+	return atomic_load_explicit(&READER(rbuf, readd)->pread, memory_order_acquire);
+}
+
+static void ringbuffer_wake_writer(struct ringbuffer *rbuf, uint64_t old_pread);
+
+static inline void store_pread(struct ringbuffer *rbuf, int readd, uint64_t pread)
+{
+	uint64_t old_pread = load_pread(rbuf, readd);
+
+	atomic_store_explicit(&READER(rbuf, readd)->pread, pread, memory_order_release);
+	if (rbuf->policy == RINGBUFFER_BLOCK)
+		ringbuffer_wake_writer(rbuf, old_pread);
+}
 
 ssize_t ringbuffer_avail(struct ringbuffer *rbuf, int readd)
 {
-	ssize_t avail;
+	return load_pwrite(rbuf) - load_pread(rbuf, readd);
+}
 
-	avail = rbuf->pwrite - rbuf->pread[readd];
-	if (avail < 0)
-		avail += rbuf->size;
-	return avail;
+int ringbuffer_max_readers(struct ringbuffer *rbuf)
+{
+	return atomic_load(&rbuf->nr_slabs) * RINGBUFFER_SLAB_READERS;
 }
 
-static void ringbuffer_update_min(struct ringbuffer *rbuf)
+ssize_t ringbuffer_lag(struct ringbuffer *rbuf, int readd)
 {
-	int i;
-	ssize_t avail, min_avail = -1, min_pread;
+	if (readd < 0 || readd >= ringbuffer_max_readers(rbuf) || !RDOPEN(rbuf, readd))
+		return -1;
 
-        if (rbuf->readers == 0)
-                return;
+	return ringbuffer_avail(rbuf, readd);
+}
 
-	pthread_mutex_lock(&rbuf->mutex);
-	for (i = 0; i < MAX_READERS; i++) {
-		if (RDOPEN(rbuf, i)) {
-			avail = ringbuffer_avail(rbuf, i);
-			if (avail > min_avail) {
-				min_pread = rbuf->pread[i];
-			}
-		}
+/*
+ * Move a reader to the current write position. As in ringbuffer_open(), a
+ * conservative position is published before the writer takes this reader
+ * into account again, and then moved up.
+ */
+static void reader_sync(struct ringbuffer *rbuf, struct ringbuffer_reader *r)
+{
+	atomic_store(&r->pread, atomic_load(&rbuf->pwrite));
+	atomic_store(&r->lagged, 0);
+	atomic_store(&r->pread, atomic_load(&rbuf->pwrite));
+}
+
+/* Lower the writer's cached min_pread to seq */
+static void lower_min(struct ringbuffer *rbuf, uint64_t seq)
+{
+	uint64_t cur = atomic_load(&rbuf->min_pread);
+
+	while (cur > seq && !atomic_compare_exchange_weak(&rbuf->min_pread, &cur, seq))
+		;
+}
+
+uint64_t ringbuffer_tell(struct ringbuffer *rbuf, int readd)
+{
+	return load_pread(rbuf, readd);
+}
+
+uint64_t ringbuffer_tail(struct ringbuffer *rbuf)
+{
+	return load_pwrite(rbuf);
+}
+
+int ringbuffer_lagged(struct ringbuffer *rbuf, int readd)
+{
+	return atomic_load_explicit(&READER(rbuf, readd)->lagged, memory_order_acquire);
+}
+
+int ringbuffer_seek(struct ringbuffer *rbuf, int readd, uint64_t seq)
+{
+	struct ringbuffer_reader *r = READER(rbuf, readd);
+	uint64_t pwrite = load_pwrite(rbuf);
+
+	if (seq > pwrite)
+		seq = pwrite;
+
+	/* Moving forward never gets in the writer's way */
+	if (!atomic_load(&r->lagged) && seq >= load_pread(rbuf, readd)) {
+		store_pread(rbuf, readd, seq);
+		return 0;
+	}
+
+	/* Moving back, or rejoining after being overrun: make sure the
+	 * writer accounts for this position before relying on its data. A
+	 * write that began before min_pread was lowered reaches at most
+	 * READ_CHUNK beyond the current write position. */
+	atomic_store(&r->pread, seq);
+	atomic_store(&r->lagged, 0);
+	lower_min(rbuf, seq);
+
+	if (atomic_load(&rbuf->pwrite) + READ_CHUNK(rbuf) > seq + rbuf->size) {
+		reader_sync(rbuf, r);
+		return -1;
+	}
+
+	return 0;
+}
+
+void ringbuffer_mark_sync(struct ringbuffer *rbuf, uint64_t seq)
+{
+	uint64_t n = atomic_load_explicit(&rbuf->nr_syncs, memory_order_relaxed);
+
+	atomic_store_explicit(&rbuf->sync_seq[n % RINGBUFFER_SYNC_POINTS], seq,
+			      memory_order_release);
+	atomic_store_explicit(&rbuf->nr_syncs, n + 1, memory_order_release);
+}
+
+/* Whether the data at seq can still be read */
+static int seq_in_buffer(struct ringbuffer *rbuf, uint64_t seq)
+{
+	return load_pwrite(rbuf) + READ_CHUNK(rbuf) <= seq + rbuf->size;
+}
+
+int ringbuffer_sync_latest(struct ringbuffer *rbuf, uint64_t *id, uint64_t *seq)
+{
+	uint64_t nr, s;
+
+	do {
+		nr = atomic_load_explicit(&rbuf->nr_syncs, memory_order_acquire);
+		if (nr == 0)
+			return -1;
+		s = atomic_load_explicit(&rbuf->sync_seq[(nr - 1) % RINGBUFFER_SYNC_POINTS],
+					 memory_order_acquire);
+	} while (atomic_load(&rbuf->nr_syncs) - (nr - 1) > RINGBUFFER_SYNC_POINTS);
+
+	if (!seq_in_buffer(rbuf, s))
+		return -1;
+
+	*id = nr - 1;
+	*seq = s;
+
+	return 0;
+}
+
+int ringbuffer_sync_next(struct ringbuffer *rbuf, uint64_t after, uint64_t *id, uint64_t *seq)
+{
+	uint64_t nr, k, s, found_id = 0, found_seq = 0;
+	int found = 0;
+
+	nr = atomic_load_explicit(&rbuf->nr_syncs, memory_order_acquire);
+
+	/* Walk back from the most recent sync point */
+	for (k = nr; k > 0 && nr - k < RINGBUFFER_SYNC_POINTS; k--) {
+		s = atomic_load_explicit(&rbuf->sync_seq[(k - 1) % RINGBUFFER_SYNC_POINTS],
+					 memory_order_acquire);
+		if (s <= after)
+			break;
+		found = 1;
+		found_id = k - 1;
+		found_seq = s;
 	}
-	rbuf->min_pread = min_pread;
-	pthread_mutex_unlock(&rbuf->mutex);
+
+	/* The oldest entries may have been reused while we looked */
+	if (!found || atomic_load(&rbuf->nr_syncs) - found_id > RINGBUFFER_SYNC_POINTS)
+		return -1;
+
+	if (!seq_in_buffer(rbuf, found_seq))
+		return -1;
+
+	*id = found_id;
+	*seq = found_seq;
+
+	return 0;
+}
+
+int ringbuffer_sync_get(struct ringbuffer *rbuf, uint64_t id, uint64_t *seq)
+{
+	uint64_t nr = atomic_load_explicit(&rbuf->nr_syncs, memory_order_acquire);
+	uint64_t s;
+
+	if (id >= nr || nr - id > RINGBUFFER_SYNC_POINTS)
+		return -1;
+
+	s = atomic_load_explicit(&rbuf->sync_seq[id % RINGBUFFER_SYNC_POINTS],
+				 memory_order_acquire);
+
+	/* The entry may have been reused while we looked */
+	if (atomic_load(&rbuf->nr_syncs) - id > RINGBUFFER_SYNC_POINTS)
+		return -1;
+
+	*seq = s;
+
+	return 0;
+}
+
+/* Apply the slow reader policy if the writer overran readd. Returns 0 if
+ * nothing happened, 1 if the reader skipped ahead, or -1 if it is dropped.
+ * Lossy readers deal with being overrun themselves */
+static int reader_catch_up(struct ringbuffer *rbuf, int readd)
+{
+	struct ringbuffer_reader *r = READER(rbuf, readd);
+	uint64_t id, seq;
+
+	if (!atomic_load_explicit(&r->lagged, memory_order_acquire) ||
+	    atomic_load(&r->lossy))
+		return 0;
+
+	if (rbuf->policy == RINGBUFFER_DROP) {
+		atomic_fetch_add(&rbuf->nr_dropped, 1);
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (ringbuffer_sync_latest(rbuf, &id, &seq) == -1 ||
+	    ringbuffer_seek(rbuf, readd, seq) == -1)
+		reader_sync(rbuf, r);
+	atomic_fetch_add(&rbuf->nr_skipped, 1);
+
+	return 1;
 }
 
 void ringbuffer_reset(struct ringbuffer *rbuf)
 {
-	int i;
+	int i, nr_readers;
 
-	for (i = 0; i < MAX_READERS; i++) {
-		rbuf->pread[i] = 0;
+	nr_readers = atomic_load(&rbuf->nr_slabs) * RINGBUFFER_SLAB_READERS;
+	for (i = 0; i < nr_readers; i++) {
+		atomic_store(&READER(rbuf, i)->pread, 0);
 	}
-        rbuf->pwrite = 0;
+	atomic_store(&rbuf->pwrite, 0);
 
-	pthread_mutex_lock(&rbuf->mutex);
-	rbuf->min_pread = 0;
-	pthread_mutex_unlock(&rbuf->mutex);
+	atomic_store(&rbuf->min_pread, 0);
+	rbuf->min_readd = -1;
+	atomic_store(&rbuf->nr_syncs, 0);
 }
 
-void ringbuffer_init(struct ringbuffer *rbuf, void *data, size_t len)
+/* Add a slab of reader slots and put them on the free list. Call with
+ * readers_mutex held */
+static int ringbuffer_add_slab(struct ringbuffer *rbuf)
 {
-	int i;
+	struct ringbuffer_reader *slab;
+	void *mem;
+	int i, n, base;
 
-	memset(data, 0, len);
+	n = atomic_load_explicit(&rbuf->nr_slabs, memory_order_relaxed);
+	if (n == RINGBUFFER_MAX_SLABS)
+		return -1;
+
+	if (posix_memalign(&mem, RINGBUFFER_CACHELINE,
+			   RINGBUFFER_SLAB_READERS * sizeof(struct ringbuffer_reader)) != 0)
+		return -1;
+	slab = mem;
+
+	base = n * RINGBUFFER_SLAB_READERS;
+	for (i = 0; i < RINGBUFFER_SLAB_READERS; i++) {
+		atomic_init(&slab[i].pread, 0);
+		atomic_init(&slab[i].open, RD_FREE);
+		atomic_init(&slab[i].lagged, 0);
+		atomic_init(&slab[i].lossy, 0);
+		slab[i].next_free = (i + 1 < RINGBUFFER_SLAB_READERS) ? base + i + 1 : rbuf->free_readd;
+	}
+	rbuf->free_readd = base;
+
+	rbuf->slabs[n] = slab;
+	atomic_store_explicit(&rbuf->nr_slabs, n + 1, memory_order_release);
+
+	return 0;
+}
+
+int ringbuffer_init(struct ringbuffer *rbuf, void *data, size_t len)
+{
+	int i;
 
-	rbuf->readers = 0;
 	rbuf->data = data;
 	rbuf->size = len;
+	rbuf->policy = RINGBUFFER_BLOCK;
+
+	atomic_init(&rbuf->nr_skipped, 0);
+	atomic_init(&rbuf->nr_dropped, 0);
+	atomic_init(&rbuf->nr_lossy, 0);
+
+	atomic_init(&rbuf->pwrite, 0);
+	atomic_init(&rbuf->min_pread, 0);
+	rbuf->min_readd = -1;
+
+	for (i = 0; i < RINGBUFFER_SYNC_POINTS; i++)
+		atomic_init(&rbuf->sync_seq[i], 0);
+	atomic_init(&rbuf->nr_syncs, 0);
 
-	pthread_mutex_init(&rbuf->mutex, NULL);
-#if 0
+	atomic_init(&rbuf->nr_slabs, 0);
+	rbuf->free_readd = -1;
+	pthread_mutex_init(&rbuf->readers_mutex, NULL);
+
+	pthread_mutex_init(&rbuf->notify_mutex, NULL);
 	pthread_cond_init(&rbuf->cond, NULL);
-#endif
+	atomic_init(&rbuf->nr_waiters, 0);
+	pthread_cond_init(&rbuf->room_cond, NULL);
+	atomic_init(&rbuf->writer_waiting, 0);
+	rbuf->nr_watches = 0;
+	atomic_init(&rbuf->nr_watch_slabs, 0);
+
+	if (ringbuffer_add_slab(rbuf) == -1) {
+		ringbuffer_destroy(rbuf);
+		return -1;
+	}
+
+	return 0;
+}
+
+void ringbuffer_destroy(struct ringbuffer *rbuf)
+{
+	int i, nr_slabs;
+
+	nr_slabs = atomic_load(&rbuf->nr_slabs);
+	for (i = 0; i < nr_slabs; i++) {
+		free(rbuf->slabs[i]);
+		rbuf->slabs[i] = NULL;
+	}
+	atomic_store(&rbuf->nr_slabs, 0);
+
+	nr_slabs = atomic_load(&rbuf->nr_watch_slabs);
+	for (i = 0; i < nr_slabs; i++) {
+		free(rbuf->watch_slabs[i]);
+		rbuf->watch_slabs[i] = NULL;
+	}
+	atomic_store(&rbuf->nr_watch_slabs, 0);
 
-	ringbuffer_reset(rbuf);
+	pthread_cond_destroy(&rbuf->room_cond);
+	pthread_cond_destroy(&rbuf->cond);
+	pthread_mutex_destroy(&rbuf->notify_mutex);
+	pthread_mutex_destroy(&rbuf->readers_mutex);
+}
 
+void ringbuffer_set_policy(struct ringbuffer *rbuf, enum ringbuffer_policy policy)
+{
+	rbuf->policy = policy;
 }
 
 /* Returns a read descriptor */
 int ringbuffer_open(struct ringbuffer *rbuf)
 {
-	int i, r;
+	struct ringbuffer_reader *r;
+	int readd;
 
-	for (i = 0; i < MAX_READERS; i++) {
-		r = 1 << i;
-		if (!(rbuf->readers & r)) {
-			rbuf->readers |= r;
-			rbuf->pread[i] = rbuf->pwrite;
-			return i;
-		}
+	pthread_mutex_lock(&rbuf->readers_mutex);
+	if (rbuf->free_readd == -1 && ringbuffer_add_slab(rbuf) == -1) {
+		pthread_mutex_unlock(&rbuf->readers_mutex);
+		return -1;
+	}
+	readd = rbuf->free_readd;
+	r = READER(rbuf, readd);
+	rbuf->free_readd = r->next_free;
+	pthread_mutex_unlock(&rbuf->readers_mutex);
+
+	/* Publish a conservative position before the writer can see this
+	 * reader, then move up to the current write position. Any data the
+	 * writer reclaimed before it noticed us lies behind that position. */
+	atomic_store(&r->pread, atomic_load(&rbuf->pwrite));
+	atomic_store(&r->lagged, 0);
+	atomic_store(&r->open, RD_OPEN);
+	atomic_store(&r->pread, atomic_load(&rbuf->pwrite));
+
+	return readd;
+}
+
+int ringbuffer_open_lossy(struct ringbuffer *rbuf)
+{
+	int readd;
+
+	if ((readd = ringbuffer_open(rbuf)) != -1) {
+		atomic_store(&READER(rbuf, readd)->lossy, 1);
+		atomic_fetch_add(&rbuf->nr_lossy, 1);
 	}
 
-	return -1;
+	return readd;
 }
 
 /* Close a read descriptor */
 void ringbuffer_close(struct ringbuffer *rbuf, int readd)
 {
-	if (readd >= MAX_READERS)
+	struct ringbuffer_reader *r;
+
+	if (readd < 0 || readd >= atomic_load(&rbuf->nr_slabs) * RINGBUFFER_SLAB_READERS)
 		return;
 
-	rbuf->readers ^= (1 << readd);
-	ringbuffer_update_min(rbuf);
+	r = READER(rbuf, readd);
+	if (atomic_exchange(&r->lossy, 0))
+		atomic_fetch_sub(&rbuf->nr_lossy, 1);
+	atomic_store_explicit(&r->open, RD_FREE, memory_order_release);
+
+	/* The writer may have been waiting for this reader */
+	if (rbuf->policy == RINGBUFFER_BLOCK)
+		ringbuffer_wake_writer(rbuf, 0);
 
-	return;
+	pthread_mutex_lock(&rbuf->readers_mutex);
+	r->next_free = rbuf->free_readd;
+	rbuf->free_readd = readd;
+	pthread_mutex_unlock(&rbuf->readers_mutex);
 }
 
+#define WATCH(rbuf,i) \
+	(&(rbuf)->watch_slabs[(i) / RINGBUFFER_SLAB_WATCHES][(i) % RINGBUFFER_SLAB_WATCHES])
 
-int ringbuffer_empty(struct ringbuffer *rbuf, int readd)
+void ringbuffer_signal(struct ringbuffer *rbuf)
 {
-	return (rbuf->pread[readd] == rbuf->pwrite);
+	uint64_t one = 1;
+	int i, n, fd;
+
+	/* A waiter counts itself before it looks for data, and the data was
+	 * published before the count is read here; so a waiter that is not
+	 * counted yet will find the data without being woken */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&rbuf->nr_waiters) > 0) {
+		pthread_mutex_lock(&rbuf->notify_mutex);
+		pthread_cond_broadcast(&rbuf->cond);
+		pthread_mutex_unlock(&rbuf->notify_mutex);
+	}
+
+	n = atomic_load_explicit(&rbuf->nr_watch_slabs, memory_order_acquire) *
+		RINGBUFFER_SLAB_WATCHES;
+	for (i = 0; i < n; i++) {
+		if ((fd = atomic_load_explicit(&WATCH(rbuf, i)->fd, memory_order_acquire)) < 0)
+			continue;
+		/* A full counter already guarantees a wakeup, so a failed
+		 * write can be ignored */
+		if (write(fd, &one, sizeof(one)) == -1)
+			continue;
+	}
 }
 
+static void ringbuffer_deadline(struct timespec *abstime, int timeout_ms)
+{
+	clock_gettime(CLOCK_REALTIME, abstime);
+	abstime->tv_sec += timeout_ms / 1000;
+	abstime->tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (abstime->tv_nsec >= 1000000000L) {
+		abstime->tv_sec++;
+		abstime->tv_nsec -= 1000000000L;
+	}
+}
 
+ssize_t ringbuffer_wait(struct ringbuffer *rbuf, int readd, int timeout_ms)
+{
+	struct timespec abstime;
+	ssize_t avail;
 
-ssize_t ringbuffer_free(struct ringbuffer * rbuf)
+	if (timeout_ms >= 0)
+		ringbuffer_deadline(&abstime, timeout_ms);
+
+	pthread_mutex_lock(&rbuf->notify_mutex);
+	atomic_fetch_add(&rbuf->nr_waiters, 1);
+	while ((avail = ringbuffer_avail(rbuf, readd)) == 0) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&rbuf->cond, &rbuf->notify_mutex);
+		} else if (pthread_cond_timedwait(&rbuf->cond, &rbuf->notify_mutex,
+						  &abstime) == ETIMEDOUT) {
+			break;
+		}
+	}
+	atomic_fetch_sub(&rbuf->nr_waiters, 1);
+	pthread_mutex_unlock(&rbuf->notify_mutex);
+
+	return avail;
+}
+
+/*
+ * Wake the writer if it is waiting for room and the reader that was at
+ * old_pread may have been the slowest. The writer publishes writer_waiting
+ * before it looks at the readers' positions, and readers publish their
+ * position before they look at writer_waiting, so one of them always sees
+ * the other.
+ */
+static void ringbuffer_wake_writer(struct ringbuffer *rbuf, uint64_t old_pread)
 {
-	ssize_t free;
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(&rbuf->writer_waiting, memory_order_relaxed) ||
+	    old_pread > atomic_load(&rbuf->min_pread))
+		return;
 
-        if (rbuf->readers == 0) {
-                free = rbuf->size;
-        } else {
-	        free = rbuf->min_pread - rbuf->pwrite;
-	        if (free <= 0)
-		free += rbuf->size;
-        }
-	return free - 1;
+	pthread_mutex_lock(&rbuf->notify_mutex);
+	pthread_cond_signal(&rbuf->room_cond);
+	pthread_mutex_unlock(&rbuf->notify_mutex);
 }
 
-void ringbuffer_flush(struct ringbuffer *rbuf, int readd)
+size_t ringbuffer_wait_room(struct ringbuffer *rbuf, size_t len, int timeout_ms)
 {
-	rbuf->pread[readd] = rbuf->pwrite;
-	ringbuffer_update_min(rbuf);
+	struct timespec abstime;
+	size_t free;
+
+	if ((free = ringbuffer_make_room(rbuf, len)) >= len)
+		return free;
+
+	if (timeout_ms >= 0)
+		ringbuffer_deadline(&abstime, timeout_ms);
+
+	pthread_mutex_lock(&rbuf->notify_mutex);
+	atomic_store(&rbuf->writer_waiting, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	while ((free = ringbuffer_make_room(rbuf, len)) < len) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&rbuf->room_cond, &rbuf->notify_mutex);
+		} else if (pthread_cond_timedwait(&rbuf->room_cond, &rbuf->notify_mutex,
+						  &abstime) == ETIMEDOUT) {
+			break;
+		}
+	}
+	atomic_store(&rbuf->writer_waiting, 0);
+	pthread_mutex_unlock(&rbuf->notify_mutex);
+
+	return free;
 }
 
-ssize_t ringbuffer_writefd(int fd, struct ringbuffer *rbuf, int readd)
+/* Add a slab of free watch slots. Call with notify_mutex held */
+static int ringbuffer_add_watch_slab(struct ringbuffer *rbuf)
 {
-	size_t todo, len;
-	size_t split, n, nwritten=0;
+	struct ringbuffer_watch *slab;
+	int i, n;
 
-	todo = len = ringbuffer_avail(rbuf, readd);
-        if (len == 0)
-                return 0;
+	n = atomic_load_explicit(&rbuf->nr_watch_slabs, memory_order_relaxed);
+	if (n == RINGBUFFER_MAX_WATCH_SLABS)
+		return -1;
 
-	split =
-	    (rbuf->pread[readd] + len >
-	     rbuf->size) ? rbuf->size - rbuf->pread[readd] : 0;
-	if (split > 0) {
-		n = write(fd, rbuf->data + rbuf->pread[readd], split);
-		if (n == -1) {
-			return -1;
-		} else if (n > 0) {
-			todo -= n;
-                        nwritten += n;
-			rbuf->pread[readd] =
-			    (rbuf->pread[readd] + n) % rbuf->size;
-		}
+	if ((slab = malloc(RINGBUFFER_SLAB_WATCHES * sizeof(*slab))) == NULL)
+		return -1;
+
+	for (i = 0; i < RINGBUFFER_SLAB_WATCHES; i++) {
+		atomic_init(&slab[i].fd, -1);
+		slab[i].refcount = 0;
 	}
 
-        if (split == 0 || nwritten == split) {
-		n = write(fd, rbuf->data + rbuf->pread[readd], todo);
-		if (n == -1) {
-			return -1;
-		} else if (n > 0) {
-               		nwritten += n;
-			rbuf->pread[readd] = (rbuf->pread[readd] + n) % rbuf->size;
+	rbuf->watch_slabs[n] = slab;
+	atomic_store_explicit(&rbuf->nr_watch_slabs, n + 1, memory_order_release);
+
+	return 0;
+}
+
+/* The slot watching fd, or NULL. Call with notify_mutex held */
+static struct ringbuffer_watch *ringbuffer_find_watch(struct ringbuffer *rbuf, int fd)
+{
+	int i, n;
+
+	n = atomic_load_explicit(&rbuf->nr_watch_slabs, memory_order_relaxed) *
+		RINGBUFFER_SLAB_WATCHES;
+	for (i = 0; i < n; i++) {
+		if (atomic_load_explicit(&WATCH(rbuf, i)->fd, memory_order_relaxed) == fd)
+			return WATCH(rbuf, i);
+	}
+
+	return NULL;
+}
+
+int ringbuffer_watch(struct ringbuffer *rbuf, int fd)
+{
+	struct ringbuffer_watch *w;
+	int n, ret = 0;
+
+	pthread_mutex_lock(&rbuf->notify_mutex);
+	if ((w = ringbuffer_find_watch(rbuf, fd)) != NULL) {
+		w->refcount++;
+		goto done;
+	}
+
+	if ((w = ringbuffer_find_watch(rbuf, -1)) == NULL) {
+		n = atomic_load_explicit(&rbuf->nr_watch_slabs, memory_order_relaxed);
+		if (ringbuffer_add_watch_slab(rbuf) == -1) {
+			ret = -1;
+			goto done;
 		}
-        }
+		w = &rbuf->watch_slabs[n][0];
+	}
 
-	ringbuffer_update_min(rbuf);
+	w->refcount = 1;
+	atomic_store_explicit(&w->fd, fd, memory_order_release);
+	rbuf->nr_watches++;
 
-	return nwritten;
+done:
+	pthread_mutex_unlock(&rbuf->notify_mutex);
+	return ret;
 }
 
-ssize_t ringbuffer_readfd(int fd, struct ringbuffer * rbuf)
+void ringbuffer_unwatch(struct ringbuffer *rbuf, int fd)
+{
+	struct ringbuffer_watch *w;
+
+	pthread_mutex_lock(&rbuf->notify_mutex);
+	if ((w = ringbuffer_find_watch(rbuf, fd)) != NULL && --w->refcount == 0) {
+		atomic_store_explicit(&w->fd, -1, memory_order_release);
+		rbuf->nr_watches--;
+	}
+	pthread_mutex_unlock(&rbuf->notify_mutex);
+}
+
+int ringbuffer_empty(struct ringbuffer *rbuf, int readd)
 {
-	size_t todo, len;
-	size_t split, n, nread=0;
+	return (load_pread(rbuf, readd) == load_pwrite(rbuf));
+}
 
-	todo = len = ringbuffer_free(rbuf);
-	split =
-	    (rbuf->pwrite + len >
-	     rbuf->size) ? rbuf->size - rbuf->pwrite : 0;
+/* Find the slowest reader that has not been overrun. Only the writer may
+ * call this */
+static void ringbuffer_scan_min(struct ringbuffer *rbuf, uint64_t pwrite)
+{
+	uint64_t pread, min_pread = pwrite, before, cur;
+	int i, nr_readers, min_readd = -1;
 
-	if (split > 0) {
-		n = read(fd, rbuf->data + rbuf->pwrite, split);
-		if (n == -1) {
-			return -1;
-		} else if (n > 0) {
-			todo -= n;
-                        nread = n;
-			rbuf->pwrite = (rbuf->pwrite + n) % rbuf->size;
+	before = atomic_load(&rbuf->min_pread);
+
+	nr_readers = atomic_load_explicit(&rbuf->nr_slabs, memory_order_acquire)
+		* RINGBUFFER_SLAB_READERS;
+
+	for (i = 0; i < nr_readers; i++) {
+		if (RDLIVE(rbuf, i)) {
+			pread = load_pread(rbuf, i);
+			if (pread < min_pread) {
+				min_pread = pread;
+				min_readd = i;
+			}
 		}
 	}
 
-	n = read(fd, rbuf->data + rbuf->pwrite, todo);
-	if (n == -1) {
+	/* Don't undo a reader lowering min_pread while we scanned */
+	cur = before;
+	while (!atomic_compare_exchange_weak(&rbuf->min_pread, &cur,
+					     (cur == before || min_pread < cur) ? min_pread : cur))
+		;
+	rbuf->min_readd = (cur == before || min_pread < cur) ? min_readd : -1;
+}
+
+/* Only the writer may call this */
+ssize_t ringbuffer_free(struct ringbuffer * rbuf)
+{
+	uint64_t pwrite, min_pread;
+	size_t used;
+	int rd;
+
+	pwrite = atomic_load_explicit(&rbuf->pwrite, memory_order_relaxed);
+	min_pread = atomic_load(&rbuf->min_pread);
+	used = pwrite - min_pread;
+
+	/* Plenty of room, or the slowest reader has not moved: either way
+	 * the cached value is as good as a scan */
+	if (used <= rbuf->size / 2)
+		return rbuf->size - used;
+
+	rd = rbuf->min_readd;
+	if (rd != -1 && RDLIVE(rbuf, rd) && load_pread(rbuf, rd) == min_pread)
+		return (used < rbuf->size) ? rbuf->size - used : 0;
+
+	ringbuffer_scan_min(rbuf, pwrite);
+
+	/* A reader that skipped ahead while the writer lapped it again can be
+	 * more than a buffer behind; ringbuffer_make_room() will catch it */
+	used = pwrite - atomic_load(&rbuf->min_pread);
+	return (used < rbuf->size) ? rbuf->size - used : 0;
+}
+
+/*
+ * Ensure there are len bytes free, by marking any readers that would be
+ * overrun as lagged unless the policy is to block; lossy readers are
+ * overrun under any policy. Returns the number of bytes free.
+ */
+size_t ringbuffer_make_room(struct ringbuffer *rbuf, size_t len)
+{
+	struct ringbuffer_reader *r;
+	uint64_t pwrite, limit;
+	size_t free, used;
+	int i, nr_readers, overran = 0;
+
+	free = ringbuffer_free(rbuf);
+	if (free >= len ||
+	    (rbuf->policy == RINGBUFFER_BLOCK && atomic_load(&rbuf->nr_lossy) == 0))
+		return free;
+
+	if (len > rbuf->size)
+		len = rbuf->size;
+
+	/* Readers before limit would have unread data overwritten */
+	pwrite = atomic_load_explicit(&rbuf->pwrite, memory_order_relaxed);
+	limit = pwrite + len - rbuf->size;
+
+	nr_readers = ringbuffer_max_readers(rbuf);
+	for (i = 0; i < nr_readers; i++) {
+		r = READER(rbuf, i);
+		if (RDLIVE(rbuf, i) && load_pread(rbuf, i) < limit &&
+		    (rbuf->policy != RINGBUFFER_BLOCK || atomic_load(&r->lossy))) {
+			atomic_store(&r->lagged, 1);
+			overran = 1;
+		}
+	}
+
+	/* Only lossy readers can be overrun under the block policy */
+	if (!overran && rbuf->policy == RINGBUFFER_BLOCK)
+		return free;
+
+	ringbuffer_scan_min(rbuf, pwrite);
+
+	used = pwrite - atomic_load(&rbuf->min_pread);
+	return (used < rbuf->size) ? rbuf->size - used : 0;
+}
+
+void ringbuffer_flush(struct ringbuffer *rbuf, int readd)
+{
+	store_pread(rbuf, readd, load_pwrite(rbuf));
+}
+
+ssize_t ringbuffer_writefd(int fd, struct ringbuffer *rbuf, int readd)
+{
+	return ringbuffer_writefd_max(fd, rbuf, readd, rbuf->size);
+}
+
+int ringbuffer_peek(struct ringbuffer *rbuf, int readd, size_t max, struct iovec *iov)
+{
+	uint64_t pread, pwrite;
+	size_t len, off, split;
+	int ret;
+
+	if ((ret = reader_catch_up(rbuf, readd)) != 0)
+		return (ret == -1) ? -1 : 0;
+
+	pread = load_pread(rbuf, readd);
+	pwrite = load_pwrite(rbuf);
+
+	len = pwrite - pread;
+	if (len == 0)
+		return 0;
+
+	/* An unchecked ringbuffer_write() has lapped this reader; the data it
+	 * was waiting for is gone, so resume from the oldest intact data */
+	if (len > rbuf->size) {
+		pread = pwrite - rbuf->size;
+		store_pread(rbuf, readd, pread);
+		len = rbuf->size;
+	}
+	if (len > max)
+		len = max;
+
+	off = pread % rbuf->size;
+	split = (off + len > rbuf->size) ? rbuf->size - off : len;
+
+	iov[0].iov_base = rbuf->data + off;
+	iov[0].iov_len = split;
+	if (split == len)
+		return 1;
+
+	iov[1].iov_base = rbuf->data;
+	iov[1].iov_len = len - split;
+	return 2;
+}
+
+void ringbuffer_consume(struct ringbuffer *rbuf, int readd, size_t len)
+{
+	store_pread(rbuf, readd, load_pread(rbuf, readd) + len);
+}
+
+ssize_t ringbuffer_writefd_max(int fd, struct ringbuffer *rbuf, int readd, size_t max)
+{
+	struct iovec iov[2];
+	ssize_t n;
+	int cnt;
+
+	if ((cnt = ringbuffer_peek(rbuf, readd, max, iov)) <= 0)
+		return cnt;
+
+	/* Both sides of the wrap go out in one call */
+	if ((n = writev(fd, iov, cnt)) > 0)
+		ringbuffer_consume(rbuf, readd, n);
+
+	return n;
+}
+
+ssize_t ringbuffer_readfd(int fd, struct ringbuffer * rbuf)
+{
+	return ringbuffer_readfd_max(fd, rbuf, rbuf->size);
+}
+
+ssize_t ringbuffer_readfd_max(int fd, struct ringbuffer * rbuf, size_t max)
+{
+	uint64_t pwrite;
+	size_t len, off, want;
+	ssize_t n;
+
+	if (max > READ_CHUNK(rbuf))
+		max = READ_CHUNK(rbuf);
+	want = max;
+
+	len = ringbuffer_free(rbuf);
+	if (len < want)
+		len = ringbuffer_make_room(rbuf, want);
+	if (len > max)
+		len = max;
+	if (len == 0) {
+		/* Full; 0 is kept for the end of the input */
+		errno = EAGAIN;
 		return -1;
-	} else if (n > 0) {
-                nread += n;
-		rbuf->pwrite = (rbuf->pwrite + n) % rbuf->size;
 	}
 
-	return nread;
+	/* Read only into contiguous space; the next call picks up the rest */
+	pwrite = atomic_load_explicit(&rbuf->pwrite, memory_order_relaxed);
+	off = pwrite % rbuf->size;
+	if (off + len > rbuf->size)
+		len = rbuf->size - off;
+
+	n = read(fd, rbuf->data + off, len);
+	if (n > 0) {
+		atomic_store_explicit(&rbuf->pwrite, pwrite + n, memory_order_release);
+		ringbuffer_signal(rbuf);
+	}
+
+	return n;
 }
 
 ssize_t ringbuffer_read(struct ringbuffer * rbuf, int readd,
 			unsigned char *buf, size_t len)
 {
-	size_t todo = len;
+	uint64_t pread;
+	size_t off, todo = len;
 	size_t split;
+	int ret;
+
+	if ((ret = reader_catch_up(rbuf, readd)) != 0)
+		return (ret == -1) ? -1 : 0;
 
-	split =
-	    (rbuf->pread[readd] + len >
-	     rbuf->size) ? rbuf->size - rbuf->pread[readd] : 0;
+	pread = load_pread(rbuf, readd);
+	off = pread % rbuf->size;
+
+	split = (off + len > rbuf->size) ? rbuf->size - off : 0;
 	if (split > 0) {
-		memcpy(buf, rbuf->data + rbuf->pread[readd], split);
+		memcpy(buf, rbuf->data + off, split);
 		buf += split;
 		todo -= split;
-		rbuf->pread[readd] = 0;
+		off = 0;
 	}
-	memcpy(buf, rbuf->data + rbuf->pread[readd], todo);
-
-	rbuf->pread[readd] = (rbuf->pread[readd] + todo) % rbuf->size;
+	memcpy(buf, rbuf->data + off, todo);
 
-	ringbuffer_update_min(rbuf);
+	store_pread(rbuf, readd, pread + len);
 
 	return len;
 }
 
-ssize_t ringbuffer_write(struct ringbuffer * rbuf,
-			 const unsigned char *buf, size_t len)
+static void ringbuffer_write_chunk(struct ringbuffer * rbuf,
+				   const unsigned char *buf, size_t len)
 {
-	size_t todo = len;
+	uint64_t pwrite;
+	size_t off, todo = len;
 	size_t split;
 
-	split =
-	    (rbuf->pwrite + len >
-	     rbuf->size) ? rbuf->size - rbuf->pwrite : 0;
+	if (rbuf->policy != RINGBUFFER_BLOCK || atomic_load(&rbuf->nr_lossy) > 0)
+		ringbuffer_make_room(rbuf, len);
+
+	pwrite = atomic_load_explicit(&rbuf->pwrite, memory_order_relaxed);
+	off = pwrite % rbuf->size;
+
+	split = (off + len > rbuf->size) ? rbuf->size - off : 0;
 
 	if (split > 0) {
-		memcpy(rbuf->data + rbuf->pwrite, buf, split);
+		memcpy(rbuf->data + off, buf, split);
 		buf += split;
 		todo -= split;
-		rbuf->pwrite = 0;
+		off = 0;
 	}
-	memcpy(rbuf->data + rbuf->pwrite, buf, todo);
-	rbuf->pwrite = (rbuf->pwrite + todo) % rbuf->size;
+	memcpy(rbuf->data + off, buf, todo);
+
+	atomic_store_explicit(&rbuf->pwrite, pwrite + len, memory_order_release);
+}
+
+ssize_t ringbuffer_write(struct ringbuffer * rbuf,
+			 const unsigned char *buf, size_t len)
+{
+	size_t n, done = 0;
+
+	/* Seeking relies on no single write covering more than READ_CHUNK */
+	while (done < len) {
+		n = len - done;
+		if (n > READ_CHUNK(rbuf))
+			n = READ_CHUNK(rbuf);
+		ringbuffer_write_chunk(rbuf, buf + done, n);
+		done += n;
+	}
+
+	ringbuffer_signal(rbuf);
 
 	return len;
 }
@@ -28,24 +28,133 @@
 #define _RINGBUFFER_H_
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
-//#include <pthread.h>
+/* Reader slots are allocated in slabs of this many as readers open */
+#define RINGBUFFER_SLAB_READERS 64
 
-#define MAX_READERS 16
+/* Maximum number of slabs; this bounds readers per buffer at 65536 */
+#define RINGBUFFER_MAX_SLABS 1024
 
+/* Number of recent sync points remembered */
+#define RINGBUFFER_SYNC_POINTS 256
+
+/* Slots for notification fds watching a buffer, eg. one per worker, are
+ * allocated in slabs of this many as they are needed */
+#define RINGBUFFER_SLAB_WATCHES 16
+
+/* Maximum number of watch slabs; this bounds fds watching a buffer at 1024 */
+#define RINGBUFFER_MAX_WATCH_SLABS 64
+
+/* Cursors are padded to this size so that readers running on different
+ * cores do not share cache lines */
+#define RINGBUFFER_CACHELINE 64
+
+/* What the writer does when a reader has fallen a full buffer behind */
+enum ringbuffer_policy {
+        RINGBUFFER_BLOCK = 0, /* wait for the reader to catch up */
+        RINGBUFFER_SKIP,      /* jump the reader forward to the newest data */
+        RINGBUFFER_DROP       /* fail the reader's next read */
+};
+
+struct ringbuffer_watch {
+        _Atomic int       fd;       /* -1 if the slot is free */
+        int               refcount; /* under notify_mutex */
+};
+
+struct ringbuffer_reader {
+        _Atomic uint64_t  pread;  /* sequence number of the next byte to read */
+        _Atomic int       open;
+        _Atomic int       lagged; /* set by the writer when it overran this reader */
+        _Atomic int       lossy;  /* overrun rather than waited for, whatever the policy */
+        int               next_free; /* free list link, under readers_mutex */
+        char              pad[RINGBUFFER_CACHELINE - sizeof(uint64_t) - 4*sizeof(int)];
+};
+
+/*
+** This is a single-writer, multi-reader broadcast ring. Positions are
+** 64-bit sequence numbers that increase monotonically and are reduced
+** modulo the buffer size only when the data is accessed, so the writer
+** and each reader only ever store to their own cursor:
+**
+**   - pwrite is stored by the writer (release) after data is copied in,
+**     and loaded by readers (acquire) before they copy data out.
+**   - each reader's pread is stored by that reader (release) after data
+**     is copied out, and loaded by the writer (acquire) to find how much
+**     space is free.
+**
+** No locks are taken on the data path. Threads sleeping in
+** ringbuffer_wait() are counted, and the writer only takes notify_mutex to
+** wake them when there are any. Watch slots, like reader slots, live in
+** slabs that are only freed by ringbuffer_destroy(), so the writer signals
+** the watching fds without locking; notify_mutex serialises changes to them.
+**
+** Reader slots live in slabs that are added as more readers open and are
+** only freed by ringbuffer_destroy(), so the writer can walk them without
+** locking. Closed slots go on a free list for reuse by the next open.
+**
+** The writer caches the position of the slowest reader, and which reader
+** that was. Readers only move forward, so the cache is a safe lower bound;
+** it is refreshed by a scan of all slots only when the slowest reader has
+** moved and the cached free space has run low.
+**
+** Under the SKIP and DROP policies the writer never waits for readers.
+** When it needs more room it marks the readers it is about to overrun as
+** lagged and leaves them out of the free space calculation; each lagged
+** reader notices on its next read, and either resumes from the latest
+** sync point (or the current write position if there is none) or fails.
+** Lossy readers are treated this way under every policy, so a reader that
+** must never hold up the others, such as a recorder, can share a buffer
+** with blocking readers.
+**
+** Sync points are positions at which a reader can usefully start, such as
+** the start of a keyframe; the writer marks them as it writes. A reader can
+** seek back to a recent sync point as long as its data is still in the
+** buffer. To do so it lowers the writer's cached min_pread itself, and
+** then checks that the writer cannot have reached that data yet: each
+** write is limited to an eighth of the buffer for this reason.
+*/
 struct ringbuffer {
-	ssize_t           pread[MAX_READERS];
-        ssize_t           min_pread;
-	ssize_t           pwrite;
+        char              pad0[RINGBUFFER_CACHELINE];
+	_Atomic uint64_t  pwrite;
+        _Atomic uint64_t  min_pread; /* cached by the writer, lowered by seeks */
+        int               min_readd; /* reader at min_pread, or -1 */
+        char              pad1[RINGBUFFER_CACHELINE - 2*sizeof(uint64_t) - sizeof(int)];
+
 	unsigned char    *data;
-	ssize_t           size;
+	size_t            size;
+        enum ringbuffer_policy policy;
+
+        _Atomic uint64_t  nr_skipped;
+        _Atomic uint64_t  nr_dropped;
+
+        _Atomic int       nr_lossy; /* open lossy readers */
+
+        /* Sync points, stored by the writer: sync_seq[n % RINGBUFFER_SYNC_POINTS]
+         * holds sync point n, for the last RINGBUFFER_SYNC_POINTS of nr_syncs */
+        _Atomic uint64_t  sync_seq[RINGBUFFER_SYNC_POINTS];
+        _Atomic uint64_t  nr_syncs;
+
+        /* Reader slots; slabs are published by nr_slabs */
+        struct ringbuffer_reader * slabs[RINGBUFFER_MAX_SLABS];
+        _Atomic int       nr_slabs;
 
-        unsigned int      readers; /* bitmask */
+        /* Free list of reader slots, protected by readers_mutex */
+        pthread_mutex_t   readers_mutex;
+        int               free_readd;
 
-        pthread_mutex_t   mutex;
-#if 0
-        pthread_cond_t   *cond;
-#endif
+        /* Notification of new data */
+        pthread_mutex_t   notify_mutex;
+        pthread_cond_t    cond;
+        _Atomic int       nr_waiters; /* threads in ringbuffer_wait() */
+        pthread_cond_t    room_cond;
+        _Atomic int       writer_waiting; /* in ringbuffer_wait_room() */
+        int               nr_watches; /* distinct fds, under notify_mutex */
+        struct ringbuffer_watch * watch_slabs[RINGBUFFER_MAX_WATCH_SLABS];
+        _Atomic int       nr_watch_slabs;
 };
 
 /*
@@ -63,38 +172,139 @@ struct ringbuffer {
 **         ...
 **
 **     *** read min. 1000, max. <bufsize> bytes ***
-**     avail = ringbuffer_avail(rbuf);
+**     avail = ringbuffer_avail(rbuf, readd);
 **     if (avail >= 1000)
-**         count = ringbuffer_read(rbuf, buffer, min(avail, bufsize), 0);
+**         count = ringbuffer_read(rbuf, readd, buffer, min(avail, bufsize));
 **     else
 **         ...
 **
-** (2) If there is exactly one reader and one writer, there is no need
-**     to lock read or write operations.
-**     Two or more readers must be locked against each other.
-**     Flushing the buffer counts as a read operation.
-**     Resetting the buffer counts as a read and write operation.
-**     Two or more writers must be locked against each other.
+** (2) There must be only one writer. Each read descriptor must only be
+**     used by one thread at a time, but different read descriptors may be
+**     used concurrently with each other and with the writer.
+**     Resetting the buffer counts as a read and write operation on all
+**     read descriptors.
 */
 
-/* initialize ring buffer, lock and queue */
-extern void ringbuffer_init(struct ringbuffer *rbuf, void *data, size_t len);
+/* initialize ring buffer, lock and queue. data is only read where it has
+ * been written, so it need not be cleared. Returns -1 on allocation failure */
+extern int ringbuffer_init(struct ringbuffer *rbuf, void *data, size_t len);
 
-/* Returns a read descriptor */
+/* free resources allocated by ringbuffer_init(); data is not freed */
+extern void ringbuffer_destroy(struct ringbuffer *rbuf);
+
+/* Set the slow reader policy; call before any readers are opened */
+extern void ringbuffer_set_policy(struct ringbuffer *rbuf, enum ringbuffer_policy policy);
+
+/* Returns a read descriptor, or -1 if no more can be allocated */
 extern int ringbuffer_open (struct ringbuffer *rbuf);
 
+/* Returns a read descriptor that the writer overruns rather than waits
+ * for, even under the BLOCK policy, or -1. Reads do not skip or fail when
+ * it is overrun: check ringbuffer_lagged() after each read, as data read
+ * meanwhile may have been overwritten, and seek to resume */
+extern int ringbuffer_open_lossy (struct ringbuffer *rbuf);
+
 /* Close a read descriptor */
 extern void ringbuffer_close (struct ringbuffer *rbuf, int readd);
 
+/*
+** Positions
+** ---------
+** Positions are byte offsets from the start of the stream. A reader may
+** seek forward to any position up to the write position, or back to any
+** position whose data is still in the buffer; ringbuffer_seek() returns -1
+** and moves readd to the write position if seq is too old. Seeking clears
+** a reader's lagged state.
+*/
+extern uint64_t ringbuffer_tell(struct ringbuffer *rbuf, int readd);
+extern uint64_t ringbuffer_tail(struct ringbuffer *rbuf);
+extern int ringbuffer_seek(struct ringbuffer *rbuf, int readd, uint64_t seq);
+
+/* Whether the writer has overrun readd under the SKIP or DROP policy, or as
+ * a lossy reader */
+extern int ringbuffer_lagged(struct ringbuffer *rbuf, int readd);
+
+/*
+** Sync points
+** -----------
+** The writer marks positions at which readers can start, in increasing
+** order. Each is identified by its sequence number, which counts up from 0.
+** The lookups return 0 and fill in id and seq, or -1 if there is no such
+** sync point still in the buffer.
+*/
+extern void ringbuffer_mark_sync(struct ringbuffer *rbuf, uint64_t seq);
+
+/* The most recent sync point */
+extern int ringbuffer_sync_latest(struct ringbuffer *rbuf, uint64_t *id, uint64_t *seq);
+
+/* The first sync point after position 'after' */
+extern int ringbuffer_sync_next(struct ringbuffer *rbuf, uint64_t after,
+                                uint64_t *id, uint64_t *seq);
+
+/* Sync point id, if it has been marked and is still remembered; its data
+ * may no longer be in the buffer */
+extern int ringbuffer_sync_get(struct ringbuffer *rbuf, uint64_t id, uint64_t *seq);
+
+/*
+** Notification
+** ------------
+** Writers signal readers whenever new data lands in the buffer. A thread
+** may block in ringbuffer_wait() until data is available for its read
+** descriptor, and an event loop may register an eventfd with
+** ringbuffer_watch(); the writer adds 1 to each watching fd after every
+** write. A fd may be watched several times; it is only removed when it
+** has been unwatched as many times. A write already in progress when a fd
+** is removed may still signal it, so it should stay open for as long as
+** the buffer is written to, as a worker's eventfd does.
+**
+** Under the BLOCK policy a full buffer makes the writer wait instead: it
+** sleeps in ringbuffer_wait_room(), and the slowest reader wakes it when it
+** moves on or closes.
+*/
+
+/* Block until data is available for readd, or timeout_ms elapses (-1 for
+ * no timeout). Returns the number of bytes available */
+extern ssize_t ringbuffer_wait(struct ringbuffer *rbuf, int readd, int timeout_ms);
+
+/* Block until len bytes are free, or timeout_ms elapses (-1 for no
+ * timeout). Returns the number of free bytes, as ringbuffer_make_room().
+ * Only the writer may call this */
+extern size_t ringbuffer_wait_room(struct ringbuffer *rbuf, size_t len, int timeout_ms);
+
+/* Wake all readers waiting on this buffer */
+extern void ringbuffer_signal(struct ringbuffer *rbuf);
+
+/* Register an eventfd to be signalled when data is written. Returns -1 if
+ * out of memory, or if RINGBUFFER_MAX_WATCH_SLABS are full */
+extern int ringbuffer_watch(struct ringbuffer *rbuf, int fd);
+
+/* Remove a registration made by ringbuffer_watch() */
+extern void ringbuffer_unwatch(struct ringbuffer *rbuf, int fd);
+
 /* test whether buffer is empty */
 extern int ringbuffer_empty(struct ringbuffer *rbuf, int readd);
 
 /* return the number of free bytes in the buffer */
 extern ssize_t ringbuffer_free(struct ringbuffer *rbuf);
 
+/* Make len bytes free by overrunning readers as the policy allows, and
+ * return the number of free bytes. Only the writer may call this; the
+ * write functions do so themselves */
+extern size_t ringbuffer_make_room(struct ringbuffer *rbuf, size_t len);
+
 /* return the number of bytes waiting in the buffer */
 extern ssize_t ringbuffer_avail(struct ringbuffer *rbuf, int readd);
 
+/*
+** Monitoring
+** ----------
+** These may be called from any thread. Read descriptors range from 0 to
+** ringbuffer_max_readers() - 1; ringbuffer_lag() returns how many bytes
+** readd is behind the writer, or -1 if it is not open.
+*/
+extern int ringbuffer_max_readers(struct ringbuffer *rbuf);
+extern ssize_t ringbuffer_lag(struct ringbuffer *rbuf, int readd);
+
 
 /*
 ** Reset the read and write pointers to zero and flush the buffer
@@ -103,23 +313,33 @@ extern ssize_t ringbuffer_avail(struct ringbuffer *rbuf, int readd);
 extern void ringbuffer_reset(struct ringbuffer *rbuf);
 
 
-/* read routines & macros */
-/* ---------------------- */
+/* read routines */
+/* ------------- */
 /* flush buffer */
 extern void ringbuffer_flush(struct ringbuffer *rbuf, int readd);
 
-/* peek at byte <offs> in the buffer */
-#define RINGBUFFER_PEEK(rbuf,offs)	\
-			(rbuf)->data[((rbuf)->pread+(offs))%(rbuf)->size]
-
-/* advance read ptr by <num> bytes */
-#define RINGBUFFER_SKIP(rbuf,num)	\
-			(rbuf)->pread=((rbuf)->pread+(num))%(rbuf)->size
-
+/*
+** A reader that was overrun under the SKIP policy is moved to the latest
+** sync point by the next ringbuffer_writefd() or ringbuffer_read(), which
+** then return 0. Under the DROP policy they return -1 with errno ENOBUFS.
+*/
 
 /* Write to a file descriptor, reading from ringbuffer readd */
 ssize_t ringbuffer_writefd(int fd, struct ringbuffer *rbuf, int readd);
 
+/* As ringbuffer_writefd(), writing at most max bytes */
+ssize_t ringbuffer_writefd_max(int fd, struct ringbuffer *rbuf, int readd, size_t max);
+
+/*
+** For writing ring data along with other data in one call: point iov (2
+** entries) at up to max bytes available to readd, without reading them,
+** and return the number of entries used; 0 if there is nothing to read,
+** or -1 if readd was dropped. Then mark what was used as read with
+** ringbuffer_consume().
+*/
+extern int ringbuffer_peek(struct ringbuffer *rbuf, int readd, size_t max, struct iovec *iov);
+extern void ringbuffer_consume(struct ringbuffer *rbuf, int readd, size_t len);
+
 /*
 ** read <len> bytes from ring buffer into <buf>
 ** returns number of bytes transferred or -EFAULT
@@ -128,19 +348,18 @@ extern ssize_t ringbuffer_read(struct ringbuffer *rbuf, int readd,
                                unsigned char *buf, size_t len);
 
 
-/* write routines & macros */
-/* ----------------------- */
-/* write single byte to ring buffer */
-#define RINGBUFFER_WRITE_BYTE(rbuf,byte)	\
-			{ (rbuf)->data[(rbuf)->pwrite]=(byte); \
-			(rbuf)->pwrite=((rbuf)->pwrite+1)%(rbuf)->size; }
-
-/* Read from a file descriptor, writing into the ringbuffer */
+/* write routines */
+/* -------------- */
+/* Read from a file descriptor, writing into the ringbuffer. Returns the
+ * number of bytes read, 0 at the end of the input, or -1 with errno set;
+ * errno is EAGAIN if there is no room until readers catch up */
 ssize_t ringbuffer_readfd(int fd, struct ringbuffer *rbuf);
 
+/* As ringbuffer_readfd(), reading at most max bytes */
+ssize_t ringbuffer_readfd_max(int fd, struct ringbuffer *rbuf, size_t max);
+
 /*
 ** write <len> bytes to ring buffer
-** <usermem> specifies whether <buf> resides in user space
 ** returns number of bytes transferred or -EFAULT
 */
 extern ssize_t ringbuffer_write(struct ringbuffer *rbuf, const unsigned char *buf,
@@ -0,0 +1,87 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "tests.h"
+
+#include "router.h"
+
+static int
+check_prefix (http_request * request, void * data)
+{
+        const char * prefix = (const char *)data;
+
+        return !strncmp (request->path, prefix, strlen (prefix));
+}
+
+static struct resource *
+test_resource (const char * prefix, int routed)
+{
+        struct resource * r;
+
+        r = resource_new (check_prefix, NULL, NULL, NULL, (void *)prefix);
+        if (routed)
+                r->path = prefix;
+
+        return r;
+}
+
+static void
+test_lookup (struct router * router, char * path, struct resource * expected)
+{
+        http_request request;
+
+        INFO (path);
+
+        memset (&request, 0, sizeof(request));
+        request.path = path;
+
+        if (router_lookup (router, &request) != expected)
+                FAIL ("Wrong resource");
+}
+
+int
+main (int argc, char * argv[])
+{
+        struct resource * stream, * stream_hd, * status, * stream_dup, * checked, * root;
+        struct router * router;
+        list_t * resources = NULL;
+
+        /* In list order; the first matching resource should win */
+        stream_hd = test_resource ("/stream-hd", 1);
+        stream = test_resource ("/stream", 1);
+        checked = test_resource ("/status/", 0);
+        status = test_resource ("/status", 1);
+        stream_dup = test_resource ("/stream", 1);
+        root = test_resource ("/", 0);
+
+        resources = list_append (resources, stream_hd);
+        resources = list_append (resources, stream);
+        resources = list_append (resources, checked);
+        resources = list_append (resources, status);
+        resources = list_append (resources, stream_dup);
+        resources = list_append (resources, root);
+
+        if ((router = router_new (resources)) == NULL)
+                FAIL ("router_new");
+
+        INFO ("Looking up request paths:");
+        test_lookup (router, "/stream", stream);
+        test_lookup (router, "/stream.264?fps=2", stream);
+        test_lookup (router, "/stream-hd", stream_hd);
+        test_lookup (router, "/stream-h", stream);
+        test_lookup (router, "/status", status);
+        test_lookup (router, "/status/x", checked);
+        test_lookup (router, "/stat", root);
+        test_lookup (router, "/", root);
+        test_lookup (router, "", NULL);
+
+        router_free (router);
+
+        return 0;
+}
@@ -0,0 +1,164 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <limits.h>
+
+#include "router.h"
+
+struct router_node {
+        unsigned char c;
+        struct router_node * child;   /* first child, in order of c */
+        struct router_node * sibling; /* next child of the same parent */
+
+        /* The earliest resource whose path ends here */
+        struct resource * resource;
+        int order;
+};
+
+/* A resource without a path, checked in list order */
+struct router_check {
+        struct resource * resource;
+        int order;
+};
+
+struct router {
+        struct router_node root;
+
+        struct router_check * checks;
+        int nr_checks;
+};
+
+static struct router_node *
+router_child (struct router_node * node, unsigned char c, int create)
+{
+        struct router_node ** p, * n;
+
+        for (p = &node->child; *p && (*p)->c < c; p = &(*p)->sibling);
+
+        if (*p && (*p)->c == c)
+                return *p;
+
+        if (!create || (n = calloc (1, sizeof(*n))) == NULL)
+                return NULL;
+
+        n->c = c;
+        n->sibling = *p;
+        *p = n;
+
+        return n;
+}
+
+static int
+router_insert (struct router * router, struct resource * r, int order)
+{
+        struct router_node * node = &router->root;
+        const unsigned char * s;
+
+        for (s = (const unsigned char *)r->path; *s; s++) {
+                if ((node = router_child (node, *s, 1)) == NULL)
+                        return -1;
+        }
+
+        /* Keep the first of several resources with the same path */
+        if (node->resource == NULL) {
+                node->resource = r;
+                node->order = order;
+        }
+
+        return 0;
+}
+
+static void
+router_node_free (struct router_node * node)
+{
+        struct router_node * child, * next;
+
+        for (child = node->child; child; child = next) {
+                next = child->sibling;
+                router_node_free (child);
+                free (child);
+        }
+}
+
+void
+router_free (struct router * router)
+{
+        if (router == NULL)
+                return;
+
+        router_node_free (&router->root);
+        free (router->checks);
+        free (router);
+}
+
+struct router *
+router_new (list_t * resources)
+{
+        struct router * router;
+        struct resource * r;
+        list_t * l;
+        int order = 0;
+
+        if ((router = calloc (1, sizeof(*router))) == NULL)
+                return NULL;
+
+        for (l = resources; l; l = l->next)
+                order++;
+
+        if (order > 0 && (router->checks = calloc (order, sizeof(struct router_check))) == NULL) {
+                free (router);
+                return NULL;
+        }
+
+        for (order = 0, l = resources; l; l = l->next, order++) {
+                r = (struct resource *)l->data;
+
+                if (r->path == NULL) {
+                        router->checks[router->nr_checks].resource = r;
+                        router->checks[router->nr_checks].order = order;
+                        router->nr_checks++;
+                } else if (router_insert (router, r, order) == -1) {
+                        router_free (router);
+                        return NULL;
+                }
+        }
+
+        return router;
+}
+
+struct resource *
+router_lookup (struct router * router, http_request * request)
+{
+        struct router_node * node = &router->root;
+        struct resource * best = NULL;
+        int best_order = INT_MAX;
+        const unsigned char * s;
+        int i;
+
+        /* Every prefix of the path which ends at a resource is a match */
+        for (s = (const unsigned char *)request->path; node != NULL; s++) {
+                if (node->resource != NULL && node->order < best_order) {
+                        best = node->resource;
+                        best_order = node->order;
+                }
+                if (*s == '\0')
+                        break;
+                node = router_child (node, *s, 0);
+        }
+
+        /* Resources without a path only win if they come earlier */
+        for (i = 0; i < router->nr_checks && router->checks[i].order < best_order; i++) {
+                struct resource * r = router->checks[i].resource;
+
+                if (r->check (request, r->data))
+                        return r;
+        }
+
+        return best;
+}
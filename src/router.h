@@ -0,0 +1,24 @@
+#ifndef __ROUTER_H__
+#define __ROUTER_H__
+
+#include "http-reqline.h"
+#include "list.h"
+#include "resource.h"
+
+/*
+ * Maps request paths to resources. Resources which declare a path prefix
+ * are placed in a trie, so a request is resolved in a single walk of its
+ * path; any others are asked with their check function. When several
+ * resources match, the first in the resources list wins, as it would
+ * when checking each in turn.
+ */
+
+struct router;
+
+struct router * router_new (list_t * resources);
+void router_free (struct router * router);
+
+/* Returns the resource which serves this request, or NULL */
+struct resource * router_lookup (struct router * router, http_request * request);
+
+#endif /* __ROUTER_H__ */
@@ -43,12 +43,13 @@
 #include <errno.h>
 #include <poll.h>
 
+#include "fmp4.h"
+#include "hls.h"
 #include "http-reqline.h"
 #include "http-status.h"
 #include "params.h"
 #include "resource.h"
-
-#include "ringbuffer.h"
+#include "stream.h"
 
 /* #define DEBUG */
 
@@ -69,7 +70,9 @@ struct encode_data {
 	char fifo[MAXPATHLEN];
 	char fifo_path[MAXPATHLEN];
 
-	struct ringbuffer rb;
+	struct stream * stream;
+	struct hls * hls;
+	struct fmp4 * fmp4;
 };
 
 struct private_data {
@@ -213,7 +216,7 @@ void * shrecord_main (void * data)
 							eds[i].fifo);
 						goto clean;
 					}
-					ringbuffer_write(&eds[i].rb, buffer, count);
+					stream_write(eds[i].stream, buffer, count);
 				}
 			}
 		}
@@ -245,7 +248,7 @@ shrecord_check (http_request * request, void * data)
 }
 
 static void
-shrecord_head (http_request * request, params_t * request_headers, const char ** status_line,
+shrecord_head (http_request * request, const char ** status_line,
 		params_t ** response_headers, void * data)
 {
 	struct encode_data * ed = (struct encode_data *)data;
@@ -254,37 +257,36 @@ shrecord_head (http_request * request, params_t * request_headers, const char **
 
 	*status_line = http_status_line (HTTP_STATUS_OK);
 
-	r = params_append (r, "Content-Type", "video/mp4");
+	*response_headers = params_append (r, "Content-Type", "video/mp4");
 }
 
-static void
-shrecord_body (int fd, http_request * request, params_t * request_headers, void * data)
+static void *
+shrecord_open (http_request * request, int notify_fd, int chunked, void * data)
 {
 	struct encode_data * ed = (struct encode_data *)data;
-	size_t n, avail;
-	int rd;
 
-	rd = ringbuffer_open (&ed->rb);
-
-	while (ed->alive) {
-		while ((avail = ringbuffer_avail (&ed->rb, rd)) == 0)
-			usleep (10000);
+	return stream_client_open (ed->stream, notify_fd, chunked);
+}
 
-#ifdef DEBUG
-		if (avail != 0) printf ("%s: %ld bytes available\n", __func__, avail);
-#endif
-		n = ringbuffer_writefd (fd, &ed->rb, rd);
-		if (n == -1) {
-				break;
-		}
+static ssize_t
+shrecord_pump (int fd, void * client, void * data)
+{
+	struct encode_data * ed = (struct encode_data *)data;
 
-		fsync (fd);
-#ifdef DEBUG
-		if (n!=0 || avail != 0) printf ("%s: wrote %ld of %ld bytes to socket\n", __func__, n, avail);
-#endif
+	if (!ed->alive) {
+		errno = EPIPE;
+		return -1;
 	}
 
-	ringbuffer_close (&ed->rb, rd);
+	return stream_client_pump (ed->stream, (struct stream_client *)client, fd);
+}
+
+static void
+shrecord_close (void * client, void * data)
+{
+	struct encode_data * ed = (struct encode_data *)data;
+
+	stream_client_close (ed->stream, (struct stream_client *)client);
 }
 
 static void
@@ -292,7 +294,11 @@ shrecord_delete (void * data)
 {
 	struct encode_data * ed = (struct encode_data *)data;
 
-	free (ed->rb.data);
+	stream_close (ed->stream);
+	if (ed->hls)
+		hls_free (ed->hls);
+	if (ed->fmp4)
+		fmp4_free (ed->fmp4);
 }
 
 static int
@@ -339,13 +345,13 @@ shrecord_mkfifo ( char *fifo )
 }
 
 struct resource *
-shrecord_resource (const char * path, const char * ctlfile)
+shrecord_resource (const char * path, const char * ctlfile, enum stream_format format,
+		   struct hls * hls, struct fmp4 * fmp4)
 {
 	struct encode_data * ed = NULL;
 	struct private_data *pvt = &pvt_data;
+	struct resource * r;
 	int return_code;
-	unsigned char * data = NULL;
-	size_t len = 4096*16*32;
 
 	if (pvt->nr_encoders > MAX_ENCODERS)
 		return NULL;
@@ -367,15 +373,26 @@ shrecord_resource (const char * path, const char * ctlfile)
 	if (shrecord_mkfifo(ed->fifo_path) < 0) 
 		return NULL;
 
-	/* init ring buffer */
-	if ((data = malloc (len)) == NULL)
+	/* init stream; clients join at keyframes if the format is known */
+	if ((ed->stream = stream_new (RINGBUFFER_BLOCK, format, NULL)) == NULL)
 		return NULL;
-	ringbuffer_init (&ed->rb, data, len);
+
+	if ((ed->hls = hls) != NULL)
+		stream_add_tap (ed->stream, hls_write, hls);
+	if ((ed->fmp4 = fmp4) != NULL)
+		stream_add_tap (ed->stream, fmp4_write, fmp4);
 
 	ed->alive = 1;
 	pvt->nr_encoders++;
 
-	return resource_new (shrecord_check, shrecord_head, shrecord_body, shrecord_delete, ed);
+	if ((r = resource_new_stream (shrecord_check, shrecord_head, shrecord_open, shrecord_pump,
+				      shrecord_close, shrecord_delete, ed)) != NULL) {
+		r->chunked = 1;
+		r->path = ed->path;
+		resource_cache_head (r);
+	}
+
+	return r;
 }
 
 list_t *
@@ -386,7 +403,11 @@ shrecord_resources (Dictionary * config)
 	const char * path;
 	const char * ctlfile;
 	const char * preview;
+	enum stream_format format;
 	struct resource * r;
+	struct hls * hls;
+	struct fmp4 * fmp4;
+	int chunked;
 
 	l = list_new();
 
@@ -394,10 +415,38 @@ shrecord_resources (Dictionary * config)
 
 	path = dictionary_lookup (config, "Path");
 	ctlfile = dictionary_lookup (config, "CtlFile");
+	format = stream_format_parse (dictionary_lookup (config, "Format"), NULL, path);
+	chunked = stream_chunked_parse (dictionary_lookup (config, "Chunked"), 1);
+
+	if ((hls = hls_config (config)) != NULL && format != STREAM_FORMAT_H264) {
+		fprintf (stderr, "HLSPath: only available for H.264 streams\n");
+		hls_free (hls);
+		hls = NULL;
+	}
+
+	if ((fmp4 = fmp4_config (config, RINGBUFFER_BLOCK)) != NULL &&
+	    format != STREAM_FORMAT_H264) {
+		fprintf (stderr, "FMP4Path: only available for H.264 streams\n");
+		fmp4_free (fmp4);
+		fmp4 = NULL;
+	}
 
 	if (path && ctlfile) {
-		if ((r = shrecord_resource (path, ctlfile)) != NULL)
+		if ((r = shrecord_resource (path, ctlfile, format, hls, fmp4)) != NULL) {
+			r->chunked = chunked;
 			l = list_append (l, r);
+			if (hls != NULL)
+				l = list_append (l, hls_resource (hls));
+			if (fmp4 != NULL && (r = fmp4_resource (fmp4)) != NULL) {
+				r->chunked = chunked;
+				l = list_append (l, r);
+			}
+		}
+	} else {
+		if (hls != NULL)
+			hls_free (hls);
+		if (fmp4 != NULL)
+			fmp4_free (fmp4);
 	}
 
 	if ((preview = dictionary_lookup (config, "Preview")) != NULL) {
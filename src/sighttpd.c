@@ -7,12 +7,17 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <strings.h>
+#include <unistd.h>
 #include <netdb.h>
 
 #include "cfg-read.h"
 #include "dictionary.h"
 #include "sighttpd.h"
 #include "resource.h"
+#include "router.h"
 #include "stream.h"
 #include "list.h"
 
@@ -26,6 +31,9 @@ struct sighttpd * sighttpd_init (struct cfg * cfg)
 {
         struct sighttpd * sighttpd;
         const char *portname;
+        const char *workers;
+        const char *keepalive;
+        const char *io_uring;
         int port;
 
         if ((sighttpd = malloc (sizeof(*sighttpd))) == NULL)
@@ -53,6 +61,27 @@ struct sighttpd * sighttpd_init (struct cfg * cfg)
 
         sighttpd->port = port;
 
+        /* Default to one event loop per online CPU */
+        if ((workers = dictionary_lookup (cfg->dictionary, "Workers")) != NULL) {
+                sighttpd->nr_workers = atoi (workers);
+        } else {
+                sighttpd->nr_workers = sysconf (_SC_NPROCESSORS_ONLN);
+        }
+        if (sighttpd->nr_workers < 1)
+                sighttpd->nr_workers = 1;
+        sighttpd->workers = NULL;
+
+        if ((keepalive = dictionary_lookup (cfg->dictionary, "KeepAliveTimeout")) != NULL) {
+                sighttpd->keepalive_timeout = atoi (keepalive);
+        } else {
+                sighttpd->keepalive_timeout = SIGHTTPD_KEEPALIVE_TIMEOUT;
+        }
+        if (sighttpd->keepalive_timeout < 0)
+                sighttpd->keepalive_timeout = 0;
+
+        io_uring = dictionary_lookup (cfg->dictionary, "IOUring");
+        sighttpd->io_uring = (io_uring != NULL && !strncasecmp (io_uring, "on", 2));
+
 	sighttpd->resources = cfg->resources;
 
 	sighttpd->resources = list_append (sighttpd->resources, status_resource(sighttpd));
@@ -61,11 +90,17 @@ struct sighttpd * sighttpd_init (struct cfg * cfg)
 	sighttpd->resources = list_append (sighttpd->resources, kongou_resource());
 	sighttpd->resources = list_join (sighttpd->resources, statictext_resources (cfg->dictionary));
 
+	if ((sighttpd->router = router_new (sighttpd->resources)) == NULL) {
+		fprintf (stderr, "Could not build resource router\n");
+		exit (1);
+	}
+
         return sighttpd;
 }
 
 void sighttpd_close (struct sighttpd * sighttpd)
 {
+	router_free (sighttpd->router);
 	list_free_with (sighttpd->resources, resource_delete);
         free (sighttpd);
 }
@@ -75,7 +110,7 @@ sighttpd_child_new (struct sighttpd * sighttpd, int accept_fd)
 {
         struct sighttpd_child * schild;
 
-        if ((schild = malloc (sizeof(*schild))) == NULL)
+        if ((schild = calloc (1, sizeof(*schild))) == NULL)
                 return NULL;
 
         schild->sighttpd = sighttpd;
@@ -87,6 +122,13 @@ sighttpd_child_new (struct sighttpd * sighttpd, int accept_fd)
 void
 sighttpd_child_destroy (struct sighttpd_child * schild)
 {
+        struct resource * r = schild->resource;
+
+        if (r != NULL && r->close != NULL)
+                r->close (schild->client, r->data);
+
         close (schild->accept_fd);
+        free (schild->buf);
+        free (schild->out);
         free (schild);
 }
@@ -1,17 +1,67 @@
 #ifndef __SIGHTTPD_H__
 #define __SIGHTTPD_H__
 
+#include <sys/types.h>
+#include <time.h>
+
 #include "cfg-read.h"
+#include "http-reqline.h"
 #include "list.h"
 
+/* Size of the per-connection request buffer, and so of the largest
+ * request head accepted */
+#define SIGHTTPD_CHILD_BUFSIZE 8192
+
+/* Seconds an idle connection is held open for its next request */
+#define SIGHTTPD_KEEPALIVE_TIMEOUT 15
+
+/* Seconds a client has to send a whole request head, once it has started,
+ * or to start one on a new connection when keep-alive is off */
+#define SIGHTTPD_REQUEST_TIMEOUT 10
+
+struct resource;
+struct router;
+struct worker;
+
 struct sighttpd {
 	int port;
 	list_t * resources;
+	struct router * router; /* built from resources at init */
+
+	int nr_workers;
+	struct worker * workers;
+
+	int keepalive_timeout; /* 0 to close after every response */
+	int io_uring; /* batch streaming writes with io_uring */
 };
 
 struct sighttpd_child {
         struct sighttpd * sighttpd;
         int accept_fd;
+
+        /* Request data received so far, in SIGHTTPD_CHILD_BUFSIZE bytes
+         * allocated on the first read and freed once a stream that ends
+         * the connection has begun */
+        char * buf;
+        size_t buf_len;
+        http_request request; /* parsed in place in buf */
+        time_t last_active; /* monotonic seconds since the connection went
+                             * idle, or the pending request head began */
+        unsigned long nr_served; /* requests answered */
+        list_t * reading; /* node in the worker's list of children awaiting a request */
+
+        /* Response bytes the socket would not take yet, sent before any more */
+        char * out;
+        size_t out_len, out_off;
+
+        /* Streaming body state, if any */
+        int notify_fd; /* the worker's eventfd for new stream data */
+        struct resource * resource;
+        void * client;
+        int blocked; /* waiting for the socket to become writable */
+        int keep_alive; /* read another request after the body */
+        int corked; /* the body is corked until it ends */
+        list_t * streaming; /* node in the worker's list of streaming children */
 };
 
 struct sighttpd * sighttpd_init (struct cfg * cfg);
@@ -0,0 +1,789 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "http-date.h"
+#include "http-range.h"
+#include "http-reqline.h"
+#include "http-status.h"
+#include "jhash.h"
+#include "params.h"
+#include "resource.h"
+#include "staticfile.h"
+
+/* #define DEBUG */
+
+#define DEFAULT_INDEX "index.html"
+
+#define x_strdup(s) ((s)?strdup((s)):(NULL))
+
+struct staticfile {
+	char * path;
+	char * file;    /* for a single file */
+	char * root;    /* for a directory */
+	char * index;
+	char * ctype;   /* overrides the type guessed from the file name */
+};
+
+/*
+ * File cache
+ */
+
+struct file_entry {
+	char * filename;
+	struct file_entry * hash_next;
+	struct file_entry * lru_prev, * lru_next;
+
+	int refs;
+	int cached;     /* in the hash table and LRU list */
+
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	time_t checked; /* when the file was last stat()ed */
+
+	char last_modified[32];
+	char etag[64];
+
+	char * data;    /* the contents, or NULL if not cached */
+};
+
+#define FILE_CACHE_BUCKETS 256
+
+static struct {
+	pthread_mutex_t mutex;
+	struct file_entry * buckets[FILE_CACHE_BUCKETS];
+	struct file_entry * lru_head, * lru_tail; /* most recently used first */
+	size_t size;
+} file_cache = { PTHREAD_MUTEX_INITIALIZER, { NULL }, NULL, NULL, 0 };
+
+static ub4
+file_cache_bucket (const char * filename)
+{
+	return jenkins_hash ((ub1 *)filename, strlen (filename), 0) % FILE_CACHE_BUCKETS;
+}
+
+static void
+file_entry_free (struct file_entry * e)
+{
+	free (e->filename);
+	free (e->data);
+	free (e);
+}
+
+static void
+file_cache_lru_unlink (struct file_entry * e)
+{
+	if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+	else file_cache.lru_head = e->lru_next;
+
+	if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+	else file_cache.lru_tail = e->lru_prev;
+
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void
+file_cache_lru_push (struct file_entry * e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = file_cache.lru_head;
+	if (file_cache.lru_head) file_cache.lru_head->lru_prev = e;
+	file_cache.lru_head = e;
+	if (file_cache.lru_tail == NULL) file_cache.lru_tail = e;
+}
+
+/* Call with the cache locked */
+static void
+file_cache_remove (struct file_entry * e)
+{
+	struct file_entry ** p;
+
+	for (p = &file_cache.buckets[file_cache_bucket (e->filename)]; *p; p = &(*p)->hash_next) {
+		if (*p == e) {
+			*p = e->hash_next;
+			break;
+		}
+	}
+
+	file_cache_lru_unlink (e);
+	file_cache.size -= e->size;
+	e->cached = 0;
+
+	/* Entries still being sent are freed on release */
+	if (e->refs == 0)
+		file_entry_free (e);
+}
+
+static struct file_entry *
+file_cache_find (const char * filename)
+{
+	struct file_entry * e;
+
+	for (e = file_cache.buckets[file_cache_bucket (filename)]; e; e = e->hash_next) {
+		if (!strcmp (e->filename, filename))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void
+file_cache_insert (struct file_entry * e)
+{
+	ub4 b = file_cache_bucket (e->filename);
+
+	e->hash_next = file_cache.buckets[b];
+	file_cache.buckets[b] = e;
+	file_cache_lru_push (e);
+	file_cache.size += e->size;
+	e->cached = 1;
+
+	while (file_cache.size > STATICFILE_CACHE_SIZE && file_cache.lru_tail != e)
+		file_cache_remove (file_cache.lru_tail);
+}
+
+static int
+file_read (const char * filename, char * data, off_t size)
+{
+	ssize_t n;
+	off_t off = 0;
+	int fd;
+
+	if ((fd = open (filename, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	while (off < size) {
+		n = read (fd, data + off, size - off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		off += n;
+	}
+
+	close (fd);
+
+	return (off == size) ? 0 : -1;
+}
+
+static struct file_entry *
+file_entry_new (const char * filename, struct stat * st, time_t now)
+{
+	struct file_entry * e;
+
+	if ((e = calloc (1, sizeof(*e))) == NULL)
+		return NULL;
+
+	if ((e->filename = strdup (filename)) == NULL) {
+		free (e);
+		return NULL;
+	}
+
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtime;
+	e->checked = now;
+	e->refs = 1;
+
+	httpdate_snprint (e->last_modified, sizeof(e->last_modified), e->mtime);
+	snprintf (e->etag, sizeof(e->etag), "\"%lx-%llx-%llx\"", (unsigned long)e->ino,
+		  (unsigned long long)e->size, (unsigned long long)e->mtime);
+
+	if (e->size <= STATICFILE_CACHE_FILE_MAX) {
+		if ((e->data = malloc (e->size > 0 ? e->size : 1)) == NULL ||
+		    file_read (filename, e->data, e->size) == -1) {
+			free (e->data);
+			e->data = NULL;
+		}
+	}
+
+	return e;
+}
+
+/*
+ * Find a regular file, with its contents if it is small. Files are
+ * stat()ed at most once a second to notice changes. Release the entry
+ * with file_release() when done.
+ */
+static struct file_entry *
+file_lookup (const char * filename)
+{
+	struct file_entry * e;
+	struct stat st;
+	time_t now = httpdate_now ()->time;
+
+	pthread_mutex_lock (&file_cache.mutex);
+	if ((e = file_cache_find (filename)) != NULL && e->checked == now) {
+		e->refs++;
+		file_cache_lru_unlink (e);
+		file_cache_lru_push (e);
+		pthread_mutex_unlock (&file_cache.mutex);
+		return e;
+	}
+	pthread_mutex_unlock (&file_cache.mutex);
+
+	if (stat (filename, &st) == -1 || !S_ISREG (st.st_mode))
+		return NULL;
+
+	pthread_mutex_lock (&file_cache.mutex);
+	if ((e = file_cache_find (filename)) != NULL) {
+		if (e->dev == st.st_dev && e->ino == st.st_ino &&
+		    e->size == st.st_size && e->mtime == st.st_mtime) {
+			e->checked = now;
+			e->refs++;
+			file_cache_lru_unlink (e);
+			file_cache_lru_push (e);
+			pthread_mutex_unlock (&file_cache.mutex);
+			return e;
+		}
+
+		/* Changed on disk */
+		file_cache_remove (e);
+	}
+	pthread_mutex_unlock (&file_cache.mutex);
+
+	if ((e = file_entry_new (filename, &st, now)) == NULL)
+		return NULL;
+
+#ifdef DEBUG
+	printf ("staticfile: loaded %s (%s)\n", filename, e->data ? "cached" : "uncached");
+#endif
+
+	if (e->data != NULL) {
+		pthread_mutex_lock (&file_cache.mutex);
+		/* Another worker may have loaded it meanwhile */
+		if (file_cache_find (filename) == NULL)
+			file_cache_insert (e);
+		pthread_mutex_unlock (&file_cache.mutex);
+	}
+
+	return e;
+}
+
+static void
+file_release (struct file_entry * e)
+{
+	pthread_mutex_lock (&file_cache.mutex);
+	if (--e->refs == 0 && !e->cached)
+		file_entry_free (e);
+	pthread_mutex_unlock (&file_cache.mutex);
+}
+
+/*
+ * Resources
+ */
+
+static const struct {
+	const char * ext;
+	const char * ctype;
+} content_types[] = {
+	{"html", "text/html"},
+	{"htm", "text/html"},
+	{"css", "text/css"},
+	{"js", "application/javascript"},
+	{"json", "application/json"},
+	{"txt", "text/plain"},
+	{"xml", "application/xml"},
+	{"png", "image/png"},
+	{"jpg", "image/jpeg"},
+	{"jpeg", "image/jpeg"},
+	{"gif", "image/gif"},
+	{"svg", "image/svg+xml"},
+	{"ico", "image/x-icon"},
+	{"wasm", "application/wasm"},
+	{"m3u8", "application/vnd.apple.mpegurl"},
+	{"ts", "video/mp2t"},
+	{"mp4", "video/mp4"},
+	{"m4s", "video/iso.segment"},
+	{"webm", "video/webm"},
+	{"ogv", "video/ogg"},
+	{NULL, NULL}
+};
+
+static const char *
+staticfile_content_type (struct staticfile * sf, const char * filename)
+{
+	const char * ext;
+	int i;
+
+	if (sf->ctype != NULL)
+		return sf->ctype;
+
+	if ((ext = strrchr (filename, '.')) != NULL && strchr (ext, '/') == NULL) {
+		for (i = 0; content_types[i].ext; i++) {
+			if (!strcasecmp (ext + 1, content_types[i].ext))
+				return content_types[i].ctype;
+		}
+	}
+
+	return "application/octet-stream";
+}
+
+static int
+hexval (char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Map a request below a directory's path onto a file under its root.
+ * Returns -1 for paths which could escape the root.
+ */
+static int
+staticdir_filename (struct staticfile * sf, const char * path, char * filename, size_t n)
+{
+	char rel[PATH_MAX];
+	const char * s;
+	size_t len = 0;
+	int hi, lo;
+
+	for (s = path + strlen (sf->path); *s && *s != '?' && *s != '#'; s++) {
+		if (len + 1 >= sizeof(rel))
+			return -1;
+
+		if (*s == '%' && (hi = hexval (s[1])) != -1 && (lo = hexval (s[2])) != -1) {
+			rel[len] = (char)(hi * 16 + lo);
+			s += 2;
+		} else {
+			rel[len] = *s;
+		}
+
+		if (rel[len] == '\0')
+			return -1;
+		len++;
+	}
+	rel[len] = '\0';
+
+	/* No ".." path segments */
+	for (s = rel; (s = strstr (s, "..")) != NULL; s += 2) {
+		if ((s == rel || s[-1] == '/') && (s[2] == '\0' || s[2] == '/'))
+			return -1;
+	}
+
+	if (len == 0 || rel[len-1] == '/') {
+		if ((size_t)snprintf (filename, n, "%s/%s%s", sf->root, rel, sf->index) >= n)
+			return -1;
+	} else {
+		if ((size_t)snprintf (filename, n, "%s/%s", sf->root, rel) >= n)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Whether the client's copy, described by its conditional headers, is current */
+static int
+staticfile_not_modified (http_request * request, struct file_entry * e)
+{
+	const char * inm, * ims;
+	time_t t;
+
+	/* If-None-Match takes precedence over If-Modified-Since */
+	if ((inm = http_request_header (request, HTTP_HEADER_IF_NONE_MATCH)) != NULL)
+		return (!strcmp (inm, "*") || strstr (inm, e->etag) != NULL);
+
+	if ((ims = http_request_header (request, HTTP_HEADER_IF_MODIFIED_SINCE)) != NULL) {
+		if (!strcmp (ims, e->last_modified))
+			return 1;
+		t = httpdate_parse ((char *)ims, strlen (ims));
+		return (t != (time_t)-1 && e->mtime <= t);
+	}
+
+	return 0;
+}
+
+/*
+ * Whether a Range header applies to the current file. An If-Range
+ * validator which no longer matches means the client's partial copy is
+ * stale, and the whole file is sent instead.
+ */
+static int
+staticfile_range_applies (http_request * request, struct file_entry * e)
+{
+	const char * if_range;
+
+	if ((if_range = http_request_header (request, HTTP_HEADER_IF_RANGE)) == NULL)
+		return 1;
+
+	if (if_range[0] == '"')
+		return !strcmp (if_range, e->etag);
+
+	return !strcmp (if_range, e->last_modified);
+}
+
+/*
+ * A file found for a request by the head, the parts of it to send, and
+ * how far the body has got. The file stays referenced (and open, if its
+ * contents are not cached) until the response is done, so the body sends
+ * the file that the head described.
+ */
+struct staticfile_response {
+	http_status status;
+	struct file_entry * e;
+	int fd;         /* the open file, if its contents are not cached */
+	const char * ctype;
+	http_range ranges[HTTP_RANGE_MAX];
+	int nranges;
+
+	int part;       /* the range being sent */
+	off_t off, end; /* the bytes of the file still to send for it */
+	/* A part head, the trailer or an error page, sent first */
+	char buf[HTTP_RANGE_PART_HEAD_MAX];
+	size_t buf_off, buf_len;
+};
+
+static void
+staticfile_response_free (struct staticfile_response * resp)
+{
+	if (resp->fd != -1)
+		close (resp->fd);
+	if (resp->e != NULL)
+		file_release (resp->e);
+	free (resp);
+}
+
+/* Find the file for a request; returns its status */
+static http_status
+staticfile_resolve (struct staticfile * sf, http_request * request,
+		    struct staticfile_response * resp)
+{
+	char filename[PATH_MAX];
+	struct file_entry * e = NULL;
+	const char * range;
+
+	resp->nranges = 0;
+	resp->fd = -1;
+
+	if (sf->file != NULL) {
+		e = file_lookup (sf->file);
+	} else if (staticdir_filename (sf, request->path, filename, sizeof(filename)) == 0) {
+		e = file_lookup (filename);
+	}
+
+	if ((resp->e = e) == NULL)
+		return HTTP_STATUS_NOT_FOUND;
+
+	resp->ctype = staticfile_content_type (sf, e->filename);
+
+	if (staticfile_not_modified (request, e))
+		return HTTP_STATUS_NOT_MODIFIED;
+
+	if ((range = http_request_header (request, HTTP_HEADER_RANGE)) != NULL &&
+	    staticfile_range_applies (request, e)) {
+		resp->nranges = http_range_parse (range, e->size, resp->ranges);
+		if (resp->nranges == -1)
+			return HTTP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE;
+
+		/* Parts whose heads would not fit are not sent; the whole
+		 * file is, as for a Range header that is ignored */
+		if (resp->nranges > 1 &&
+		    http_range_multipart_length (resp->ranges, resp->nranges, e->size,
+						 resp->ctype) == -1)
+			resp->nranges = 0;
+	}
+
+	/* Uncached files are opened now, so that the body comes from the
+	 * same file even if it is replaced meanwhile */
+	if (e->data == NULL &&
+	    (resp->fd = open (e->filename, O_RDONLY | O_CLOEXEC)) == -1) {
+		file_release (e);
+		resp->e = NULL;
+		return HTTP_STATUS_NOT_FOUND;
+	}
+
+	return (resp->nranges > 0) ? HTTP_STATUS_PARTIAL_CONTENT : HTTP_STATUS_OK;
+}
+
+static int
+staticfile_check (http_request * request, void * data)
+{
+	struct staticfile * sf = (struct staticfile *)data;
+
+	return !strncmp (request->path, sf->path, strlen(sf->path));
+}
+
+static void
+staticfile_head (http_request * request, const char ** status_line,
+		 params_t ** response_headers, void * data)
+{
+	struct staticfile * sf = (struct staticfile *)data;
+	struct staticfile_response * resp;
+	struct file_entry * e;
+	params_t * r = *response_headers;
+	char length[32], content_range[80];
+	off_t len;
+
+	if ((resp = calloc (1, sizeof(*resp))) == NULL) {
+		*status_line = http_status_line (HTTP_STATUS_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	resp->status = staticfile_resolve (sf, request, resp);
+	*status_line = http_status_line (resp->status);
+
+	/* Kept for the body */
+	request->state = resp;
+
+	if ((e = resp->e) == NULL) {
+		*response_headers = http_status_append_headers (r, resp->status);
+		return;
+	}
+
+	if (resp->status == HTTP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) {
+		r = http_status_append_headers (r, resp->status);
+		http_range_snprint (content_range, sizeof(content_range), NULL, e->size);
+		r = params_append (r, "Content-Range", content_range);
+		*response_headers = r;
+		return;
+	}
+
+	if (resp->nranges > 1) {
+		r = params_append (r, "Content-Type", HTTP_RANGE_MULTIPART);
+		len = http_range_multipart_length (resp->ranges, resp->nranges, e->size,
+						   resp->ctype);
+	} else if (resp->nranges == 1) {
+		r = params_append (r, "Content-Type", (char *)resp->ctype);
+		http_range_snprint (content_range, sizeof(content_range), &resp->ranges[0],
+				    e->size);
+		r = params_append (r, "Content-Range", content_range);
+		len = resp->ranges[0].last - resp->ranges[0].first + 1;
+	} else {
+		/* A 304 carries the Content-Length of the file it stands for */
+		r = params_append (r, "Content-Type", (char *)resp->ctype);
+		len = e->size;
+	}
+
+	snprintf (length, sizeof(length), "%lld", (long long)len);
+	r = params_append (r, "Content-Length", length);
+	r = params_append (r, "Accept-Ranges", "bytes");
+	r = params_append (r, "Last-Modified", e->last_modified);
+	r = params_append (r, "ETag", e->etag);
+	*response_headers = r;
+}
+
+/* Move on to the next part of a multipart/byteranges body, after its
+ * head; the trailer follows the last part */
+static void
+staticfile_next_part (struct staticfile_response * resp)
+{
+	http_range * range = &resp->ranges[resp->part];
+	int n;
+
+	resp->buf_off = resp->buf_len = 0;
+	resp->off = resp->end = 0;
+
+	if (resp->part == resp->nranges) {
+		resp->buf_len = strlen (HTTP_RANGE_TRAILER);
+		memcpy (resp->buf, HTTP_RANGE_TRAILER, resp->buf_len);
+		return;
+	}
+
+	/* Known to fit, from http_range_multipart_length() */
+	n = http_range_part_head (resp->buf, sizeof(resp->buf), range, resp->e->size,
+				  resp->ctype);
+	resp->buf_len = n;
+
+	resp->off = range->first;
+	resp->end = range->last + 1;
+}
+
+static void *
+staticfile_open (http_request * request, int notify_fd, int chunked, void * data)
+{
+	struct staticfile_response * resp = (struct staticfile_response *)request->state;
+
+	(void) notify_fd;
+	(void) chunked;
+	(void) data;
+
+	if (resp == NULL)
+		return NULL;
+
+	/* The body sends from what the head found */
+	request->state = NULL;
+
+	switch (resp->status) {
+	case HTTP_STATUS_OK:
+		resp->end = resp->e->size;
+		break;
+	case HTTP_STATUS_PARTIAL_CONTENT:
+		if (resp->nranges == 1) {
+			resp->off = resp->ranges[0].first;
+			resp->end = resp->ranges[0].last + 1;
+		} else {
+			staticfile_next_part (resp);
+		}
+		break;
+	case HTTP_STATUS_NOT_FOUND:
+	case HTTP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE:
+		resp->buf_len = http_status_format_body (resp->status, resp->buf,
+							 sizeof(resp->buf));
+		break;
+	default:
+		break;
+	}
+
+	return resp;
+}
+
+/*
+ * Send as much of the body as the socket takes without blocking: any
+ * buffered part head, then the file's bytes, from the cache or with
+ * sendfile() from the file opened by the head.
+ */
+static ssize_t
+staticfile_pump (int fd, void * client, void * data)
+{
+	struct staticfile_response * resp = (struct staticfile_response *)client;
+	struct file_entry * e = resp->e;
+	ssize_t n;
+
+	(void) data;
+
+	while (1) {
+		if (resp->buf_off < resp->buf_len) {
+			n = write (fd, resp->buf + resp->buf_off, resp->buf_len - resp->buf_off);
+			if (n > 0)
+				resp->buf_off += n;
+		} else if (resp->off < resp->end) {
+			if (e->data != NULL) {
+				n = write (fd, e->data + resp->off, resp->end - resp->off);
+				if (n > 0)
+					resp->off += n;
+			} else {
+				n = sendfile (fd, resp->fd, &resp->off, resp->end - resp->off);
+			}
+		} else if (resp->nranges > 1 && resp->part < resp->nranges) {
+			resp->part++;
+			staticfile_next_part (resp);
+			continue;
+		} else {
+			return RESOURCE_PUMP_END;
+		}
+
+		if (n > 0 || (n == -1 && errno == EINTR))
+			continue;
+
+		/* EAGAIN waits for the socket to drain; a file that shrank
+		 * (n == 0) can no longer fill its Content-Length */
+		if (n == 0)
+			errno = EIO;
+		return -1;
+	}
+}
+
+static void
+staticfile_close (void * client, void * data)
+{
+	(void) data;
+
+	staticfile_response_free ((struct staticfile_response *)client);
+}
+
+static void
+staticfile_release (void * state, void * data)
+{
+	(void) data;
+
+	staticfile_response_free ((struct staticfile_response *)state);
+}
+
+static void
+staticfile_delete (void * data)
+{
+	struct staticfile * sf = (struct staticfile *)data;
+
+	free (sf->path);
+	free (sf->file);
+	free (sf->root);
+	free (sf->index);
+	free (sf->ctype);
+	free (sf);
+}
+
+static struct resource *
+staticfile_resource (const char * path, const char * file, const char * root,
+		     const char * index, const char * ctype)
+{
+	struct staticfile * sf;
+	struct resource * r;
+
+	if ((sf = calloc (1, sizeof(*sf))) == NULL)
+		return NULL;
+
+	sf->path = x_strdup (path);
+	sf->file = x_strdup (file);
+	sf->root = x_strdup (root);
+	sf->index = x_strdup (index);
+	sf->ctype = x_strdup (ctype);
+
+	if ((r = resource_new_stream (staticfile_check, staticfile_head, staticfile_open,
+				      staticfile_pump, staticfile_close, staticfile_delete,
+				      sf)) != NULL) {
+		r->release = staticfile_release;
+		r->path = sf->path;
+	}
+
+	return r;
+}
+
+list_t *
+staticfile_resources (Dictionary * config)
+{
+	list_t * l;
+	const char * path, * file, * ctype;
+
+	l = list_new ();
+
+	path = dictionary_lookup (config, "Path");
+	file = dictionary_lookup (config, "File");
+	ctype = dictionary_lookup (config, "Type");
+
+	if (path && file)
+		l = list_append (l, staticfile_resource (path, file, NULL, NULL, ctype));
+
+	return l;
+}
+
+list_t *
+staticdir_resources (Dictionary * config)
+{
+	list_t * l;
+	const char * path, * root, * index, * ctype;
+
+	l = list_new ();
+
+	path = dictionary_lookup (config, "Path");
+	root = dictionary_lookup (config, "Root");
+	index = dictionary_lookup (config, "Index");
+	ctype = dictionary_lookup (config, "Type");
+
+	if (!index) index = DEFAULT_INDEX;
+
+	if (path && root)
+		l = list_append (l, staticfile_resource (path, NULL, root, index, ctype));
+
+	return l;
+}
@@ -0,0 +1,25 @@
+#ifndef __STATICFILE_H__
+#define __STATICFILE_H__
+
+#include "dictionary.h"
+#include "resource.h"
+#include "list.h"
+
+/*
+ * Files served from disk: a single file at a path (<StaticFile>), or a
+ * directory tree below a path prefix (<Directory>). Small files are kept
+ * in memory, shared by all such resources; larger ones are sent with
+ * sendfile(). Responses carry Last-Modified and an ETag, and conditional
+ * requests for unchanged files are answered with 304 Not Modified.
+ */
+
+/* Total size of the in-memory file cache */
+#define STATICFILE_CACHE_SIZE (4*1024*1024)
+
+/* Files larger than this are not cached */
+#define STATICFILE_CACHE_FILE_MAX (256*1024)
+
+list_t * staticfile_resources (Dictionary * config);
+list_t * staticdir_resources (Dictionary * config);
+
+#endif /* __STATICFILE_H__ */
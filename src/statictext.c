@@ -29,7 +29,7 @@ statictext_check (http_request * request, void * data)
 }
 
 static void
-statictext_head (http_request * request, params_t * request_headers, const char ** status_line,
+statictext_head (http_request * request, const char ** status_line,
 		params_t ** response_headers, void * data)
 {
 	struct statictext * st = (struct statictext *)data;
@@ -44,7 +44,7 @@ statictext_head (http_request * request, params_t * request_headers, const char
 }
 
 static void
-statictext_body (int fd, http_request * request, params_t * request_headers, void * data)
+statictext_body (int fd, http_request * request, void * data)
 {
 	struct statictext * st = (struct statictext *)data;
 
@@ -66,6 +66,7 @@ struct resource *
 statictext_resource (char * path, char * text, char * ctype)
 {
 	struct statictext * st;
+	struct resource * r;
 
 	if ((st = calloc (1, sizeof(*st))) == NULL)
 		return NULL;
@@ -74,7 +75,15 @@ statictext_resource (char * path, char * text, char * ctype)
 	st->text = x_strdup(text);
 	st->ctype = x_strdup(ctype);
 
-	return resource_new (statictext_check, statictext_head, statictext_body, statictext_delete, st);
+	if ((r = resource_new (statictext_check, statictext_head, statictext_body,
+			       statictext_delete, st)) != NULL) {
+		r->path = st->path;
+		r->body_cache = st->text;
+		r->body_cache_len = strlen (st->text);
+		resource_cache_head (r);
+	}
+
+	return r;
 }
 
 list_t *
@@ -44,43 +44,53 @@ status_append_headers (params_t * response_headers)
 }
 
 static void
-status_head (http_request * request, params_t * request_headers, const char ** status_line,
+status_head (http_request * request, const char ** status_line,
 		params_t ** response_headers, void * data)
 {
         *status_line = http_status_line (HTTP_STATUS_OK);
         *response_headers = status_append_headers (*response_headers);
 }
 
-static int
-status_body (int fd, http_request * request, params_t * request_headers, void * data)
+static void
+status_body (int fd, http_request * request, void * data)
 {
     char buf[4096];
-    int n, ntotal=0;
+    int n;
     struct sighttpd * sighttpd = (struct sighttpd *)data;
+    list_t * l;
 
     n = snprintf (buf, 4096, STATUS_HEAD, VERSION, VERSION);
-    if (n < 0) return -1;
+    if (n < 0) return;
     if (n > 4096) n = 4096;
-    ntotal += n;
     write (fd, buf, n);
 
     n = snprintf (buf, 4096, "<p>Active resources: %d</p>\n", list_length (sighttpd->resources));
-    if (n < 0) return -1;
+    if (n < 0) return;
     if (n > 4096) n = 4096;
-    ntotal += n;
     write (fd, buf, n);
 
+    for (l = sighttpd->resources; l; l = l->next) {
+        struct resource * r = (struct resource *)l->data;
+
+        if (r->status != NULL)
+            r->status (fd, r->data);
+    }
+
     n = snprintf (buf, 4096, STATUS_FOOT, VERSION, VERSION);
-    if (n < 0) return -1;
+    if (n < 0) return;
     if (n > 4096) n = 4096;
-    ntotal += n;
     write (fd, buf, n);
-
-    return ntotal;
 }
 
 struct resource *
 status_resource (struct sighttpd * sighttpd)
 {
-	return resource_new (status_check, status_head, status_body, NULL /* del */, sighttpd);
+	struct resource * r;
+
+	if ((r = resource_new (status_check, status_head, status_body, NULL /* del */, sighttpd)) != NULL) {
+		r->path = "/status";
+		resource_cache_head (r);
+	}
+
+	return r;
 }
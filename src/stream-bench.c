@@ -0,0 +1,323 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+/*
+ * Compare the CPU cost of fanning a stream out to many clients through the
+ * ring buffer, with a write per client or with one io_uring submission for
+ * all of them, against the splice/tee zero-copy path.
+ *
+ * A producer thread writes into a pipe that feeds the stream, and each
+ * client is one end of a socketpair drained by a consumer thread. The
+ * figures reported are bytes delivered to all clients per second of CPU
+ * time used by the whole process, the CPU used as a percentage of one CPU,
+ * and the system calls per second made by the thread serving the clients
+ * (counted by wrapping them at link time). The producer and consumers do
+ * the same work in every mode, so the difference is in the stream itself.
+ *
+ * Usage: stream-bench [clients [seconds]]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE /* loff_t */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "stream.h"
+#include "uring.h"
+
+#define MAX_CLIENTS 256
+#define BUF_SIZE (64*1024)
+
+enum bench_mode {
+        BENCH_RING,
+        BENCH_URING,
+        BENCH_ZERO_COPY
+};
+
+static volatile int running;
+static _Atomic unsigned long long delivered;
+
+/* System calls made by the thread serving the clients, while counting */
+static __thread int counting;
+static unsigned long syscalls;
+
+ssize_t __real_read (int fd, void * buf, size_t count);
+ssize_t __real_write (int fd, const void * buf, size_t count);
+ssize_t __real_writev (int fd, const struct iovec * iov, int iovcnt);
+ssize_t __real_splice (int fd_in, loff_t * off_in, int fd_out, loff_t * off_out,
+                       size_t len, unsigned int flags);
+int __real_fsync (int fd);
+int __real_poll (struct pollfd * fds, nfds_t nfds, int timeout);
+int __real_ioctl (int fd, unsigned long request, void * arg);
+
+ssize_t
+__wrap_read (int fd, void * buf, size_t count)
+{
+        syscalls += counting;
+        return __real_read (fd, buf, count);
+}
+
+ssize_t
+__wrap_write (int fd, const void * buf, size_t count)
+{
+        syscalls += counting;
+        return __real_write (fd, buf, count);
+}
+
+ssize_t
+__wrap_writev (int fd, const struct iovec * iov, int iovcnt)
+{
+        syscalls += counting;
+        return __real_writev (fd, iov, iovcnt);
+}
+
+ssize_t
+__wrap_splice (int fd_in, loff_t * off_in, int fd_out, loff_t * off_out, size_t len,
+               unsigned int flags)
+{
+        syscalls += counting;
+        return __real_splice (fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+int
+__wrap_fsync (int fd)
+{
+        syscalls += counting;
+        return __real_fsync (fd);
+}
+
+int
+__wrap_poll (struct pollfd * fds, nfds_t nfds, int timeout)
+{
+        syscalls += counting;
+        return __real_poll (fds, nfds, timeout);
+}
+
+int
+__wrap_ioctl (int fd, unsigned long request, void * arg)
+{
+        syscalls += counting;
+        return __real_ioctl (fd, request, arg);
+}
+
+static void *
+producer_main (void * data)
+{
+        int fd = *(int *)data;
+        static char buf[BUF_SIZE];
+
+        memset (buf, 'x', sizeof(buf));
+
+        while (running) {
+                if (write (fd, buf, sizeof(buf)) == -1)
+                        break;
+        }
+
+        close (fd);
+        return NULL;
+}
+
+static void *
+consumer_main (void * data)
+{
+        int fd = *(int *)data;
+        char buf[BUF_SIZE];
+        ssize_t n;
+
+        while ((n = read (fd, buf, sizeof(buf))) > 0)
+                atomic_fetch_add (&delivered, n);
+
+        return NULL;
+}
+
+static double
+cpu_seconds (void)
+{
+        struct rusage ru;
+
+        getrusage (RUSAGE_SELF, &ru);
+
+        return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+                (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static double
+now (void)
+{
+        struct timeval tv;
+
+        gettimeofday (&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double
+bench (const char * name, int nr_clients, int seconds, enum bench_mode mode)
+{
+        struct stream * stream;
+        struct stream_client * clients[MAX_CLIENTS];
+        struct pollfd pfds[MAX_CLIENTS + 1];
+        int socks[MAX_CLIENTS][2], blocked[MAX_CLIENTS];
+        pthread_t consumers[MAX_CLIENTS], producer;
+        int pipefd[2], notify_fd, i, res;
+        double start, cpu_start, cpu, wall;
+        unsigned long long bytes;
+        unsigned long calls;
+        struct uring * u = NULL;
+        int zero_copy = (mode == BENCH_ZERO_COPY);
+        uint64_t count;
+        ssize_t n;
+        void * tag;
+
+        if (mode == BENCH_URING && (u = uring_new (MAX_CLIENTS)) == NULL) {
+                perror ("io_uring_setup");
+                return 0;
+        }
+
+        if (pipe (pipefd) == -1 || (notify_fd = eventfd (0, EFD_NONBLOCK)) == -1) {
+                perror ("stream-bench");
+                exit (1);
+        }
+
+        if ((stream = stream_open (pipefd[0], RINGBUFFER_BLOCK, STREAM_FORMAT_NONE, NULL, zero_copy ? nr_clients : 0)) == NULL) {
+                fprintf (stderr, "stream_open failed\n");
+                exit (1);
+        }
+
+        pfds[0].fd = notify_fd;
+        pfds[0].events = POLLIN;
+
+        for (i = 0; i < nr_clients; i++) {
+                if (socketpair (AF_UNIX, SOCK_STREAM, 0, socks[i]) == -1) {
+                        perror ("socketpair");
+                        exit (1);
+                }
+                fcntl (socks[i][0], F_SETFL, O_NONBLOCK);
+                clients[i] = stream_client_open (stream, notify_fd, 0);
+                blocked[i] = 0;
+                pthread_create (&consumers[i], NULL, consumer_main, &socks[i][1]);
+        }
+
+        atomic_store (&delivered, 0);
+        running = 1;
+        pthread_create (&producer, NULL, producer_main, &pipefd[1]);
+
+        start = now ();
+        cpu_start = cpu_seconds ();
+        syscalls = 0;
+        calls = u ? uring_syscalls (u) : 0;
+        counting = 1;
+
+        while (now () - start < seconds) {
+                for (i = 0; i < nr_clients; i++) {
+                        pfds[i+1].fd = socks[i][0];
+                        pfds[i+1].events = blocked[i] ? POLLOUT : 0;
+                        pfds[i+1].revents = 0;
+                }
+
+                if (poll (pfds, nr_clients + 1, 100) == -1 && errno != EINTR)
+                        break;
+
+                if (pfds[0].revents & POLLIN)
+                        read (notify_fd, &count, sizeof(count));
+
+                for (i = 0; i < nr_clients; i++) {
+                        if (blocked[i] && !(pfds[i+1].revents & POLLOUT))
+                                continue;
+
+                        if (u && stream_client_queue (stream, clients[i], socks[i][0], u,
+                                                      (void *)(intptr_t)i))
+                                continue;
+
+                        n = stream_client_pump (stream, clients[i], socks[i][0]);
+                        blocked[i] = (n == -1 && errno == EAGAIN);
+                }
+
+                if (u) {
+                        uring_submit (u);
+                        while (uring_complete (u, &tag, &res)) {
+                                i = (intptr_t)tag;
+                                n = stream_client_complete (stream, clients[i], res);
+                                blocked[i] = (n == -1 && errno == EAGAIN);
+                        }
+                }
+        }
+
+        counting = 0;
+        wall = now () - start;
+        cpu = cpu_seconds () - cpu_start;
+        bytes = atomic_load (&delivered);
+        calls = syscalls + (u ? uring_syscalls (u) - calls : 0);
+
+        printf ("%-10s %3d clients: %8.1f MB delivered, %6.2f CPU s (%5.1f%%), "
+                "%8.1f MB per CPU second, %9.0f syscalls/s\n",
+                name, nr_clients, bytes / 1e6, cpu, cpu * 100 / wall, bytes / 1e6 / cpu,
+                calls / wall);
+
+        /* Shut down: the producer closes the pipe, which ends the stream */
+        running = 0;
+        for (i = 0; i < nr_clients; i++) {
+                stream_client_close (stream, clients[i]);
+                close (socks[i][0]);
+        }
+        for (i = 0; i < nr_clients; i++) {
+                pthread_join (consumers[i], NULL);
+                close (socks[i][1]);
+        }
+
+        /* With no clients left the stream drains the pipe until the
+         * producer closes it */
+        pthread_join (producer, NULL);
+        while (stream->active)
+                usleep (1000);
+        usleep (10000);
+
+        close (notify_fd);
+        close (pipefd[0]);
+        stream_close (stream);
+        uring_free (u);
+
+        return bytes / cpu;
+}
+
+int
+main (int argc, char * argv[])
+{
+        int nr_clients = 8, seconds = 3;
+        double ring, io_uring, zero_copy;
+
+        if (argc > 1) nr_clients = atoi (argv[1]);
+        if (argc > 2) seconds = atoi (argv[2]);
+
+        if (nr_clients < 1 || nr_clients > MAX_CLIENTS) {
+                fprintf (stderr, "clients must be between 1 and %d\n", MAX_CLIENTS);
+                exit (1);
+        }
+
+        ring = bench ("ringbuffer", nr_clients, seconds, BENCH_RING);
+        io_uring = bench ("io_uring", nr_clients, seconds, BENCH_URING);
+        zero_copy = bench ("zero-copy", nr_clients, seconds, BENCH_ZERO_COPY);
+
+        if (io_uring > 0)
+                printf ("io_uring/ringbuffer: %.2fx\n", io_uring / ring);
+        printf ("zero-copy/ringbuffer: %.2fx\n", zero_copy / ring);
+
+        exit (0);
+}
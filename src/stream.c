@@ -2,41 +2,309 @@
    Copyright (C) 2009 Conrad Parker
 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE /* splice, tee */
+
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "stream.h"
+#include "http-chunked.h"
 #include "params.h"
+#include "resource.h"
 #include "ringbuffer.h"
+#include "uring.h"
 
 /* #define DEBUG */
 
+/* Bytes moved from the input per splice in zero-copy mode; the size of a
+ * default pipe */
+#define ZERO_COPY_CHUNK (64*1024)
+
+/* Requested size of each zero-copy client's pipe */
+#define ZERO_COPY_PIPE_SIZE (1024*1024)
+
+/* Most bytes stream_write() puts in the ring buffer at once */
+#define STREAM_WRITE_CHUNK (64*1024)
+
+struct stream_client {
+        int rd;          /* ringbuffer read descriptor, or -1 for zero-copy */
+        int notify_fd;
+
+        /* Chunked transfer coding; the prefix and ring data are each sent
+         * as chunks */
+        int chunked;
+        struct http_chunk chunk;
+
+        /* A write queued by stream_client_queue(), framing included */
+        struct iovec queued[4];
+
+        /* Streams with sync points only */
+        int synced;      /* whether rd is at or after a sync point */
+        struct stream_prefix * prefix; /* a reference, or NULL */
+        size_t prefix_len, prefix_off;
+
+        /* Frame rate limiting; frame_id is the sync point last joined */
+        uint64_t frame_id;
+        int in_frame;            /* still sending frame_id */
+        uint64_t frame_interval; /* microseconds, or 0 to send every frame */
+        uint64_t next_frame;     /* when the next frame is due */
+
+        /* DVR; times are microseconds since the epoch, and end_time is 0
+         * for a client that is never ended */
+        uint64_t start_time;
+        uint64_t end_time;
+        uint64_t end_seq;        /* where end_time is, once it is indexed */
+
+        /* Zero-copy clients only */
+        int pipe[2];
+        _Atomic int dropped;
+        list_t * node;   /* in stream->zc_clients */
+};
+
+/* Monotonic time in microseconds */
+static uint64_t
+stream_now (void)
+{
+        struct timespec ts;
+
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Wall-clock time in microseconds since the epoch */
+static uint64_t
+stream_time (void)
+{
+        struct timespec ts;
+
+        clock_gettime (CLOCK_REALTIME, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+stream_eof (struct stream * stream)
+{
+        stream->active = 0;
+        ringbuffer_signal (&stream->rb);
+}
+
+static struct stream_prefix *
+stream_prefix_ref (struct stream_prefix * prefix)
+{
+        if (prefix != NULL)
+                atomic_fetch_add (&prefix->refcount, 1);
+        return prefix;
+}
+
+static void
+stream_prefix_unref (struct stream_prefix * prefix)
+{
+        if (prefix != NULL && atomic_fetch_sub (&prefix->refcount, 1) == 1)
+                free (prefix);
+}
+
+/* Whether prefix, which may be NULL for none, holds data */
+static int
+stream_prefix_equal (const struct stream_prefix * prefix, const unsigned char * data,
+                     size_t len)
+{
+        if (prefix == NULL)
+                return len == 0;
+
+        return prefix->len == len && !memcmp (prefix->data, data, len);
+}
+
+/*
+ * Add sync point id to the DVR index, unless one was indexed within the last
+ * STREAM_INDEX_INTERVAL. Its prefix is shared with any earlier entry that
+ * has the same prefix, or replaces the oldest. Called with sync_mutex held.
+ */
+static void
+stream_index_add (struct stream * stream, uint64_t id, uint64_t pos,
+                  struct stream_prefix * prefix)
+{
+        struct stream_index_entry * e;
+        struct stream_sync * p;
+        uint64_t now = stream_time ();
+        int i;
+
+        if (stream->nr_indexed > 0) {
+                e = &stream->index[(stream->nr_indexed - 1) % stream->index_size];
+                if (now < e->time + STREAM_INDEX_INTERVAL)
+                        return;
+        }
+
+        for (i = 0; i < STREAM_INDEX_PREFIXES; i++) {
+                p = &stream->index_prefixes[i];
+                if (p->id != 0 &&
+                    (p->prefix == prefix ||
+                     (prefix != NULL && stream_prefix_equal (p->prefix, prefix->data, prefix->len))))
+                        break;
+        }
+
+        if (i == STREAM_INDEX_PREFIXES) {
+                /* Prefix ids start at 1, so that 0 marks an unused slot */
+                stream->nr_index_prefixes++;
+                p = &stream->index_prefixes[stream->nr_index_prefixes % STREAM_INDEX_PREFIXES];
+                p->id = stream->nr_index_prefixes;
+                stream_prefix_unref (p->prefix);
+                p->prefix = stream_prefix_ref (prefix);
+        }
+
+        e = &stream->index[stream->nr_indexed % stream->index_size];
+        e->time = now;
+        e->seq = pos;
+        e->id = id;
+        e->prefix = p->id;
+        stream->nr_indexed++;
+}
+
+/* The first entry in the DVR index at or after time, or nr_indexed if there
+ * is none yet. Called with sync_mutex held */
+static uint64_t
+stream_index_find (struct stream * stream, uint64_t time)
+{
+        uint64_t lo = 0, hi = stream->nr_indexed, mid;
+
+        if (hi > stream->index_size)
+                lo = hi - stream->index_size;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (stream->index[mid % stream->index_size].time < time)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+/* Record a sync point at pos, and the data to send before it */
+int
+stream_mark_sync (struct stream * stream, uint64_t pos, const unsigned char * prefix,
+                  size_t prefix_len)
+{
+        struct stream_sync * sync;
+        struct stream_prefix * p = NULL, * last;
+        uint64_t id = atomic_load (&stream->rb.nr_syncs);
+
+        if (prefix_len > STREAM_PREFIX_MAX)
+                return -1;
+
+        /* The prefix is in place before the sync point is visible */
+        pthread_mutex_lock (&stream->sync_mutex);
+
+        /* Sync points mostly carry the same prefix as the one before */
+        last = stream->syncs[(id + STREAM_SYNC_PREFIXES - 1) % STREAM_SYNC_PREFIXES].prefix;
+        if (prefix_len == 0) {
+                p = NULL;
+        } else if (stream_prefix_equal (last, prefix, prefix_len)) {
+                p = stream_prefix_ref (last);
+        } else if ((p = malloc (sizeof(*p) + prefix_len)) != NULL) {
+                atomic_init (&p->refcount, 1);
+                p->len = prefix_len;
+                memcpy (p->data, prefix, prefix_len);
+        } else {
+                pthread_mutex_unlock (&stream->sync_mutex);
+                return -1;
+        }
+
+        sync = &stream->syncs[id % STREAM_SYNC_PREFIXES];
+        stream_prefix_unref (sync->prefix);
+        sync->id = id;
+        sync->prefix = p;
+        if (stream->index)
+                stream_index_add (stream, id, pos, p);
+        pthread_mutex_unlock (&stream->sync_mutex);
+
+        ringbuffer_mark_sync (&stream->rb, pos);
+
+        return 0;
+}
+
+/* Called by the parser for each IDR access unit */
+static void
+stream_h264_sync (uint64_t pos, const unsigned char * params, size_t params_len, void * data)
+{
+        stream_mark_sync ((struct stream *)data, pos, params, params_len);
+}
+
+/* Called by the parser for each part of a multipart stream */
+static void
+stream_multipart_sync (uint64_t pos, void * data)
+{
+        stream_mark_sync ((struct stream *)data, pos, NULL, 0);
+}
+
+/* Pass newly written data to the stream's parser, if any */
+static void
+stream_parse (struct stream * stream, const unsigned char * buf, size_t len)
+{
+        int i;
+
+        if (stream->h264)
+                h264_parser_scan (stream->h264, buf, len);
+        else if (stream->multipart)
+                multipart_parser_scan (stream->multipart, buf, len);
+
+        for (i = 0; i < stream->nr_taps; i++)
+                stream->taps[i] (buf, len, stream->tap_data[i]);
+}
+
 static void *
-stream_writer (struct stream * stream)
+stream_writer (void * data)
 {
-        size_t available;
+        struct stream * stream = (struct stream *)data;
+        uint64_t before;
         ssize_t n;
         fd_set rfds;
         struct timeval tv;
         int retval;
 
-        stream->active = 1;
-
         while (stream->active) {
                 FD_ZERO (&rfds);
                 FD_SET (stream->input_fd, &rfds);
 
                 tv.tv_sec = 5;
                 tv.tv_usec = 0;
-                retval = select (1, &rfds, NULL, NULL, &tv);
-                if (retval == -1)
+                retval = select (stream->input_fd + 1, &rfds, NULL, NULL, &tv);
+                if (retval == -1) {
                         perror ("select");
-                else if (retval) {
+                } else if (retval) {
+                        before = ringbuffer_tail (&stream->rb);
                         n = ringbuffer_readfd (stream->input_fd, &stream->rb);
+                        if (n > 0)
+                                stream_parse (stream, stream->rb.data + before % stream->rb.size, n);
+                        if (n == 0) {
+                                stream_eof (stream);
+                        } else if (n == -1 && errno == EAGAIN) {
+                                /* Full; wait for the slowest reader */
+                                ringbuffer_wait_room (&stream->rb, 1, 1000);
+                        } else if (n == -1 && errno != EINTR) {
+                                perror ("read");
+                                stream_eof (stream);
+                        }
 #ifdef DEBUG
                         if (n!=0) printf ("stream_writer: read %ld bytes\n", n);
 #endif
@@ -46,15 +314,130 @@ stream_writer (struct stream * stream)
         return NULL;
 }
 
+/*
+ * Duplicate the len bytes at the head of the input pipe into each
+ * zero-copy client's pipe. tee() always starts at the head of the pipe, so
+ * a client that only accepts part of the data misses the rest of it.
+ * The writer never waits here, as the worker that drains a full pipe may
+ * itself be waiting for clients_mutex; under the block policy such clients
+ * skip data, as they would under skip.
+ */
+static void
+stream_zero_copy_tee (struct stream * stream, size_t len)
+{
+        struct stream_client * c;
+        list_t * l;
+        ssize_t n;
+
+        pthread_mutex_lock (&stream->clients_mutex);
+        for (l = stream->zc_clients; l; l = l->next) {
+                c = (struct stream_client *)l->data;
+                if (atomic_load (&c->dropped))
+                        continue;
+
+                n = tee (stream->pipe[0], c->pipe[1], len, SPLICE_F_NONBLOCK);
+                if (n == (ssize_t)len)
+                        continue;
+
+                if (stream->rb.policy == RINGBUFFER_DROP) {
+                        atomic_store (&c->dropped, 1);
+                        atomic_fetch_add (&stream->rb.nr_dropped, 1);
+                } else {
+                        atomic_fetch_add (&stream->rb.nr_skipped, 1);
+                }
+        }
+        pthread_mutex_unlock (&stream->clients_mutex);
+}
+
+/* Consume len bytes from the input pipe, into the ringbuffer if there are
+ * any readers there */
+static int
+stream_zero_copy_drain (struct stream * stream, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                if (atomic_load (&stream->nr_ring_clients) > 0) {
+                        n = ringbuffer_readfd_max (stream->pipe[0], &stream->rb, len);
+                        if (n == -1 && errno == EAGAIN) {
+                                ringbuffer_wait_room (&stream->rb, 1, 1000);
+                                continue;
+                        }
+                } else {
+                        n = splice (stream->pipe[0], NULL, stream->devnull, NULL, len, SPLICE_F_MOVE);
+                }
+
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        perror ("stream_zero_copy_drain");
+                        return -1;
+                } else if (n == 0) {
+                        /* The tee()d data is gone from the pipe */
+                        return -1;
+                }
+                len -= n;
+        }
+
+        return 0;
+}
+
+static void *
+stream_zero_copy_writer (void * data)
+{
+        struct stream * stream = (struct stream *)data;
+        ssize_t n;
+
+        while (stream->active) {
+                n = splice (stream->input_fd, NULL, stream->pipe[1], NULL, ZERO_COPY_CHUNK,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (n == -1) {
+                        if (errno == EINTR || errno == EAGAIN)
+                                continue;
+                        perror ("splice");
+                        break;
+                } else if (n == 0) {
+                        break;
+                }
+
+                stream_zero_copy_tee (stream, n);
+
+                if (stream_zero_copy_drain (stream, n) == -1)
+                        break;
+
+                ringbuffer_signal (&stream->rb);
+
+#ifdef DEBUG
+                printf ("stream_zero_copy_writer: spliced %ld bytes\n", n);
+#endif
+        }
+
+        stream_eof (stream);
+
+        return NULL;
+}
+
+/* splice() needs a pipe, regular file or socket on the input side */
+static int
+stream_can_splice (int fd)
+{
+        struct stat statbuf;
+
+        if (fstat (fd, &statbuf) == -1)
+                return 0;
+
+        return (S_ISFIFO (statbuf.st_mode) || S_ISREG (statbuf.st_mode) ||
+                S_ISSOCK (statbuf.st_mode));
+}
+
 struct stream *
-stream_open (int fd)
+stream_new (enum ringbuffer_policy policy, enum stream_format format, const char * content_type)
 {
         struct stream * stream;
-	pthread_t child;
         unsigned char * data;
         size_t len = 4096*16*32;
 
-        if ((stream = malloc (sizeof(*stream))) == NULL)
+        if ((stream = calloc (1, sizeof(*stream))) == NULL)
                 return NULL;
 
         if ((data = malloc (len)) == NULL) {
@@ -62,20 +445,1044 @@ stream_open (int fd)
                 return NULL;
         }
 
+	stream->input_fd = -1;
+        stream->active = 1;
+
+        if (ringbuffer_init (&stream->rb, data, len) == -1) {
+                free (data);
+                free (stream);
+                return NULL;
+        }
+        ringbuffer_set_policy (&stream->rb, policy);
+
+        if (format == STREAM_FORMAT_H264) {
+                stream->h264 = h264_parser_new (stream_h264_sync, stream);
+        } else if (format == STREAM_FORMAT_MJPEG) {
+                stream->multipart = multipart_parser_new (content_type, stream_multipart_sync,
+                                                          stream);
+                if (stream->multipart == NULL)
+                        fprintf (stderr, "Format mjpeg: no boundary in content type %s\n",
+                                 content_type ? content_type : "(none)");
+        }
+        if (stream->h264 || stream->multipart || format == STREAM_FORMAT_FMP4)
+                stream->format = format;
+        pthread_mutex_init (&stream->sync_mutex, NULL);
+
+        pthread_mutex_init (&stream->clients_mutex, NULL);
+        stream->zc_clients = list_new ();
+        stream->pipe[0] = stream->pipe[1] = stream->devnull = -1;
+
+        return stream;
+}
+
+int
+stream_set_dvr (struct stream * stream, const struct stream_dvr * dvr)
+{
+        struct stream_index_entry * index;
+        uint64_t index_size = STREAM_INDEX_DEFAULT;
+        unsigned char * data;
+        int fd;
+
+        if (stream->format == STREAM_FORMAT_NONE) {
+                fprintf (stderr, "DVRPath: only available for streams with a Format\n");
+                return -1;
+        }
+
+        if (dvr->duration > 0)
+                index_size = dvr->duration * 1000000 / STREAM_INDEX_INTERVAL + 1;
+
+        if ((index = calloc (index_size, sizeof(*index))) == NULL)
+                return -1;
+
+        if ((fd = open (dvr->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+                perror (dvr->path);
+                free (index);
+                return -1;
+        }
+
+        /* The file's pages are only allocated as they are written */
+        if (ftruncate (fd, dvr->size) == -1 ||
+            (data = mmap (NULL, dvr->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+                perror (dvr->path);
+                close (fd);
+                free (index);
+                return -1;
+        }
+        close (fd);
+
+        /* Nothing has been written yet, so the data can simply be replaced */
+        free (stream->rb.data);
+        stream->rb.data = data;
+        stream->rb.size = dvr->size;
+
+        stream->dvr_size = dvr->size;
+        stream->index = index;
+        stream->index_size = index_size;
+
+        return 0;
+}
+
+void
+stream_write (struct stream * stream, const unsigned char * buf, size_t len)
+{
+        size_t n;
+
+        while (len > 0) {
+                n = (len > STREAM_WRITE_CHUNK) ? STREAM_WRITE_CHUNK : len;
+
+                if (stream->rb.policy == RINGBUFFER_BLOCK) {
+                        while (stream->active && ringbuffer_wait_room (&stream->rb, n, 1000) < n)
+                                ;
+                }
+
+                ringbuffer_write (&stream->rb, buf, n);
+                stream_parse (stream, buf, n);
+
+                buf += n;
+                len -= n;
+        }
+}
+
+int
+stream_add_tap (struct stream * stream, StreamTap tap, void * data)
+{
+        if (stream->nr_taps == STREAM_MAX_TAPS)
+                return -1;
+
+        stream->taps[stream->nr_taps] = tap;
+        stream->tap_data[stream->nr_taps] = data;
+        stream->nr_taps++;
+
+        return 0;
+}
+
+int
+stream_start (struct stream * stream, int fd, int zero_copy_clients)
+{
+	pthread_t child;
+
 	stream->input_fd = fd;
 
-        ringbuffer_init (&stream->rb, data, len);
-	pthread_create(&child, 0, stream_writer, stream);
+        if (zero_copy_clients > 0 && (stream->format != STREAM_FORMAT_NONE || stream->nr_taps > 0)) {
+                fprintf (stderr, "ZeroCopy: not available for streams with a Format, HLS or FMP4, "
+                         "using the ring buffer\n");
+                zero_copy_clients = 0;
+        }
+
+        if (zero_copy_clients > 0 && !stream_can_splice (fd)) {
+                fprintf (stderr, "ZeroCopy: input cannot be spliced, using the ring buffer\n");
+                zero_copy_clients = 0;
+        }
+
+        if (zero_copy_clients > 0) {
+                if (pipe2 (stream->pipe, O_CLOEXEC) == -1 ||
+                    (stream->devnull = open ("/dev/null", O_WRONLY | O_CLOEXEC)) == -1) {
+                        perror ("ZeroCopy");
+                        zero_copy_clients = 0;
+                }
+        }
+        stream->zero_copy_clients = zero_copy_clients;
+
+	if (pthread_create (&child, 0, zero_copy_clients > 0 ? stream_zero_copy_writer : stream_writer,
+                            stream) != 0)
+                return -1;
 	pthread_detach(child);
 
+        return 0;
+}
+
+struct stream *
+stream_open (int fd, enum ringbuffer_policy policy, enum stream_format format,
+             const char * content_type, int zero_copy_clients)
+{
+        struct stream * stream;
+
+        if ((stream = stream_new (policy, format, content_type)) == NULL)
+                return NULL;
+
+        if (stream_start (stream, fd, zero_copy_clients) == -1) {
+                stream_close (stream);
+                return NULL;
+        }
+
         return stream;
 }
 
 void
 stream_close (struct stream * stream)
 {
+        int i;
+
         stream->active = 0;
-        free (stream->rb.data);
+        ringbuffer_destroy (&stream->rb);
+        if (stream->dvr_size > 0)
+                munmap (stream->rb.data, stream->dvr_size);
+        else
+                free (stream->rb.data);
+        free (stream->index);
+
+        if (stream->h264)
+                h264_parser_free (stream->h264);
+        if (stream->multipart)
+                multipart_parser_free (stream->multipart);
+        for (i = 0; i < STREAM_SYNC_PREFIXES; i++)
+                stream_prefix_unref (stream->syncs[i].prefix);
+        for (i = 0; i < STREAM_INDEX_PREFIXES; i++)
+                stream_prefix_unref (stream->index_prefixes[i].prefix);
+        pthread_mutex_destroy (&stream->sync_mutex);
+
+        if (stream->pipe[0] != -1) {
+                close (stream->pipe[0]);
+                close (stream->pipe[1]);
+        }
+        if (stream->devnull != -1)
+                close (stream->devnull);
 
         free (stream);
 }
+
+static struct stream_client *
+stream_client_open_zero_copy (struct stream * stream, struct stream_client * c)
+{
+        if (pipe2 (c->pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+                return NULL;
+
+        /* A larger pipe lets a client absorb bursts; this may fail if it
+         * exceeds /proc/sys/fs/pipe-max-size, which is harmless */
+        fcntl (c->pipe[1], F_SETPIPE_SZ, ZERO_COPY_PIPE_SIZE);
+
+        atomic_init (&c->dropped, 0);
+
+        pthread_mutex_lock (&stream->clients_mutex);
+        stream->zc_clients = list_prepend (stream->zc_clients, c);
+        c->node = stream->zc_clients;
+        stream->nr_zc_clients++;
+        pthread_mutex_unlock (&stream->clients_mutex);
+
+        return c;
+}
+
+/* Queue prefix, a reference the client takes over, to be sent next */
+static void
+stream_client_set_prefix (struct stream_client * c, struct stream_prefix * prefix)
+{
+        stream_prefix_unref (c->prefix);
+        c->prefix = prefix;
+        c->prefix_len = prefix ? prefix->len : 0;
+        c->prefix_off = 0;
+}
+
+/*
+ * Move a client to sync point id, and queue the data that must precede it.
+ * Returns -1 if it is no longer in the buffer.
+ */
+static int
+stream_client_join_id (struct stream * stream, struct stream_client * c, uint64_t id)
+{
+        struct stream_sync * sync;
+        uint64_t seq;
+        int ret = -1;
+
+        c->synced = 0;
+
+        if (ringbuffer_sync_get (&stream->rb, id, &seq) == -1)
+                return -1;
+
+        /* The prefix may already have been reused for a later sync point */
+        pthread_mutex_lock (&stream->sync_mutex);
+        sync = &stream->syncs[id % STREAM_SYNC_PREFIXES];
+        if (sync->id == id) {
+                stream_client_set_prefix (c, stream_prefix_ref (sync->prefix));
+                ret = 0;
+        }
+        pthread_mutex_unlock (&stream->sync_mutex);
+
+        if (ret == -1 || ringbuffer_seek (&stream->rb, c->rd, seq) == -1)
+                return -1;
+
+        c->synced = 1;
+        c->frame_id = id;
+        c->in_frame = 1;
+
+        return 0;
+}
+
+/* Move a client to the most recent sync point. Returns -1 if there is none
+ * in the buffer */
+static int
+stream_client_join (struct stream * stream, struct stream_client * c)
+{
+        uint64_t id, seq;
+
+        c->synced = 0;
+
+        if (ringbuffer_sync_latest (&stream->rb, &id, &seq) == -1)
+                return -1;
+
+        return stream_client_join_id (stream, c, id);
+}
+
+struct stream_client *
+stream_client_open (struct stream * stream, int notify_fd, int chunked)
+{
+        struct stream_client * c;
+        int zero_copy;
+
+	if ((c = calloc (1, sizeof(*c))) == NULL)
+		return NULL;
+
+        c->rd = -1;
+        c->notify_fd = notify_fd;
+        c->synced = (stream->format == STREAM_FORMAT_NONE);
+        c->chunked = chunked;
+        http_chunk_init (&c->chunk);
+
+        if (ringbuffer_watch (&stream->rb, notify_fd) == -1) {
+                free (c);
+                return NULL;
+        }
+
+        /* Chunk framing goes out with the data from the ring buffer, which
+         * splice() cannot do */
+        pthread_mutex_lock (&stream->clients_mutex);
+        zero_copy = !chunked && (stream->nr_zc_clients < stream->zero_copy_clients);
+        pthread_mutex_unlock (&stream->clients_mutex);
+
+        if (zero_copy) {
+                if (stream_client_open_zero_copy (stream, c) == NULL)
+                        goto err;
+        } else {
+                /* Too many clients to tee to; serve from the ring buffer */
+                if ((c->rd = ringbuffer_open (&stream->rb)) == -1)
+                        goto err;
+                atomic_fetch_add (&stream->nr_ring_clients, 1);
+
+                if (stream->format != STREAM_FORMAT_NONE)
+                        stream_client_join (stream, c);
+        }
+
+        return c;
+
+err:
+        ringbuffer_unwatch (&stream->rb, notify_fd);
+        free (c);
+        return NULL;
+}
+
+static ssize_t
+stream_client_pump_zero_copy (struct stream * stream, struct stream_client * c, int fd)
+{
+        ssize_t n;
+        int queued;
+
+        if (atomic_load (&c->dropped)) {
+                errno = ENOBUFS;
+                return -1;
+        }
+
+        if (ioctl (c->pipe[0], FIONREAD, &queued) == -1)
+                return -1;
+
+        if (queued == 0) {
+                if (!stream->active) {
+                        errno = EPIPE;
+                        return -1;
+                }
+                return 0;
+        }
+
+        n = splice (c->pipe[0], NULL, fd, NULL, queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1)
+                return -1;
+
+	/* A short write means the socket is full; wait until it drains */
+        if (n < queued) {
+                errno = EAGAIN;
+                return -1;
+        }
+
+        return n;
+}
+
+/*
+ * Under the skip policy, a client that falls more than half a buffer behind
+ * a stream with sync points drops whole frames before the writer has to
+ * overrun it: it is sent the rest of its current frame, and then moves to
+ * the latest sync point. Returns 1 if the client is at the start of a frame
+ * and should move; otherwise sets *max to what is left of its frame.
+ */
+static int
+stream_client_behind (struct stream * stream, struct stream_client * c, size_t * max)
+{
+        uint64_t id, seq, latest, pread;
+
+        if (ringbuffer_lag (&stream->rb, c->rd) <= (ssize_t)(stream->rb.size / 2))
+                return 0;
+
+        pread = ringbuffer_tell (&stream->rb, c->rd);
+        if (pread == 0 || ringbuffer_sync_next (&stream->rb, pread - 1, &id, &seq) == -1)
+                return 0;
+
+        if (seq > pread) {
+                *max = seq - pread;
+                return 0;
+        }
+
+        return (ringbuffer_sync_latest (&stream->rb, &id, &latest) == 0 && latest > pread);
+}
+
+/*
+ * For a client with a frame rate limit, send the rest of the current frame,
+ * and then nothing until the next is due, when the client moves to the
+ * latest complete frame. A frame is complete once the next one is marked,
+ * so the end of each frame sent is always known. Returns 1 if the client
+ * should wait; otherwise *max is limited to what is left of the frame.
+ */
+static int
+stream_client_decimate (struct stream * stream, struct stream_client * c, size_t * max)
+{
+        uint64_t id, seq, pread, now;
+
+        if (!c->synced || !c->in_frame) {
+                now = stream_now ();
+                if (now < c->next_frame)
+                        return 1;
+
+                if (ringbuffer_sync_latest (&stream->rb, &id, &seq) == -1 || id == 0 ||
+                    (c->synced && id - 1 <= c->frame_id) ||
+                    stream_client_join_id (stream, c, id - 1) == -1)
+                        return 1;
+
+                /* Keep to the requested rate on average, unless far behind */
+                c->next_frame += c->frame_interval;
+                if (c->next_frame < now)
+                        c->next_frame = now + c->frame_interval;
+        }
+
+        if (ringbuffer_sync_get (&stream->rb, c->frame_id + 1, &seq) == -1) {
+                /* Overrun; wait to rejoin */
+                c->synced = 0;
+                return 1;
+        }
+
+        pread = ringbuffer_tell (&stream->rb, c->rd);
+        if (seq <= pread) {
+                /* Sent the whole frame */
+                c->in_frame = 0;
+                return 1;
+        }
+
+        if (seq - pread < *max)
+                *max = seq - pread;
+
+        return 0;
+}
+
+/* Write what is left of a client's prefix. The frame it belongs to is
+ * already in the ring buffer, and is written next; the prefix is held with
+ * MSG_MORE to go out in the same segment */
+static ssize_t
+stream_client_write_prefix (struct stream_client * c, int fd)
+{
+        struct iovec iov;
+        ssize_t n;
+
+        iov.iov_base = c->prefix->data + c->prefix_off;
+        iov.iov_len = c->prefix_len - c->prefix_off;
+
+        if (c->chunked)
+                n = http_chunk_writev (fd, &c->chunk, &iov, 1);
+        else
+                n = send (fd, iov.iov_base, iov.iov_len, MSG_MORE);
+
+        if (n > 0)
+                c->prefix_off += n;
+
+        return n;
+}
+
+/*
+ * Check, after a write from the ring buffer, whether the writer overran the
+ * client meanwhile: the data may have been overwritten as it went out, so
+ * nothing more of it can be trusted. Under the drop policy the client is
+ * dropped, returning -1 with errno ENOBUFS. Otherwise it discards what is
+ * left, and a client of a stream with sync points waits for the next one,
+ * from which it is sent the prefix data again.
+ */
+static int
+stream_client_check_overrun (struct stream * stream, struct stream_client * c)
+{
+        if (!ringbuffer_lagged (&stream->rb, c->rd))
+                return 0;
+
+        if (stream->rb.policy == RINGBUFFER_DROP) {
+                atomic_fetch_add (&stream->rb.nr_dropped, 1);
+                errno = ENOBUFS;
+                return -1;
+        }
+
+        atomic_fetch_add (&stream->rb.nr_skipped, 1);
+        ringbuffer_seek (&stream->rb, c->rd, ringbuffer_tail (&stream->rb));
+        if (stream->format != STREAM_FORMAT_NONE)
+                c->synced = 0;
+
+        return 0;
+}
+
+/* Write up to max bytes from the ring buffer as a chunk, or the rest of the
+ * chunk in progress */
+static ssize_t
+stream_client_write_chunk (struct stream * stream, struct stream_client * c, int fd,
+                           size_t max)
+{
+        struct iovec iov[2];
+        ssize_t n;
+        int cnt;
+
+        if (http_chunk_pending (&c->chunk))
+                max = c->chunk.left;
+
+        if ((cnt = ringbuffer_peek (&stream->rb, c->rd, max, iov)) == -1)
+                return -1;
+
+        if (cnt == 0 && !http_chunk_pending (&c->chunk))
+                return 0;
+
+        if ((n = http_chunk_writev (fd, &c->chunk, iov, cnt)) > 0) {
+                ringbuffer_consume (&stream->rb, c->rd, n);
+                if (stream_client_check_overrun (stream, c) == -1)
+                        return -1;
+        }
+
+        return n;
+}
+
+/*
+ * Finish the chunk a chunked client was last sent, before anything else
+ * can go out. A chunk holds either prefix data or ring data; a client
+ * sent the rest of its prefix is at the ring data. Returns -1 with errno
+ * EAGAIN if the socket fills first.
+ */
+static ssize_t
+stream_client_finish_chunk (struct stream * stream, struct stream_client * c, int fd)
+{
+        ssize_t n;
+
+        if (c->prefix_off < c->prefix_len)
+                n = stream_client_write_prefix (c, fd);
+        else
+                n = stream_client_write_chunk (stream, c, fd, 0);
+
+        if (n != -1 && http_chunk_pending (&c->chunk)) {
+                errno = EAGAIN;
+                return -1;
+        }
+
+        return n;
+}
+
+/* Under the skip policy, a client that has fallen behind stops being synced
+ * and waits to rejoin; otherwise *max may be limited as for
+ * stream_client_behind() */
+static void
+stream_client_check_skip (struct stream * stream, struct stream_client * c, size_t * max)
+{
+        if (c->synced && stream->rb.policy == RINGBUFFER_SKIP &&
+            (ringbuffer_lagged (&stream->rb, c->rd) || stream_client_behind (stream, c, max))) {
+                atomic_fetch_add (&stream->rb.nr_skipped, 1);
+                c->synced = 0;
+        }
+}
+
+/*
+ * Keep a client of a stream with sync points aligned to them: a client that
+ * has not yet joined, or that skipped data, waits for the next sync point.
+ * Then send it the prefix data for its sync point. *max is set to the most
+ * that may be sent from the ring buffer, which is 0 if a client with a frame
+ * rate limit has nothing due. Returns the number of bytes written, or -1.
+ */
+static ssize_t
+stream_client_sync (struct stream * stream, struct stream_client * c, int fd, size_t * max)
+{
+        ssize_t n;
+
+        *max = stream->rb.size;
+
+        stream_client_check_skip (stream, c, max);
+
+        if (c->frame_interval > 0) {
+                if (stream_client_decimate (stream, c, max)) {
+                        /* Discard data until the next frame is due */
+                        ringbuffer_seek (&stream->rb, c->rd, ringbuffer_tail (&stream->rb));
+                        *max = 0;
+                        return 0;
+                }
+        } else if (!c->synced && stream_client_join (stream, c) == -1) {
+                /* Discard data until there is somewhere to start */
+                ringbuffer_seek (&stream->rb, c->rd, ringbuffer_tail (&stream->rb));
+                return 0;
+        }
+
+        if (c->prefix_off == c->prefix_len)
+                return 0;
+
+        if ((n = stream_client_write_prefix (c, fd)) == -1)
+                return -1;
+
+        if (c->prefix_off < c->prefix_len || (c->chunked && http_chunk_pending (&c->chunk))) {
+                errno = EAGAIN;
+                return -1;
+        }
+
+        return n;
+}
+
+/*
+ * Whether a client with a DVR end time has reached it. The end is only
+ * known once a sync point at or after end_time has been indexed; until then
+ * the client continues as usual. Otherwise *max is limited to what is left.
+ */
+static int
+stream_client_ended (struct stream * stream, struct stream_client * c, size_t * max)
+{
+        uint64_t i, pread;
+
+        if (c->end_seq == 0) {
+                pthread_mutex_lock (&stream->sync_mutex);
+                if ((i = stream_index_find (stream, c->end_time)) < stream->nr_indexed)
+                        c->end_seq = stream->index[i % stream->index_size].seq;
+                pthread_mutex_unlock (&stream->sync_mutex);
+                if (c->end_seq == 0)
+                        return 0;
+        }
+
+        pread = ringbuffer_tell (&stream->rb, c->rd);
+        if (pread >= c->end_seq)
+                return 1;
+
+        if (c->end_seq - pread < *max)
+                *max = c->end_seq - pread;
+
+        return 0;
+}
+
+/* Finish a client's response: a chunked body is complete, and the
+ * connection can carry another request */
+static ssize_t
+stream_client_end (struct stream_client * c, int fd)
+{
+        if (c->chunked)
+                return (http_chunk_end (fd, &c->chunk) == -1) ? -1 : RESOURCE_PUMP_END;
+
+        errno = EPIPE;
+        return -1;
+}
+
+ssize_t
+stream_client_pump (struct stream * stream, struct stream_client * c, int fd)
+{
+	ssize_t n, sent = 0;
+        size_t max = stream->rb.size;
+
+        if (c->rd == -1)
+                return stream_client_pump_zero_copy (stream, c, fd);
+
+        if (c->chunked && http_chunk_pending (&c->chunk) &&
+            (sent = stream_client_finish_chunk (stream, c, fd)) == -1)
+                return -1;
+
+        if (stream->format != STREAM_FORMAT_NONE) {
+                if ((n = stream_client_sync (stream, c, fd, &max)) == -1)
+                        return -1;
+                sent += n;
+        }
+
+        if (c->end_time > 0 && c->synced && stream_client_ended (stream, c, &max))
+                return stream_client_end (c, fd);
+
+	if (!c->synced || max == 0 || ringbuffer_avail (&stream->rb, c->rd) == 0) {
+                if (!stream->active)
+                        return stream_client_end (c, fd);
+		return sent;
+        }
+
+        if (c->chunked) {
+                n = stream_client_write_chunk (stream, c, fd, max);
+        } else if ((n = ringbuffer_writefd_max (fd, &stream->rb, c->rd, max)) > 0 &&
+                   stream_client_check_overrun (stream, c) == -1) {
+                return -1;
+        }
+
+	/* A short write means the socket is full; wait until it drains */
+	if ((n > 0 && ringbuffer_avail (&stream->rb, c->rd) > 0) ||
+            (n != -1 && c->chunked && http_chunk_pending (&c->chunk))) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+#ifdef DEBUG
+	printf ("stream_reader: wrote %ld bytes to socket\n", n);
+#endif
+
+	return (n == -1) ? -1 : sent + n;
+}
+
+int
+stream_client_queue (struct stream * stream, struct stream_client * c, int fd,
+                     struct uring * u, void * tag)
+{
+        struct iovec iov[2];
+        size_t max = stream->rb.size;
+        int cnt, index;
+
+        /* Only ring data goes this way; zero-copy clients, those with a
+         * prefix or chunk to finish, and those with a frame rate or end
+         * time take the usual path */
+        if (c->rd == -1 || c->prefix_off < c->prefix_len || c->frame_interval > 0 ||
+            c->end_time > 0 || (c->chunked && http_chunk_pending (&c->chunk)))
+                return 0;
+
+        if (stream->format != STREAM_FORMAT_NONE) {
+                stream_client_check_skip (stream, c, &max);
+                if (!c->synced)
+                        return 0;
+        }
+
+        if ((cnt = ringbuffer_peek (&stream->rb, c->rd, max, iov)) <= 0)
+                return 0;
+
+        if (c->chunked) {
+                cnt = http_chunk_iov (&c->chunk, iov, cnt, c->queued);
+                return (cnt > 0 && uring_queue_writev (u, fd, c->queued, cnt, tag) == 0);
+        }
+
+        /* Contiguous data is written straight from the registered ring */
+        if (cnt == 1 && (index = uring_buffer (u, stream->rb.data, stream->rb.size)) != -1)
+                return (uring_queue_write_fixed (u, fd, iov[0].iov_base, iov[0].iov_len,
+                                                 index, tag) == 0);
+
+        memcpy (c->queued, iov, cnt * sizeof(*iov));
+        return (uring_queue_writev (u, fd, c->queued, cnt, tag) == 0);
+}
+
+ssize_t
+stream_client_complete (struct stream * stream, struct stream_client * c, int res)
+{
+        size_t n;
+
+        if (res < 0) {
+                errno = -res;
+                return -1;
+        }
+
+        n = c->chunked ? http_chunk_advance (&c->chunk, res) : (size_t)res;
+        ringbuffer_consume (&stream->rb, c->rd, n);
+
+        /* The writer may have overrun the data while the kernel copied it */
+        if (n > 0 && stream_client_check_overrun (stream, c) == -1)
+                return -1;
+
+        /* A short write means the socket is full; wait until it drains */
+        if (ringbuffer_avail (&stream->rb, c->rd) > 0 ||
+            (c->chunked && http_chunk_pending (&c->chunk))) {
+                errno = EAGAIN;
+                return -1;
+        }
+
+        return res;
+}
+
+int
+stream_client_set_fps (struct stream * stream, struct stream_client * c, double fps)
+{
+        if (stream->format != STREAM_FORMAT_MJPEG || c->rd == -1 || fps <= 0)
+                return -1;
+
+        /* Start at the latest complete frame */
+        c->frame_interval = 1000000 / fps;
+        c->next_frame = stream_now ();
+        c->synced = 0;
+
+        return 0;
+}
+
+int
+stream_client_seek_time (struct stream * stream, struct stream_client * c, double t)
+{
+        struct stream_index_entry * e;
+        struct stream_sync * p;
+        uint64_t i, time;
+        int ret = -1;
+
+        if (stream->index == NULL || c->rd == -1)
+                return -1;
+
+        if (t <= 0)
+                t += stream_time () / 1000000.0;
+        time = (t > 0) ? t * 1000000 : 0;
+
+        /* Entries whose data or prefix has since been overwritten are
+         * passed over, leaving the oldest that can still be sent */
+        pthread_mutex_lock (&stream->sync_mutex);
+        for (i = stream_index_find (stream, time); i < stream->nr_indexed; i++) {
+                e = &stream->index[i % stream->index_size];
+                p = &stream->index_prefixes[e->prefix % STREAM_INDEX_PREFIXES];
+                if (p->id != e->prefix || ringbuffer_seek (&stream->rb, c->rd, e->seq) == -1)
+                        continue;
+
+                stream_client_set_prefix (c, stream_prefix_ref (p->prefix));
+                c->synced = 1;
+                c->frame_id = e->id;
+                c->in_frame = 1;
+                c->start_time = e->time;
+                ret = 0;
+                break;
+        }
+        pthread_mutex_unlock (&stream->sync_mutex);
+
+        return ret;
+}
+
+int
+stream_client_set_duration (struct stream * stream, struct stream_client * c, double duration)
+{
+        if (stream->index == NULL || c->rd == -1 || duration <= 0)
+                return -1;
+
+        /* A client that did not seek starts live */
+        if (c->start_time == 0)
+                c->start_time = stream_time ();
+
+        c->end_time = c->start_time + duration * 1000000;
+        c->end_seq = 0;
+
+        return 0;
+}
+
+void
+stream_client_close (struct stream * stream, struct stream_client * c)
+{
+	ringbuffer_unwatch (&stream->rb, c->notify_fd);
+
+        if (c->rd == -1) {
+                pthread_mutex_lock (&stream->clients_mutex);
+                stream->zc_clients = list_remove (stream->zc_clients, c->node);
+                stream->nr_zc_clients--;
+                pthread_mutex_unlock (&stream->clients_mutex);
+
+                free (c->node);
+                close (c->pipe[0]);
+                close (c->pipe[1]);
+        } else {
+                ringbuffer_close (&stream->rb, c->rd);
+                atomic_fetch_sub (&stream->nr_ring_clients, 1);
+        }
+
+        stream_prefix_unref (c->prefix);
+	free (c);
+}
+
+enum ringbuffer_policy
+stream_policy_parse (const char * value)
+{
+        if (value == NULL || !strcasecmp (value, "block"))
+                return RINGBUFFER_BLOCK;
+        else if (!strcasecmp (value, "skip"))
+                return RINGBUFFER_SKIP;
+        else if (!strcasecmp (value, "drop"))
+                return RINGBUFFER_DROP;
+
+        fprintf (stderr, "Unknown SlowClient policy %s, using block\n", value);
+        return RINGBUFFER_BLOCK;
+}
+
+int
+stream_chunked_parse (const char * value, int def)
+{
+        if (value == NULL)
+                return def;
+        else if (!strcasecmp (value, "on"))
+                return 1;
+        else if (!strcasecmp (value, "off"))
+                return 0;
+
+        fprintf (stderr, "Chunked must be on or off, ignoring %s\n", value);
+        return def;
+}
+
+int
+stream_size_parse (const char * value, size_t * size)
+{
+        /* The largest size that fits both size_t and off_t, plus one */
+        double limit = SIZE_MAX + 1.0;
+        double off_limit = (double)((off_t)1 << (sizeof(off_t) * 8 - 2)) * 2;
+        char * end;
+        double n;
+
+        if (off_limit < limit)
+                limit = off_limit;
+
+        n = strtod (value, &end);
+        if (end == value)
+                return -1;
+
+        switch (*end) {
+        case 't': case 'T': n *= 1024;
+        /* fall through */
+        case 'g': case 'G': n *= 1024;
+        /* fall through */
+        case 'm': case 'M': n *= 1024;
+        /* fall through */
+        case 'k': case 'K': n *= 1024;
+                end++;
+        }
+
+        /* Also rejects NaN */
+        if (*end != '\0' || !(n >= 1 && n < limit))
+                return -1;
+
+        *size = n;
+        return 0;
+}
+
+int
+stream_dvr_parse (struct stream_dvr * dvr, const char * path, const char * size,
+                  const char * duration)
+{
+        char * end;
+        double n;
+
+        if (path == NULL)
+                return -1;
+
+        dvr->path = path;
+        dvr->size = 0;
+        dvr->duration = 0;
+
+        if (size == NULL) {
+                fprintf (stderr, "DVRPath: no DVRSize given\n");
+                return -1;
+        }
+
+        /* Whole pages, so that the end of the mapping is backed by the file */
+        if (stream_size_parse (size, &dvr->size) == 0)
+                dvr->size &= ~((size_t)sysconf (_SC_PAGESIZE) - 1);
+        if (dvr->size == 0) {
+                fprintf (stderr, "DVRSize: invalid size %s\n", size);
+                return -1;
+        }
+
+        if (duration != NULL) {
+                n = strtod (duration, &end);
+                switch (*end) {
+                case 'd': case 'D': n *= 24;
+                /* fall through */
+                case 'h': case 'H': n *= 60;
+                /* fall through */
+                case 'm': case 'M': n *= 60;
+                }
+                if (n > 0)
+                        dvr->duration = n;
+                else
+                        fprintf (stderr, "DVRDuration: invalid duration %s, indexing a day\n",
+                                 duration);
+        }
+
+        return 0;
+}
+
+enum stream_format
+stream_format_parse (const char * value, const char * content_type, const char * path)
+{
+        const char * ext;
+
+        if (value == NULL) {
+                if (content_type && !strncasecmp (content_type, "video/h264", 10))
+                        return STREAM_FORMAT_H264;
+                if (content_type && !strncasecmp (content_type, "multipart/x-mixed-replace", 25))
+                        return STREAM_FORMAT_MJPEG;
+                if (path && (ext = strrchr (path, '.')) != NULL &&
+                    (!strcasecmp (ext, ".264") || !strcasecmp (ext, ".h264")))
+                        return STREAM_FORMAT_H264;
+                return STREAM_FORMAT_NONE;
+        }
+
+        if (!strcasecmp (value, "h264"))
+                return STREAM_FORMAT_H264;
+        else if (!strcasecmp (value, "mjpeg"))
+                return STREAM_FORMAT_MJPEG;
+        else if (!strcasecmp (value, "none"))
+                return STREAM_FORMAT_NONE;
+
+        fprintf (stderr, "Unknown stream Format %s, using none\n", value);
+        return STREAM_FORMAT_NONE;
+}
+
+static const char * policy_names[] = { "block", "skip", "drop" };
+
+void
+stream_write_status (int fd, const char * path, struct stream * stream)
+{
+        struct ringbuffer * rb = &stream->rb;
+        struct stream_client * c;
+        char buf[256];
+        int n, i, nr_readers, queued;
+        uint64_t indexed;
+        ssize_t lag;
+        list_t * l;
+
+        n = snprintf (buf, sizeof(buf),
+                      "<h2>%s</h2>\n<p>SlowClient %s: %llu skipped, %llu dropped</p>\n"
+                      "<p>%llu sync points</p>\n",
+                      path, policy_names[rb->policy],
+                      (unsigned long long)atomic_load (&rb->nr_skipped),
+                      (unsigned long long)atomic_load (&rb->nr_dropped),
+                      (unsigned long long)atomic_load (&rb->nr_syncs));
+        if (n > 0 && write (fd, buf, n) == -1)
+                return;
+
+        if (stream->index) {
+                pthread_mutex_lock (&stream->sync_mutex);
+                indexed = stream->nr_indexed;
+                if (indexed > stream->index_size)
+                        indexed = stream->index_size;
+                pthread_mutex_unlock (&stream->sync_mutex);
+
+                n = snprintf (buf, sizeof(buf), "<p>DVR: %zu MB, %llu sync points indexed</p>\n",
+                              stream->dvr_size >> 20, (unsigned long long)indexed);
+                if (write (fd, buf, n) == -1)
+                        return;
+        }
+
+        n = snprintf (buf, sizeof(buf), "<table>\n<tr><th>Reader</th><th>Lag (bytes)</th></tr>\n");
+        if (write (fd, buf, n) == -1)
+                return;
+
+        nr_readers = ringbuffer_max_readers (rb);
+        for (i = 0; i < nr_readers; i++) {
+                if ((lag = ringbuffer_lag (rb, i)) == -1)
+                        continue;
+
+                n = snprintf (buf, sizeof(buf), "<tr><td>%d</td><td>%ld</td></tr>\n",
+                              i, (long)lag);
+                if (write (fd, buf, n) == -1)
+                        return;
+        }
+
+        /* Zero-copy clients lag by whatever is still queued in their pipe */
+        pthread_mutex_lock (&stream->clients_mutex);
+        for (l = stream->zc_clients, i = 0; l; l = l->next, i++) {
+                c = (struct stream_client *)l->data;
+                if (ioctl (c->pipe[0], FIONREAD, &queued) == -1)
+                        continue;
+
+                n = snprintf (buf, sizeof(buf), "<tr><td>zero-copy %d</td><td>%d</td></tr>\n",
+                              i, queued);
+                if (write (fd, buf, n) == -1)
+                        break;
+        }
+        pthread_mutex_unlock (&stream->clients_mutex);
+
+        n = snprintf (buf, sizeof(buf), "</table>\n");
+        write (fd, buf, n);
+}
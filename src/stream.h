@@ -1,18 +1,240 @@
 #ifndef __STREAM_H__
 #define __STREAM_H__
 
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "list.h"
 #include "params.h"
 #include "ringbuffer.h"
+#include "h264-parse.h"
+#include "multipart-parse.h"
+
+/*
+ * A stream reads from an input fd in its own thread and fans the data out
+ * to any number of clients.
+ *
+ * Normally input is read into a ring buffer and written out to each
+ * client from there. In zero-copy mode, input is spliced into a pipe and
+ * tee()d into a pipe per client, which the client then splices to its
+ * socket, so the data never passes through user space. Each zero-copy
+ * client costs a pipe and a tee() per read, so only the first
+ * zero_copy_clients clients are served this way and the rest fall back to
+ * the ring buffer.
+ *
+ * If the stream's format is known, its input is parsed for points at which
+ * a client can start decoding, and new clients join at the most recent one
+ * rather than at whatever byte happens to be arriving. Parsing needs the
+ * data in the ring buffer, so zero-copy is not available for such streams.
+ *
+ * A stream with sync points may keep a DVR: its ring buffer is then a file
+ * mapped into memory, which can be far larger than RAM as the page cache
+ * decides what stays resident, and its sync points are indexed by
+ * wall-clock time so that clients can start in the past.
+ */
+
+enum stream_format {
+        STREAM_FORMAT_NONE = 0,
+        STREAM_FORMAT_H264,     /* H.264 Annex-B; clients join at IDR pictures */
+        STREAM_FORMAT_MJPEG,    /* multipart JPEG; clients join at each part */
+        STREAM_FORMAT_FMP4      /* fragmented MP4, written with stream_write(); the writer
+                                 * marks sync points with stream_mark_sync() */
+};
+
+/* Number of recent sync points whose prefix data is kept */
+#define STREAM_SYNC_PREFIXES 16
+
+/* Largest prefix of a sync point */
+#define STREAM_PREFIX_MAX 2048
+
+/* Data that must be sent before the data at a sync point, such as the H.264
+ * parameter sets or an MP4 init segment. It is never changed once made, and
+ * is shared by the sync points, index entries and clients that refer to it;
+ * the last reference frees it */
+struct stream_prefix {
+        _Atomic int refcount;
+        size_t len;
+        unsigned char data[];
+};
+
+/* A sync point and its prefix, NULL if it has none */
+struct stream_sync {
+        uint64_t id;
+        struct stream_prefix * prefix;
+};
+
+/* DVR configuration; see stream_set_dvr() */
+struct stream_dvr {
+        const char * path;
+        size_t size;            /* bytes */
+        double duration;        /* seconds indexed, or 0 for the default */
+};
+
+/* One sync point in the DVR index, of at most one per STREAM_INDEX_INTERVAL */
+struct stream_index_entry {
+        uint64_t time;          /* microseconds since the epoch */
+        uint64_t seq;           /* position in the ring buffer */
+        uint64_t id;            /* sync point number */
+        uint64_t prefix;        /* id of its prefix in index_prefixes */
+};
+
+/* Microseconds between indexed sync points */
+#define STREAM_INDEX_INTERVAL 1000000
+
+/* Sync points indexed if no duration is given: a day */
+#define STREAM_INDEX_DEFAULT (24*60*60)
+
+/* Number of distinct prefixes the index can refer to; prefixes rarely
+ * change, but H.264 IDR pictures may alternate between carrying their own
+ * parameter sets and relying on earlier ones */
+#define STREAM_INDEX_PREFIXES 8
+
+/* Called from the writer with each block of input as it is added to the
+ * stream, eg. to feed an HLS segmenter */
+typedef void (*StreamTap) (const unsigned char * buf, size_t len, void * data);
+
+#define STREAM_MAX_TAPS 4
 
 struct stream {
         int input_fd;
         int active;
         struct ringbuffer rb;
+
+        _Atomic int nr_ring_clients;
+
+        /* Sync points */
+        enum stream_format format;
+        struct h264_parser * h264;
+        struct multipart_parser * multipart;
+        pthread_mutex_t sync_mutex;
+        struct stream_sync syncs[STREAM_SYNC_PREFIXES];
+
+        /* DVR, if any; the index is protected by sync_mutex */
+        size_t dvr_size;        /* size of the mapping, or 0 if rb.data is malloc()ed */
+        struct stream_index_entry * index;
+        uint64_t index_size, nr_indexed;
+        struct stream_sync index_prefixes[STREAM_INDEX_PREFIXES];
+        uint64_t nr_index_prefixes;
+
+        int nr_taps;
+        StreamTap taps[STREAM_MAX_TAPS];
+        void * tap_data[STREAM_MAX_TAPS];
+
+        /* Zero-copy */
+        int zero_copy_clients; /* maximum; 0 if disabled */
+        int pipe[2];           /* input is spliced in here */
+        int devnull;
+        pthread_mutex_t clients_mutex;
+        list_t * zc_clients;
+        int nr_zc_clients;
 };
 
-struct stream * stream_open (int fd);
+struct stream_client;
+struct uring;
+
+/* The content type is needed for STREAM_FORMAT_MJPEG, to find the boundary */
+struct stream * stream_open (int fd, enum ringbuffer_policy policy, enum stream_format format,
+                             const char * content_type, int zero_copy_clients);
+
+/* A stream with no input thread; data is written in with stream_write() */
+struct stream * stream_new (enum ringbuffer_policy policy, enum stream_format format,
+                            const char * content_type);
+
+/* Also pass each block of input to tap; call before any data is written, or
+ * before stream_start(). Returns -1 if the stream has STREAM_MAX_TAPS */
+int stream_add_tap (struct stream * stream, StreamTap tap, void * data);
+
+/* Keep a DVR for a stream with sync points: replace its ring buffer with
+ * dvr->size bytes of the file dvr->path, mapped into memory, and index its
+ * sync points for dvr->duration seconds. Anything already in the file is
+ * overwritten. Call before any data is written, or before stream_start().
+ * Returns -1 if the file cannot be mapped */
+int stream_set_dvr (struct stream * stream, const struct stream_dvr * dvr);
+
+/* Start a thread reading input from fd into a stream made with
+ * stream_new(). stream_open() is stream_new() followed by this */
+int stream_start (struct stream * stream, int fd, int zero_copy_clients);
+
+/* Append data to a stream made with stream_new(). Under the block policy this
+ * waits for the slowest client to make room */
+void stream_write (struct stream * stream, const unsigned char * buf, size_t len);
+
+/* Mark a sync point at byte pos of a STREAM_FORMAT_FMP4 stream, before which
+ * a client joining there is sent prefix. Returns -1 if prefix_len is over
+ * STREAM_PREFIX_MAX */
+int stream_mark_sync (struct stream * stream, uint64_t pos, const unsigned char * prefix,
+                      size_t prefix_len);
+
 void stream_close (struct stream * stream);
-params_t * stream_append_headers (params_t * response_headers, struct stream * stream);
-int stream_stream_body (int fd, struct stream * stream);
+
+/* Per-client state; notify_fd is signalled when new data arrives. If chunked
+ * is set, the client is sent the stream with chunked transfer coding, and
+ * is always served from the ring buffer */
+struct stream_client * stream_client_open (struct stream * stream, int notify_fd, int chunked);
+
+/* Write whatever is available for a client to fd, following the conventions
+ * of ResourcePump. A chunked client is sent the last chunk when the input
+ * ends, and then RESOURCE_PUMP_END is returned */
+ssize_t stream_client_pump (struct stream * stream, struct stream_client * c, int fd);
+
+/*
+ * Queue a client's next write from the ring buffer on u, to be reported
+ * with tag, rather than writing it now; a stream's clients can then be sent
+ * their data with one io_uring_enter() between them. Returns 1 if a write
+ * was queued, in which case its result must be passed to
+ * stream_client_complete() before the client is used again, or 0 if the
+ * client is to be pumped as usual.
+ */
+int stream_client_queue (struct stream * stream, struct stream_client * c, int fd,
+                         struct uring * u, void * tag);
+
+/* Finish a queued write, given its result (bytes written or -errno), and
+ * return as stream_client_pump() would */
+ssize_t stream_client_complete (struct stream * stream, struct stream_client * c, int res);
+
+/* Limit a client of an MJPEG stream to fps whole frames per second, chosen
+ * as they become due. Returns -1 for other streams */
+int stream_client_set_fps (struct stream * stream, struct stream_client * c, double fps);
+
+/* Move a client of a stream with a DVR back to the first indexed sync point
+ * at or after time t, in seconds since the epoch or, if t is not positive,
+ * relative to now; or to the oldest still in the buffer. Returns -1 if the
+ * stream has no DVR or there is no such sync point, leaving the client to
+ * start live */
+int stream_client_seek_time (struct stream * stream, struct stream_client * c, double t);
+
+/* End a client's response at the first indexed sync point at least duration
+ * seconds after the point it started from, as though the input had ended.
+ * Returns -1 if the stream has no DVR */
+int stream_client_set_duration (struct stream * stream, struct stream_client * c,
+                                double duration);
+
+void stream_client_close (struct stream * stream, struct stream_client * c);
+
+/* Parse a SlowClient configuration value: "block", "skip" or "drop" */
+enum ringbuffer_policy stream_policy_parse (const char * value);
+
+/* Parse a Chunked configuration value: "on" or "off", or def if unset or
+ * anything else */
+int stream_chunked_parse (const char * value, int def);
+
+/* Parse a size in bytes, with an optional K, M, G or T suffix. Returns -1
+ * if value is not a positive size, has anything after the suffix, or does
+ * not fit a size_t and an off_t */
+int stream_size_parse (const char * value, size_t * size);
+
+/* Parse the DVRPath, DVRSize and DVRDuration configuration values into dvr.
+ * Sizes may end in K, M, G or T, and durations in s, m, h or d. Returns -1
+ * if there is no path or the size is not valid */
+int stream_dvr_parse (struct stream_dvr * dvr, const char * path, const char * size,
+                      const char * duration);
+
+/* Parse a Format configuration value: "h264", "mjpeg" or "none". If value is
+ * NULL, guess from the content type and path */
+enum stream_format stream_format_parse (const char * value, const char * content_type,
+                                       const char * path);
+
+/* Write an HTML summary of a stream and its clients' lag to fd */
+void stream_write_status (int fd, const char * path, struct stream * stream);
 
 #endif /* __STREAM_H__ */
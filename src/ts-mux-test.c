@@ -0,0 +1,159 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tests.h"
+
+#include "ts-mux.h"
+
+#define MAX_AU 5000
+
+static unsigned char out[2 * TS_PACKET_SIZE + (MAX_AU / 176 + 4) * TS_PACKET_SIZE];
+
+static int
+packet_pid (const unsigned char * p)
+{
+        return ((p[1] & 0x1f) << 8) | p[2];
+}
+
+/* The payload of a packet, after any adaptation field */
+static const unsigned char *
+packet_payload (const unsigned char * p, size_t * len)
+{
+        size_t off = 4;
+
+        if (p[3] & 0x20)
+                off += 1 + p[4];
+
+        if (off > TS_PACKET_SIZE)
+                FAIL ("Adaptation field overruns packet");
+
+        *len = TS_PACKET_SIZE - off;
+        return p + off;
+}
+
+static uint32_t
+crc32_mpeg (const unsigned char * buf, size_t len)
+{
+        uint32_t crc = 0xffffffff;
+        size_t i;
+        int bit;
+
+        for (i = 0; i < len; i++) {
+                crc ^= (uint32_t)buf[i] << 24;
+                for (bit = 0; bit < 8; bit++)
+                        crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+        }
+
+        return crc;
+}
+
+static void
+check_section (const unsigned char * p, int pid, int table_id)
+{
+        const unsigned char * s;
+        size_t section_len;
+
+        if (p[0] != 0x47 || packet_pid (p) != pid || !(p[1] & 0x40))
+                FAIL ("Bad PSI packet header");
+
+        s = p + 5 + p[4];
+        if (s[0] != table_id)
+                FAIL ("Wrong table");
+
+        /* The CRC over a whole section, including its CRC, is 0 */
+        section_len = 3 + (((s[1] & 0x0f) << 8) | s[2]);
+        if (crc32_mpeg (s, section_len) != 0)
+                FAIL ("Bad section CRC");
+}
+
+/* Mux an access unit in two pieces, and check it can be reassembled */
+static void
+test_pes (size_t au_len, uint64_t pts)
+{
+        unsigned char au[MAX_AU], pes[MAX_AU + 64];
+        struct ts_mux m;
+        struct iovec iov[2];
+        const unsigned char * p, * payload;
+        size_t i, len, n, pes_len = 0;
+        unsigned int cc = 0;
+        uint64_t t;
+
+        for (i = 0; i < au_len; i++)
+                au[i] = i * 7;
+
+        ts_mux_init (&m);
+        len = ts_mux_tables (&m, out);
+        check_section (out, TS_PID_PAT, 0x00);
+        check_section (out + TS_PACKET_SIZE, TS_PID_PMT, 0x02);
+
+        iov[0].iov_base = au;
+        iov[0].iov_len = au_len / 3;
+        iov[1].iov_base = au + au_len / 3;
+        iov[1].iov_len = au_len - au_len / 3;
+
+        n = ts_mux_pes (&m, out + len, pts, iov, 2);
+        if (n % TS_PACKET_SIZE != 0)
+                FAIL ("Output is not whole packets");
+        if (n > ts_mux_pes_size (au_len))
+                FAIL ("Output exceeds ts_mux_pes_size()");
+
+        for (p = out + len; p < out + len + n; p += TS_PACKET_SIZE) {
+                if (p[0] != 0x47 || packet_pid (p) != TS_PID_VIDEO)
+                        FAIL ("Bad video packet header");
+                if ((p[3] & 0x0f) != cc)
+                        FAIL ("Continuity counter out of sequence");
+                cc = (cc + 1) & 0x0f;
+
+                if (p == out + len) {
+                        if (!(p[1] & 0x40) || !(p[3] & 0x20) || !(p[5] & 0x10))
+                                FAIL ("First packet should start the PES and carry a PCR");
+                        t = ((uint64_t)p[6] << 25) | (p[7] << 17) | (p[8] << 9) |
+                                (p[9] << 1) | (p[10] >> 7);
+                        if (t != pts - TS_PCR_DELAY)
+                                FAIL ("Wrong PCR");
+                } else if (p[1] & 0x40) {
+                        FAIL ("Unit start in a continuation packet");
+                }
+
+                payload = packet_payload (p, &i);
+                memcpy (pes + pes_len, payload, i);
+                pes_len += i;
+        }
+
+        if (pes_len != 14 + au_len)
+                FAIL ("PES packet has the wrong length");
+        if (pes[0] != 0 || pes[1] != 0 || pes[2] != 1 || pes[3] != 0xe0)
+                FAIL ("Bad PES start code");
+
+        t = ((uint64_t)(pes[9] & 0x0e) << 29) | (pes[10] << 22) | ((pes[11] & 0xfe) << 14) |
+                (pes[12] << 7) | (pes[13] >> 1);
+        if (t != pts)
+                FAIL ("Wrong PTS");
+
+        if (memcmp (pes + 14, au, au_len))
+                FAIL ("Access unit corrupted");
+}
+
+int
+main (int argc, char * argv[])
+{
+        static const size_t lengths[] = {1, 161, 162, 163, 169, 170, 171, 184, 345, 346, 347,
+                                         1000, MAX_AU};
+        size_t i;
+
+        INFO ("Muxing access units of various lengths");
+        for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+                test_pes (lengths[i], TS_CLOCK + i * 3003);
+
+        INFO ("Muxing with a timestamp past 33 bits");
+        test_pes (500, ((uint64_t)1 << 33) - 1);
+
+        exit (EXIT_SUCCESS);
+}
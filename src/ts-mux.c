@@ -0,0 +1,216 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#include <string.h>
+
+#include "ts-mux.h"
+
+/* Bytes of TS packet after the 4 byte header */
+#define TS_PAYLOAD_SIZE (TS_PACKET_SIZE - 4)
+
+/* An adaptation field carrying only a PCR: length, flags and 6 bytes */
+#define TS_PCR_FIELD_SIZE 8
+
+/* PES header with a PTS */
+#define PES_HEADER_SIZE 14
+
+#define STREAM_TYPE_H264 0x1b
+#define STREAM_ID_VIDEO  0xe0
+
+#define PROGRAM_NUMBER 1
+
+/* CRC-32/MPEG-2, as used by PSI sections */
+static uint32_t
+ts_crc32 (const unsigned char * buf, size_t len)
+{
+        uint32_t crc = 0xffffffff;
+        size_t i;
+        int bit;
+
+        for (i = 0; i < len; i++) {
+                crc ^= (uint32_t)buf[i] << 24;
+                for (bit = 0; bit < 8; bit++)
+                        crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+        }
+
+        return crc;
+}
+
+static void
+ts_header (unsigned char * p, int pid, int unit_start, int adaptation, unsigned int * cc)
+{
+        p[0] = 0x47;
+        p[1] = (unit_start ? 0x40 : 0x00) | ((pid >> 8) & 0x1f);
+        p[2] = pid & 0xff;
+        p[3] = (adaptation ? 0x30 : 0x10) | (*cc & 0x0f);
+        *cc = (*cc + 1) & 0x0f;
+}
+
+/* Write a PSI section, which must fit in one packet, with its CRC */
+static void
+ts_section (unsigned char * p, int pid, unsigned int * cc, const unsigned char * section,
+            size_t len)
+{
+        unsigned char * s = p + 5;
+        uint32_t crc;
+
+        ts_header (p, pid, 1, 0, cc);
+        p[4] = 0; /* pointer field */
+
+        memcpy (s, section, len);
+        crc = ts_crc32 (s, len);
+        s[len] = crc >> 24;
+        s[len+1] = crc >> 16;
+        s[len+2] = crc >> 8;
+        s[len+3] = crc;
+
+        memset (s + len + 4, 0xff, TS_PACKET_SIZE - 5 - len - 4);
+}
+
+void
+ts_mux_init (struct ts_mux * m)
+{
+        memset (m, 0, sizeof(*m));
+}
+
+size_t
+ts_mux_tables (struct ts_mux * m, unsigned char * out)
+{
+        static const unsigned char pat[] = {
+                0x00,                   /* table_id */
+                0xb0, 13,               /* section_syntax_indicator, section_length */
+                0x00, 0x01,             /* transport_stream_id */
+                0xc1,                   /* version 0, current_next_indicator */
+                0x00, 0x00,             /* section_number, last_section_number */
+                PROGRAM_NUMBER >> 8, PROGRAM_NUMBER & 0xff,
+                0xe0 | (TS_PID_PMT >> 8), TS_PID_PMT & 0xff
+        };
+        static const unsigned char pmt[] = {
+                0x02,                   /* table_id */
+                0xb0, 18,               /* section_syntax_indicator, section_length */
+                PROGRAM_NUMBER >> 8, PROGRAM_NUMBER & 0xff,
+                0xc1,                   /* version 0, current_next_indicator */
+                0x00, 0x00,             /* section_number, last_section_number */
+                0xe0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xff, /* PCR_PID */
+                0xf0, 0x00,             /* program_info_length */
+                STREAM_TYPE_H264,
+                0xe0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xff,
+                0xf0, 0x00              /* ES_info_length */
+        };
+
+        ts_section (out, TS_PID_PAT, &m->cc_pat, pat, sizeof(pat));
+        ts_section (out + TS_PACKET_SIZE, TS_PID_PMT, &m->cc_pmt, pmt, sizeof(pmt));
+
+        return 2 * TS_PACKET_SIZE;
+}
+
+size_t
+ts_mux_pes_size (size_t len)
+{
+        /* The first packet loses room to the PCR; the last may be mostly stuffing */
+        return ((PES_HEADER_SIZE + len + TS_PCR_FIELD_SIZE) / TS_PAYLOAD_SIZE + 1) *
+                TS_PACKET_SIZE;
+}
+
+static void
+pes_timestamp (unsigned char * p, int marker, uint64_t ts)
+{
+        p[0] = (marker << 4) | ((ts >> 29) & 0x0e) | 1;
+        p[1] = ts >> 22;
+        p[2] = ((ts >> 14) & 0xfe) | 1;
+        p[3] = ts >> 7;
+        p[4] = ((ts << 1) & 0xfe) | 1;
+}
+
+/* Copy len bytes from the pieces of iov, advancing *i and *off */
+static void
+iov_copy (unsigned char * dest, size_t len, const struct iovec * iov, int * i, size_t * off)
+{
+        size_t n;
+
+        while (len > 0) {
+                n = iov[*i].iov_len - *off;
+                if (n > len)
+                        n = len;
+                memcpy (dest, (unsigned char *)iov[*i].iov_base + *off, n);
+                dest += n;
+                len -= n;
+                *off += n;
+                if (*off == iov[*i].iov_len) {
+                        (*i)++;
+                        *off = 0;
+                }
+        }
+}
+
+size_t
+ts_mux_pes (struct ts_mux * m, unsigned char * out, uint64_t pts,
+            const struct iovec * iov, int iovcnt)
+{
+        unsigned char header[PES_HEADER_SIZE];
+        struct iovec pieces[iovcnt + 1];
+        unsigned char * p = out, * q;
+        uint64_t pcr = pts - TS_PCR_DELAY;
+        size_t len = 0, n, room, af, off = 0;
+        int i = 0, first = 1;
+
+        pts &= 0x1ffffffffULL;
+
+        header[0] = 0x00;
+        header[1] = 0x00;
+        header[2] = 0x01;
+        header[3] = STREAM_ID_VIDEO;
+        header[4] = 0x00; /* PES_packet_length: unbounded, as allowed for video */
+        header[5] = 0x00;
+        header[6] = 0x84; /* data_alignment_indicator */
+        header[7] = 0x80; /* PTS only */
+        header[8] = 5;
+        pes_timestamp (header + 9, 0x2, pts);
+
+        pieces[0].iov_base = header;
+        pieces[0].iov_len = sizeof(header);
+        len = sizeof(header);
+        for (n = 0; n < (size_t)iovcnt; n++) {
+                pieces[n+1] = iov[n];
+                len += iov[n].iov_len;
+        }
+
+        while (len > 0) {
+                af = first ? TS_PCR_FIELD_SIZE : 0;
+                room = TS_PAYLOAD_SIZE - af;
+                n = (len < room) ? len : room;
+
+                /* The last packet is padded out with adaptation field stuffing */
+                if (n < room)
+                        af = TS_PAYLOAD_SIZE - n;
+
+                ts_header (p, TS_PID_VIDEO, first, af > 0, &m->cc_video);
+
+                if (af > 0) {
+                        q = p + 4;
+                        q[0] = af - 1; /* adaptation_field_length */
+                        if (af > 1) {
+                                q[1] = first ? 0x10 : 0x00; /* PCR_flag */
+                                memset (q + 2, 0xff, af - 2);
+                        }
+                        if (first) {
+                                pcr &= 0x1ffffffffULL;
+                                q[2] = pcr >> 25;
+                                q[3] = pcr >> 17;
+                                q[4] = pcr >> 9;
+                                q[5] = pcr >> 1;
+                                q[6] = ((pcr & 1) << 7) | 0x7e; /* reserved bits, extension 0 */
+                                q[7] = 0x00;
+                        }
+                }
+
+                iov_copy (p + 4 + af, n, pieces, &i, &off);
+
+                p += TS_PACKET_SIZE;
+                len -= n;
+                first = 0;
+        }
+
+        return p - out;
+}
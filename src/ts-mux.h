@@ -0,0 +1,50 @@
+#ifndef __TS_MUX_H__
+#define __TS_MUX_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * A minimal MPEG-2 transport stream muxer for a single H.264 elementary
+ * stream, as used for HLS segments. Each segment starts with the PAT and
+ * PMT, followed by one PES packet per access unit. The PCR is carried on
+ * the video PID, in the first TS packet of each PES packet.
+ */
+
+#define TS_PACKET_SIZE 188
+
+#define TS_PID_PAT   0x0000
+#define TS_PID_PMT   0x1000
+#define TS_PID_VIDEO 0x0100
+
+/* Timestamps are in units of 1/90000 second */
+#define TS_CLOCK 90000
+
+/* How far the PCR runs ahead of the presentation time of each picture */
+#define TS_PCR_DELAY (TS_CLOCK / 10)
+
+struct ts_mux {
+        unsigned int cc_pat;
+        unsigned int cc_pmt;
+        unsigned int cc_video;
+};
+
+void ts_mux_init (struct ts_mux * m);
+
+/* Write the PAT and PMT. Returns the number of bytes written, which is
+ * always 2 * TS_PACKET_SIZE */
+size_t ts_mux_tables (struct ts_mux * m, unsigned char * out);
+
+/* The most bytes ts_mux_pes() writes for an access unit of len bytes */
+size_t ts_mux_pes_size (size_t len);
+
+/*
+ * Write an access unit, made of the iovcnt pieces in iov, as a PES packet
+ * with the given presentation time; pts must be at least TS_PCR_DELAY.
+ * Returns the number of bytes written.
+ */
+size_t ts_mux_pes (struct ts_mux * m, unsigned char * out, uint64_t pts,
+                   const struct iovec * iov, int iovcnt);
+
+#endif /* __TS_MUX_H__ */
@@ -12,6 +12,7 @@
 #include "http-reqline.h"
 #include "http-status.h"
 #include "params.h"
+#include "resource.h"
 #include "shell.h"
 
 #define UIOMUX_HEADER \
@@ -48,42 +49,46 @@ uiomux_append_headers(params_t * response_headers)
 }
 
 static void
-uiomux_head (http_request * request, params_t * request_headers, const char ** status_line,
+uiomux_head (http_request * request, const char ** status_line,
 		params_t ** response_headers, void * data)
 {
         *status_line = http_status_line (HTTP_STATUS_OK);
         *response_headers = uiomux_append_headers (*response_headers);
 }
 
-static int
-uiomux_body(int fd, http_request * request, params_t * request_headers, void * data)
+static void
+uiomux_body(int fd, http_request * request, void * data)
 {
 	char buf[4096];
-	int n, total = 0;
-	int status;
+	int n;
 
 	n = snprintf(buf, 4096, UIOMUX_HEADER, VERSION, VERSION);
 	if (n < 0)
-		return -1;
+		return;
 	if (n > 4096)
 		n = 4096;
-	total += write(fd, buf, n);
+	write(fd, buf, n);
 
-        total += shell_stream (fd, "uiomux info");
-        total += shell_stream (fd, "uiomux meminfo");
+        shell_stream (fd, "uiomux info");
+        shell_stream (fd, "uiomux meminfo");
 
 	n = snprintf(buf, 4096, UIOMUX_FOOTER);
 	if (n < 0)
-		return -1;
+		return;
 	if (n > 4096)
 		n = 4096;
-	total += write(fd, buf, n);
-
-        return total;
+	write(fd, buf, n);
 }
 
 struct resource *
 uiomux_resource (void)
 {
-	return resource_new (uiomux_check, uiomux_head, uiomux_body, NULL /* del */, NULL /* data */);
+	struct resource * r;
+
+	if ((r = resource_new (uiomux_check, uiomux_head, uiomux_body, NULL /* del */, NULL /* data */)) != NULL) {
+		r->path = "/uiomux";
+		resource_cache_head (r);
+	}
+
+	return r;
 }
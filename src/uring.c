@@ -0,0 +1,339 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "uring.h"
+
+/* #define DEBUG */
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+struct uring {
+        int fd;
+        unsigned int entries;
+
+        /* Submission queue */
+        void * sq_ring;
+        size_t sq_ring_size;
+        unsigned int * sq_head, * sq_tail, * sq_mask, * sq_array;
+        struct io_uring_sqe * sqes;
+        size_t sqes_size;
+        unsigned int queued; /* written but not yet submitted */
+
+        /* Completion queue, which shares the submission queue's mapping
+         * on kernels with IORING_FEAT_SINGLE_MMAP */
+        void * cq_ring;
+        size_t cq_ring_size;
+        unsigned int * cq_head, * cq_tail, * cq_mask;
+        struct io_uring_cqe * cqes;
+
+        /* Registered fixed buffers, and regions that could not be */
+        struct iovec buffers[URING_MAX_BUFFERS];
+        int nr_buffers;
+        void * failed[URING_MAX_BUFFERS];
+        int nr_failed;
+
+        unsigned long syscalls;
+};
+
+static unsigned int
+load_acquire (unsigned int * p)
+{
+        return atomic_load_explicit ((_Atomic unsigned int *)p, memory_order_acquire);
+}
+
+static void
+store_release (unsigned int * p, unsigned int v)
+{
+        atomic_store_explicit ((_Atomic unsigned int *)p, v, memory_order_release);
+}
+
+static int
+uring_enter (struct uring * u, unsigned int to_submit, unsigned int min_complete,
+             unsigned int flags)
+{
+        u->syscalls++;
+        return syscall (__NR_io_uring_enter, u->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+uring_register (struct uring * u, unsigned int opcode, void * arg, unsigned int nr_args)
+{
+        u->syscalls++;
+        return syscall (__NR_io_uring_register, u->fd, opcode, arg, nr_args);
+}
+
+struct uring *
+uring_new (unsigned int entries)
+{
+        struct io_uring_params p;
+        struct uring * u;
+        char * sq, * cq;
+
+        if ((u = calloc (1, sizeof(*u))) == NULL)
+                return NULL;
+
+        memset (&p, 0, sizeof(p));
+        if ((u->fd = syscall (__NR_io_uring_setup, entries, &p)) == -1) {
+                free (u);
+                return NULL;
+        }
+        u->entries = p.sq_entries;
+
+        u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+        u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if ((p.features & IORING_FEAT_SINGLE_MMAP) && u->cq_ring_size > u->sq_ring_size)
+                u->sq_ring_size = u->cq_ring_size;
+
+        u->sq_ring = mmap (NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+        if (u->sq_ring == MAP_FAILED)
+                goto err_close;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                u->cq_ring = u->sq_ring;
+        } else {
+                u->cq_ring = mmap (NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+                if (u->cq_ring == MAP_FAILED)
+                        goto err_sq;
+        }
+
+        u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        u->sqes = mmap (NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+        if (u->sqes == MAP_FAILED)
+                goto err_cq;
+
+        sq = u->sq_ring;
+        u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+        u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+        u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+        u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+        cq = u->cq_ring;
+        u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+        u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+        u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+        u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+        u->syscalls = 1;
+
+        return u;
+
+err_cq:
+        if (u->cq_ring != u->sq_ring)
+                munmap (u->cq_ring, u->cq_ring_size);
+err_sq:
+        munmap (u->sq_ring, u->sq_ring_size);
+err_close:
+        close (u->fd);
+        free (u);
+        return NULL;
+}
+
+void
+uring_free (struct uring * u)
+{
+        if (u == NULL)
+                return;
+
+        munmap (u->sqes, u->sqes_size);
+        if (u->cq_ring != u->sq_ring)
+                munmap (u->cq_ring, u->cq_ring_size);
+        munmap (u->sq_ring, u->sq_ring_size);
+
+        /* Closing the ring also unregisters its buffers */
+        close (u->fd);
+        free (u);
+}
+
+unsigned int
+uring_space (struct uring * u)
+{
+        return u->entries - u->queued;
+}
+
+int
+uring_buffer (struct uring * u, void * base, size_t len)
+{
+        int i;
+
+        for (i = 0; i < u->nr_buffers; i++) {
+                if (u->buffers[i].iov_base == base && u->buffers[i].iov_len >= len)
+                        return i;
+        }
+
+        for (i = 0; i < u->nr_failed; i++) {
+                if (u->failed[i] == base)
+                        return -1;
+        }
+
+        if (u->nr_buffers == URING_MAX_BUFFERS || u->nr_failed == URING_MAX_BUFFERS)
+                return -1;
+
+        /* The table can only be registered as a whole. Indices already
+         * handed out stay the same, as the new buffer goes at the end */
+        if (u->nr_buffers > 0)
+                uring_register (u, IORING_UNREGISTER_BUFFERS, NULL, 0);
+
+        u->buffers[u->nr_buffers].iov_base = base;
+        u->buffers[u->nr_buffers].iov_len = len;
+
+        if (uring_register (u, IORING_REGISTER_BUFFERS, u->buffers, u->nr_buffers + 1) == -1) {
+#ifdef DEBUG
+                perror ("io_uring_register");
+#endif
+                u->failed[u->nr_failed++] = base;
+                if (u->nr_buffers > 0 &&
+                    uring_register (u, IORING_REGISTER_BUFFERS, u->buffers, u->nr_buffers) == -1)
+                        u->nr_buffers = 0;
+                return -1;
+        }
+
+        return u->nr_buffers++;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe (struct uring * u, int fd, void * tag)
+{
+        struct io_uring_sqe * sqe;
+        unsigned int tail, i;
+
+        if (u->queued == u->entries) {
+                errno = EBUSY;
+                return NULL;
+        }
+
+        /* Only this thread moves the tail */
+        tail = *u->sq_tail + u->queued;
+        i = tail & *u->sq_mask;
+
+        sqe = &u->sqes[i];
+        memset (sqe, 0, sizeof(*sqe));
+        sqe->fd = fd;
+        /* Fail with -EAGAIN if the socket is full, rather than waiting for
+         * it to drain; O_NONBLOCK alone does not stop io_uring waiting */
+        sqe->rw_flags = RWF_NOWAIT;
+        sqe->user_data = (uint64_t)(uintptr_t)tag;
+        u->sq_array[i] = i;
+        u->queued++;
+
+        return sqe;
+}
+
+int
+uring_queue_writev (struct uring * u, int fd, const struct iovec * iov, int iovcnt, void * tag)
+{
+        struct io_uring_sqe * sqe;
+
+        if ((sqe = uring_get_sqe (u, fd, tag)) == NULL)
+                return -1;
+
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uint64_t)(uintptr_t)iov;
+        sqe->len = iovcnt;
+
+        return 0;
+}
+
+int
+uring_queue_write_fixed (struct uring * u, int fd, const void * buf, size_t len, int index,
+                         void * tag)
+{
+        struct io_uring_sqe * sqe;
+
+        if ((sqe = uring_get_sqe (u, fd, tag)) == NULL)
+                return -1;
+
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = len;
+        sqe->buf_index = index;
+
+        return 0;
+}
+
+int
+uring_submit (struct uring * u)
+{
+        unsigned int n, left;
+
+        if ((n = u->queued) == 0)
+                return 0;
+
+        store_release (u->sq_tail, *u->sq_tail + n);
+        u->queued = 0;
+
+        /* Submit everything and wait for it in one call. Submission stops
+         * early at a write that cannot be started, and a signal can cut
+         * the wait short; either way, carry on from there */
+        do {
+                left = *u->sq_tail - load_acquire (u->sq_head);
+                if (uring_enter (u, left, n, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR)
+                        return -1;
+        } while (*u->sq_tail != load_acquire (u->sq_head) ||
+                 load_acquire (u->cq_tail) - *u->cq_head < n);
+
+        return n;
+}
+
+int
+uring_complete (struct uring * u, void ** tag, int * res)
+{
+        struct io_uring_cqe * cqe;
+        unsigned int head;
+
+        head = *u->cq_head;
+        if (head == load_acquire (u->cq_tail))
+                return 0;
+
+        cqe = &u->cqes[head & *u->cq_mask];
+        *tag = (void *)(uintptr_t)cqe->user_data;
+        *res = cqe->res;
+
+        store_release (u->cq_head, head + 1);
+
+        return 1;
+}
+
+unsigned long
+uring_syscalls (struct uring * u)
+{
+        return u->syscalls;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+struct uring * uring_new (unsigned int entries) { errno = ENOSYS; return NULL; }
+void uring_free (struct uring * u) { }
+unsigned int uring_space (struct uring * u) { return 0; }
+int uring_buffer (struct uring * u, void * base, size_t len) { return -1; }
+int uring_queue_writev (struct uring * u, int fd, const struct iovec * iov, int iovcnt,
+                        void * tag) { errno = ENOSYS; return -1; }
+int uring_queue_write_fixed (struct uring * u, int fd, const void * buf, size_t len,
+                             int index, void * tag) { errno = ENOSYS; return -1; }
+int uring_submit (struct uring * u) { return 0; }
+int uring_complete (struct uring * u, void ** tag, int * res) { return 0; }
+unsigned long uring_syscalls (struct uring * u) { return 0; }
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,61 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * A minimal io_uring for batching socket writes: a worker queues one write
+ * per client, then submits them all and waits for their results with a
+ * single io_uring_enter(). Writes are made with RWF_NOWAIT, so that they
+ * complete during the submission, each with the byte count (or -errno, eg.
+ * -EAGAIN for a full socket) that a non-blocking write() would have
+ * returned.
+ *
+ * Memory the writes come from, such as a stream's ring buffer, can be
+ * registered with the kernel once as a fixed buffer, so that it is not
+ * mapped again for every write.
+ */
+
+/* Most fixed buffers per ring */
+#define URING_MAX_BUFFERS 16
+
+struct uring;
+
+/* Create a ring with room for entries queued writes. Returns NULL with
+ * errno set if the kernel (or build) has no io_uring */
+struct uring * uring_new (unsigned int entries);
+
+void uring_free (struct uring * u);
+
+/* Writes that can be queued before the next uring_submit() */
+unsigned int uring_space (struct uring * u);
+
+/*
+ * The index of the fixed buffer covering len bytes at base, registering it
+ * first if need be, or -1 if it cannot be registered (eg. for lack of
+ * locked memory, or because it maps a file). Registered memory stays pinned
+ * until the ring is freed.
+ */
+int uring_buffer (struct uring * u, void * base, size_t len);
+
+/* Queue a write of iov, to be reported with tag */
+int uring_queue_writev (struct uring * u, int fd, const struct iovec * iov, int iovcnt,
+                        void * tag);
+
+/* Queue a write of len bytes at buf, within fixed buffer index */
+int uring_queue_write_fixed (struct uring * u, int fd, const void * buf, size_t len,
+                             int index, void * tag);
+
+/* Submit the queued writes and wait for all of them to complete. Returns
+ * the number submitted, or -1 */
+int uring_submit (struct uring * u);
+
+/* Take the next result: returns 1 and sets *tag and *res, or 0 if there
+ * are none left */
+int uring_complete (struct uring * u, void ** tag, int * res);
+
+/* System calls made so far, for benchmarks */
+unsigned long uring_syscalls (struct uring * u);
+
+#endif /* __URING_H__ */
@@ -0,0 +1,355 @@
+/*
+   Copyright (C) 2010 Conrad Parker
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "http-response.h"
+#include "list.h"
+#include "sighttpd.h"
+#include "uring.h"
+#include "worker.h"
+
+/* #define DEBUG */
+
+#define WORKER_MAX_EVENTS 64
+
+/* Stream writes batched per io_uring submission */
+#define WORKER_URING_ENTRIES 256
+
+struct worker {
+	pthread_t thread;
+	int epfd;
+	int notify_fd; /* signalled by stream writers when new data arrives */
+	list_t * streaming;
+	struct uring * uring; /* if streaming writes are batched */
+
+	/* Children waiting for a request, checked for the idle and request
+	 * timeouts. The accept loop adds new connections, so this list is
+	 * locked */
+	pthread_mutex_t reading_mutex;
+	list_t * reading;
+	int keepalive_timeout;
+};
+
+static time_t
+worker_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void
+worker_reading_remove (struct worker * w, struct sighttpd_child * schild)
+{
+	if (schild->reading == NULL)
+		return;
+
+	pthread_mutex_lock (&w->reading_mutex);
+	w->reading = list_remove (w->reading, schild->reading);
+	pthread_mutex_unlock (&w->reading_mutex);
+
+	free (schild->reading);
+	schild->reading = NULL;
+}
+
+static void
+worker_reading_add (struct worker * w, struct sighttpd_child * schild)
+{
+	schild->last_active = worker_now ();
+	pthread_mutex_lock (&w->reading_mutex);
+	w->reading = list_prepend (w->reading, schild);
+	schild->reading = w->reading;
+	pthread_mutex_unlock (&w->reading_mutex);
+}
+
+static int
+worker_watch (struct worker * w, struct sighttpd_child * schild, int op, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = schild;
+
+	return epoll_ctl (w->epfd, op, schild->accept_fd, &ev);
+}
+
+static void
+worker_close (struct worker * w, struct sighttpd_child * schild)
+{
+	if (schild->streaming != NULL) {
+		w->streaming = list_remove (w->streaming, schild->streaming);
+		free (schild->streaming);
+	}
+
+	worker_reading_remove (w, schild);
+
+	/* Closing the socket only removes it from the epoll set if no other
+	 * process has inherited it */
+	epoll_ctl (w->epfd, EPOLL_CTL_DEL, schild->accept_fd, NULL);
+	sighttpd_child_destroy (schild);
+}
+
+static void
+worker_update (struct worker * w, struct sighttpd_child * schild, http_response_state state)
+{
+	int blocked;
+
+	switch (state) {
+	case HTTP_RESPONSE_READ:
+		if (schild->streaming != NULL) {
+			/* A chunked body has ended; wait for the next request */
+			w->streaming = list_remove (w->streaming, schild->streaming);
+			free (schild->streaming);
+			schild->streaming = NULL;
+			worker_reading_add (w, schild);
+			worker_watch (w, schild, EPOLL_CTL_MOD, EPOLLIN | EPOLLRDHUP);
+		}
+		break;
+	case HTTP_RESPONSE_STREAM:
+	case HTTP_RESPONSE_BLOCKED:
+		blocked = (state == HTTP_RESPONSE_BLOCKED);
+
+		if (schild->streaming == NULL) {
+			/* Stop reading requests; only watch for hangup and,
+			 * if need be, writability */
+			worker_reading_remove (w, schild);
+			w->streaming = list_prepend (w->streaming, schild);
+			schild->streaming = w->streaming;
+			worker_watch (w, schild, EPOLL_CTL_MOD,
+				      EPOLLRDHUP | (blocked ? EPOLLOUT : 0));
+		} else if (blocked != schild->blocked) {
+			worker_watch (w, schild, EPOLL_CTL_MOD,
+				      EPOLLRDHUP | (blocked ? EPOLLOUT : 0));
+		}
+		schild->blocked = blocked;
+		break;
+	case HTTP_RESPONSE_CLOSE:
+	default:
+		worker_close (w, schild);
+		break;
+	}
+}
+
+/*
+ * Seconds a child waiting for a request may stay as it is: part way through
+ * a request head, or idle, between requests or before the first one
+ */
+static int
+worker_timeout (struct worker * w, struct sighttpd_child * schild)
+{
+	if (schild->buf_len > 0 || w->keepalive_timeout == 0)
+		return SIGHTTPD_REQUEST_TIMEOUT;
+
+	return w->keepalive_timeout;
+}
+
+/* Close connections that have sat idle, or been sending a request head,
+ * for too long */
+static void
+worker_expire (struct worker * w, time_t now)
+{
+	struct sighttpd_child * schild;
+	list_t * l, * next, * expired = NULL;
+
+	pthread_mutex_lock (&w->reading_mutex);
+	for (l = w->reading; l; l = next) {
+		next = l->next;
+		schild = (struct sighttpd_child *)l->data;
+
+		if (now - schild->last_active >= worker_timeout (w, schild)) {
+			w->reading = list_remove (w->reading, l);
+			free (l);
+			schild->reading = NULL;
+			expired = list_prepend (expired, schild);
+		}
+	}
+	pthread_mutex_unlock (&w->reading_mutex);
+
+	for (l = expired; l; l = l->next) {
+#ifdef DEBUG
+		printf ("Closing idle connection %d\n", ((struct sighttpd_child *)l->data)->accept_fd);
+#endif
+		worker_close (w, (struct sighttpd_child *)l->data);
+	}
+	list_free (expired);
+}
+
+/* Submit the streaming writes queued on the worker's io_uring, and move
+ * each of their clients on with the result */
+static void
+worker_submit (struct worker * w)
+{
+	void * tag;
+	int res;
+
+	if (uring_submit (w->uring) == -1)
+		perror ("io_uring_enter");
+
+	while (uring_complete (w->uring, &tag, &res))
+		worker_update (w, (struct sighttpd_child *)tag,
+			       http_response_complete ((struct sighttpd_child *)tag, res));
+}
+
+static void *
+worker_main (void * data)
+{
+	struct worker * w = (struct worker *)data;
+	struct epoll_event events[WORKER_MAX_EVENTS];
+	struct sighttpd_child * schild;
+	list_t * l, * next;
+	uint64_t count;
+	http_response_state state;
+	unsigned long served;
+	size_t pending;
+	time_t now, expired = 0;
+	int i, n;
+
+	while (1) {
+		/* Wake at least once a second to expire idle connections */
+		n = epoll_wait (w->epfd, events, WORKER_MAX_EVENTS, 1000);
+		if (n == -1) {
+			if (errno != EINTR)
+				perror ("epoll_wait");
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			schild = (struct sighttpd_child *)events[i].data.ptr;
+
+			if (schild == NULL) {
+				/* New stream data; the streaming children are
+				 * pumped below */
+				if (read (w->notify_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+					perror ("read");
+			} else if (schild->streaming == NULL) {
+				/* The clock restarts when a request head begins and
+				 * when one is answered, but not as the rest of a head
+				 * trickles in */
+				served = schild->nr_served;
+				pending = schild->buf_len;
+				now = worker_now ();
+				state = http_response_read (schild);
+				if (pending == 0 || schild->nr_served != served)
+					schild->last_active = now;
+				worker_update (w, schild, state);
+			} else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				worker_close (w, schild);
+			} else if (events[i].events & EPOLLOUT) {
+				worker_update (w, schild, http_response_pump (schild));
+			}
+		}
+
+		for (l = w->streaming; l; l = next) {
+			next = l->next;
+			schild = (struct sighttpd_child *)l->data;
+
+			if (schild->blocked)
+				continue;
+
+			if (w->uring != NULL) {
+				if (uring_space (w->uring) == 0)
+					worker_submit (w);
+				if (http_response_queue (schild, w->uring))
+					continue;
+			}
+
+			worker_update (w, schild, http_response_pump (schild));
+		}
+
+		if (w->uring != NULL)
+			worker_submit (w);
+
+		if ((now = worker_now ()) != expired) {
+			worker_expire (w, now);
+			expired = now;
+		}
+	}
+
+	return NULL;
+}
+
+int
+workers_start (struct sighttpd * sighttpd)
+{
+	struct worker * w;
+	struct epoll_event ev;
+	int i;
+
+	if ((sighttpd->workers = calloc (sighttpd->nr_workers, sizeof(struct worker))) == NULL)
+		return -1;
+
+	for (i = 0; i < sighttpd->nr_workers; i++) {
+		w = &sighttpd->workers[i];
+
+		if ((w->epfd = epoll_create1 (EPOLL_CLOEXEC)) == -1) {
+			perror ("epoll_create");
+			return -1;
+		}
+
+		if ((w->notify_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			perror ("eventfd");
+			return -1;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, w->notify_fd, &ev) == -1) {
+			perror ("epoll_ctl");
+			return -1;
+		}
+
+		w->streaming = list_new ();
+
+		if (sighttpd->io_uring &&
+		    (w->uring = uring_new (WORKER_URING_ENTRIES)) == NULL && i == 0)
+			perror ("IOUring: io_uring_setup");
+
+		pthread_mutex_init (&w->reading_mutex, NULL);
+		w->reading = list_new ();
+		w->keepalive_timeout = sighttpd->keepalive_timeout;
+
+		if (pthread_create (&w->thread, NULL, worker_main, w) != 0) {
+			perror ("pthread_create");
+			return -1;
+		}
+	}
+
+#ifdef DEBUG
+	printf ("Started %d workers\n", sighttpd->nr_workers);
+#endif
+
+	return 0;
+}
+
+int
+workers_dispatch (struct sighttpd * sighttpd, struct sighttpd_child * schild)
+{
+	static int next_worker = 0;
+	struct worker * w;
+
+	/* Hand out connections round-robin; only the accept loop calls this */
+	w = &sighttpd->workers[next_worker];
+	next_worker = (next_worker + 1) % sighttpd->nr_workers;
+
+	schild->notify_fd = w->notify_fd;
+	http_response_init (schild);
+
+	worker_reading_add (w, schild);
+
+	return worker_watch (w, schild, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP);
+}
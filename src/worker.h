@@ -0,0 +1,16 @@
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+#include "sighttpd.h"
+
+/*
+ * A small fixed pool of event loops. Each worker owns the client sockets
+ * handed to it, reading requests and pumping streaming bodies from an
+ * epoll set instead of dedicating a thread to each connection.
+ */
+
+int workers_start (struct sighttpd * sighttpd);
+
+int workers_dispatch (struct sighttpd * sighttpd, struct sighttpd_child * schild);
+
+#endif /* __WORKER_H__ */